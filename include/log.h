@@ -1,8 +1,10 @@
 #ifndef __LOGLIB_INCLUDE_LOG_H__
 #define __LOGLIB_INCLUDE_LOG_H__
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 /**
  * \defgroup Log Log module
@@ -16,7 +18,8 @@
  * The log library is implemented in C, but define guards a provided to ensure 
  * compatibility with C++ compilers.
  *
- * All log messages have the format "[TIMESTAMP] SEVERITY: MESSAGE".
+ * By default, all log messages have the format "[TIMESTAMP] SEVERITY: MESSAGE"
+ * (see log_set_pattern()).
  * \{
  */
 
@@ -49,6 +52,14 @@ typedef enum {
   LOG_TRACE   = 5  /**< Detailed trace information. */
 } log_t;
 
+/**
+ * Selects the source of record timestamps (see log_set_clock()).
+ */
+typedef enum {
+  LOG_CLOCK_REALTIME = 0, /**< Read the wall clock for every record. */
+  LOG_CLOCK_TSC      = 1  /**< Read the CPU cycle counter. */
+} log_clock_t;
+
 /**
  * \defgroup LogConfig Log configuration functions.
  *
@@ -142,6 +153,1079 @@ extern "C"
 #endif
 void log_set_stdout_file(char * filename);
 
+/**
+ * Sets a zstd-compressed file as the standard error stream.
+ *
+ * Like log_set_stderr_file(), but records are compressed on the writing
+ * thread with streaming zstd. Each write is flushed, so the file can be read
+ * while it grows (see the logzcat tool), and a frame is ended after every
+ * MiB of records and when the program exits, so each frame can be decoded on
+ * its own. Small frames compress much better with a dictionary: either one
+ * trained by "zstd --train", or the format strings of the program as
+ * collected by the logdict tool, which are used as raw content. The file
+ * stays open until the next call to log_set_stderr(), log_set_stderr_file()
+ * or log_set_stderr_compressed(). If the library was built without zstd,
+ * the stream is not changed and an error is logged.
+ * \param filename The name of the file, which is truncated.
+ * \param dictionary The name of the dictionary file, or NULL for none. The
+ * same dictionary is needed to decompress the file.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_stderr_compressed(const char * filename,
+			       const char * dictionary);
+
+/**
+ * Sets a zstd-compressed file as the standard output stream, like
+ * log_set_stderr_compressed().
+ * \param filename The name of the file, which is truncated.
+ * \param dictionary The name of the dictionary file, or NULL for none.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_stdout_compressed(const char * filename,
+			       const char * dictionary);
+
+/**
+ * Sets a crash-consistent block file as the standard error stream.
+ *
+ * Records are grouped into blocks, each with its length, a sequence number
+ * and a CRC32C (computed with SSE4.2 where available), and a footer that
+ * repeats the length. A block is written with a single system call when it
+ * holds 64 KiB, when a record arrives and its oldest record is over 100 ms
+ * old, and when the program exits. Unlike log_set_stderr_file(), an existing
+ * file is reopened rather than truncated: the last intact block is found by
+ * scanning backward from the end, whatever follows it (such as a block torn
+ * by a power loss) is truncated, and new blocks are appended. Read the file
+ * with log_block_read() or the logblockcat tool. The file stays open until
+ * the next change of the standard error stream.
+ * \param filename The name of the file. If it exists, it must have been
+ * written in blocks.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_stderr_blocks(const char * filename);
+
+/**
+ * Sets a crash-consistent block file as the standard output stream, like
+ * log_set_stderr_blocks().
+ * \param filename The name of the file.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_stdout_blocks(const char * filename);
+
+/**
+ * Sets a file written around the page cache as the standard error stream.
+ *
+ * Log files are written once and rarely read back soon, so their pages
+ * would only evict data the application needs from the page cache. Records
+ * are gathered in an aligned 1 MiB buffer that is written with O_DIRECT
+ * when it is full, when a record arrives and its oldest record is over
+ * 100 ms old, and when the program exits. The partial block at the end of
+ * the file is written padded to 4 KiB, the padding is truncated, and the
+ * block is written again once it has grown, so the file is always exactly
+ * the records written. Where O_DIRECT is not supported (tmpfs, for
+ * example), the buffer is written through the page cache instead: writeback
+ * is started for each full 1 MiB of the file and the pages behind it are
+ * dropped once written. Like log_set_stderr_file(), the file is truncated.
+ * The file stays open until the next change of the standard error stream.
+ * \param filename The name of the file.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_stderr_direct(const char * filename);
+
+/**
+ * Sets a file written around the page cache as the standard output stream,
+ * like log_set_stderr_direct().
+ * \param filename The name of the file.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_stdout_direct(const char * filename);
+
+/**
+ * Framings of log_set_stderr_socket() and log_set_stdout_socket().
+ */
+enum {
+  LOG_SOCKET_COMPACT = 0, /**< Packets of whole records, as in log files. */
+  LOG_SOCKET_RFC5424 = 1  /**< One RFC 5424 syslog message per packet. */
+};
+
+/**
+ * Sends the standard error stream to a local collector over a Unix-domain
+ * socket.
+ *
+ * The collector listens on a SOCK_SEQPACKET or SOCK_DGRAM socket. Records
+ * are buffered and sent once a packet is full or the oldest record is 20 ms
+ * old (checked when a record arrives) and at exit, many packets per system
+ * call. In the compact framing, a packet holds up to 32 KiB of whole records
+ * as they would appear in a log file. In RFC 5424, each record is a message
+ * with its time, severity (facility user), host, program and process ID
+ * taken from the record header (so the pattern should start with the
+ * default "[%D] %L: "). Sends never block: while the collector is slow, up
+ * to 256 KiB of records are kept. While it is down, the sink reconnects at
+ * most once a second, and the records are appended to the fallback file as
+ * they would have been sent, or kept up to 256 KiB without one. Records
+ * beyond that, or still unsent at exit, are appended to the fallback file,
+ * or dropped and counted in a warning sent once the collector is back. The socket stays in use until the next change of the
+ * standard error stream.
+ * \param path The path of the socket of the collector, which may not exist
+ * yet.
+ * \param fallback The name of the fallback file, or NULL for none.
+ * \param flags LOG_SOCKET_COMPACT or LOG_SOCKET_RFC5424.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_stderr_socket(const char * path, const char * fallback,
+			   int flags);
+
+/**
+ * Sends the standard output stream to a local collector over a Unix-domain
+ * socket, like log_set_stderr_socket().
+ * \param path The path of the socket of the collector.
+ * \param fallback The name of the fallback file, or NULL for none.
+ * \param flags LOG_SOCKET_COMPACT or LOG_SOCKET_RFC5424.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_stdout_socket(const char * path, const char * fallback,
+			   int flags);
+
+/**
+ * Keeps the latest records in a named in-memory ring that the logtail tool
+ * can follow while this process runs.
+ *
+ * Records at or above the given level are copied to the ring whether or not
+ * they are logged, so a tail can show debug records that the streams
+ * filter out. Writing a record costs a copy into shared memory and no
+ * system call; the oldest records are overwritten, and readers detect by
+ * sequence number the ones they missed. Records are cut to 496 bytes. The
+ * ring is created (or replaced) with permissions 0600, and its name is
+ * removed at exit. The ring can also be enabled by setting LOGLIB_LIVE to
+ * its name, which keeps 4096 debug records.
+ * \param name The name of the ring, e.g. "myservice", or NULL to disable it.
+ * \param slots The number of records kept (rounded up to a power of two).
+ * \param level The lowest severity of the records copied to the ring.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_live(const char * name, size_t slots, log_t level);
+
+/**
+ * Records the call sites of the log macros in a dictionary file.
+ *
+ * The first record logged from each call site appends a line to the
+ * dictionary: the ID of the site (see log_site_id()) in 16 hexadecimal
+ * digits, then its severity, file, line, function and the format of that
+ * first record, separated by tabs (backslashes, tabs and newlines in the
+ * format are escaped). Sites already in the dictionary are not appended
+ * again, so a restarted process reuses its entries, and several processes
+ * and builds can share one dictionary. Since the ID does not depend on the
+ * format, the entry keeps the format first recorded for the site even when
+ * the site logs other formats, or its message is edited in a later build. Records then only need the ID (the %site directive of
+ * log_set_pattern()); the logsite tool expands it from the merged
+ * dictionaries.
+ * \param filename The name of the dictionary, or NULL to stop recording.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_site_dictionary(const char * filename);
+
+/**
+ * Counts records by fingerprint and reports the most frequent ones.
+ *
+ * A fingerprint is the format of a record together with its call site of
+ * the log macros (whose ID, see log_site_id(), reports list), or the format
+ * alone for a record logged without a site, so all the records of one
+ * message share it whatever their arguments. The number of records, their
+ * bytes and when the first and last were logged are kept for up to 1024
+ * fingerprints, without locks. Every interval, LOG_INFO
+ * records list the fingerprints with the most records since the last report.
+ * \param top The number of fingerprints listed (at most 64), or 0 to stop
+ * reporting.
+ * \param seconds The interval between reports, or 0 to only report when
+ * log_fingerprint_report() is called or the process exits.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_fingerprints(unsigned top, unsigned seconds);
+
+/**
+ * Collapses repeated records.
+ *
+ * Once a record is written, further records with its fingerprint (see
+ * log_set_fingerprints()) are only counted until the given number of seconds
+ * has passed. The next one is then written, after a record saying how many
+ * were collapsed: "The message ID "FORMAT" was repeated N more times."
+ * \param seconds The window in which repeats are collapsed, or 0 to write
+ * every record.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_collapse_repeats(unsigned seconds);
+
+/**
+ * Writes the report of log_set_fingerprints() now, and the counts of the
+ * records collapsed so far.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_fingerprint_report(void);
+
+/**
+ * Enables the sidecar time index for log files.
+ *
+ * Files subsequently opened by log_set_stdout_file() or log_set_stderr_file()
+ * are accompanied by an index file (the log file name followed by ".idx")
+ * that maps the time records were written to their byte offset. An entry is
+ * added after every_records records or every_seconds seconds, whichever comes
+ * first, so the index stays small. log_index_query() uses the index to read
+ * a time window without scanning the whole file. Passing 0 for both
+ * arguments disables the index for files opened afterwards.
+ * \param every_records Add an entry after this many records (0 for never).
+ * \param every_seconds Add an entry after this many seconds (0 for never).
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_index(unsigned every_records, unsigned every_seconds);
+
+/**
+ * Sets the pattern of the records.
+ *
+ * The pattern is compiled once, when it is set, so records are rendered 
+ * without parsing it. It consists of literal text and the directives below;
+ * a newline is appended to every record.
+ * %M: the message.
+ * %L: the severity level, e.g. "WARNING".
+ * %D: the local date and time, e.g. "Sun 18 Oct 2026 07:15:33".
+ * %d: the local date, e.g. "2026-10-18".
+ * %T: the local time, e.g. "07:15:33".
+ * %ms, %us, %ns: the fraction of the second in milli-, micro- or 
+ * nanoseconds, e.g. "%T.%us" gives "07:15:33.123456".
+ * %s: the seconds since the epoch.
+ * %tid, %pid: the thread and process IDs.
+ * %tname: the name of the thread.
+ * %X: the context fields of the thread (see log_context_push()), each 
+ * followed by a space, e.g. "request=42 tenant=acme ".
+ * %F, %N, %fn: the file, line and function of the call site of the log
+ * macros (see log_msg_site()), or nothing for records logged otherwise.
+ * %site: the ID of the call site (see log_site_id()) in 16 hexadecimal
+ * digits, or nothing for records logged otherwise.
+ * %%: a percent sign.
+ *
+ * The default pattern is "[%D] %L: %X%M". Only records in the default pattern
+ * (or with a fraction of the second, as in "[%D.%us] %L: %X%M") can be read
+ * by log_parse_header(), log_index_query() and log_merge(). If the pattern is
+ * not valid, an error is logged and the current pattern is kept.
+ * \param pattern The pattern, or NULL to restore the default pattern.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_pattern(const char * pattern);
+
+/**
+ * Selects the source of record timestamps.
+ *
+ * By default (LOG_CLOCK_REALTIME), every record reads the wall clock when it
+ * is logged. With LOG_CLOCK_TSC, the call site only reads the CPU cycle
+ * counter (rdtsc on x86, cntvct on ARM) and the ticks are converted to 
+ * wall-clock time when the record is rendered, with a mapping that is 
+ * calibrated when this function is called (which takes about 10 ms) and 
+ * refreshed every second to follow adjustments of the wall clock. If the
+ * counter is not invariant (its rate varies with the CPU frequency), 
+ * CLOCK_MONOTONIC is read instead and converted the same way.
+ * \param clock The source of timestamps.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_clock(log_clock_t clock);
+
+/**
+ * Enables the governor, which sheds verbose records while writing is slow.
+ *
+ * The governor keeps a moving average of the time log records take to be 
+ * written, including the wait for other writers. While it exceeds raise_us,
+ * the effective level is lowered one step at a time below the level set by
+ * log_set_level(), by up to three levels: at LOG_TRACE, TRACE records are shed
+ * first, then DEBUG and then INFO records, and at LOG_INFO only INFO records
+ * are. Warnings and errors are never shed. Once the average falls below
+ * restore_us, the levels are restored, one per second. A warning is logged
+ * when the first record is shed, and another one giving the number of records
+ * shed at each level when the configured level is restored.
+ * \param raise_us The average write latency, in microseconds, above which
+ * records are shed, or 0 to disable the governor.
+ * \param restore_us The average write latency, in microseconds, below which
+ * shed levels are restored. It should be well below raise_us.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_governor(unsigned raise_us, unsigned restore_us);
+
+/**
+ * Flags of log_set_staging().
+ */
+enum {
+  LOG_STAGING_HUGE_PAGES = 1 /**< Put the staging buffers on huge pages. */
+};
+
+/**
+ * Enables staging buffers and writer threads per NUMA node.
+ *
+ * With staging, a thread appends its rendered records to the buffer of the
+ * NUMA node it runs on instead of writing them to the streams, so threads
+ * only contend with threads of the same node. Each node has a writer thread,
+ * pinned to the CPUs of the node, which writes the staged records to the 
+ * streams in batches; the buffers are first touched by the writers, so they
+ * are allocated from the memory of their node. Records of different nodes
+ * may be written out of order, and a record that does not fit in its buffer
+ * is written directly. Staged records are written when staging is disabled 
+ * and when the program exits. A child created by fork() writes its records
+ * directly. If the environment variable LOGLIB_STAGING is set to "SIZE" or
+ * "SIZE,huge" when the library is first used, staging is enabled with that
+ * size and, with ",huge", LOG_STAGING_HUGE_PAGES.
+ * \param size The size of the staging memory of each node in bytes, or 0 to
+ * disable staging.
+ * \param flags LOG_STAGING_HUGE_PAGES or 0. Without huge pages available,
+ * transparent huge pages are requested instead.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_staging(size_t size, int flags);
+
+/**
+ * Reserves the memory the library uses on the logging path.
+ *
+ * The budget is mapped and faulted in at once, and the buffers that would
+ * otherwise be allocated when first needed (such as the capture buffer of
+ * each thread that opens a transaction, 64 KiB) are carved out of it. The
+ * time zone is loaded as well. In a build with the STATIC_MEMORY option
+ * (which defines LOG_STATIC_MEMORY), the library then never calls malloc()
+ * when logging: records are written to the file descriptors of the streams
+ * rather than through their stdio buffers, records longer than 1 KiB are
+ * cut short, and a transaction that finds the budget exhausted is not opened.
+ * Formats that the built-in formatter does not support (see
+ * log_vsnprintf()) are still passed to the C library, which may allocate.
+ * \param budget The number of bytes to reserve.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_static_init(size_t budget);
+
+/** \} */
+
+/**
+ * \defgroup LogContext Context functions.
+ *
+ * Attach fields such as a request ID to every record logged by a thread.
+ * Each field is rendered once, as "key=value ", when it is pushed, and 
+ * records refer to the rendered fields of their thread instead of formatting
+ * them again; the default pattern puts them before the message. A thread
+ * holds up to 16 fields and 512 bytes of rendered fields.
+ * \{
+ */
+
+/**
+ * Pushes a field onto the context of the calling thread.
+ *
+ * The field stays in the context until it is popped. If the context is 
+ * full, an error is logged and the field is not pushed.
+ * \param key The name of the field.
+ * \param format The format of the value, as for log_vsnprintf().
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_context_push(const char * key, const char * format, ...);
+
+/**
+ * Pops the field pushed last from the context of the calling thread.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_context_pop(void);
+
+/**
+ * Removes every field from the context of the calling thread (e.g. when a
+ * pooled thread finishes a task).
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_context_clear(void);
+
+/**
+ * Names the calling thread.
+ *
+ * The name is passed to pthread_setname_np() (which keeps at most 15 
+ * characters) and cached for the %tname directive of log_set_pattern(). The
+ * name of a thread that is never named this way is read once, when it is 
+ * first needed; renaming such a thread directly is not noticed.
+ * \param name The name of the thread.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_thread_name(const char * name);
+
+/** \} */
+
+/**
+ * \defgroup LogTxn Transaction functions.
+ *
+ * Keep the verbose records of a unit of work (e.g. a request) and write them
+ * only if it fails. While a thread has an open transaction, its records that
+ * are too verbose for log_set_level() but not for the transaction are
+ * captured in a 64 KiB buffer of the thread: the format and the arguments
+ * are copied (the characters of strings included) and only formatted if the
+ * records are written. They are written, with their original times and context fields,
+ * by log_txn_fail() or when the thread logs an error. Records that do not fit
+ * are counted and reported by a warning.
+ * \{
+ */
+
+/**
+ * Opens a transaction on the calling thread.
+ *
+ * A transaction opened while another is open is nested in it: it shares the
+ * buffer and level of the outermost transaction, and only the outermost
+ * log_txn_commit() discards the captured records.
+ * \param level The level of the least severe message to be captured.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_txn_begin(log_t level);
+
+/**
+ * Closes the innermost transaction of the calling thread. If it is the
+ * outermost one, the captured records are discarded.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_txn_commit(void);
+
+/**
+ * Writes the records captured by the transactions of the calling thread and
+ * closes the innermost one. Until the outermost one is closed, records of
+ * the transaction level are written as they are logged.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_txn_fail(void);
+
+/**
+ * Returns whether a message of the given level would be logged or captured
+ * by a transaction of the calling thread.
+ * \param level The severity level of the message.
+ * \return Non-zero if the message would not be discarded.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_is_enabled(const log_t level);
+
+/** \} */
+
+/**
+ * \defgroup LogBatch Batch functions.
+ *
+ * Log many related records with one acquisition of the module lock and one
+ * write per stream. The records appended to a batch are rendered back to 
+ * back in a buffer of the calling thread and written together when the
+ * batch is committed, so the records of the standard output (and those of
+ * the standard error) stream appear contiguously and in order, even if other
+ * threads or processes log at the same time.
+ * \{
+ */
+
+/**
+ * Opens a batch on the calling thread. A batch opened while another is open
+ * is nested in it, and its records are written with those of the outermost
+ * one.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_batch_begin(void);
+
+/**
+ * Appends a message to the open batch of the calling thread.
+ *
+ * The message is rendered at once, like by log_msg(), but only written when
+ * the batch is committed, or when the thread exits with the batch open. It is
+ * counted by its fingerprint (see log_set_fingerprints()) as it is appended.
+ * Without an open batch, in a transaction of the thread (see log_txn_begin())
+ * or in a process attached to a shared-memory ring, the message is logged at
+ * once, exactly as by log_msg(). In a static-memory build (see
+ * log_static_init()), a batch that exceeds 64 KiB for a stream is written
+ * early.
+ * \param level The severity level of the message.
+ * \param format The format of the message, as for log_vsnprintf().
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_batch_append(const log_t level, const char * format, ...);
+
+/**
+ * Closes the innermost batch of the calling thread. If it is the outermost
+ * one, its records are written.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_batch_commit(void);
+
+/** \} */
+
+/**
+ * \defgroup LogRt Real-time logging functions.
+ *
+ * Log from signal handlers and real-time threads (e.g. SCHED_FIFO audio or
+ * control loops), where log_msg() must not be called because it may lock,
+ * allocate and block on I/O. log_rt_msg() is async-signal-safe and 
+ * wait-free: it copies the arguments into a ring of the calling thread, 
+ * taken from a pool allocated in advance by log_rt_setup(), and another
+ * thread formats and writes the records with log_rt_drain(). If the ring is
+ * full, the record is lost and counted instead of waiting.
+ * \{
+ */
+
+/**
+ * Allocates the pool of real-time rings. It must be called once, before any
+ * call to log_rt_msg(), from a thread that may allocate.
+ * \param threads The number of threads that may log with log_rt_msg() at
+ * the same time.
+ * \param records The number of records each ring can hold, rounded up to a
+ * power of two.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_rt_setup(size_t threads, size_t records);
+
+/**
+ * Queues a message for log_rt_drain(), without locking, allocating or 
+ * waiting.
+ *
+ * The first call of a thread claims a ring of the pool; if none is left, the
+ * message is discarded. The arguments are copied (the characters of strings
+ * included) and formatted later, so format must remain valid until the 
+ * record is drained (e.g. a string literal). The ID and name of the thread
+ * and its context fields (see log_context_push()) are kept with the record.
+ * A message is lost and counted if the ring is full, if its arguments and
+ * the context fields exceed 224 bytes, if its format needs conversions of
+ * the C library, or if it is logged by a signal handler that interrupted
+ * log_rt_msg() on the same thread.
+ * \param level The severity level of the message.
+ * \param format The format of the message, as for log_vsnprintf().
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_rt_msg(const log_t level, const char * format, ...);
+
+/**
+ * Gives the ring of the calling thread back to the pool, e.g. before the
+ * thread exits. Its records are still written by log_rt_drain().
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_rt_release(void);
+
+/**
+ * Formats and writes the records queued by log_rt_msg(), like log_msg() 
+ * would have, in the order each thread queued them. If records were lost
+ * since the last call, a warning giving their number is written.
+ * \return The number of records written.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+size_t log_rt_drain(void);
+
+/** \} */
+
+/**
+ * \defgroup LogShm Shared-memory ring functions.
+ *
+ * Route records from cooperating processes through a named POSIX
+ * shared-memory ring instead of the locked streams. Producers attached to the
+ * ring enqueue rendered records without taking the module lock or calling 
+ * flock(), and a single collector (see the logcollectd tool) drains the ring
+ * into the standard output and error streams.
+ *
+ * The ring has two lanes with their own capacity and policy: warnings, errors
+ * and fatal errors take the express lane, and the rest the bulk lane. The
+ * collector empties the express lane before every few hundred records of the
+ * bulk lane, so a flood of debug records does not delay an error. When a lane
+ * is full, its policy decides whether the record is dropped at once or the
+ * producer waits briefly for the collector; dropped records are counted and
+ * the collector reports their number.
+ * \{
+ */
+
+/**
+ * What a producer does when its lane of the shared-memory ring is full.
+ *
+ * Neither policy blocks for long: a waiting producer polls the lane for up
+ * to 100 ms and then drops its record, so that a collector that stopped
+ * cannot stall the processes that log. Both policies are therefore lossy, and
+ * the records dropped are counted and reported by log_shm_drain().
+ */
+typedef enum {
+  LOG_SHM_DROP = 0, /**< Drop the record at once. */
+  LOG_SHM_WAIT = 1  /**< Wait up to 100 ms for the collector, then drop it. */
+} log_shm_policy_t;
+
+/**
+ * Creates a shared-memory ring and attaches this process to it.
+ *
+ * Creates the ring with the given name, or reuses it if it already exists
+ * (so that records queued for a restarted collector are not lost). The
+ * number of slots is rounded up to a power of two, and each slot holds one
+ * record of at most slot_size bytes including its bookkeeping; longer
+ * records are cut short. Slots are limited to 4096 bytes. The bulk lane
+ * drops records when it is full; the express lane, with a quarter of the
+ * slots (but at least 16), waits up to 100 ms for the collector and then
+ * drops them too (see log_shm_policy_t).
+ * \param name The name of the shared-memory object, e.g. "/myservice.log".
+ * \param slots The number of records the bulk lane can hold.
+ * \param slot_size The size of each slot in bytes.
+ * \return 0 if this process is attached to the ring, or -1 (after logging an
+ * error) if it could not be created or reused.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_shm_create(const char * name, size_t slots, size_t slot_size);
+
+/**
+ * Creates a shared-memory ring with the given lanes and attaches this
+ * process to it, like log_shm_create().
+ * \param name The name of the shared-memory object.
+ * \param express_slots The number of records the express lane can hold.
+ * \param express_policy What producers do when the express lane is full.
+ * \param bulk_slots The number of records the bulk lane can hold.
+ * \param bulk_policy What producers do when the bulk lane is full.
+ * \param slot_size The size of each slot in bytes.
+ * \return 0 if this process is attached to the ring, or -1 (after logging an
+ * error) if not.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_shm_create_lanes(const char * name, size_t express_slots,
+			 log_shm_policy_t express_policy, size_t bulk_slots,
+			 log_shm_policy_t bulk_policy, size_t slot_size);
+
+/**
+ * Attaches this process to an existing shared-memory ring.
+ *
+ * After a successful call, log_msg() hands every record to the ring rather
+ * than writing it to the streams. If the ring cannot be opened, an error is
+ * logged and the streams continue to be used. Children created by fork()
+ * inherit the attachment.
+ * \param name The name passed to log_shm_create().
+ * \return 0 if this process is attached to the ring, or -1 (after logging an
+ * error) if not.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_shm_attach(const char * name);
+
+/**
+ * Detaches this process from its shared-memory ring.
+ *
+ * Subsequent records are written to the streams again. This function must
+ * not be called while other threads may still be logging.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_shm_detach(void);
+
+/**
+ * Removes the name of a shared-memory ring from the system. Processes that
+ * are attached to the ring are unaffected.
+ * \param name The name passed to log_shm_create().
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_shm_unlink(const char * name);
+
+/**
+ * Writes the records queued in the shared-memory ring to the streams.
+ *
+ * The records of each lane are written in the order they were queued, in
+ * batches with one advisory lock per batch, and the express lane is emptied
+ * first. A producer that claimed a slot and did not fill it within a second
+ * has its slot reclaimed if its process no longer exists, or if it has not
+ * even started to write (its record is then lost); a producer that is only
+ * slow to finish holds up its lane until it is done. If records were lost
+ * since the last call, a warning giving their number is written.
+ * The streams are flushed once the records are written.
+ * \return The number of records written.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+size_t log_shm_drain(void);
+
+/** \} */
+
+/**
+ * \defgroup LogLive Live tail functions.
+ *
+ * Read the ring of a process that called log_set_live(), as the logtail tool
+ * does. Readers map the ring read-only and never slow down the process.
+ * \{
+ */
+
+/**
+ * A reader of a live ring.
+ */
+struct LogLive;
+
+/**
+ * Opens the live ring with the given name for reading.
+ * \param name The name passed to log_set_live().
+ * \param backlog The number of records already in the ring to read first.
+ * \return The reader, or NULL (after logging an error) if the ring cannot be
+ * opened.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+struct LogLive * log_live_attach(const char * name, size_t backlog);
+
+/**
+ * Writes the records added to a live ring since the last call.
+ *
+ * Records the writer overwrote before they could be read are skipped and
+ * counted. A record that is still being written ends the call, and is read
+ * by the next one.
+ * \param live The reader.
+ * \param level The lowest severity of the records written.
+ * \param out The stream the records are written to.
+ * \param lost Set to the number of records that were skipped, if not NULL.
+ * \return The number of records written.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+size_t log_live_read(struct LogLive * live, log_t level, FILE * out,
+		     size_t * lost);
+
+/**
+ * Closes a reader of a live ring.
+ * \param live The reader, or NULL.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_live_detach(struct LogLive * live);
+
+/** \} */
+
+/**
+ * \defgroup LogMetric Metric functions.
+ *
+ * Count events and record distributions of values without writing a record
+ * for each. Every thread adds to its own counters without locks or atomic
+ * read-modify-write operations, and the totals since the last summary are
+ * logged at level LOG_INFO, one record per metric, at a fixed interval.
+ * Metrics are named by string literals; a name is registered the first time
+ * it is used, as a counter or a histogram, and calls of the other kind with
+ * the same name are ignored. At most 64 metrics can be registered.
+ * \{
+ */
+
+/**
+ * Adds to a counter.
+ * \param name The name of the counter.
+ * \param delta The amount added.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_metric_count(const char * name, long long delta);
+
+/**
+ * Adds a value to a histogram.
+ *
+ * Values are kept in buckets of 8 per power of two, so the quantiles in the
+ * summaries are within about 6% of the values observed. Values that are not
+ * positive share one bucket.
+ * \param name The name of the histogram.
+ * \param value The value.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_metric_observe(const char * name, double value);
+
+/**
+ * Sets the interval between summaries.
+ *
+ * Summaries are written by the first thread to update a metric after the
+ * interval has passed, and when the process exits. The default is 10
+ * seconds.
+ * \param seconds The interval, or 0 to only write summaries when
+ * log_metric_flush() is called.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_set_metric_interval(unsigned seconds);
+
+/**
+ * Writes the summaries of the metrics that changed since the last summary.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_metric_flush(void);
+
+/** \} */
+
+/**
+ * \defgroup LogRead Log file reading functions.
+ *
+ * Read log files written in the "[TIMESTAMP] SEVERITY: MESSAGE" format.
+ * \{
+ */
+
+/**
+ * Parses the header of a record.
+ *
+ * \param line The start of the line.
+ * \param len The number of bytes available at line.
+ * \param time If not NULL, receives the timestamp of the record, including
+ * its fraction of the second if the header has one.
+ * \param level If not NULL, receives the severity level of the record, or 
+ * LOG_TRACE + 1 if the severity is not one of the named levels.
+ * \return The length of the header (the offset of the message), or 0 if the
+ * line does not start with a header (e.g. a continuation line).
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+size_t log_parse_header(const char * line, size_t len, struct timespec * time,
+			log_t * level);
+
+/**
+ * Writes the records of a log file whose timestamp falls in a time window.
+ *
+ * If the file has a sidecar index (see log_set_index()), the index is binary
+ * searched and only the part of the file that may hold the window is mapped
+ * and read; otherwise the whole file is scanned. Lines without a header are
+ * treated as part of the preceding record. The index locates records by the
+ * time they were written, so the window should not span a change of the
+ * system clock.
+ * \param filename The name of the log file.
+ * \param from The earliest timestamp to be written.
+ * \param to The latest timestamp to be written.
+ * \param out The stream where the records are written.
+ * \return The number of records written.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+size_t log_index_query(const char * filename, time_t from, time_t to,
+		       FILE * out);
+
+/**
+ * Writes the records of a file written by log_set_stdout_blocks() or
+ * log_set_stderr_blocks().
+ *
+ * Blocks whose checksum does not match are skipped. A block with a corrupt
+ * payload is skipped using the length confirmed by its footer; after a
+ * corrupt header, the next header is searched for. Blocks missing from the
+ * sequence are counted as corrupt.
+ * \param filename The name of the file.
+ * \param out The stream where the records are written.
+ * \param corrupt If not NULL, receives the number of blocks that were lost.
+ * \return The number of intact blocks, or -1 if the file could not be read.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+long long log_block_read(const char * filename, FILE * out, size_t * corrupt);
+
+/**
+ * Writes the records of several log files in the order of their timestamps.
+ *
+ * The files are mapped and merged in one pass, keeping the next record of
+ * each file in a heap, and the records are written straight from the
+ * mappings with writev() to the file descriptor of out. Records with the
+ * same timestamp keep the order of the files, and the records of each file
+ * keep their order. Timestamps may have a fraction of the second. Files
+ * written by log_set_stdout_blocks() or log_set_stderr_blocks() are
+ * recognized and their corrupt blocks skipped as by log_block_read().
+ * Lines without a header are treated as part of the preceding record.
+ * \param filenames The names of the files.
+ * \param count The number of files.
+ * \param out The stream where the records are written.
+ * \param corrupt If not NULL, receives the number of blocks that were lost.
+ * \return The number of records written, or -1 if a file could not be read
+ * or out could not be written.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+long long log_merge(const char * const * filenames, size_t count, FILE * out,
+		    size_t * corrupt);
+
+/** \} */
+
+/**
+ * \defgroup LogFormat Formatting functions.
+ *
+ * The formatter used for log messages. It supports the flags, field widths,
+ * precisions and length modifiers of the d, i, u, x, X, o, c, s, p, f, F, e,
+ * E, g, G and % conversions, renders into a caller-provided buffer without
+ * locking a stream, consulting the locale or allocating memory, and produces
+ * exactly the output of the GNU C library. A null pointer given for %s is
+ * written as "(null)", or as nothing if the precision is less than 6, where
+ * the C standard leaves the behavior undefined. Formats using any other
+ * conversion (or positional arguments) are passed to vsnprintf().
+ * \{
+ */
+
+/**
+ * Formats a string like vsnprintf().
+ * \param buffer The destination buffer.
+ * \param size The size of buffer; at most size - 1 characters and a
+ * terminating null character are written.
+ * \param format The printf() format.
+ * \param args The arguments of the format.
+ * \return The length of the complete output, which may exceed size - 1.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_vsnprintf(char * buffer, size_t size, const char * format,
+		  va_list args);
+
+/**
+ * Formats a string like snprintf(). See log_vsnprintf().
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_snprintf(char * buffer, size_t size, const char * format, ...);
+
+/**
+ * The flags of a conversion specification.
+ */
+enum {
+  LOG_FORMAT_LEFT = 1,   /**< '-': pad on the right. */
+  LOG_FORMAT_PLUS = 2,   /**< '+': always print a sign. */
+  LOG_FORMAT_SPACE = 4,  /**< ' ': print a space instead of a plus sign. */
+  LOG_FORMAT_ALT = 8,    /**< '#': alternative form. */
+  LOG_FORMAT_ZERO = 16   /**< '0': pad with zeros. */
+};
+
+/**
+ * A parsed conversion specification, e.g. "%-8.3f".
+ *
+ * The log_convert_*() functions below format a single argument according to
+ * a specification that has already been parsed, so that a caller that 
+ * parses formats ahead of time (such as the C++ front end in log.hpp) does
+ * not pay for parsing on every call.
+ */
+typedef struct {
+  int flags;       /**< A combination of the LOG_FORMAT_* flags. */
+  int width;       /**< The minimum field width. */
+  int precision;   /**< The precision, or -1 if none was given. */
+  char length;     /**< The length modifier (H for hh, q for ll), or 0. */
+  char conversion; /**< The conversion character, e.g. 'd'. */
+} log_spec_t;
+
+/**
+ * Formats an integer with a d or i specification. Like snprintf(), the
+ * functions log_convert_*() write at most size - 1 characters and a null
+ * character, and return the length of the complete output.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_convert_signed(char * buffer, size_t size, const log_spec_t * spec,
+		       long long value);
+
+/**
+ * Formats an integer with a u, x, X or o specification.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_convert_unsigned(char * buffer, size_t size, const log_spec_t * spec,
+			 unsigned long long value);
+
+/**
+ * Formats a double with an f, F, e, E, g or G specification.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_convert_double(char * buffer, size_t size, const log_spec_t * spec,
+		       double value);
+
+/**
+ * Formats a character with a c specification.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_convert_char(char * buffer, size_t size, const log_spec_t * spec,
+		     char value);
+
+/**
+ * Formats a string with an s specification.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_convert_string(char * buffer, size_t size, const log_spec_t * spec,
+		       const char * value);
+
+/**
+ * Formats a pointer with a p specification.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+int log_convert_pointer(char * buffer, size_t size, const log_spec_t * spec,
+			const void * value);
+
 /** \} */
 
 /**
@@ -152,8 +1236,8 @@ void log_set_stdout_file(char * filename);
  * and can be changed to alternate locations with the Log configuration 
  * functions.
  *
- * \param The format argument to be passed to vfprintf.
- * \param The variable length arguments to be passed to vfprintf.
+ * \param The format argument to be passed to log_vsnprintf().
+ * \param The variable length arguments to be passed to log_vsnprintf().
  * \{
  */
 
@@ -165,7 +1249,8 @@ void log_set_stdout_file(char * filename);
  * than level set by log_set_level(), then no logging occurs. In general, it 
  * is preferred to use one of the log macros. log_msg() is both thread safe 
  * and can be called on the same log files by multiple cooperating processes 
- * (i.e. respect advisory locks placed by flock()).
+ * (i.e. respect advisory locks placed by flock()). Processes attached to a
+ * shared-memory ring with log_shm_attach() queue the record instead.
  *  
  * If called from code compiled with NVCC (device code executed on the GPU), the
  * log utilities do nothing.
@@ -178,18 +1263,88 @@ extern "C"
 #endif
 void log_msg(const log_t level, const char * restrict format, ...);
 
+/**
+ * The descriptor of a call site of the log macros.
+ *
+ * Each call of log_info() and the other macros declares one, as a static
+ * constant, so the file, line, function and level of the call are stored
+ * once and only a pointer to them travels with each record. The format is
+ * passed with each call, since it need not be a constant.
+ */
+struct LogSite {
+  const char * file;     /**< The source file, from __FILE__. */
+  const char * function; /**< The function, from __func__. */
+  int line;              /**< The line, from __LINE__. */
+  log_t level;           /**< The severity level of the message. */
+};
+
+/**
+ * Logs a message like log_msg(), with the level of a call site.
+ *
+ * The file, line and function of the site are shown by the %F, %N and %fn
+ * directives of the pattern (see log_set_pattern()). The text that a
+ * pattern renders from the site alone, such as "%F:%N %fn: ", is rendered
+ * once per site and pattern and then copied.
+ * \param site The descriptor of the call site, which must outlive the
+ * program (see LOG_SITE_MSG()).
+ * \param format The format of the message, as for log_msg().
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_msg_site(const struct LogSite * site,
+		  const char * restrict format, ...);
+
+/**
+ * Returns the ID of a call site.
+ *
+ * The ID is a 64-bit hash of the file, function, line and level of the
+ * site, so it is the same in every run and every build in which the site is
+ * unchanged (see log_set_site_dictionary()). The format is not part of it,
+ * since a site may log a different one on each call.
+ * \param site The descriptor of the call site.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+unsigned long long log_site_id(const struct LogSite * site);
+
+/**
+ * Declares the descriptor of the call site and logs a message with it.
+ */
+#define LOG_SITE_MSG(level, format, ...)				\
+  do {									\
+    static const struct LogSite log_site_ =				\
+      { __FILE__, __func__, __LINE__, level };				\
+    log_msg_site(&log_site_, format, ##__VA_ARGS__);			\
+  } while(0)
+
+/**
+ * Logs a message that has already been formatted.
+ *
+ * The message is written like a message logged by log_msg(), with the 
+ * record header and a newline, so it must not end with a newline itself.
+ * \param level The severity level of the message to be logged.
+ * \param message The message, which need not be null terminated.
+ * \param len The length of message in bytes.
+ */
+#ifdef __cplusplus
+extern "C"
+#endif
+void log_write(const log_t level, const char * message, size_t len);
+
 /**
  * Logs a fatal error (and crashes the program in DEBUG mode).
  */
 #ifdef DEBUG
 #define log_fatal(format, ...)						\
   {									\
-    log_msg(LOG_FATAL, format, ##__VA_ARGS__);			\
+    LOG_SITE_MSG(LOG_FATAL, format, ##__VA_ARGS__);			\
     exit(EXIT_FAILURE);							\
   }
 #else
 #define log_fatal(format, ...)                                          \
-  log_msg(LOG_FATAL, format, ##__VA_ARGS__);
+  LOG_SITE_MSG(LOG_FATAL, format, ##__VA_ARGS__)
 #endif
 
 /**
@@ -198,12 +1353,12 @@ void log_msg(const log_t level, const char * restrict format, ...);
 #ifdef DEBUG
 #define log_error(format,...)						\
   {									\
-    log_msg(LOG_ERROR, format, ##__VA_ARGS__);			\
+    LOG_SITE_MSG(LOG_ERROR, format, ##__VA_ARGS__);			\
     exit(EXIT_FAILURE);							\
   }
 #else
 #define log_error(format, ...)                                           \
-  log_msg(LOG_ERROR, format, ##__VA_ARGS__)
+  LOG_SITE_MSG(LOG_ERROR, format, ##__VA_ARGS__)
 #endif
 
 /**
@@ -212,19 +1367,19 @@ void log_msg(const log_t level, const char * restrict format, ...);
 #ifdef DEBUG
 #define log_warning(format, ...)					\
   {									\
-    log_msg(LOG_WARNING, format, ##__VA_ARGS__);			\
+    LOG_SITE_MSG(LOG_WARNING, format, ##__VA_ARGS__);			\
     exit(EXIT_FAILURE);							\
   }
 #else
 #define log_warning(format, ...)                                        \
-  log_msg(LOG_WARNING, format, ##__VA_ARGS__);
+  LOG_SITE_MSG(LOG_WARNING, format, ##__VA_ARGS__)
 #endif
 
 /**
  * Logs standard runtime information.
  */
 #define log_info(format, ...)                                           \
-  log_msg(LOG_INFO, format, ##__VA_ARGS__)
+  LOG_SITE_MSG(LOG_INFO, format, ##__VA_ARGS__)
 
 /**
  * Logs debugging information (or does nothing in release builds).
@@ -237,7 +1392,7 @@ void log_msg(const log_t level, const char * restrict format, ...);
 #define log_debug(format, ...) 
 #else
 #define log_debug(format, ...)                                         \
-  log_msg(LOG_DEBUG, format, ##__VA_ARGS__)
+  LOG_SITE_MSG(LOG_DEBUG, format, ##__VA_ARGS__)
 #endif
 
 /**
@@ -253,7 +1408,7 @@ void log_msg(const log_t level, const char * restrict format, ...);
 #define log_trace(format, ...) 
 #else
 #define log_trace(format, ...)	                                       \
-  log_msg(LOG_TRACE, format, ##__VA_ARGS__)
+  LOG_SITE_MSG(LOG_TRACE, format, ##__VA_ARGS__)
 #endif
 
 /** \} */ /* Logging functions */
@@ -0,0 +1,387 @@
+#ifndef __LOGLIB_INCLUDE_LOG_HPP__
+#define __LOGLIB_INCLUDE_LOG_HPP__
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "log.h"
+
+/**
+ * \defgroup LogCpp C++ front end
+ *
+ * Type-safe logging for C++17 and later. The format is parsed when the
+ * program is compiled: a conversion that the formatter does not support, a
+ * wrong number of arguments or an argument whose type does not suit its
+ * conversion is a compile error, and at run time each argument is handed
+ * straight to the formatter function for its (already parsed) conversion.
+ * The record is then written by log_write(), like any other record.
+ *
+ * \code
+ * loglib_info("Served %s in %.3f ms.", request.path, elapsed);
+ * \endcode
+ *
+ * The supported conversions are those of log_vsnprintf(). Widths and
+ * precisions must be given in the format ('*' is not supported), and
+ * arguments are passed as their own type: integers are printed with their
+ * value (length modifiers only narrow them, as "hh" and "h" do in C), strings
+ * may be C strings, std::string or std::string_view, and %p takes any
+ * pointer.
+ * \{
+ */
+
+namespace loglib {
+namespace detail {
+
+/**
+ * The reasons a format can be rejected.
+ */
+enum FormatError {
+  FORMAT_OK,
+  FORMAT_UNSUPPORTED,  /**< A conversion the formatter does not support. */
+  FORMAT_STAR,         /**< A width or precision given by '*'. */
+  FORMAT_POSITIONAL    /**< A positional argument ("%1$d"). */
+};
+
+constexpr std::size_t length(const char * text) {
+  std::size_t len = 0;
+  while(text[len] != '\0') ++len;
+  return len;
+}
+
+/**
+ * Returns the number of conversions in a format (excluding "%%").
+ */
+constexpr std::size_t count_conversions(const char * format) {
+  std::size_t count = 0;
+  for(std::size_t i = 0; format[i] != '\0'; ++i) {
+    if(format[i] != '%') continue;
+    if(format[i + 1] == '%') ++i; else ++count;
+  }
+  return count;
+}
+
+/**
+ * A parsed format: the specification of each conversion and the literal text
+ * before each conversion and after the last one, with "%%" collapsed.
+ */
+template<std::size_t Conversions, std::size_t Length>
+struct Format {
+  FormatError error = FORMAT_OK;
+  log_spec_t specs[Conversions + 1] = {};
+  std::size_t literal_offset[Conversions + 1] = {};
+  std::size_t literal_len[Conversions + 1] = {};
+  char text[Length + 1] = {};
+};
+
+/**
+ * Parses a format at compile time. Mirrors the parser of log_vsnprintf().
+ */
+template<std::size_t Conversions, std::size_t Length>
+constexpr Format<Conversions, Length> parse(const char * format) {
+  Format<Conversions, Length> parsed;
+  std::size_t conversion = 0, text_len = 0;
+  const char * p = format;
+  while(true) {
+    /* Copy the literal text up to the next conversion. */
+    while(*p != '\0' && !(p[0] == '%' && p[1] != '%')) {
+      parsed.text[text_len++] = *p;
+      ++parsed.literal_len[conversion];
+      p += p[0] == '%' ? 2 : 1;
+    }
+    if(*p == '\0') break;
+    log_spec_t spec = { 0, 0, -1, 0, 0 };
+    for(++p;; ++p) {
+      if(*p == '-') spec.flags |= LOG_FORMAT_LEFT;
+      else if(*p == '+') spec.flags |= LOG_FORMAT_PLUS;
+      else if(*p == ' ') spec.flags |= LOG_FORMAT_SPACE;
+      else if(*p == '#') spec.flags |= LOG_FORMAT_ALT;
+      else if(*p == '0') spec.flags |= LOG_FORMAT_ZERO;
+      else break;
+    }
+    if(*p == '*') parsed.error = FORMAT_STAR;
+    while(*p >= '0' && *p <= '9') spec.width = spec.width * 10 + (*p++ - '0');
+    if(*p == '.') {
+      spec.precision = 0;
+      if(*++p == '*') parsed.error = FORMAT_STAR;
+      while(*p >= '0' && *p <= '9')
+	spec.precision = spec.precision * 10 + (*p++ - '0');
+    }
+    if(*p == '$') parsed.error = FORMAT_POSITIONAL;
+    if(*p == 'h' || *p == 'l') {
+      spec.length = *p++;
+      if(*p == spec.length) {
+	spec.length = spec.length == 'h' ? 'H' : 'q';
+	++p;
+      }
+    } else if(*p == 'z' || *p == 'j' || *p == 't') {
+      spec.length = *p++;
+    }
+    spec.conversion = *p;
+    switch(*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+      break;
+    case 'c': case 's': case 'p':
+      if(spec.length != 0 && parsed.error == FORMAT_OK)
+	parsed.error = FORMAT_UNSUPPORTED;
+      break;
+    default:
+      if(parsed.error == FORMAT_OK) parsed.error = FORMAT_UNSUPPORTED;
+      return parsed;
+    }
+    ++p;
+    parsed.specs[conversion++] = spec;
+    parsed.literal_offset[conversion] = text_len;
+  }
+  return parsed;
+}
+
+template<typename T>
+using Bare = std::remove_cv_t<std::remove_reference_t<T>>;
+
+template<typename T>
+constexpr bool is_string_v =
+  std::is_same_v<std::decay_t<T>, char *>
+  || std::is_same_v<std::decay_t<T>, const char *>
+  || std::is_same_v<Bare<T>, std::string>
+  || std::is_same_v<Bare<T>, std::string_view>;
+
+template<typename T>
+constexpr bool is_integer_v =
+  std::is_integral_v<Bare<T>> || std::is_enum_v<Bare<T>>;
+
+/**
+ * Returns true if an argument of type T suits the conversion.
+ */
+template<typename T>
+constexpr bool accepts(char conversion) {
+  switch(conversion) {
+  case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+    return is_integer_v<T>;
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+    /* long double would have to be narrowed. */
+    return std::is_same_v<Bare<T>, double> || std::is_same_v<Bare<T>, float>;
+  case 's':
+    return is_string_v<T>;
+  case 'p':
+    return std::is_pointer_v<std::decay_t<T>>
+      || std::is_null_pointer_v<Bare<T>>;
+  default:
+    return false;
+  }
+}
+
+template<typename... Args, std::size_t N, std::size_t L, std::size_t... I>
+constexpr bool accepts_all(const Format<N, L> & format,
+			   std::index_sequence<I...>) {
+  return (true && ... && accepts<Args>(format.specs[I].conversion));
+}
+
+/**
+ * Formats one argument, returning the length of its complete output.
+ */
+template<typename T>
+int convert(char * buffer, std::size_t size, const log_spec_t & spec,
+	    const T & value) {
+  if constexpr(std::is_floating_point_v<T>) {
+    return log_convert_double(buffer, size, &spec, value);
+  } else if constexpr(std::is_null_pointer_v<T>) {
+    return log_convert_pointer(buffer, size, &spec, nullptr);
+  } else if constexpr(std::is_same_v<T, std::string>
+		      || std::is_same_v<T, std::string_view>) {
+    /* The string need not be null terminated, so bound it. */
+    log_spec_t bounded = spec;
+    if(bounded.precision < 0 || (std::size_t) bounded.precision > value.size())
+      bounded.precision = (int) value.size();
+    return log_convert_string(buffer, size, &bounded, value.data());
+  } else if constexpr(std::is_pointer_v<std::decay_t<T>>) {
+    if constexpr(is_string_v<T>)
+      if(spec.conversion == 's')
+	return log_convert_string(buffer, size, &spec, value);
+    return log_convert_pointer(buffer, size, &spec,
+			       (const void *) value);
+  } else {
+    /* Integers keep their value unless a length modifier narrows them. */
+    using Integer = std::conditional_t<std::is_same_v<T, bool>, int,
+      typename std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>,
+				  std::common_type<T>>::type>;
+    Integer integer = static_cast<Integer>(value);
+    if(spec.conversion == 'c')
+      return log_convert_char(buffer, size, &spec, (char) integer);
+    if(spec.conversion == 'd' || spec.conversion == 'i') {
+      long long signed_value = (long long) integer;
+      if(spec.length == 'H') signed_value = (signed char) signed_value;
+      else if(spec.length == 'h') signed_value = (short) signed_value;
+      return log_convert_signed(buffer, size, &spec, signed_value);
+    }
+    unsigned long long unsigned_value =
+      (unsigned long long) (std::make_unsigned_t<Integer>) integer;
+    if(spec.length == 'H') unsigned_value = (unsigned char) unsigned_value;
+    else if(spec.length == 'h') unsigned_value = (unsigned short) unsigned_value;
+    return log_convert_unsigned(buffer, size, &spec, unsigned_value);
+  }
+}
+
+/**
+ * Renders the message with the semantics of snprintf(), except that the
+ * message is null terminated only if it ends with a conversion, and returns
+ * its complete length.
+ */
+template<std::size_t N, std::size_t L, typename... Args>
+std::size_t render(const Format<N, L> & format, char * buffer,
+		   std::size_t size, const Args &... args) {
+  std::size_t len = 0, conversion = 0;
+  auto put_literal = [&](std::size_t i) {
+    std::size_t n = format.literal_len[i];
+    if(len < size) {
+      std::size_t room = size - len;
+      std::char_traits<char>::copy(buffer + len,
+				   format.text + format.literal_offset[i],
+				   n < room ? n : room);
+    }
+    len += n;
+  };
+  auto put_argument = [&](const auto & arg) {
+    put_literal(conversion);
+    std::size_t room = len < size ? size - len : 0;
+    int n = convert(buffer + (size - room), room, format.specs[conversion],
+		    arg);
+    if(n > 0) len += n;
+    ++conversion;
+  };
+  (put_argument(args), ...);
+  (void) put_argument; /* For formats without conversions. */
+  put_literal(conversion);
+  return len;
+}
+
+} /* namespace detail */
+
+/**
+ * Logs a message whose format is checked at compile time. Use the
+ * loglib_*() macros, which wrap the format with LOGLIB_FORMAT().
+ * \param level The severity level of the message to be logged.
+ * \param format A type whose static constexpr member function str() returns
+ * the format.
+ * \param args The arguments of the format.
+ */
+template<typename Format, typename... Args>
+void log(log_t level, Format format, const Args &... args) {
+  (void) format;
+  static constexpr const char * text = Format::str();
+  static constexpr auto parsed =
+    detail::parse<detail::count_conversions(text), detail::length(text)>(text);
+  static_assert(parsed.error != detail::FORMAT_UNSUPPORTED,
+		"log.hpp: the format has a conversion that is not supported");
+  static_assert(parsed.error != detail::FORMAT_STAR,
+		"log.hpp: '*' widths and precisions are not supported");
+  static_assert(parsed.error != detail::FORMAT_POSITIONAL,
+		"log.hpp: positional arguments are not supported");
+  static_assert(detail::count_conversions(text) == sizeof...(Args),
+		"log.hpp: the number of arguments does not match the format");
+  if constexpr(detail::count_conversions(text) == sizeof...(Args))
+    static_assert(detail::accepts_all<Args...>(
+		    parsed, std::index_sequence_for<Args...>()),
+		  "log.hpp: an argument type does not match its conversion");
+  if(!log_is_enabled(level)) return;
+  /* Most messages fit on the stack; the rest are rendered again. */
+  char stack_message[1024];
+  std::size_t len = detail::render(parsed, stack_message,
+				   sizeof(stack_message), args...);
+  if(len < sizeof(stack_message)) {
+    log_write(level, stack_message, len);
+  } else {
+    std::unique_ptr<char[]> message(new char[len + 1]);
+    detail::render(parsed, message.get(), len + 1, args...);
+    log_write(level, message.get(), len);
+  }
+}
+
+} /* namespace loglib */
+
+/**
+ * Wraps a string literal in a type, so that it can be parsed at compile
+ * time by loglib::log().
+ */
+#define LOGLIB_FORMAT(format)						\
+  ([] {									\
+    struct Format {							\
+      static constexpr const char * str() { return format; }		\
+    };									\
+    return Format();							\
+  }())
+
+/**
+ * Logs a fatal error (and crashes the program in DEBUG mode).
+ */
+#ifdef DEBUG
+#define loglib_fatal(format, ...)					\
+  {									\
+    ::loglib::log(LOG_FATAL, LOGLIB_FORMAT(format), ##__VA_ARGS__);	\
+    exit(EXIT_FAILURE);							\
+  }
+#else
+#define loglib_fatal(format, ...)					\
+  ::loglib::log(LOG_FATAL, LOGLIB_FORMAT(format), ##__VA_ARGS__)
+#endif
+
+/**
+ * Logs a recoverable error (and crashes the program in DEBUG mode).
+ */
+#ifdef DEBUG
+#define loglib_error(format, ...)					\
+  {									\
+    ::loglib::log(LOG_ERROR, LOGLIB_FORMAT(format), ##__VA_ARGS__);	\
+    exit(EXIT_FAILURE);							\
+  }
+#else
+#define loglib_error(format, ...)					\
+  ::loglib::log(LOG_ERROR, LOGLIB_FORMAT(format), ##__VA_ARGS__)
+#endif
+
+/**
+ * Logs a warning (and crashes the program in DEBUG mode).
+ */
+#ifdef DEBUG
+#define loglib_warning(format, ...)					\
+  {									\
+    ::loglib::log(LOG_WARNING, LOGLIB_FORMAT(format), ##__VA_ARGS__);	\
+    exit(EXIT_FAILURE);							\
+  }
+#else
+#define loglib_warning(format, ...)					\
+  ::loglib::log(LOG_WARNING, LOGLIB_FORMAT(format), ##__VA_ARGS__)
+#endif
+
+/**
+ * Logs standard runtime information.
+ */
+#define loglib_info(format, ...)					\
+  ::loglib::log(LOG_INFO, LOGLIB_FORMAT(format), ##__VA_ARGS__)
+
+/**
+ * Logs debugging information (or does nothing in release builds).
+ */
+#ifdef RELEASE
+#define loglib_debug(format, ...)
+#else
+#define loglib_debug(format, ...)					\
+  ::loglib::log(LOG_DEBUG, LOGLIB_FORMAT(format), ##__VA_ARGS__)
+#endif
+
+/**
+ * Logs tracing information (or does nothing in release builds).
+ */
+#ifdef RELEASE
+#define loglib_trace(format, ...)
+#else
+#define loglib_trace(format, ...)					\
+  ::loglib::log(LOG_TRACE, LOGLIB_FORMAT(format), ##__VA_ARGS__)
+#endif
+
+/** \} */
+#endif
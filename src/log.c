@@ -1,12 +1,70 @@
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/file.h>
 
 #include "log.h"
+#include "log_private.h"
+
+/**
+ * Size of the stack buffer used to render a record. Longer records are
+ * rendered on the heap.
+ */
+#define LOG_RECORD_SIZE 1024
+
+/**
+ * The governor sheds one more level at most this often (in nanoseconds)...
+ */
+#define LOG_GOVERNOR_RAISE_NS 50000000ULL
+
+/**
+ * ...and restores one level at most this often, once writes are fast again.
+ */
+#define LOG_GOVERNOR_RESTORE_NS 1000000000ULL
+
+/**
+ * The governor sheds three levels below the configured one at most, and
+ * never warnings or errors.
+ */
+#define LOG_GOVERNOR_MAX_SHED 3
+
+/**
+ * Shed records check whether the streams have been idle long enough to
+ * restore a level once per this many records.
+ */
+#define LOG_GOVERNOR_IDLE_CHECK 64
+
+/**
+ * The reports of the governor, written after the module is unlocked.
+ */
+enum {
+  LOG_GOVERNOR_REPORT_SHED = 1,    /**< It shed its first record. */
+  LOG_GOVERNOR_REPORT_RESTORED = 2 /**< It restored the configured level. */
+};
+
+/**
+ * The state of the governor (see log_set_governor()). The thresholds and
+ * the average are guarded by the module lock; shed is read without it.
+ */
+struct LogGovernor {
+  _Atomic uint64_t raise_ns;   /**< 0 if the governor is off. */
+  uint64_t restore_ns;
+  uint64_t latency_ns;         /**< The moving average of write latency. */
+  uint64_t changed_ns;         /**< When shed last changed. */
+  _Atomic uint64_t written_ns; /**< When a record was last written. */
+  _Atomic int shed;            /**< The number of levels shed. */
+  _Atomic bool shedding;       /**< A record was shed since the last report. */
+  _Atomic int report;
+  _Atomic unsigned long long shed_records[LOG_GOVERNOR_MAX_SHED];
+};
 
 /**
  * 
@@ -19,6 +77,14 @@ struct LogConfig {
   FILE * stderr;
   bool stdout_should_be_closed;
   bool stderr_should_be_closed;
+  unsigned index_records;
+  unsigned index_seconds;
+  struct LogIndex * stdout_index;
+  struct LogIndex * stderr_index;
+  struct LogSink * stdout_sink; /**< Replaces stdout if not NULL. */
+  struct LogSink * stderr_sink; /**< Replaces stderr if not NULL. */
+  _Atomic(const struct LogPattern *) pattern;
+  struct LogGovernor governor;
 };
 
 /**
@@ -29,18 +95,52 @@ static struct LogConfig config =  {
   .lock = PTHREAD_MUTEX_INITIALIZER,
   .level = LOG_INFO,
   .stdout_should_be_closed = false,
-  .stderr_should_be_closed = false
+  .stderr_should_be_closed = false,
+  .index_records = 0,
+  .index_seconds = 0,
+  .stdout_index = NULL,
+  .stderr_index = NULL,
+  .stdout_sink = NULL,
+  .stderr_sink = NULL,
+  .pattern = &log_default_pattern,
+  .governor = { .raise_ns = 0, .shed = 0, .shedding = false, .report = 0 }
 };
 
+/**
+ * Completes what the sinks have buffered when the program exits. They stay
+ * open, since handlers that run later may still log.
+ */
+static void log_sync_sinks(void) {
+  pthread_mutex_lock(&config.lock);
+  if(config.stdout_sink != NULL) config.stdout_sink->sync(config.stdout_sink);
+  if(config.stderr_sink != NULL) config.stderr_sink->sync(config.stderr_sink);
+  pthread_mutex_unlock(&config.lock);
+}
+
 /**
  *
  */
 static void log_setup() {
   pthread_mutex_lock(&config.lock);
+  bool first = !config.setup;
   config.stdout = stdout;
   config.stderr = stderr;
   config.setup = true;
   pthread_mutex_unlock(&config.lock);
+  /* Registered first, so that it runs after the handlers that flush. */
+  if(first) atexit(log_sync_sinks);
+  /* LOGLIB_STAGING=SIZE[,huge] enables the staging buffers. */
+  const char * staging = getenv("LOGLIB_STAGING");
+  if(first && staging != NULL) {
+    char * end;
+    size_t size = strtoull(staging, &end, 0);
+    log_set_staging(size, strcmp(end, ",huge") == 0 ?
+		    LOG_STAGING_HUGE_PAGES : 0);
+  }
+  /* LOGLIB_LIVE=NAME keeps the latest debug records in a live ring. */
+  const char * live = getenv("LOGLIB_LIVE");
+  if(first && live != NULL && live[0] != '\0')
+    log_set_live(live, 4096, LOG_DEBUG);
 }
 
 /**
@@ -51,6 +151,10 @@ log_t log_get_level() {
   return config.level;
 }
 
+log_t log_level_threshold(void) {
+  return config.level;
+}
+
 /**
  * 
  */
@@ -61,6 +165,55 @@ void log_set_level(log_t level) {
   pthread_mutex_unlock(&config.lock);
 }
 
+void log_set_index(unsigned every_records, unsigned every_seconds) {
+  if(!config.setup) log_setup();
+  pthread_mutex_lock(&config.lock);
+  config.index_records = every_records;
+  config.index_seconds = every_seconds;
+  pthread_mutex_unlock(&config.lock);
+}
+
+void log_set_pattern(const char * pattern) {
+  if(!config.setup) log_setup();
+  const struct LogPattern * compiled = &log_default_pattern;
+  size_t error_offset;
+  if(pattern != NULL
+     && (compiled = log_pattern_compile(pattern, &error_offset)) == NULL) {
+    log_error("I could not compile the pattern \"%s\" at offset %zu.",
+	      pattern, error_offset);
+    return;
+  }
+  pthread_mutex_lock(&config.lock);
+  const struct LogPattern * old_pattern = config.pattern;
+  atomic_store_explicit(&config.pattern, compiled, memory_order_release);
+  log_pattern_retire(old_pattern);
+  pthread_mutex_unlock(&config.lock);
+}
+
+/**
+ * Replaces the sidecar index of a stream. The module must be locked.
+ * \param index The index to be replaced.
+ * \param filename The name of the new log file, or NULL if the new stream
+ * is not a file opened by the library.
+ */
+static void log_replace_index(struct LogIndex ** index, const char * filename) {
+  log_index_close(*index);
+  *index = NULL;
+  if(filename != NULL && (config.index_records > 0 || config.index_seconds > 0))
+    *index = log_index_open(filename, config.index_records,
+			    config.index_seconds);
+}
+
+/**
+ * Replaces the sink of a stream, closing the old one. The module must be
+ * locked.
+ */
+static void log_replace_sink(struct LogSink ** sink,
+			     struct LogSink * replacement) {
+  if(*sink != NULL) (*sink)->close(*sink);
+  *sink = replacement;
+}
+
 void log_set_stderr_file(char * filename) {
   if(!config.setup) log_setup();
   pthread_mutex_lock(&config.lock); /* Lock the module. */
@@ -77,6 +230,8 @@ void log_set_stderr_file(char * filename) {
     if(config.stderr_should_be_closed)
       fclose(old_stderr);
     config.stderr_should_be_closed = true;
+    log_replace_index(&config.stderr_index, filename);
+    log_replace_sink(&config.stderr_sink, NULL);
     pthread_mutex_unlock(&config.lock); /* Unlock the module. */
   }
 }
@@ -97,6 +252,8 @@ void log_set_stdout_file(char * filename) {
     if(config.stdout_should_be_closed)
       fclose(old_stdout);
     config.stdout_should_be_closed = true;
+    log_replace_index(&config.stdout_index, filename);
+    log_replace_sink(&config.stdout_sink, NULL);
     pthread_mutex_unlock(&config.lock); /* Unlock the module. */
   }
 }
@@ -106,6 +263,8 @@ void log_set_stderr(FILE * stream) {
   if(config.stderr_should_be_closed) fclose(config.stderr);
   config.stderr = stream;
   config.stderr_should_be_closed = false;
+  log_replace_index(&config.stderr_index, NULL);
+  log_replace_sink(&config.stderr_sink, NULL);
   pthread_mutex_unlock(&config.lock);
 }
 
@@ -115,67 +274,440 @@ void log_set_stdout(FILE * stream) {
   if(config.stdout_should_be_closed) fclose(config.stdout);
   config.stdout = stream;
   config.stdout_should_be_closed = false;
+  log_replace_index(&config.stdout_index, NULL);
+  log_replace_sink(&config.stdout_sink, NULL);
   pthread_mutex_unlock(&config.lock);
 }
 
-void log_msg(const log_t level, const char * restrict format, ...) {
+/**
+ * Replaces the stream that receives messages of the given level with a sink,
+ * or logs why the sink could not be opened.
+ * \param level The severity level used to select the stream.
+ * \param filename The name of the file of the sink.
+ * \param sink The sink, or NULL with errno set.
+ */
+static void log_set_sink(const log_t level, const char * filename,
+			 struct LogSink * sink) {
+  bool error_stream = log_level_is_error(level);
+  if(sink == NULL) {
+    log_error("I could not change %s to %s with error %d.",
+	      error_stream ? "stderr" : "stdout", filename, errno);
+    return;
+  }
+  pthread_mutex_lock(&config.lock);
+  if(error_stream) {
+    if(config.stderr_should_be_closed) fclose(config.stderr);
+    config.stderr = stderr;
+    config.stderr_should_be_closed = false;
+    log_replace_index(&config.stderr_index, NULL);
+    log_replace_sink(&config.stderr_sink, sink);
+  } else {
+    if(config.stdout_should_be_closed) fclose(config.stdout);
+    config.stdout = stdout;
+    config.stdout_should_be_closed = false;
+    log_replace_index(&config.stdout_index, NULL);
+    log_replace_sink(&config.stdout_sink, sink);
+  }
+  pthread_mutex_unlock(&config.lock);
+}
+
+void log_set_stderr_compressed(const char * filename,
+			       const char * dictionary) {
+  if(!config.setup) log_setup();
+  log_set_sink(LOG_ERROR, filename, log_zstd_open(filename, dictionary));
+}
+
+void log_set_stdout_compressed(const char * filename,
+			       const char * dictionary) {
+  if(!config.setup) log_setup();
+  log_set_sink(LOG_INFO, filename, log_zstd_open(filename, dictionary));
+}
+
+void log_set_stderr_blocks(const char * filename) {
+  if(!config.setup) log_setup();
+  log_set_sink(LOG_ERROR, filename, log_block_open(filename));
+}
+
+void log_set_stdout_blocks(const char * filename) {
+  if(!config.setup) log_setup();
+  log_set_sink(LOG_INFO, filename, log_block_open(filename));
+}
+
+void log_set_stderr_direct(const char * filename) {
+  if(!config.setup) log_setup();
+  log_set_sink(LOG_ERROR, filename, log_direct_open(filename));
+}
+
+void log_set_stdout_direct(const char * filename) {
+  if(!config.setup) log_setup();
+  log_set_sink(LOG_INFO, filename, log_direct_open(filename));
+}
+
+void log_set_stderr_socket(const char * path, const char * fallback,
+			   int flags) {
+  if(!config.setup) log_setup();
+  log_set_sink(LOG_ERROR, path,
+	       log_socket_open(path, fallback, flags, LOG_ERROR));
+}
+
+void log_set_stdout_socket(const char * path, const char * fallback,
+			   int flags) {
+  if(!config.setup) log_setup();
+  log_set_sink(LOG_INFO, path,
+	       log_socket_open(path, fallback, flags, LOG_INFO));
+}
+
+const char * log_level_str(const log_t level) {
+  switch(level) {
+  case LOG_FATAL:   return "FATAL";
+  case LOG_ERROR:   return "ERROR";
+  case LOG_WARNING: return "WARNING";
+  case LOG_INFO:    return "INFO";
+  case LOG_DEBUG:   return "DEBUG";
+  case LOG_TRACE:   return "TRACE";
+  default:          return "UNKNOWN";
+  }
+}
+
+/**
+ * Returns the current value of the monotonic clock in nanoseconds.
+ */
+static uint64_t log_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void log_set_governor(unsigned raise_us, unsigned restore_us) {
+  if(!config.setup) log_setup();
+  pthread_mutex_lock(&config.lock);
+  struct LogGovernor * governor = &config.governor;
+  governor->restore_ns = (uint64_t) restore_us * 1000;
+  governor->latency_ns = 0;
+  governor->changed_ns = log_now_ns();
+  atomic_store(&governor->raise_ns, (uint64_t) raise_us * 1000);
+  if(raise_us == 0 && atomic_exchange(&governor->shed, 0) > 0
+     && atomic_exchange(&governor->shedding, false))
+    atomic_fetch_or(&governor->report, LOG_GOVERNOR_REPORT_RESTORED);
+  pthread_mutex_unlock(&config.lock);
+}
+
+/**
+ * Returns the most verbose level logged while shed levels are shed: that many
+ * below the configured level, but never below LOG_WARNING.
+ */
+static int log_governed_level(int shed) {
+  int level = (int) config.level - shed;
+  return level > LOG_WARNING ? level : LOG_WARNING;
+}
+
+/**
+ * Updates the average write latency and sheds or restores a level if it
+ * calls for it. The module must be locked.
+ * \param now The current value of the monotonic clock.
+ * \param latency The latency of the last write.
+ */
+static void log_govern(uint64_t now, uint64_t latency) {
+  struct LogGovernor * governor = &config.governor;
+  /* An exponential moving average over about 8 writes. */
+  governor->latency_ns = governor->latency_ns - governor->latency_ns / 8
+    + latency / 8;
+  int shed = atomic_load_explicit(&governor->shed, memory_order_relaxed);
+  uint64_t since = now - governor->changed_ns;
+  /* The average lags, so a fast write never sheds another level. */
+  uint64_t raise_ns = atomic_load(&governor->raise_ns);
+  if(governor->latency_ns > raise_ns && latency > raise_ns
+     && shed < LOG_GOVERNOR_MAX_SHED && log_governed_level(shed) > LOG_WARNING
+     && since >= LOG_GOVERNOR_RAISE_NS) {
+    atomic_store_explicit(&governor->shed, shed + 1, memory_order_relaxed);
+    governor->changed_ns = now;
+  } else if(governor->latency_ns < governor->restore_ns && shed > 0
+	    && since >= LOG_GOVERNOR_RESTORE_NS) {
+    /* Restore one level at a time, and slowly, to avoid flapping. */
+    atomic_store_explicit(&governor->shed, shed - 1, memory_order_relaxed);
+    governor->changed_ns = now;
+    if(shed == 1 && atomic_exchange(&governor->shedding, false))
+      atomic_fetch_or(&governor->report, LOG_GOVERNOR_REPORT_RESTORED);
+  }
+}
+
+/**
+ * Writes the records due from the governor. The module must not be locked.
+ */
+static void log_govern_report(void) {
+  struct LogGovernor * governor = &config.governor;
+  int report = atomic_exchange(&governor->report, 0);
+  char record[256];
+  int len;
+  if(report & LOG_GOVERNOR_REPORT_SHED) {
+    len = log_format_record(record, sizeof(record), LOG_WARNING,
+			    "The log is slow, so verbose records are being "
+			    "shed.");
+    log_emit(LOG_WARNING, record, len);
+  }
+  if(report & LOG_GOVERNOR_REPORT_RESTORED) {
+    unsigned long long info =
+      atomic_exchange(&governor->shed_records[0], 0);
+    unsigned long long debug =
+      atomic_exchange(&governor->shed_records[1], 0);
+    unsigned long long trace =
+      atomic_exchange(&governor->shed_records[2], 0);
+    len = log_format_record(record, sizeof(record), LOG_WARNING,
+			    "The log is no longer slow; %llu INFO, %llu DEBUG "
+			    "and %llu TRACE records were shed.",
+			    info, debug, trace);
+    log_emit(LOG_WARNING, record, len);
+  }
+}
+
+bool log_level_logged(const log_t level) {
+  if(level > config.level) return false;
+  struct LogGovernor * governor = &config.governor;
+  int shed = atomic_load_explicit(&governor->shed, memory_order_relaxed);
+  if(shed == 0 || (int) level <= log_governed_level(shed)) return true;
+  unsigned long long count = atomic_fetch_add_explicit(
+    &governor->shed_records[(level < LOG_TRACE ? level : LOG_TRACE) - LOG_INFO],
+    1, memory_order_relaxed);
+  /* Shedding is reported with the first record shed, not with the level. */
+  if(!atomic_load_explicit(&governor->shedding, memory_order_relaxed)
+     && !atomic_exchange(&governor->shedding, true)) {
+    atomic_fetch_or(&governor->report, LOG_GOVERNOR_REPORT_SHED);
+    log_govern_report();
+  }
+  /* Nothing is written while everything is shed, so look at the clock. */
+  if(count % LOG_GOVERNOR_IDLE_CHECK == 0) {
+    uint64_t now = log_now_ns();
+    if(now - atomic_load(&governor->written_ns) >= LOG_GOVERNOR_RESTORE_NS
+       && pthread_mutex_trylock(&config.lock) == 0) {
+      governor->latency_ns = 0;
+      log_govern(now, 0);
+      pthread_mutex_unlock(&config.lock);
+      if(atomic_load(&governor->report) != 0) log_govern_report();
+    }
+  }
+  return false;
+}
+
+/**
+ * Writes data to a stream under its advisory lock, or to the sink that
+ * replaces it. The module must be locked.
+ */
+static void log_write_stream(FILE * stream, struct LogSink * sink,
+			     struct LogIndex * index, const char * data,
+			     size_t len) {
+  if(sink != NULL) {
+    sink->write(sink, data, len);
+    return;
+  }
+  flock(fileno(stream), LOCK_EX); /* Lock the file. */
+  if(index != NULL) log_index_note(index, stream, data, len);
+#ifdef LOG_STATIC_MEMORY
+  /* The stream's buffer would be allocated on first use, so bypass it. */
+  fflush(stream);
+  for(size_t written = 0; written < len;) {
+    ssize_t n = write(fileno(stream), data + written, len - written);
+    if(n < 0 && errno != EINTR) break;
+    if(n > 0) written += n;
+  }
+#else
+  fwrite(data, sizeof(char), len, stream);
+#endif
+  flock(fileno(stream), LOCK_UN); /* Unlock the file. */
+}
+
+void log_emit(const log_t level, const char * data, size_t len) {
+  const char * streams[2] = { NULL, NULL };
+  size_t lens[2] = { 0, 0 };
+  int stream = log_level_is_error(level) ? 1 : 0;
+  streams[stream] = data;
+  lens[stream] = len;
+  log_emit_streams(streams, lens);
+}
+
+void log_emit_streams(const char * const * data, const size_t * len) {
   if(!config.setup) log_setup();
-  /* Get the current time (not critical / no lock needed). */
-  if(level <= config.level) {
-    /* Messages less severe than config.level are not logged. */
-    time_t rawtime;
-    struct tm * timeinfo;
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    char time_str[25];
-    strftime(time_str, 25, "%a %d %b %Y %H:%M:%S", timeinfo);
-    /* Get the level string (not critical / no lock needed). */
-    char * level_str;
-    FILE * stream;
-    switch(level) {
-    case LOG_FATAL:
-      level_str = "FATAL";
-      stream = config.stderr;
-      break;
-    case LOG_ERROR:
-      level_str = "ERROR";
-      stream = config.stderr;
-      break;
-    case LOG_WARNING:
-      level_str = "WARNING";
-      stream = config.stderr;
-      break;
-    case LOG_INFO:
-      level_str = "INFO";
-      stream = config.stdout;
-      break;
-    case LOG_DEBUG:
-      level_str = "DEBUG";
-      stream = config.stdout;
-      break;
-    case LOG_TRACE:
-      level_str = "TRACE";
-      stream = config.stdout;
-      break;
-    default:
-      level_str = "UNKNOWN";
-      stream = config.stdout;
-      break;
+  /* The governor measures the wait for the lock as well as the write. */
+  struct LogGovernor * governor = &config.governor;
+  bool governed = atomic_load_explicit(&governor->raise_ns,
+				       memory_order_relaxed) != 0;
+  uint64_t start = governed ? log_now_ns() : 0;
+  /* Do the actual printing. This is critical and needs to be locked. */
+  pthread_mutex_lock(&config.lock);
+  if(len[0] > 0)
+    log_write_stream(config.stdout, config.stdout_sink, config.stdout_index,
+		     data[0], len[0]);
+  if(len[1] > 0)
+    log_write_stream(config.stderr, config.stderr_sink, config.stderr_index,
+		     data[1], len[1]);
+  if(governed) {
+    uint64_t now = log_now_ns();
+    atomic_store_explicit(&governor->written_ns, now, memory_order_relaxed);
+    log_govern(now, now - start);
+  }
+  pthread_mutex_unlock(&config.lock);
+  if(governed && atomic_load(&governor->report) != 0) log_govern_report();
+}
+
+void log_flush_streams(void) {
+  if(!config.setup) log_setup();
+  pthread_mutex_lock(&config.lock);
+  if(config.stdout_sink == NULL) fflush(config.stdout);
+  if(config.stderr_sink == NULL) fflush(config.stderr);
+  pthread_mutex_unlock(&config.lock);
+}
+
+int log_render_record(char * buffer, size_t size,
+		      const struct LogRecord * record, va_list args) {
+  const struct LogPattern * pattern =
+    atomic_load_explicit(&config.pattern, memory_order_acquire);
+  return log_pattern_render(pattern, buffer, size, record, args);
+}
+
+int log_vformat_record(char * buffer, size_t size, const log_t level,
+		       const char * format, va_list args) {
+  struct LogRecord record = { .level = level, .format = format };
+  log_record_stamp(&record);
+  return log_render_record(buffer, size, &record, args);
+}
+
+int log_format_record(char * buffer, size_t size, const log_t level,
+		      const char * format, ...) {
+  va_list args;
+  va_start(args, format);
+  int len = log_vformat_record(buffer, size, level, format, args);
+  va_end(args);
+  return len < (int) size ? len : (int) size;
+}
+
+void log_submit(const struct LogRecord * fields, va_list args) {
+  bool collapsed;
+  struct LogFingerprint * print = log_fingerprint_note(fields, &collapsed);
+  if(!collapsed) log_submit_noted(fields, print, args);
+}
+
+void log_submit_noted(const struct LogRecord * fields,
+		      struct LogFingerprint * print, va_list args) {
+  char stack_record[LOG_RECORD_SIZE];
+  char * record = stack_record;
+  va_list retry;
+  va_copy(retry, args);
+  size_t len = log_render_record(record, LOG_RECORD_SIZE, fields, args);
+  if(len > LOG_RECORD_SIZE) {
+    /* The message is too long for the stack, so format it again. */
+#ifdef LOG_STATIC_MEMORY
+    record = NULL; /* Keep what fits rather than allocate. */
+#else
+    record = malloc(len + 1);
+#endif
+    if(record != NULL)
+      log_render_record(record, len + 1, fields, retry);
+    else
+      record = stack_record, len = LOG_RECORD_SIZE; /* Keep what fits. */
+  }
+  va_end(retry);
+  if(print != NULL) log_fingerprint_count(print, len);
+  if(log_live_wants(fields->level))
+    log_live_append(fields->level, record, len);
+  /*
+   * Prefer the shared-memory ring, then the staging buffers, to the locked
+   * streams.
+   */
+  if(!log_shm_enqueue(fields->level, record, len)
+     && !log_staging_enqueue(fields->level, record, len))
+    log_emit(fields->level, record, len);
+  if(record != stack_record) free(record);
+}
+
+void log_submit_message(const struct LogRecord * fields, ...) {
+  va_list args;
+  va_start(args, fields);
+  log_submit(fields, args);
+  va_end(args);
+}
+
+void log_vmsg(const log_t level, const char * format,
+	      const struct LogSite * site, va_list args) {
+  if(!config.setup) log_setup();
+  /*
+   * Messages less severe than config.level are not logged, unless they
+   * belong to a transaction of this thread (see log_txn_begin()).
+   */
+  bool logged = log_level_logged(level);
+  int txn = log_txn_thread == NULL ? LOG_TXN_NONE
+    : log_txn_route(level, logged);
+  if(logged || txn != LOG_TXN_NONE) {
+    if(site != NULL) log_site_note(site, format);
+    struct LogRecord fields = { .level = level, .format = format,
+				.site = site,
+				.context = log_context_current() };
+    log_record_stamp(&fields);
+    if(txn == LOG_TXN_CAPTURE) {
+      /* A va_list parameter may not be passed on by address. */
+      va_list capture;
+      va_copy(capture, args);
+      log_txn_capture(&fields, &capture);
+      va_end(capture);
+    } else {
+      log_submit(&fields, args);
     }
-    /* Get the variable length arguments. (not critical / no lock needed)*/
-    va_list args;
-    va_start(args, format);
-    /* Do the actual printing. This is critical and needs to be locked. */
-    pthread_mutex_lock(&config.lock);
-    flock(fileno(stream), LOCK_EX); /* Lock the file. */
-    fprintf(stream, "[%s] %s: ", time_str, level_str);
-    vfprintf(stream, format, args);
-    fprintf(stream, "\n");
-    flock(fileno(stream), LOCK_UN); /* Unlock the file. */
-    pthread_mutex_unlock(&config.lock);
-    /* Signal the end of the variable length arguments. */
-    va_end(args);
+  } else if(log_live_wants(level)) {
+    /* The record is only kept in memory for a live viewer. */
+    struct LogRecord fields = { .level = level, .format = format,
+				.site = site,
+				.context = log_context_current() };
+    log_record_stamp(&fields);
+    log_live_submit(&fields, args);
+  }
+  fflush(stdout);
+  fflush(stderr);
+}
+
+void log_msg(const log_t level, const char * restrict format, ...) {
+  va_list args;
+  va_start(args, format);
+  log_vmsg(level, format, NULL, args);
+  va_end(args);
+}
+
+void log_msg_site(const struct LogSite * site,
+		  const char * restrict format, ...) {
+  va_list args;
+  va_start(args, format);
+  log_vmsg(site->level, format, site, args);
+  va_end(args);
+}
+
+void log_write(const log_t level, const char * message, size_t len) {
+  if(!config.setup) log_setup();
+  bool logged = log_level_logged(level);
+  int txn = log_txn_thread == NULL ? LOG_TXN_NONE
+    : log_txn_route(level, logged);
+  if(logged || txn != LOG_TXN_NONE) {
+    struct LogRecord fields = { .level = level, .message = message,
+				.message_len = len,
+				.context = log_context_current() };
+    log_record_stamp(&fields);
+    if(txn == LOG_TXN_CAPTURE)
+      log_txn_capture(&fields, NULL);
+    else
+      log_submit_message(&fields);
+  } else if(log_live_wants(level)) {
+    struct LogRecord fields = { .level = level, .message = message,
+				.message_len = len,
+				.context = log_context_current() };
+    log_record_stamp(&fields);
+    log_live_submit_message(&fields);
   }
   fflush(stdout);
   fflush(stderr);
 }
+
+int log_is_enabled(const log_t level) {
+  if(!config.setup) log_setup();
+  int shed = atomic_load_explicit(&config.governor.shed, memory_order_relaxed);
+  if((level <= config.level
+      && (shed == 0 || (int) level <= log_governed_level(shed)))
+     || log_live_wants(level))
+    return 1;
+  return log_txn_thread != NULL && log_txn_route(level, false) != LOG_TXN_NONE;
+}
@@ -0,0 +1,61 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * Allocations from the arena are aligned to cache lines.
+ */
+#define LOG_ARENA_ALIGN 64
+
+/**
+ * The memory reserved by log_static_init(). Allocations only move the used
+ * count forward and are never freed.
+ */
+static struct {
+  _Atomic(char *) memory;
+  size_t size;
+  _Atomic size_t used;
+} log_arena = { .memory = NULL, .size = 0, .used = 0 };
+
+void log_static_init(size_t budget) {
+  if(atomic_load(&log_arena.memory) != NULL) {
+    log_error("I could not reserve the static memory with error %d.",
+	      EALREADY);
+    return;
+  }
+  /* Fault the pages in now rather than on the logging path. */
+  char * memory = mmap(NULL, budget, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if(budget == 0 || memory == MAP_FAILED) {
+    log_error("I could not reserve the static memory with error %d.",
+	      budget == 0 ? EINVAL : errno);
+    return;
+  }
+  log_arena.size = budget;
+  atomic_store_explicit(&log_arena.memory, memory, memory_order_release);
+  /* The C library loads the time zone, which allocates, when first asked. */
+  tzset();
+  time_t now = time(NULL);
+  struct tm fields;
+  localtime_r(&now, &fields);
+  log_get_level();
+}
+
+void * log_arena_alloc(size_t size) {
+  char * memory = atomic_load_explicit(&log_arena.memory,
+				       memory_order_acquire);
+  if(memory == NULL) return NULL;
+  size = (size + LOG_ARENA_ALIGN - 1) & ~(size_t) (LOG_ARENA_ALIGN - 1);
+  size_t offset = atomic_fetch_add(&log_arena.used, size);
+  if(offset + size > log_arena.size) {
+    atomic_fetch_sub(&log_arena.used, size);
+    return NULL;
+  }
+  return memory + offset;
+}
@@ -0,0 +1,176 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The initial size of the buffer of each stream of a batch. Buffers grow as
+ * needed, except in static-memory builds, where they are taken once from the
+ * arena and a batch that fills one is written early.
+ */
+#define LOG_BATCH_SIZE 65536
+
+/**
+ * The records of a batch for one stream, rendered back to back.
+ */
+struct LogBatchStream {
+  char * data;
+  size_t len;
+  size_t size;
+};
+
+/**
+ * The open batch of a thread.
+ */
+struct LogBatch {
+  unsigned depth; /**< The number of nested batches. */
+  struct LogBatchStream streams[2];
+};
+
+static __thread struct LogBatch log_batch = { .depth = 0 };
+
+static void log_batch_flush(struct LogBatch * batch);
+
+/**
+ * The buffers of a thread are kept for its lifetime. When it exits, the
+ * records of a batch it left open are written and the buffers are freed.
+ */
+static pthread_once_t log_batch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_batch_key;
+
+static void log_batch_free(void * argument) {
+  struct LogBatch * batch = argument;
+  log_batch_flush(batch);
+  batch->depth = 0;
+#ifndef LOG_STATIC_MEMORY
+  free(batch->streams[0].data);
+  free(batch->streams[1].data);
+  batch->streams[0].data = batch->streams[1].data = NULL;
+  batch->streams[0].size = batch->streams[1].size = 0;
+#endif
+}
+
+static void log_batch_setup(void) {
+  pthread_key_create(&log_batch_key, log_batch_free);
+}
+
+void log_batch_begin(void) {
+  ++log_batch.depth;
+}
+
+/**
+ * Writes the records of the batch and empties it.
+ */
+static void log_batch_flush(struct LogBatch * batch) {
+  const char * data[2] = { batch->streams[0].data, batch->streams[1].data };
+  size_t len[2] = { batch->streams[0].len, batch->streams[1].len };
+  /* Staging keeps each stream's records together; otherwise lock once. */
+  for(int stream = 0; stream < 2; ++stream)
+    if(len[stream] > 0
+       && log_staging_enqueue(stream == 0 ? LOG_INFO : LOG_ERROR,
+			      data[stream], len[stream]))
+      len[stream] = 0;
+  if(len[0] > 0 || len[1] > 0) log_emit_streams(data, len);
+  batch->streams[0].len = 0;
+  batch->streams[1].len = 0;
+}
+
+/**
+ * Makes room for at least need more bytes in the buffer of a stream.
+ * \return false if there is no room.
+ */
+static bool log_batch_reserve(struct LogBatchStream * stream, size_t need) {
+  if(stream->size - stream->len >= need) return true;
+#ifdef LOG_STATIC_MEMORY
+  if(stream->data == NULL
+     && (stream->data = log_arena_alloc(LOG_BATCH_SIZE)) != NULL) {
+    stream->size = LOG_BATCH_SIZE;
+    pthread_once(&log_batch_once, log_batch_setup);
+    pthread_setspecific(log_batch_key, &log_batch);
+  }
+  return stream->size - stream->len >= need;
+#else
+  size_t size = stream->size > 0 ? stream->size : LOG_BATCH_SIZE;
+  while(size - stream->len < need) size *= 2;
+  char * data = realloc(stream->data, size);
+  if(data == NULL) return false;
+  if(stream->data == NULL) {
+    pthread_once(&log_batch_once, log_batch_setup);
+    pthread_setspecific(log_batch_key, &log_batch);
+  }
+  stream->data = data;
+  stream->size = size;
+  return true;
+#endif
+}
+
+void log_batch_append(const log_t level, const char * format, ...) {
+  struct LogBatch * batch = &log_batch;
+  va_list args;
+  va_start(args, format);
+  if(batch->depth == 0 || log_shm_is_attached() || log_txn_thread != NULL) {
+    /*
+     * Without a batch, with a shared-memory ring (which takes each record
+     * without locking anyway) or in a transaction (which routes the records
+     * of the thread itself), log the record as log_msg() does.
+     */
+    log_vmsg(level, format, NULL, args);
+    va_end(args);
+    return;
+  }
+  if(!log_level_logged(level)) {
+    if(log_live_wants(level)) {
+      struct LogRecord fields = { .level = level, .format = format,
+				  .context = log_context_current() };
+      log_record_stamp(&fields);
+      log_live_submit(&fields, args);
+    }
+    va_end(args);
+    return;
+  }
+  struct LogRecord fields = { .level = level, .format = format,
+			      .context = log_context_current() };
+  log_record_stamp(&fields);
+  bool collapsed;
+  struct LogFingerprint * print = log_fingerprint_note(&fields, &collapsed);
+  if(collapsed) {
+    va_end(args);
+    return;
+  }
+  struct LogBatchStream * stream =
+    &batch->streams[log_level_is_error(level) ? 1 : 0];
+  for(int attempt = 0; attempt < 2; ++attempt) {
+    va_list copy;
+    va_copy(copy, args);
+    size_t room = stream->size - stream->len;
+    size_t len = log_render_record(stream->data + stream->len, room, &fields,
+				   copy);
+    va_end(copy);
+    if(len <= room) {
+      if(print != NULL) log_fingerprint_count(print, len);
+      if(log_live_wants(level))
+	log_live_append(level, stream->data + stream->len, len);
+      stream->len += len;
+      break;
+    }
+    if(!log_batch_reserve(stream, len)) {
+      /* Write what the batch holds to make room, or the record alone. */
+      log_batch_flush(batch);
+      if(!log_batch_reserve(stream, len)) {
+	log_submit_noted(&fields, print, args);
+	break;
+      }
+    }
+  }
+  va_end(args);
+}
+
+void log_batch_commit(void) {
+  struct LogBatch * batch = &log_batch;
+  if(batch->depth == 0) return;
+  if(--batch->depth == 0) log_batch_flush(batch);
+}
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE /* For memmem(). */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOG_BLOCK_X86 1
+#endif
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The payload a block holds before it is written. Longer writes get a block
+ * of their own.
+ */
+#define LOG_BLOCK_SIZE 65536
+
+/**
+ * A block is also written once its first record is this old (in
+ * nanoseconds), when the next record arrives.
+ */
+#define LOG_BLOCK_DELAY_NS 100000000ULL
+
+/**
+ * The magic numbers of the header ("LOGB") and footer ("BEND") of a block.
+ */
+#define LOG_BLOCK_MAGIC 0x42474f4cU
+#define LOG_BLOCK_END_MAGIC 0x444e4542U
+
+/**
+ * The header of a block, followed by the payload and a footer. The CRC32C
+ * covers the fields before it and the payload. Fields are in the byte order
+ * of the writer.
+ */
+struct LogBlockHeader {
+  uint32_t magic;
+  uint32_t len;      /**< The bytes of the payload. */
+  uint64_t sequence; /**< The number of blocks before this one. */
+  uint32_t crc;
+  uint32_t reserved;
+};
+
+/**
+ * The footer of a block, which lets the last block be found from the end of
+ * the file and a block with a corrupt payload be skipped.
+ */
+struct LogBlockFooter {
+  uint32_t len;
+  uint32_t magic;
+};
+
+#define LOG_BLOCK_OVERHEAD \
+  (sizeof(struct LogBlockHeader) + sizeof(struct LogBlockFooter))
+
+/**
+ * CRC32C (Castagnoli) of data, continuing from crc (0 to start).
+ */
+typedef uint32_t (*log_crc32c_t)(uint32_t crc, const unsigned char * data,
+				 size_t len);
+
+static uint32_t log_crc32c_table[8][256];
+
+static uint32_t log_crc32c_software(uint32_t crc, const unsigned char * data,
+				    size_t len) {
+  crc = ~crc;
+  uint32_t (* table)[256] = log_crc32c_table;
+  /* Slicing by 8: one table lookup per byte, eight bytes per step. */
+  for(; len >= 8; data += 8, len -= 8) {
+    uint32_t lo = crc ^ ((uint32_t) data[0] | (uint32_t) data[1] << 8
+			 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24);
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff]
+      ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+      ^ table[3][data[4]] ^ table[2][data[5]] ^ table[1][data[6]]
+      ^ table[0][data[7]];
+  }
+  for(; len > 0; ++data, --len)
+    crc = table[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#ifdef LOG_BLOCK_X86
+__attribute__((target("sse4.2")))
+static uint32_t log_crc32c_sse42(uint32_t crc, const unsigned char * data,
+				 size_t len) {
+  crc = ~crc;
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for(; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t) crc64;
+#endif
+  for(; len > 0; ++data, --len)
+    crc = _mm_crc32_u8(crc, *data);
+  return ~crc;
+}
+#endif
+
+static log_crc32c_t log_crc32c = log_crc32c_software;
+static pthread_once_t log_crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fills the tables of the software CRC and selects the instruction set.
+ */
+static void log_crc32c_setup(void) {
+  for(uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for(int bit = 0; bit < 8; ++bit)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78U : crc >> 1;
+    log_crc32c_table[0][i] = crc;
+  }
+  for(int k = 1; k < 8; ++k)
+    for(int i = 0; i < 256; ++i) {
+      uint32_t crc = log_crc32c_table[k - 1][i];
+      log_crc32c_table[k][i] = log_crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+    }
+#ifdef LOG_BLOCK_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2")) log_crc32c = log_crc32c_sse42;
+#endif
+}
+
+/**
+ * Returns the CRC of a block.
+ */
+static uint32_t log_block_crc(const struct LogBlockHeader * header,
+			      const char * payload) {
+  uint32_t crc = log_crc32c(0, (const unsigned char *) header,
+			    offsetof(struct LogBlockHeader, crc));
+  return log_crc32c(crc, (const unsigned char *) payload, header->len);
+}
+
+/**
+ * Checks the block of a mapped file that starts at offset.
+ * \return true if the header, payload and footer are intact.
+ */
+static bool log_block_valid(const char * map, size_t size, size_t offset) {
+  struct LogBlockHeader header;
+  struct LogBlockFooter footer;
+  if(size - offset < LOG_BLOCK_OVERHEAD) return false;
+  memcpy(&header, map + offset, sizeof(header));
+  if(header.magic != LOG_BLOCK_MAGIC
+     || header.len > size - offset - LOG_BLOCK_OVERHEAD)
+    return false;
+  memcpy(&footer, map + offset + sizeof(header) + header.len, sizeof(footer));
+  return footer.magic == LOG_BLOCK_END_MAGIC && footer.len == header.len
+    && header.crc == log_block_crc(&header, map + offset + sizeof(header));
+}
+
+/**
+ * Finds the end of the last intact block of a file by scanning backward
+ * from its end for a footer.
+ * \param map The mapped file.
+ * \param size The size of the file.
+ * \param sequence Receives the sequence number of the next block.
+ * \return The end of the last intact block, or 0 if there is none.
+ */
+static size_t log_block_find_end(const char * map, size_t size,
+				 uint64_t * sequence) {
+  *sequence = 0;
+  const uint32_t magic = LOG_BLOCK_END_MAGIC;
+  for(size_t end = size; end >= LOG_BLOCK_OVERHEAD; --end) {
+    const char * candidate = map + end - sizeof(struct LogBlockFooter);
+    if(memcmp(candidate + offsetof(struct LogBlockFooter, magic), &magic,
+	      sizeof(magic)) != 0)
+      continue;
+    struct LogBlockFooter footer;
+    memcpy(&footer, candidate, sizeof(footer));
+    if(footer.len > end - LOG_BLOCK_OVERHEAD) continue;
+    size_t start = end - LOG_BLOCK_OVERHEAD - footer.len;
+    if(log_block_valid(map, size, start)) {
+      struct LogBlockHeader header;
+      memcpy(&header, map + start, sizeof(header));
+      *sequence = header.sequence + 1;
+      return end;
+    }
+  }
+  return 0;
+}
+
+/**
+ * A file written as a sequence of blocks.
+ */
+struct LogBlockSink {
+  struct LogSink sink;
+  int fd;
+  uint64_t sequence;  /**< The sequence number of the next block. */
+  uint64_t first_ns;  /**< When the first buffered record arrived. */
+  size_t len;
+  char payload[LOG_BLOCK_SIZE];
+};
+
+/**
+ * Returns the current value of the monotonic clock in nanoseconds.
+ */
+static uint64_t log_block_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Writes a payload as one block with a single system call.
+ */
+static void log_block_write(struct LogBlockSink * sink, const char * payload,
+			    size_t len) {
+  struct LogBlockHeader header = {
+    .magic = LOG_BLOCK_MAGIC, .len = len, .sequence = sink->sequence++,
+    .reserved = 0
+  };
+  header.crc = log_block_crc(&header, payload);
+  struct LogBlockFooter footer = { .len = len, .magic = LOG_BLOCK_END_MAGIC };
+  struct iovec parts[3] = {
+    { &header, sizeof(header) }, { (void *) payload, len },
+    { &footer, sizeof(footer) }
+  };
+  size_t left = LOG_BLOCK_OVERHEAD + len;
+  for(int part = 0; left > 0;) {
+    ssize_t n = writev(sink->fd, parts + part, 3 - part);
+    if(n < 0 && errno != EINTR) break;
+    if(n <= 0) continue;
+    left -= n;
+    /* Resume a short write where it stopped. */
+    while(part < 3 && (size_t) n >= parts[part].iov_len)
+      n -= parts[part++].iov_len;
+    if(part < 3) {
+      parts[part].iov_base = (char *) parts[part].iov_base + n;
+      parts[part].iov_len -= n;
+    }
+  }
+}
+
+static void log_block_sink_sync(struct LogSink * base) {
+  struct LogBlockSink * sink = (struct LogBlockSink *) base;
+  if(sink->len > 0) log_block_write(sink, sink->payload, sink->len);
+  sink->len = 0;
+}
+
+static void log_block_sink_write(struct LogSink * base, const char * data,
+				 size_t len) {
+  struct LogBlockSink * sink = (struct LogBlockSink *) base;
+  if(sink->len + len > LOG_BLOCK_SIZE) log_block_sink_sync(base);
+  if(len >= LOG_BLOCK_SIZE) {
+    log_block_write(sink, data, len);
+    return;
+  }
+  uint64_t now = log_block_now_ns();
+  if(sink->len == 0) sink->first_ns = now;
+  memcpy(sink->payload + sink->len, data, len);
+  sink->len += len;
+  if(sink->len == LOG_BLOCK_SIZE || now - sink->first_ns >= LOG_BLOCK_DELAY_NS)
+    log_block_sink_sync(base);
+}
+
+static void log_block_sink_close(struct LogSink * base) {
+  struct LogBlockSink * sink = (struct LogBlockSink *) base;
+  log_block_sink_sync(base);
+  close(sink->fd);
+  free(sink);
+}
+
+struct LogSink * log_block_open(const char * filename) {
+  pthread_once(&log_crc32c_once, log_crc32c_setup);
+  struct LogBlockSink * sink = malloc(sizeof(struct LogBlockSink));
+  if(sink == NULL) return NULL;
+  sink->sink.write = log_block_sink_write;
+  sink->sink.sync = log_block_sink_sync;
+  sink->sink.close = log_block_sink_close;
+  sink->sequence = 0;
+  sink->len = 0;
+  int error = 0;
+  struct stat stats;
+  if((sink->fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0
+     || fstat(sink->fd, &stats) != 0) {
+    error = errno;
+  } else if(stats.st_size > 0) {
+    /* Drop whatever follows the last intact block, such as a torn write. */
+    size_t size = stats.st_size;
+    char * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, sink->fd, 0);
+    if(map == MAP_FAILED) {
+      error = errno;
+    } else {
+      uint32_t magic;
+      memcpy(&magic, map, size < sizeof(magic) ? size : sizeof(magic));
+      /* Refuse to truncate a file that was never written in blocks. */
+      if(size < sizeof(magic) || magic != LOG_BLOCK_MAGIC) {
+	error = EINVAL;
+      } else {
+	size_t end = log_block_find_end(map, size, &sink->sequence);
+	if(end < size && ftruncate(sink->fd, end) != 0) error = errno;
+      }
+      munmap(map, size);
+    }
+  }
+  if(error == 0 && lseek(sink->fd, 0, SEEK_END) < 0) error = errno;
+  if(error != 0) {
+    if(sink->fd >= 0) close(sink->fd);
+    free(sink);
+    errno = error;
+    return NULL;
+  }
+  return &sink->sink;
+}
+
+bool log_block_is_file(const char * map, size_t size) {
+  uint32_t magic;
+  if(size < LOG_BLOCK_OVERHEAD) return false;
+  memcpy(&magic, map, sizeof(magic));
+  return magic == LOG_BLOCK_MAGIC;
+}
+
+void log_block_cursor_init(struct LogBlockCursor * cursor, const char * map,
+			   size_t size) {
+  pthread_once(&log_crc32c_once, log_crc32c_setup);
+  memset(cursor, 0, sizeof(*cursor));
+  cursor->map = map;
+  cursor->size = size;
+}
+
+bool log_block_next(struct LogBlockCursor * cursor, const char ** payload,
+		    size_t * len) {
+  const char * map = cursor->map;
+  size_t size = cursor->size;
+  const uint32_t magic = LOG_BLOCK_MAGIC;
+  while(cursor->offset + LOG_BLOCK_OVERHEAD <= size) {
+    size_t offset = cursor->offset;
+    struct LogBlockHeader header;
+    memcpy(&header, map + offset, sizeof(header));
+    if(log_block_valid(map, size, offset)) {
+      /* The sequence tells how many blocks the damage took. */
+      if(header.sequence > cursor->expected)
+	cursor->skipped += header.sequence - cursor->expected;
+      else if(cursor->damaged)
+	++cursor->skipped;
+      cursor->damaged = false;
+      cursor->expected = header.sequence + 1;
+      cursor->offset += LOG_BLOCK_OVERHEAD + header.len;
+      *payload = map + offset + sizeof(header);
+      *len = header.len;
+      return true;
+    }
+    cursor->damaged = true;
+    struct LogBlockFooter footer;
+    if(header.magic == LOG_BLOCK_MAGIC
+       && header.len <= size - offset - LOG_BLOCK_OVERHEAD) {
+      memcpy(&footer, map + offset + sizeof(header) + header.len,
+	     sizeof(footer));
+      /* The footer confirms the length, so only the payload is corrupt. */
+      if(footer.magic == LOG_BLOCK_END_MAGIC && footer.len == header.len) {
+	cursor->offset += LOG_BLOCK_OVERHEAD + header.len;
+	continue;
+      }
+    }
+    /* Otherwise resynchronize on the next header. */
+    const char * next = memmem(map + offset + 1, size - offset - 1, &magic,
+			       sizeof(magic));
+    if(next == NULL) break;
+    cursor->offset = next - map;
+  }
+  cursor->offset = size;
+  if(cursor->damaged) {
+    ++cursor->skipped;
+    cursor->damaged = false;
+  }
+  return false;
+}
+
+long long log_block_read(const char * filename, FILE * out,
+			 size_t * corrupt) {
+  if(corrupt != NULL) *corrupt = 0;
+  int fd = open(filename, O_RDONLY);
+  struct stat stats;
+  if(fd < 0 || fstat(fd, &stats) != 0) {
+    log_error("I could not open %s with error %d.", filename, errno);
+    if(fd >= 0) close(fd);
+    return -1;
+  }
+  size_t size = stats.st_size;
+  if(size == 0) {
+    close(fd);
+    return 0;
+  }
+  char * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    log_error("I could not map %s with error %d.", filename, errno);
+    return -1;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  long long blocks = 0;
+  struct LogBlockCursor cursor;
+  log_block_cursor_init(&cursor, map, size);
+  const char * payload;
+  size_t len;
+  while(log_block_next(&cursor, &payload, &len)) {
+    fwrite(payload, 1, len, out);
+    ++blocks;
+  }
+  munmap(map, size);
+  if(corrupt != NULL) *corrupt = cursor.skipped;
+  return blocks;
+}
@@ -0,0 +1,173 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The calibration is refreshed when this many nanoseconds have passed since
+ * the last one, to follow adjustments of the wall clock (e.g. by NTP).
+ */
+#define LOG_CLOCK_RECALIBRATE_NS 1000000000ULL
+
+/**
+ * The interval over which the tick rate is first measured.
+ */
+#define LOG_CLOCK_CALIBRATE_NS 10000000ULL
+
+_Atomic int log_clock_source = LOG_CLOCK_SOURCE_REALTIME;
+
+/**
+ * The mapping from ticks to wall-clock time:
+ * ns = base_ns + ((ticks - base_ticks) * mult >> 32).
+ * It is published with a sequence lock, so readers never wait for the thread
+ * that refreshes it.
+ */
+static struct {
+  _Atomic unsigned sequence; /**< Odd while the mapping is updated. */
+  _Atomic bool updating;
+  _Atomic uint64_t base_ticks;
+  _Atomic uint64_t base_ns;
+  _Atomic uint64_t mult;
+} log_clock = { 0 };
+
+static uint64_t log_clock_realtime_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t log_clock_scale(uint64_t ticks, uint64_t mult) {
+#ifdef __SIZEOF_INT128__
+  return (uint64_t) (((unsigned __int128) ticks * mult) >> 32);
+#else
+  return (uint64_t) ((long double) ticks * mult / 4294967296.0L);
+#endif
+}
+
+/**
+ * Returns true if the cycle counter runs at a constant rate regardless of
+ * frequency scaling and sleep states.
+ */
+static bool log_clock_counter_is_invariant(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned eax, ebx, ecx, edx;
+  if(__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0
+     || eax < 0x80000007)
+    return false;
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx & (1U << 8)) != 0; /* Invariant TSC. */
+#elif defined(__aarch64__)
+  return true; /* The generic timer has a fixed frequency. */
+#else
+  return false;
+#endif
+}
+
+/**
+ * Publishes a new mapping.
+ */
+static void log_clock_publish(uint64_t ticks, uint64_t ns, uint64_t mult) {
+  atomic_fetch_add_explicit(&log_clock.sequence, 1, memory_order_acq_rel);
+  atomic_store_explicit(&log_clock.base_ticks, ticks, memory_order_relaxed);
+  atomic_store_explicit(&log_clock.base_ns, ns, memory_order_relaxed);
+  atomic_store_explicit(&log_clock.mult, mult, memory_order_relaxed);
+  atomic_fetch_add_explicit(&log_clock.sequence, 1, memory_order_release);
+}
+
+/**
+ * Measures the current tick rate against the wall clock. The wall clock is
+ * read between two reads of the counter so that the pair is taken as close
+ * together as possible.
+ */
+static void log_clock_sample(int source, uint64_t * ticks, uint64_t * ns) {
+  uint64_t before = log_clock_read(source);
+  *ns = log_clock_realtime_ns();
+  uint64_t after = log_clock_read(source);
+  *ticks = before + (after - before) / 2;
+}
+
+void log_set_clock(log_clock_t clock) {
+  int source = LOG_CLOCK_SOURCE_REALTIME;
+  if(clock == LOG_CLOCK_TSC)
+    source = log_clock_counter_is_invariant() ?
+      LOG_CLOCK_SOURCE_COUNTER : LOG_CLOCK_SOURCE_MONOTONIC;
+  if(source != LOG_CLOCK_SOURCE_REALTIME) {
+    /* Measure the tick rate once; later refreshes only track drift. */
+    uint64_t ticks0, ns0, ticks1, ns1;
+    log_clock_sample(source, &ticks0, &ns0);
+    do {
+      log_clock_sample(source, &ticks1, &ns1);
+    } while(ns1 - ns0 < LOG_CLOCK_CALIBRATE_NS && ns1 >= ns0);
+    uint64_t mult = ticks1 > ticks0 ?
+      (uint64_t) (((long double) (ns1 - ns0) * 4294967296.0L)
+		  / (ticks1 - ticks0)) : 1ULL << 32;
+    log_clock_publish(ticks1, ns1, mult);
+  }
+  atomic_store_explicit(&log_clock_source, source, memory_order_release);
+}
+
+/**
+ * Refreshes the mapping from a new sample, keeping the tick rate measured
+ * over the time since the last refresh.
+ */
+static void log_clock_recalibrate(int source, uint64_t base_ticks,
+				  uint64_t base_ns, uint64_t mult) {
+  bool expected = false;
+  if(!atomic_compare_exchange_strong(&log_clock.updating, &expected, true))
+    return; /* Another thread is at it. */
+  uint64_t ticks, ns;
+  log_clock_sample(source, &ticks, &ns);
+  if(ticks > base_ticks && ns > base_ns) {
+    uint64_t measured = (uint64_t) (((long double) (ns - base_ns)
+				     * 4294967296.0L) / (ticks - base_ticks));
+    /* Ignore samples distorted by a step of the wall clock. */
+    if(measured < mult + mult / 1000 && measured > mult - mult / 1000)
+      mult = measured;
+  }
+  log_clock_publish(ticks, ns, mult);
+  atomic_store(&log_clock.updating, false);
+}
+
+/**
+ * Reads a consistent copy of the mapping.
+ */
+static void log_clock_load(uint64_t * base_ticks, uint64_t * base_ns,
+			   uint64_t * mult) {
+  unsigned sequence;
+  do {
+    sequence = atomic_load_explicit(&log_clock.sequence,
+				    memory_order_acquire);
+    *base_ticks = atomic_load_explicit(&log_clock.base_ticks,
+				       memory_order_relaxed);
+    *base_ns = atomic_load_explicit(&log_clock.base_ns, memory_order_relaxed);
+    *mult = atomic_load_explicit(&log_clock.mult, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+  } while((sequence & 1) != 0
+	  || sequence != atomic_load_explicit(&log_clock.sequence,
+					      memory_order_relaxed));
+}
+
+void log_clock_to_realtime(uint64_t ticks, struct timespec * time) {
+  int source = atomic_load_explicit(&log_clock_source, memory_order_acquire);
+  uint64_t base_ticks, base_ns, mult;
+  log_clock_load(&base_ticks, &base_ns, &mult);
+  if(source != LOG_CLOCK_SOURCE_REALTIME && ticks > base_ticks
+     && log_clock_scale(ticks - base_ticks, mult) >= LOG_CLOCK_RECALIBRATE_NS) {
+    /* Refresh the mapping before it is used for a distant tick. */
+    log_clock_recalibrate(source, base_ticks, base_ns, mult);
+    log_clock_load(&base_ticks, &base_ns, &mult);
+  }
+  uint64_t ns;
+  if(ticks >= base_ticks)
+    ns = base_ns + log_clock_scale(ticks - base_ticks, mult);
+  else
+    ns = base_ns - log_clock_scale(base_ticks - ticks, mult);
+  time->tv_sec = ns / 1000000000ULL;
+  time->tv_nsec = ns % 1000000000ULL;
+}
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE /* For gettid() and pthread_getname_np(). */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The context fields of the calling thread.
+ */
+static __thread struct LogContext log_context = { .depth = 0, .len = 0 };
+
+const struct LogContext * log_context_current(void) {
+  return &log_context;
+}
+
+void log_context_push(const char * key, const char * format, ...) {
+  struct LogContext * context = &log_context;
+  size_t key_len = strlen(key);
+  size_t room = LOG_CONTEXT_SIZE - context->len;
+  if(context->depth == LOG_CONTEXT_FIELDS || key_len + 2 > room) {
+    log_error("I could not push the context field %s with error %d.", key,
+	      ENOBUFS);
+    return;
+  }
+  /* Render "key=value " once, after the fields already pushed. */
+  char * field = context->text + context->len;
+  memcpy(field, key, key_len);
+  field[key_len] = '=';
+  va_list args;
+  va_start(args, format);
+  int value_len = log_vsnprintf(field + key_len + 1, room - key_len - 1,
+				format, args);
+  va_end(args);
+  if(value_len < 0 || (size_t) value_len + key_len + 2 > room) {
+    log_error("I could not push the context field %s with error %d.", key,
+	      ENOBUFS);
+    return;
+  }
+  field[key_len + 1 + value_len] = ' ';
+  context->offsets[context->depth++] = context->len;
+  context->len += key_len + value_len + 2;
+}
+
+void log_context_pop(void) {
+  struct LogContext * context = &log_context;
+  if(context->depth == 0) return;
+  context->len = context->offsets[--context->depth];
+}
+
+void log_context_clear(void) {
+  log_context.depth = 0;
+  log_context.len = 0;
+}
+
+/**
+ * The thread and process IDs and the thread name are cached. A fork()
+ * invalidates the IDs in the child, which is detected by the generation
+ * counter.
+ */
+static pthread_once_t log_ids_once = PTHREAD_ONCE_INIT;
+static unsigned log_fork_generation = 1;
+static pid_t log_pid = 0;
+static __thread pid_t log_tid = 0;
+static __thread unsigned log_tid_generation = 0;
+static __thread bool log_have_thread_name = false;
+static __thread char log_thread_name_cache[LOG_THREAD_NAME_SIZE];
+
+static void log_ids_after_fork(void) {
+  ++log_fork_generation;
+  log_pid = 0;
+}
+
+static void log_ids_setup(void) {
+  pthread_atfork(NULL, NULL, log_ids_after_fork);
+}
+
+pid_t log_thread_id(void) {
+  if(log_tid_generation != log_fork_generation) {
+    pthread_once(&log_ids_once, log_ids_setup);
+    log_tid = gettid();
+    log_tid_generation = log_fork_generation;
+  }
+  return log_tid;
+}
+
+pid_t log_process_id(void) {
+  if(log_pid == 0) {
+    pthread_once(&log_ids_once, log_ids_setup);
+    log_pid = getpid();
+  }
+  return log_pid;
+}
+
+const char * log_thread_name(void) {
+  if(!log_have_thread_name) {
+    if(pthread_getname_np(pthread_self(), log_thread_name_cache,
+			  LOG_THREAD_NAME_SIZE) != 0)
+      log_thread_name_cache[0] = '\0';
+    log_have_thread_name = true;
+  }
+  return log_thread_name_cache;
+}
+
+void log_set_thread_name(const char * name) {
+  /* The kernel keeps at most 15 characters. */
+  strncpy(log_thread_name_cache, name, LOG_THREAD_NAME_SIZE - 1);
+  log_thread_name_cache[LOG_THREAD_NAME_SIZE - 1] = '\0';
+  log_have_thread_name = true;
+  int error = pthread_setname_np(pthread_self(), log_thread_name_cache);
+  if(error != 0)
+    log_error("I could not name the thread %s with error %d.", name, error);
+}
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE /* For O_DIRECT and sync_file_range(). */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The alignment of the offsets, lengths and buffer of direct writes, which
+ * suits the logical block size of any device.
+ */
+#define LOG_DIRECT_ALIGN 4096
+
+/**
+ * The records buffered before they are written (a multiple of
+ * LOG_DIRECT_ALIGN). Without direct I/O, it is also the unit in which the
+ * written pages are dropped from the page cache.
+ */
+#define LOG_DIRECT_BUFFER_SIZE (1 << 20)
+
+/**
+ * The buffer is also written once its first record is this old (in
+ * nanoseconds), when the next record arrives.
+ */
+#define LOG_DIRECT_DELAY_NS 100000000ULL
+
+/**
+ * A file written around the page cache: with O_DIRECT, or else with
+ * writeback started and the pages dropped behind the write frontier.
+ */
+struct LogDirectSink {
+  struct LogSink sink;
+  int fd;
+  bool direct;        /**< The file is written with O_DIRECT. */
+  off_t offset;       /**< The file offset of the start of the buffer. */
+  size_t len;         /**< The bytes in the buffer. */
+  size_t written;     /**< The bytes of the buffer already in the file. */
+  uint64_t first_ns;  /**< When the first unwritten record arrived. */
+  off_t started;      /**< The end of the range whose writeback started. */
+  off_t dropped;      /**< The end of the range dropped from the cache. */
+  char * buffer;      /**< Aligned to LOG_DIRECT_ALIGN. */
+};
+
+/**
+ * Returns the current value of the monotonic clock in nanoseconds.
+ */
+static uint64_t log_direct_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Writes all of data at an offset. If the file system turns out to refuse
+ * direct writes, the file falls back to writes through the page cache.
+ * \return false if the data could not be written.
+ */
+static bool log_direct_pwrite(struct LogDirectSink * sink, const char * data,
+			      size_t len, off_t offset) {
+  while(len > 0) {
+    ssize_t n = pwrite(sink->fd, data, len, offset);
+    if(n < 0 && errno == EINVAL && sink->direct) {
+      int flags = fcntl(sink->fd, F_GETFL);
+      if(flags < 0 || fcntl(sink->fd, F_SETFL, flags & ~O_DIRECT) != 0)
+	return false;
+      sink->direct = false;
+      continue;
+    }
+    if(n < 0 && errno != EINTR) return false;
+    if(n <= 0) continue;
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+/**
+ * Starts the writeback of the full chunks below end, and drops the chunk
+ * before them from the page cache once it is written. Only the pages of the
+ * last chunk are left dirty in the cache.
+ */
+static void log_direct_release(struct LogDirectSink * sink, off_t end) {
+  end -= end % LOG_DIRECT_BUFFER_SIZE;
+  if(end <= sink->started) return;
+  sync_file_range(sink->fd, sink->started, end - sink->started,
+		  SYNC_FILE_RANGE_WRITE);
+  if(sink->started > sink->dropped) {
+    /* Clean pages are dropped, so wait for the earlier writeback first. */
+    sync_file_range(sink->fd, sink->dropped, sink->started - sink->dropped,
+		    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+		    | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(sink->fd, sink->dropped, sink->started - sink->dropped,
+		  POSIX_FADV_DONTNEED);
+    sink->dropped = sink->started;
+  }
+  sink->started = end;
+}
+
+/**
+ * Moves past the records of the buffer that are in the file. A direct write
+ * covers whole blocks, so the partial block at the end stays in the buffer,
+ * to be written again once it has grown.
+ */
+static void log_direct_advance(struct LogDirectSink * sink) {
+  if(sink->direct) {
+    size_t aligned = sink->written & ~(size_t) (LOG_DIRECT_ALIGN - 1);
+    memmove(sink->buffer, sink->buffer + aligned, sink->written - aligned);
+    sink->offset += aligned;
+    sink->len = sink->written = sink->written - aligned;
+  } else {
+    sink->offset += sink->written;
+    sink->len = sink->written = 0;
+  }
+}
+
+/**
+ * Writes what the buffer holds that is not in the file yet. An unaligned
+ * tail is written padded to a block and the padding is truncated. Records
+ * that cannot be written are dropped.
+ */
+static void log_direct_flush(struct LogDirectSink * sink) {
+  if(sink->written == sink->len) return;
+  bool written;
+  if(sink->direct) {
+    /* Start with the block that holds the tail of the last flush. */
+    size_t start = sink->written & ~(size_t) (LOG_DIRECT_ALIGN - 1);
+    size_t padded = (sink->len + LOG_DIRECT_ALIGN - 1)
+      & ~(size_t) (LOG_DIRECT_ALIGN - 1);
+    written = log_direct_pwrite(sink, sink->buffer + start, padded - start,
+				sink->offset + start);
+    if(written && padded > sink->len)
+      (void) ftruncate(sink->fd, sink->offset + sink->len);
+  } else {
+    written = log_direct_pwrite(sink, sink->buffer + sink->written,
+				sink->len - sink->written,
+				sink->offset + sink->written);
+  }
+  if(written) {
+    sink->written = sink->len;
+    /* Direct writes may have been refused, so check again. */
+    if(!sink->direct) log_direct_release(sink, sink->offset + sink->len);
+  } else {
+    sink->len = sink->written;
+  }
+  log_direct_advance(sink);
+}
+
+static void log_direct_sink_sync(struct LogSink * base) {
+  log_direct_flush((struct LogDirectSink *) base);
+}
+
+static void log_direct_sink_write(struct LogSink * base, const char * data,
+				  size_t len) {
+  struct LogDirectSink * sink = (struct LogDirectSink *) base;
+  uint64_t now = log_direct_now_ns();
+  if(sink->written == sink->len) sink->first_ns = now;
+  while(len > 0) {
+    size_t part = LOG_DIRECT_BUFFER_SIZE - sink->len;
+    if(part > len) part = len;
+    memcpy(sink->buffer + sink->len, data, part);
+    sink->len += part;
+    data += part;
+    len -= part;
+    if(sink->len == LOG_DIRECT_BUFFER_SIZE) log_direct_flush(sink);
+  }
+  if(sink->written < sink->len && now - sink->first_ns >= LOG_DIRECT_DELAY_NS)
+    log_direct_flush(sink);
+}
+
+static void log_direct_sink_close(struct LogSink * base) {
+  struct LogDirectSink * sink = (struct LogDirectSink *) base;
+  log_direct_flush(sink);
+  if(!sink->direct) {
+    /* Drop the last chunk as well, once it is written. */
+    fdatasync(sink->fd);
+    posix_fadvise(sink->fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  close(sink->fd);
+  free(sink->buffer);
+  free(sink);
+}
+
+struct LogSink * log_direct_open(const char * filename) {
+  struct LogDirectSink * sink = calloc(1, sizeof(struct LogDirectSink));
+  if(sink == NULL) return NULL;
+  int error = posix_memalign((void **) &sink->buffer, LOG_DIRECT_ALIGN,
+			     LOG_DIRECT_BUFFER_SIZE);
+  if(error != 0) {
+    free(sink);
+    errno = error;
+    return NULL;
+  }
+  sink->sink.write = log_direct_sink_write;
+  sink->sink.sync = log_direct_sink_sync;
+  sink->sink.close = log_direct_sink_close;
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  sink->direct = true;
+  sink->fd = open(filename, flags | O_DIRECT, 0666);
+  if(sink->fd < 0 && errno == EINVAL) {
+    /* The file system does not support O_DIRECT (tmpfs, for example). */
+    sink->direct = false;
+    sink->fd = open(filename, flags, 0666);
+  }
+  if(sink->fd < 0) {
+    error = errno;
+    free(sink->buffer);
+    free(sink);
+    errno = error;
+    return NULL;
+  }
+  return &sink->sink;
+}
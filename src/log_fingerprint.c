@@ -0,0 +1,316 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The number of fingerprints that are tracked (a power of two). Records of
+ * further call sites and formats are neither counted nor collapsed.
+ */
+#define LOG_FINGERPRINTS 1024
+
+/**
+ * The number of slots a lookup probes before it gives up.
+ */
+#define LOG_FINGERPRINT_PROBES 32
+
+/**
+ * The most fingerprints a report lists.
+ */
+#define LOG_FINGERPRINT_MAX_TOP 64
+
+/**
+ * The size of the copy of the format that the records of the module quote.
+ * Longer formats are cut short.
+ */
+#define LOG_FINGERPRINT_TEXT_SIZE 200
+
+/**
+ * The size of the records of the module, which fits the quoted format.
+ */
+#define LOG_FINGERPRINT_RECORD_SIZE 512
+
+/**
+ * The records of a format at a call site, or of a format logged without a
+ * site.
+ */
+struct LogFingerprint {
+  _Atomic uint64_t key;      /**< See log_fingerprint_key(), or 0. */
+  log_t level;
+  uint64_t id;               /**< The ID of the site, or a hash of the format. */
+  char text[LOG_FINGERPRINT_TEXT_SIZE]; /**< The format of the first record. */
+  _Atomic bool ready;        /**< The fields above are set. */
+  _Atomic uint64_t count;
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t first_ns; /**< The wall-clock time of the first record. */
+  _Atomic uint64_t last_ns;
+  _Atomic uint64_t window_ns; /**< When the last record was written. */
+  _Atomic uint64_t repeats;   /**< The records collapsed since then. */
+  /* The totals at the last report, which only the reporter uses. */
+  uint64_t reported_count;
+  uint64_t reported_bytes;
+};
+
+static struct LogFingerprint log_fingerprints[LOG_FINGERPRINTS];
+
+static struct {
+  pthread_mutex_t lock;      /**< Taken to report. */
+  _Atomic bool enabled;
+  _Atomic unsigned top;
+  _Atomic uint64_t interval_ns;
+  _Atomic uint64_t deadline_ns; /**< When the next report is due, or 0. */
+  _Atomic uint64_t collapse_ns;
+  bool registered;           /**< The exit handler is registered. */
+} log_fingerprint = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Returns the current value of the coarse wall clock in nanoseconds, which
+ * is cheap enough to read for every record.
+ */
+static uint64_t log_fingerprint_now_ns(void) {
+  struct timespec now;
+#ifdef CLOCK_REALTIME_COARSE
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+#else
+  clock_gettime(CLOCK_REALTIME, &now);
+#endif
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Hashes a format and a level with FNV-1a.
+ */
+static uint64_t log_fingerprint_hash(const char * format, log_t level) {
+  uint64_t hash = 0xcbf29ce484222325ULL ^ (unsigned) level;
+  for(; *format != '\0'; ++format) {
+    hash ^= (unsigned char) *format;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash != 0 ? hash : 1;
+}
+
+/**
+ * Returns the key of a record: a hash of its format and level, since the
+ * format may live in a buffer that is reused, mixed with the address of its
+ * site, if any, since a site may log a different format on each call. Keys
+ * with a site are even and keys without one odd.
+ */
+static uint64_t log_fingerprint_key(const struct LogRecord * fields,
+				    uint64_t * hash) {
+  *hash = log_fingerprint_hash(fields->format, fields->level);
+  if(fields->site == NULL) return *hash | 1;
+  uint64_t key = *hash ^ (uintptr_t) fields->site * 0x9e3779b97f4a7c15ULL;
+  return (key | 2) & ~(uint64_t) 1;
+}
+
+/**
+ * Finds the fingerprint of a record, claiming a free slot the first time.
+ * \return The fingerprint, or NULL if the record has no format or the table
+ * is too full.
+ */
+static struct LogFingerprint * log_fingerprint_find(
+  const struct LogRecord * fields) {
+  if(fields->format == NULL) return NULL;
+  uint64_t hash = 0;
+  uint64_t key = log_fingerprint_key(fields, &hash);
+  size_t index = ((key >> 3) * 0x9e3779b97f4a7c15ULL) >> 32;
+  for(int probe = 0; probe < LOG_FINGERPRINT_PROBES; ++probe) {
+    struct LogFingerprint * print =
+      &log_fingerprints[(index + probe) & (LOG_FINGERPRINTS - 1)];
+    uint64_t found = atomic_load_explicit(&print->key, memory_order_acquire);
+    if(found == 0
+       && atomic_compare_exchange_strong(&print->key, &found, key)) {
+      print->level = fields->level;
+      print->id = fields->site != NULL ? log_site_id(fields->site) : hash;
+      snprintf(print->text, sizeof(print->text), "%s", fields->format);
+      atomic_store_explicit(&print->ready, true, memory_order_release);
+      return print;
+    }
+    if(found == key) {
+      /* The thread that claimed the slot may still be filling it in. */
+      while(!atomic_load_explicit(&print->ready, memory_order_acquire))
+	;
+      return print;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Writes a record saying how many records of a fingerprint were collapsed,
+ * if any were.
+ */
+static void log_fingerprint_repeated(struct LogFingerprint * print) {
+  uint64_t repeats = atomic_exchange(&print->repeats, 0);
+  if(repeats == 0) return;
+  char record[LOG_FINGERPRINT_RECORD_SIZE];
+  int len = log_format_record(record, sizeof(record), print->level,
+			      "The message %016llx \"%s\" was repeated %llu "
+			      "more times.", (unsigned long long) print->id,
+			      print->text,
+			      (unsigned long long) repeats);
+  log_emit(print->level, record, len);
+}
+
+struct LogFingerprint * log_fingerprint_note(const struct LogRecord * fields,
+					     bool * collapsed) {
+  *collapsed = false;
+  if(!atomic_load_explicit(&log_fingerprint.enabled, memory_order_relaxed))
+    return NULL;
+  struct LogFingerprint * print = log_fingerprint_find(fields);
+  if(print == NULL) return NULL;
+  uint64_t now = log_fingerprint_now_ns();
+  atomic_fetch_add_explicit(&print->count, 1, memory_order_relaxed);
+  uint64_t first = 0;
+  if(atomic_load_explicit(&print->first_ns, memory_order_relaxed) == 0)
+    atomic_compare_exchange_strong(&print->first_ns, &first, now);
+  atomic_store_explicit(&print->last_ns, now, memory_order_relaxed);
+  uint64_t collapse_ns = atomic_load_explicit(&log_fingerprint.collapse_ns,
+					      memory_order_relaxed);
+  if(collapse_ns > 0) {
+    uint64_t window = atomic_load_explicit(&print->window_ns,
+					   memory_order_relaxed);
+    /* Only the first record past the window is written; it opens another. */
+    if((window != 0 && now - window < collapse_ns)
+       || !atomic_compare_exchange_strong(&print->window_ns, &window, now)) {
+      atomic_fetch_add_explicit(&print->repeats, 1, memory_order_relaxed);
+      *collapsed = true;
+    } else {
+      log_fingerprint_repeated(print);
+    }
+  }
+  uint64_t deadline = atomic_load_explicit(&log_fingerprint.deadline_ns,
+					   memory_order_relaxed);
+  if(deadline != 0 && now >= deadline) {
+    uint64_t interval = atomic_load(&log_fingerprint.interval_ns);
+    if(interval > 0
+       && atomic_compare_exchange_strong(&log_fingerprint.deadline_ns,
+					 &deadline, now + interval))
+      log_fingerprint_report();
+  }
+  return print;
+}
+
+void log_fingerprint_count(struct LogFingerprint * print, size_t len) {
+  atomic_fetch_add_explicit(&print->bytes, len, memory_order_relaxed);
+}
+
+/**
+ * Renders a wall-clock time in nanoseconds as local time.
+ */
+static void log_fingerprint_time(char * buffer, size_t size, uint64_t ns) {
+  time_t seconds = ns / 1000000000ULL;
+  struct tm local;
+  localtime_r(&seconds, &local);
+  strftime(buffer, size, "%Y-%m-%d %H:%M:%S", &local);
+}
+
+void log_fingerprint_report(void) {
+  pthread_mutex_lock(&log_fingerprint.lock);
+  unsigned top = atomic_load(&log_fingerprint.top);
+  struct LogFingerprint * ranked[LOG_FINGERPRINT_MAX_TOP];
+  uint64_t counts[LOG_FINGERPRINT_MAX_TOP];
+  unsigned ranked_count = 0;
+  uint64_t total = 0, total_bytes = 0;
+  size_t fingerprints = 0;
+  for(size_t i = 0; i < LOG_FINGERPRINTS; ++i) {
+    struct LogFingerprint * print = &log_fingerprints[i];
+    if(!atomic_load_explicit(&print->ready, memory_order_acquire))
+      continue;
+    log_fingerprint_repeated(print);
+    uint64_t count = atomic_load(&print->count);
+    uint64_t bytes = atomic_load(&print->bytes);
+    uint64_t new_count = count - print->reported_count;
+    total_bytes += bytes - print->reported_bytes;
+    print->reported_count = count;
+    print->reported_bytes = bytes;
+    if(new_count == 0) continue;
+    total += new_count;
+    ++fingerprints;
+    /* Insert the fingerprint among the top ones, by count. */
+    if(ranked_count < top || (top > 0 && counts[top - 1] < new_count)) {
+      unsigned j = ranked_count < top ? ranked_count++ : top - 1;
+      for(; j > 0 && counts[j - 1] < new_count; --j) {
+	ranked[j] = ranked[j - 1];
+	counts[j] = counts[j - 1];
+      }
+      ranked[j] = print;
+      counts[j] = new_count;
+    }
+  }
+  if(top > 0 && total > 0) {
+    char record[LOG_FINGERPRINT_RECORD_SIZE];
+    int len = log_format_record(record, sizeof(record), LOG_INFO,
+				"%llu records (%llu bytes) of %zu messages "
+				"since the last report; the most frequent:",
+				(unsigned long long) total,
+				(unsigned long long) total_bytes, fingerprints);
+    log_emit(LOG_INFO, record, len);
+    for(unsigned i = 0; i < ranked_count; ++i) {
+      struct LogFingerprint * print = ranked[i];
+      char first[32], last[32];
+      log_fingerprint_time(first, sizeof(first),
+			   atomic_load(&print->first_ns));
+      log_fingerprint_time(last, sizeof(last), atomic_load(&print->last_ns));
+      len = log_format_record(record, sizeof(record), LOG_INFO,
+			      "%u. %016llx %s: %llu records (%llu in all), "
+			      "%llu bytes in all, first seen %s, last seen %s: "
+			      "\"%s\"", i + 1,
+			      (unsigned long long) print->id,
+			      log_level_str(print->level),
+			      (unsigned long long) counts[i],
+			      (unsigned long long) print->reported_count,
+			      (unsigned long long) print->reported_bytes,
+			      first, last, print->text);
+      log_emit(LOG_INFO, record, len);
+    }
+  }
+  pthread_mutex_unlock(&log_fingerprint.lock);
+}
+
+/**
+ * Writes the collapsed records and the last report when the program exits.
+ */
+static void log_fingerprint_exit(void) {
+  log_fingerprint_report();
+}
+
+/**
+ * Enables the module if it reports or collapses. The module must be locked.
+ */
+static void log_fingerprint_update(void) {
+  bool enabled = atomic_load(&log_fingerprint.top) > 0
+    || atomic_load(&log_fingerprint.collapse_ns) > 0;
+  if(enabled && !log_fingerprint.registered) {
+    atexit(log_fingerprint_exit);
+    log_fingerprint.registered = true;
+  }
+  atomic_store(&log_fingerprint.enabled, enabled);
+}
+
+void log_set_fingerprints(unsigned top, unsigned seconds) {
+  if(top > LOG_FINGERPRINT_MAX_TOP) top = LOG_FINGERPRINT_MAX_TOP;
+  uint64_t interval = top > 0 ? seconds * 1000000000ULL : 0;
+  pthread_mutex_lock(&log_fingerprint.lock);
+  atomic_store(&log_fingerprint.top, top);
+  atomic_store(&log_fingerprint.interval_ns, interval);
+  atomic_store(&log_fingerprint.deadline_ns, interval > 0 ?
+	       log_fingerprint_now_ns() + interval : 0);
+  log_fingerprint_update();
+  pthread_mutex_unlock(&log_fingerprint.lock);
+}
+
+void log_set_collapse_repeats(unsigned seconds) {
+  pthread_mutex_lock(&log_fingerprint.lock);
+  atomic_store(&log_fingerprint.collapse_ns, seconds * 1000000000ULL);
+  log_fingerprint_update();
+  pthread_mutex_unlock(&log_fingerprint.lock);
+}
@@ -0,0 +1,981 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * A printf() engine for the conversions that log messages actually use.
+ *
+ * Unlike vfprintf(), it never consults the locale, never locks a stream and
+ * never allocates. Integers are converted two digits at a time from a table.
+ * Floating point numbers are converted exactly, with big-number arithmetic
+ * sized for a double, and rounded half to even, which is what glibc does in
+ * the default rounding mode; the output therefore matches glibc byte for
+ * byte. Conversions outside the supported subset make the whole call fall
+ * back to vsnprintf().
+ */
+
+/**
+ * The number of significant digits kept for a double. The exact decimal
+ * expansion of a double never has more than 767 significant digits, so the
+ * digits past this point are known to be zero.
+ */
+#define LOG_FORMAT_MAX_DIGITS 800
+
+/**
+ * The number of 32-bit words needed for the fraction of any double
+ * (1074 bits, plus a word for the digits being carried out).
+ */
+#define LOG_FORMAT_FRAC_WORDS 36
+
+/**
+ * The number of 32-bit words needed for the integer part of any double.
+ */
+#define LOG_FORMAT_INT_WORDS 33
+
+/**
+ * Two-digit strings for the decimal conversion table.
+ */
+static const char log_format_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536"
+  "37383940414243444546474849505152535455565758596061626364656667686970717273"
+  "74757677787980818283848586878889909192939495969798" "99";
+
+/**
+ * The destination of a conversion. len counts every character produced, even
+ * those that did not fit, as snprintf() does.
+ */
+struct LogOut {
+  char * buffer;
+  size_t size;
+  size_t len;
+};
+
+static inline void log_out_chars(struct LogOut * out, const char * chars,
+				 size_t n) {
+  if(n > 0 && out->len < out->size) {
+    size_t room = out->size - out->len;
+    memcpy(out->buffer + out->len, chars, n < room ? n : room);
+  }
+  out->len += n;
+}
+
+static inline void log_out_fill(struct LogOut * out, char c, size_t n) {
+  if(out->len < out->size) {
+    size_t room = out->size - out->len;
+    memset(out->buffer + out->len, c, n < room ? n : room);
+  }
+  out->len += n;
+}
+
+/**
+ * Writes the digits of value in the given base ending just before end and
+ * returns the start of the digits.
+ */
+static char * log_format_digits(uint64_t value, unsigned base, bool upper,
+				char * end) {
+  static const char lower_hex[] = "0123456789abcdef";
+  static const char upper_hex[] = "0123456789ABCDEF";
+  char * p = end;
+  switch(base) {
+  case 10:
+    while(value >= 100) {
+      unsigned pair = (unsigned) (value % 100) * 2;
+      value /= 100;
+      *--p = log_format_pairs[pair + 1];
+      *--p = log_format_pairs[pair];
+    }
+    if(value >= 10) {
+      *--p = log_format_pairs[value * 2 + 1];
+      *--p = log_format_pairs[value * 2];
+    } else {
+      *--p = '0' + (char) value;
+    }
+    break;
+  case 16: {
+    const char * hex = upper ? upper_hex : lower_hex;
+    do *--p = hex[value & 15]; while((value >>= 4) != 0);
+    break;
+  }
+  default:
+    do *--p = '0' + (char) (value & 7); while((value >>= 3) != 0);
+    break;
+  }
+  return p;
+}
+
+/**
+ * Pads the body of a conversion to the field width.
+ */
+static void log_format_pad(struct LogOut * out, const log_spec_t * spec,
+			   const char * prefix, size_t prefix_len,
+			   size_t zeros, const char * body, size_t body_len) {
+  size_t len = prefix_len + zeros + body_len;
+  size_t pad = spec->width > 0 && (size_t) spec->width > len ?
+    (size_t) spec->width - len : 0;
+  if(!(spec->flags & LOG_FORMAT_LEFT)) log_out_fill(out, ' ', pad);
+  log_out_chars(out, prefix, prefix_len);
+  log_out_fill(out, '0', zeros);
+  log_out_chars(out, body, body_len);
+  if(spec->flags & LOG_FORMAT_LEFT) log_out_fill(out, ' ', pad);
+}
+
+/**
+ * Converts an integer. negative is the sign of a signed conversion whose
+ * magnitude is value.
+ */
+static void log_format_integer(struct LogOut * out,
+			       const log_spec_t * spec,
+			       uint64_t value, bool negative) {
+  char digits[24];
+  char * end = digits + sizeof(digits);
+  unsigned base = 10;
+  if(spec->conversion == 'x' || spec->conversion == 'X'
+     || spec->conversion == 'p')
+    base = 16;
+  else if(spec->conversion == 'o')
+    base = 8;
+  char * start = log_format_digits(value, base, spec->conversion == 'X', end);
+  size_t len = end - start;
+  /* An explicit precision of zero prints nothing for zero. */
+  if(spec->precision == 0 && value == 0) len = 0;
+  size_t zeros = spec->precision > 0 && (size_t) spec->precision > len ?
+    (size_t) spec->precision - len : 0;
+  char prefix[2];
+  size_t prefix_len = 0;
+  if(spec->conversion == 'd' || spec->conversion == 'i') {
+    if(negative) prefix[prefix_len++] = '-';
+    else if(spec->flags & LOG_FORMAT_PLUS) prefix[prefix_len++] = '+';
+    else if(spec->flags & LOG_FORMAT_SPACE) prefix[prefix_len++] = ' ';
+  } else if(spec->flags & LOG_FORMAT_ALT) {
+    if(base == 16 && value != 0) {
+      prefix[prefix_len++] = '0';
+      prefix[prefix_len++] = spec->conversion == 'X' ? 'X' : 'x';
+    } else if(base == 8 && zeros == 0 && (len == 0 || *start != '0')) {
+      zeros = 1;
+    }
+  }
+  if((spec->flags & LOG_FORMAT_ZERO) && !(spec->flags & LOG_FORMAT_LEFT)
+     && spec->precision < 0 && spec->width > 0
+     && (size_t) spec->width > prefix_len + zeros + len)
+    zeros = spec->width - prefix_len - len;
+  log_format_pad(out, spec, prefix, prefix_len, zeros, end - len, len);
+}
+
+/**
+ * Converts a signed integer.
+ */
+static void log_format_signed(struct LogOut * out,
+			      const log_spec_t * spec,
+			      int64_t value) {
+  uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+  log_format_integer(out, spec, magnitude, value < 0);
+}
+
+/**
+ * Converts a pointer like glibc: "(nil)" or the address in %#x form.
+ */
+static void log_format_pointer(struct LogOut * out,
+			       const log_spec_t * spec,
+			       const void * pointer) {
+  if(pointer == NULL) {
+    log_spec_t padded = *spec;
+    padded.flags &= ~LOG_FORMAT_ZERO;
+    log_format_pad(out, &padded, NULL, 0, 0, "(nil)", 5);
+    return;
+  }
+  log_spec_t hex = *spec;
+  hex.flags |= LOG_FORMAT_ALT;
+  log_format_integer(out, &hex, (uintptr_t) pointer, false);
+}
+
+/**
+ * Generates the exact decimal expansion of a positive double, most
+ * significant digit first.
+ */
+struct LogDigits {
+  /* The digits of the integer part. */
+  char int_digits[320];
+  int int_len;
+  int int_pos;
+  /* The fraction, either in 64 bits or as a big number of 32-bit words. */
+  bool big;
+  uint64_t frac;
+  int frac_bits;
+  uint32_t words[LOG_FORMAT_FRAC_WORDS];
+  int lo; /**< The first nonzero word. */
+  int hi; /**< One past the last word of the fraction. */
+  /* Fraction digits produced but not yet consumed. */
+  char chunk[9];
+  int chunk_len;
+  int chunk_pos;
+  /** The decimal exponent of the first significant digit. */
+  int exp10;
+};
+
+/**
+ * Converts the integer part, a big number of n little-endian 32-bit words,
+ * to decimal by repeated division by 10^9.
+ */
+static void log_digits_big_int(struct LogDigits * g, uint32_t * words, int n) {
+  char reversed[320];
+  int len = 0;
+  while(n > 0) {
+    uint64_t remainder = 0;
+    for(int i = n - 1; i >= 0; --i) {
+      uint64_t current = (remainder << 32) | words[i];
+      words[i] = (uint32_t) (current / 1000000000u);
+      remainder = current % 1000000000u;
+    }
+    while(n > 0 && words[n - 1] == 0) --n;
+    for(int i = 0; i < 9 && (n > 0 || remainder != 0); ++i) {
+      reversed[len++] = '0' + (char) (remainder % 10);
+      remainder /= 10;
+    }
+  }
+  for(int i = 0; i < len; ++i)
+    g->int_digits[i] = reversed[len - 1 - i];
+  g->int_len = len;
+}
+
+/**
+ * Produces the next nine fraction digits.
+ */
+static void log_digits_next_chunk(struct LogDigits * g) {
+  uint32_t chunk;
+  if(!g->big) {
+    /* The fraction has at most 60 bits, so one digit at a time fits. */
+    for(int i = 0; i < 9; ++i) {
+      g->frac *= 10;
+      g->chunk[i] = '0' + (char) (g->frac >> g->frac_bits);
+      g->frac &= ((uint64_t) 1 << g->frac_bits) - 1;
+    }
+    g->chunk_len = 9;
+    g->chunk_pos = 0;
+    return;
+  }
+  /* Multiply by 10^9; the word carried out of the top holds the digits. */
+  uint64_t carry = 0;
+  for(int i = g->lo; i < g->hi; ++i) {
+    uint64_t product = (uint64_t) g->words[i] * 1000000000u + carry;
+    g->words[i] = (uint32_t) product;
+    carry = product >> 32;
+  }
+  chunk = (uint32_t) carry;
+  while(g->lo < g->hi && g->words[g->lo] == 0) ++g->lo;
+  for(int i = 8; i >= 0; --i) {
+    g->chunk[i] = '0' + (char) (chunk % 10);
+    chunk /= 10;
+  }
+  g->chunk_len = 9;
+  g->chunk_pos = 0;
+}
+
+/**
+ * Returns true if no digit is left in the fraction.
+ */
+static inline bool log_digits_frac_zero(const struct LogDigits * g) {
+  return g->big ? g->lo >= g->hi : g->frac == 0;
+}
+
+/**
+ * Returns the next digit of the expansion (integer digits first).
+ */
+static int log_digits_next(struct LogDigits * g) {
+  if(g->int_pos < g->int_len) return g->int_digits[g->int_pos++] - '0';
+  if(g->chunk_pos == g->chunk_len) {
+    if(log_digits_frac_zero(g)) return 0;
+    log_digits_next_chunk(g);
+  }
+  return g->chunk[g->chunk_pos++] - '0';
+}
+
+/**
+ * Returns true if any digit that has not been consumed is nonzero.
+ */
+static bool log_digits_rest_nonzero(const struct LogDigits * g) {
+  for(int i = g->int_pos; i < g->int_len; ++i)
+    if(g->int_digits[i] != '0') return true;
+  for(int i = g->chunk_pos; i < g->chunk_len; ++i)
+    if(g->chunk[i] != '0') return true;
+  return !log_digits_frac_zero(g);
+}
+
+/**
+ * Prepares the expansion of mantissa * 2^exponent (mantissa != 0) and finds
+ * the exponent of its first significant digit.
+ */
+static void log_digits_init(struct LogDigits * g, uint64_t mantissa,
+			    int exponent) {
+  g->int_len = g->int_pos = 0;
+  g->chunk_len = g->chunk_pos = 0;
+  g->big = false;
+  g->frac = 0;
+  g->frac_bits = 0;
+  if(exponent >= 0) {
+    if(exponent <= 11) {
+      char * end = g->int_digits + sizeof(g->int_digits);
+      char * start = log_format_digits(mantissa << exponent, 10, false, end);
+      g->int_len = end - start;
+      memmove(g->int_digits, start, g->int_len);
+    } else {
+      uint32_t words[LOG_FORMAT_INT_WORDS];
+      memset(words, 0, sizeof(words));
+      int shift = exponent % 32, offset = exponent / 32;
+      uint64_t low = mantissa << shift;
+      uint64_t high = shift > 0 ? mantissa >> (64 - shift) : 0;
+      words[offset] = (uint32_t) low;
+      words[offset + 1] = (uint32_t) (low >> 32);
+      words[offset + 2] = (uint32_t) high;
+      int n = offset + 3;
+      while(words[n - 1] == 0) --n;
+      log_digits_big_int(g, words, n);
+    }
+  } else {
+    int bits = -exponent;
+    uint64_t integer = bits < 64 ? mantissa >> bits : 0;
+    uint64_t frac = bits < 64 ? mantissa & (((uint64_t) 1 << bits) - 1)
+      : mantissa;
+    if(integer != 0) {
+      char * end = g->int_digits + sizeof(g->int_digits);
+      char * start = log_format_digits(integer, 10, false, end);
+      g->int_len = end - start;
+      memmove(g->int_digits, start, g->int_len);
+    }
+    if(bits <= 60) {
+      g->frac = frac;
+      g->frac_bits = bits;
+    } else {
+      /* Align the binary point with a word boundary. */
+      g->big = true;
+      int words = (bits + 31) / 32;
+      int shift = words * 32 - bits;
+      memset(g->words, 0, sizeof(g->words));
+      uint64_t low = frac << shift;
+      uint64_t high = shift > 0 ? frac >> (64 - shift) : 0;
+      int offset = 0;
+      /* The fraction has at most 53 significant bits at the bottom. */
+      g->words[offset] = (uint32_t) low;
+      g->words[offset + 1] = (uint32_t) (low >> 32);
+      g->words[offset + 2] = (uint32_t) high;
+      g->lo = 0;
+      g->hi = words;
+      while(g->lo < g->hi && g->words[g->lo] == 0) ++g->lo;
+    }
+  }
+  if(g->int_len > 0) {
+    g->exp10 = g->int_len - 1;
+    return;
+  }
+  /* Skip the zeros after the decimal point. */
+  g->exp10 = -1;
+  for(;;) {
+    if(g->chunk_pos == g->chunk_len) log_digits_next_chunk(g);
+    if(g->chunk[g->chunk_pos] != '0') break;
+    ++g->chunk_pos;
+    --g->exp10;
+  }
+}
+
+/**
+ * Takes the first n significant digits (n may be zero or negative) and rounds
+ * them half to even. The digits are stored in digits, of which at most
+ * LOG_FORMAT_MAX_DIGITS are kept (the rest are zero), and g->exp10 is updated
+ * if rounding carries into a new digit.
+ * \return The number of digits stored.
+ */
+static int log_digits_round(struct LogDigits * g, int n, char * digits) {
+  if(n < 0) return 0; /* Less than a tenth of the last place: rounds to 0. */
+  int kept = n < LOG_FORMAT_MAX_DIGITS ? n : LOG_FORMAT_MAX_DIGITS;
+  for(int i = 0; i < kept; ++i)
+    digits[i] = '0' + (char) log_digits_next(g);
+  if(n > kept) return kept; /* Nothing left to round. */
+  int next = log_digits_next(g);
+  bool round_up = next > 5
+    || (next == 5 && (log_digits_rest_nonzero(g)
+		      || (kept > 0 && (digits[kept - 1] - '0') % 2 == 1)));
+  if(!round_up) return kept;
+  int i = kept - 1;
+  while(i >= 0 && digits[i] == '9') digits[i--] = '0';
+  if(i >= 0) {
+    ++digits[i];
+  } else {
+    /* Every digit carried, e.g. 9.99 -> 10.0. */
+    if(kept > 1) memmove(digits + 1, digits, kept - 1);
+    digits[0] = '1';
+    ++g->exp10;
+    if(kept == 0) kept = 1;
+  }
+  return kept;
+}
+
+/**
+ * Returns the digit at decimal position exponent (0 for units, -1 for tenths
+ * and so on) of the rounded digits.
+ */
+static inline char log_digit_at(const char * digits, int len, int exp10,
+				int position) {
+  int i = exp10 - position;
+  return i >= 0 && i < len ? digits[i] : '0';
+}
+
+/**
+ * Writes the digits from position first down to position last.
+ */
+static void log_out_positions(struct LogOut * out, const char * digits,
+			      int len, int exp10, int first, int last) {
+  /* Zeros before the significant digits. */
+  while(first >= last && first > exp10) {
+    log_out_fill(out, '0', 1);
+    --first;
+  }
+  /* Significant digits, in one piece. */
+  if(first >= last) {
+    int i = exp10 - first;
+    int n = first - last + 1;
+    int available = len - i > 0 ? len - i : 0;
+    int copy = n < available ? n : available;
+    log_out_chars(out, digits + i, copy);
+    log_out_fill(out, '0', n - copy);
+  }
+}
+
+/**
+ * Converts a double with %f, %e or %g.
+ */
+static void log_format_double(struct LogOut * out,
+			      const log_spec_t * spec,
+			      double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  bool negative = bits >> 63;
+  int biased = (int) ((bits >> 52) & 0x7ff);
+  uint64_t mantissa = bits & (((uint64_t) 1 << 52) - 1);
+  char conversion = spec->conversion;
+  bool upper = conversion == 'F' || conversion == 'E' || conversion == 'G';
+  char lower_conversion = conversion | 0x20;
+  char prefix[1];
+  size_t prefix_len = 0;
+  if(negative) prefix[prefix_len++] = '-';
+  else if(spec->flags & LOG_FORMAT_PLUS) prefix[prefix_len++] = '+';
+  else if(spec->flags & LOG_FORMAT_SPACE) prefix[prefix_len++] = ' ';
+  if(biased == 0x7ff) {
+    /* Infinities and NaNs are padded with spaces only. */
+    const char * text = mantissa == 0 ? (upper ? "INF" : "inf")
+      : (upper ? "NAN" : "nan");
+    log_spec_t padded = *spec;
+    padded.flags &= ~LOG_FORMAT_ZERO;
+    log_format_pad(out, &padded, prefix, prefix_len, 0, text, 3);
+    return;
+  }
+  int precision = spec->precision < 0 ? 6 : spec->precision;
+  bool alt = spec->flags & LOG_FORMAT_ALT;
+  char digits[LOG_FORMAT_MAX_DIGITS];
+  int len = 0;
+  int exp10 = 0;
+  struct LogDigits g;
+  bool zero = biased == 0 && mantissa == 0;
+  if(!zero) {
+    int exponent = biased == 0 ? -1074 : biased - 1075;
+    if(biased != 0) mantissa |= (uint64_t) 1 << 52;
+    log_digits_init(&g, mantissa, exponent);
+  }
+  /* Decide on the style and round to the digits it shows. */
+  bool exponential = lower_conversion == 'e';
+  bool strip = false;
+  if(lower_conversion == 'g') {
+    int significant = precision == 0 ? 1 : precision;
+    int unrounded = zero ? 0 : g.exp10;
+    if(!zero) {
+      len = log_digits_round(&g, significant, digits);
+      exp10 = g.exp10;
+    }
+    if(significant > exp10 && exp10 >= -4) {
+      precision = significant - 1 - exp10;
+    } else {
+      exponential = true;
+      precision = significant - 1;
+      /*
+       * glibc first picks the style from the unrounded exponent. When that
+       * chose %f with no fraction digits and rounding then carried into a
+       * new digit (999999.5 with %#g), it switches to %e but keeps the
+       * empty fraction, printing "1.e+06". Do the same to match it.
+       */
+      if(!zero && unrounded == significant - 1 && exp10 == significant)
+	precision = 0;
+    }
+    strip = !alt;
+  } else if(!zero) {
+    int significant = exponential ? precision + 1 : g.exp10 + 1 + precision;
+    len = log_digits_round(&g, significant, digits);
+    exp10 = g.exp10;
+  }
+  if(zero) exp10 = 0;
+  /* Find the number of fraction digits after stripping trailing zeros. */
+  int last = exponential ? exp10 - precision : -precision;
+  if(strip) {
+    int top = exponential ? exp10 : 0;
+    int i = len - 1;
+    while(i >= 0 && digits[i] == '0') --i;
+    int lowest = i >= 0 ? exp10 - i : top;
+    if(lowest > top) lowest = top;
+    if(last < lowest) last = lowest;
+  }
+  int fraction = exponential ? exp10 - last : -last;
+  bool point = fraction > 0 || alt;
+  /* Build the exponent suffix. */
+  char suffix[8];
+  size_t suffix_len = 0;
+  if(exponential) {
+    int e = zero ? 0 : exp10;
+    suffix[suffix_len++] = upper ? 'E' : 'e';
+    suffix[suffix_len++] = e < 0 ? '-' : '+';
+    if(e < 0) e = -e;
+    if(e >= 100) suffix[suffix_len++] = '0' + (char) (e / 100);
+    suffix[suffix_len++] = '0' + (char) (e / 10 % 10);
+    suffix[suffix_len++] = '0' + (char) (e % 10);
+  }
+  size_t integer_len = exponential ? 1 : (exp10 >= 0 ? exp10 + 1 : 1);
+  size_t body_len = integer_len + (point ? 1 : 0) + fraction + suffix_len;
+  /* Pad to the field width around the sign. */
+  size_t zeros = 0;
+  size_t total = prefix_len + body_len;
+  size_t pad = spec->width > 0 && (size_t) spec->width > total ?
+    (size_t) spec->width - total : 0;
+  if(spec->flags & LOG_FORMAT_LEFT) {
+  } else if(spec->flags & LOG_FORMAT_ZERO) {
+    zeros = pad;
+    pad = 0;
+  } else {
+    log_out_fill(out, ' ', pad);
+  }
+  log_out_chars(out, prefix, prefix_len);
+  log_out_fill(out, '0', zeros);
+  if(exponential) {
+    log_out_fill(out, len > 0 ? digits[0] : '0', 1);
+    if(point) log_out_fill(out, '.', 1);
+    if(fraction > 0)
+      log_out_positions(out, digits + (len > 0 ? 1 : 0), len > 0 ? len - 1 : 0,
+			-1, -1, -fraction);
+    log_out_chars(out, suffix, suffix_len);
+  } else {
+    if(exp10 >= 0 && !zero) log_out_positions(out, digits, len, exp10, exp10, 0);
+    else log_out_fill(out, '0', 1);
+    if(point) log_out_fill(out, '.', 1);
+    if(fraction > 0) {
+      if(zero) log_out_fill(out, '0', fraction);
+      else log_out_positions(out, digits, len, exp10, -1, -fraction);
+    }
+  }
+  if(spec->flags & LOG_FORMAT_LEFT) log_out_fill(out, ' ', pad);
+}
+
+/**
+ * Converts a string with %s.
+ */
+static void log_format_string(struct LogOut * out,
+			      const log_spec_t * spec,
+			      const char * string) {
+  if(string == NULL)
+    string = spec->precision < 0 || spec->precision >= 6 ? "(null)" : "";
+  size_t len = spec->precision < 0 ? strlen(string)
+    : strnlen(string, spec->precision);
+  log_spec_t padded = *spec;
+  padded.flags &= ~LOG_FORMAT_ZERO;
+  log_format_pad(out, &padded, NULL, 0, 0, string, len);
+}
+
+/**
+ * Parses the conversion specification at format (just after the '%').
+ * Width and precision given as '*' are marked with -2 for the caller.
+ * \return The character after the specification, or NULL if it is not
+ * supported.
+ */
+static const char * log_format_parse(const char * format,
+				     log_spec_t * spec) {
+  spec->flags = 0;
+  spec->width = 0;
+  spec->precision = -1;
+  spec->length = 0;
+  for(;; ++format) {
+    switch(*format) {
+    case '-': spec->flags |= LOG_FORMAT_LEFT; continue;
+    case '+': spec->flags |= LOG_FORMAT_PLUS; continue;
+    case ' ': spec->flags |= LOG_FORMAT_SPACE; continue;
+    case '#': spec->flags |= LOG_FORMAT_ALT; continue;
+    case '0': spec->flags |= LOG_FORMAT_ZERO; continue;
+    }
+    break;
+  }
+  if(*format == '*') {
+    spec->width = -2;
+    ++format;
+  } else {
+    while(*format >= '0' && *format <= '9')
+      spec->width = spec->width * 10 + (*format++ - '0');
+  }
+  if(*format == '.') {
+    ++format;
+    spec->precision = 0;
+    if(*format == '*') {
+      spec->precision = -2;
+      ++format;
+    } else {
+      while(*format >= '0' && *format <= '9')
+	spec->precision = spec->precision * 10 + (*format++ - '0');
+    }
+  }
+  /* Positional arguments ("%1$d") are not supported. */
+  if(*format == '$') return NULL;
+  switch(*format) {
+  case 'h':
+    spec->length = 'h';
+    if(*++format == 'h') {
+      spec->length = 'H';
+      ++format;
+    }
+    break;
+  case 'l':
+    spec->length = 'l';
+    if(*++format == 'l') {
+      spec->length = 'q';
+      ++format;
+    }
+    break;
+  case 'z': case 'j': case 't':
+    spec->length = *format++;
+    break;
+  }
+  spec->conversion = *format;
+  switch(*format) {
+  case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+  case '%':
+    return format + 1;
+  case 'c': case 's': case 'p':
+    /* Wide characters and strings are left to the C library. */
+    return spec->length == 0 ? format + 1 : NULL;
+  default:
+    return NULL;
+  }
+}
+
+/**
+ * The arguments of a format: either a va_list or arguments packed by
+ * log_pack_args(). Packed arguments are 8-byte slots holding the values as
+ * read from the va_list (after the conversion implied by the length 
+ * modifier), except that strings are copied into the slots as a 32-bit 
+ * length (UINT32_MAX for NULL) followed by the characters and a null 
+ * character.
+ */
+struct LogArgs {
+  va_list * list;
+  const unsigned char * packed;
+};
+
+/**
+ * The size of a packed slot.
+ */
+#define LOG_PACK_SLOT 8
+
+static inline uint64_t log_args_slot(struct LogArgs * args) {
+  uint64_t slot;
+  memcpy(&slot, args->packed, sizeof(slot));
+  args->packed += LOG_PACK_SLOT;
+  return slot;
+}
+
+static int log_args_int(struct LogArgs * args) {
+  if(args->packed != NULL) return (int) (int64_t) log_args_slot(args);
+  return va_arg(*args->list, int);
+}
+
+static int64_t log_args_signed(struct LogArgs * args, char length) {
+  if(args->packed != NULL) return (int64_t) log_args_slot(args);
+  switch(length) {
+  case 'H': return (signed char) va_arg(*args->list, int);
+  case 'h': return (short) va_arg(*args->list, int);
+  case 'l': return va_arg(*args->list, long);
+  case 'q': return va_arg(*args->list, long long);
+  case 'z': return va_arg(*args->list, ssize_t);
+  case 'j': return va_arg(*args->list, intmax_t);
+  case 't': return va_arg(*args->list, ptrdiff_t);
+  default:  return va_arg(*args->list, int);
+  }
+}
+
+static uint64_t log_args_unsigned(struct LogArgs * args, char length) {
+  if(args->packed != NULL) return log_args_slot(args);
+  switch(length) {
+  case 'H': return (unsigned char) va_arg(*args->list, unsigned);
+  case 'h': return (unsigned short) va_arg(*args->list, unsigned);
+  case 'l': return va_arg(*args->list, unsigned long);
+  case 'q': return va_arg(*args->list, unsigned long long);
+  case 'z': return va_arg(*args->list, size_t);
+  case 'j': return va_arg(*args->list, uintmax_t);
+  case 't': return (size_t) va_arg(*args->list, ptrdiff_t);
+  default:  return va_arg(*args->list, unsigned);
+  }
+}
+
+static double log_args_double(struct LogArgs * args) {
+  if(args->packed == NULL) return va_arg(*args->list, double);
+  uint64_t slot = log_args_slot(args);
+  double value;
+  memcpy(&value, &slot, sizeof(value));
+  return value;
+}
+
+static const void * log_args_pointer(struct LogArgs * args) {
+  if(args->packed == NULL) return va_arg(*args->list, void *);
+  return (const void *) (uintptr_t) log_args_slot(args);
+}
+
+static const char * log_args_string(struct LogArgs * args) {
+  if(args->packed == NULL) return va_arg(*args->list, const char *);
+  uint32_t len;
+  memcpy(&len, args->packed, sizeof(len));
+  if(len == UINT32_MAX) {
+    args->packed += LOG_PACK_SLOT;
+    return NULL;
+  }
+  const char * string = (const char *) args->packed + sizeof(len);
+  size_t size = sizeof(len) + len + 1;
+  args->packed += (size + LOG_PACK_SLOT - 1) / LOG_PACK_SLOT * LOG_PACK_SLOT;
+  return string;
+}
+
+/**
+ * Formats with either kind of arguments. Returns -2 instead of formatting
+ * if the format uses a conversion that this engine does not support.
+ */
+static int log_format_args(char * buffer, size_t size, const char * format,
+			   struct LogArgs * args) {
+  struct LogOut out = { .buffer = buffer, .size = size, .len = 0 };
+  const char * p = format;
+  for(;;) {
+    /* Copy the literal text up to the next conversion. */
+    const char * percent = strchr(p, '%');
+    if(percent == NULL) {
+      log_out_chars(&out, p, strlen(p));
+      break;
+    }
+    log_out_chars(&out, p, percent - p);
+    log_spec_t spec;
+    const char * next = log_format_parse(percent + 1, &spec);
+    if(next == NULL) return -2;
+    if(spec.width == -2) {
+      spec.width = log_args_int(args);
+      if(spec.width < 0) {
+	spec.flags |= LOG_FORMAT_LEFT;
+	spec.width = -spec.width;
+      }
+    }
+    if(spec.precision == -2) {
+      spec.precision = log_args_int(args);
+      if(spec.precision < 0) spec.precision = -1;
+    }
+    switch(spec.conversion) {
+    case 'd': case 'i':
+      log_format_signed(&out, &spec, log_args_signed(args, spec.length));
+      break;
+    case 'u': case 'x': case 'X': case 'o':
+      log_format_integer(&out, &spec, log_args_unsigned(args, spec.length),
+			 false);
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+      log_format_double(&out, &spec, log_args_double(args));
+      break;
+    case 'c': {
+      char c = (char) log_args_int(args);
+      spec.flags &= ~LOG_FORMAT_ZERO;
+      log_format_pad(&out, &spec, NULL, 0, 0, &c, 1);
+      break;
+    }
+    case 's':
+      log_format_string(&out, &spec, log_args_string(args));
+      break;
+    case 'p':
+      log_format_pointer(&out, &spec, log_args_pointer(args));
+      break;
+    case '%':
+      log_out_chars(&out, "%", 1);
+      break;
+    }
+    p = next;
+  }
+  /* Terminate the string, cutting it short if necessary. */
+  if(size > 0) buffer[out.len < size ? out.len : size - 1] = '\0';
+  return (int) out.len;
+}
+
+int log_vsnprintf(char * buffer, size_t size, const char * format,
+		  va_list args) {
+  va_list list, fallback;
+  va_copy(list, args);
+  va_copy(fallback, args);
+  struct LogArgs source = { .list = &list, .packed = NULL };
+  int len = log_format_args(buffer, size, format, &source);
+  if(len == -2) {
+    /* Let the C library handle what this engine does not. */
+    len = vsnprintf(buffer, size, format, fallback);
+  }
+  va_end(list);
+  va_end(fallback);
+  return len;
+}
+
+/**
+ * Appends a slot to packed arguments, if it fits.
+ */
+static inline void log_pack_slot(unsigned char * buffer, size_t size,
+				 size_t * len, uint64_t slot) {
+  if(*len + LOG_PACK_SLOT <= size) memcpy(buffer + *len, &slot, sizeof(slot));
+  *len += LOG_PACK_SLOT;
+}
+
+size_t log_pack_args(void * buffer, size_t size, const char * format,
+		     va_list args) {
+  va_list list;
+  va_copy(list, args);
+  struct LogArgs source = { .list = &list, .packed = NULL };
+  unsigned char * packed = buffer;
+  size_t len = 0;
+  for(const char * p = format; (p = strchr(p, '%')) != NULL;) {
+    log_spec_t spec;
+    const char * next = log_format_parse(p + 1, &spec);
+    if(next == NULL) {
+      len = LOG_PACK_UNSUPPORTED;
+      break;
+    }
+    if(spec.width == -2)
+      log_pack_slot(packed, size, &len, (uint64_t) log_args_int(&source));
+    if(spec.precision == -2) {
+      int precision = log_args_int(&source);
+      log_pack_slot(packed, size, &len, (uint64_t) precision);
+      spec.precision = precision < 0 ? -1 : precision;
+    }
+    switch(spec.conversion) {
+    case 'd': case 'i':
+      log_pack_slot(packed, size, &len,
+		    (uint64_t) log_args_signed(&source, spec.length));
+      break;
+    case 'u': case 'x': case 'X': case 'o':
+      log_pack_slot(packed, size, &len,
+		    log_args_unsigned(&source, spec.length));
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': {
+      double value = log_args_double(&source);
+      uint64_t slot;
+      memcpy(&slot, &value, sizeof(slot));
+      log_pack_slot(packed, size, &len, slot);
+      break;
+    }
+    case 'c':
+      log_pack_slot(packed, size, &len, (uint64_t) log_args_int(&source));
+      break;
+    case 'p':
+      log_pack_slot(packed, size, &len,
+		    (uintptr_t) log_args_pointer(&source));
+      break;
+    case 's': {
+      /* The string may not outlive the call, so copy it. */
+      const char * string = log_args_string(&source);
+      if(string == NULL) {
+	log_pack_slot(packed, size, &len, UINT32_MAX);
+	break;
+      }
+      /* A precision bounds a string that need not be terminated. */
+      size_t string_len = spec.precision < 0 ? strlen(string)
+	: strnlen(string, spec.precision);
+      if(string_len >= UINT32_MAX) string_len = UINT32_MAX - 1;
+      uint32_t len32 = (uint32_t) string_len;
+      size_t slots = (sizeof(len32) + string_len + 1 + LOG_PACK_SLOT - 1)
+	/ LOG_PACK_SLOT * LOG_PACK_SLOT;
+      if(len + slots <= size) {
+	memcpy(packed + len, &len32, sizeof(len32));
+	memcpy(packed + len + sizeof(len32), string, string_len);
+	packed[len + sizeof(len32) + string_len] = '\0';
+      }
+      len += slots;
+      break;
+    }
+    }
+    p = next;
+  }
+  va_end(list);
+  return len;
+}
+
+int log_snprintf_packed(char * buffer, size_t size, const char * format,
+			const void * packed) {
+  struct LogArgs source = { .list = NULL, .packed = packed };
+  return log_format_args(buffer, size, format, &source);
+}
+
+int log_snprintf(char * buffer, size_t size, const char * format, ...) {
+  va_list args;
+  va_start(args, format);
+  int len = log_vsnprintf(buffer, size, format, args);
+  va_end(args);
+  return len;
+}
+
+/**
+ * Terminates the output of a single conversion like snprintf().
+ */
+static int log_out_finish(struct LogOut * out) {
+  if(out->size > 0)
+    out->buffer[out->len < out->size ? out->len : out->size - 1] = '\0';
+  return (int) out->len;
+}
+
+int log_convert_signed(char * buffer, size_t size, const log_spec_t * spec,
+		       long long value) {
+  struct LogOut out = { .buffer = buffer, .size = size, .len = 0 };
+  log_format_signed(&out, spec, value);
+  return log_out_finish(&out);
+}
+
+int log_convert_unsigned(char * buffer, size_t size, const log_spec_t * spec,
+			 unsigned long long value) {
+  struct LogOut out = { .buffer = buffer, .size = size, .len = 0 };
+  log_format_integer(&out, spec, value, false);
+  return log_out_finish(&out);
+}
+
+int log_convert_double(char * buffer, size_t size, const log_spec_t * spec,
+		       double value) {
+  struct LogOut out = { .buffer = buffer, .size = size, .len = 0 };
+  log_format_double(&out, spec, value);
+  return log_out_finish(&out);
+}
+
+int log_convert_char(char * buffer, size_t size, const log_spec_t * spec,
+		     char value) {
+  struct LogOut out = { .buffer = buffer, .size = size, .len = 0 };
+  log_spec_t padded = *spec;
+  padded.flags &= ~LOG_FORMAT_ZERO;
+  log_format_pad(&out, &padded, NULL, 0, 0, &value, 1);
+  return log_out_finish(&out);
+}
+
+int log_convert_string(char * buffer, size_t size, const log_spec_t * spec,
+		       const char * value) {
+  struct LogOut out = { .buffer = buffer, .size = size, .len = 0 };
+  log_format_string(&out, spec, value);
+  return log_out_finish(&out);
+}
+
+int log_convert_pointer(char * buffer, size_t size, const log_spec_t * spec,
+			const void * value) {
+  struct LogOut out = { .buffer = buffer, .size = size, .len = 0 };
+  log_format_pointer(&out, spec, value);
+  return log_out_finish(&out);
+}
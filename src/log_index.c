@@ -0,0 +1,272 @@
+#define _GNU_SOURCE /* For strptime(). */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * Identifies a sidecar index file ("LOGIDX01").
+ */
+#define LOG_INDEX_MAGIC "LOGIDX01"
+
+/**
+ * Entries are located by the time at which the records were written, which
+ * may trail the timestamp in their header by a little (e.g. when records
+ * pass through the shared-memory ring). Queries extend their end by this many
+ * seconds and then filter on the header timestamp.
+ */
+#define LOG_INDEX_SLACK 2
+
+/**
+ * One entry of the sidecar index: every record at or after offset was
+ * written at or after time.
+ */
+struct LogIndexEntry {
+  int64_t time;
+  uint64_t offset;
+};
+
+/**
+ * The sidecar index of an open log file.
+ */
+struct LogIndex {
+  FILE * file;
+  unsigned every_records;
+  unsigned every_seconds;
+  unsigned records; /**< Records written since the last entry. */
+  time_t last_time; /**< Time of the last entry. */
+};
+
+struct LogIndex * log_index_open(const char * filename, unsigned every_records,
+				 unsigned every_seconds) {
+  size_t len = strlen(filename);
+  char * index_filename = malloc(len + sizeof(".idx"));
+  struct LogIndex * index = calloc(1, sizeof(struct LogIndex));
+  if(index_filename == NULL || index == NULL) {
+    free(index_filename);
+    free(index);
+    return NULL;
+  }
+  memcpy(index_filename, filename, len);
+  memcpy(index_filename + len, ".idx", sizeof(".idx"));
+  index->file = fopen(index_filename, "w");
+  free(index_filename);
+  if(index->file == NULL) {
+    free(index);
+    return NULL;
+  }
+  fwrite(LOG_INDEX_MAGIC, sizeof(char), 8, index->file);
+  index->every_records = every_records;
+  index->every_seconds = every_seconds;
+  /* Force an entry for the first record. */
+  index->records = every_records;
+  index->last_time = 0;
+  return index;
+}
+
+void log_index_close(struct LogIndex * index) {
+  if(index == NULL) return;
+  fclose(index->file);
+  free(index);
+}
+
+void log_index_note(struct LogIndex * index, FILE * stream, const char * data,
+		    size_t len) {
+  time_t now = time(NULL);
+  bool due = (index->every_records > 0
+	      && index->records >= index->every_records)
+    || (index->every_seconds > 0
+	&& now - index->last_time >= (time_t) index->every_seconds);
+  if(due) {
+    /*
+     * Flush the records before the entry and then the entry itself, so that
+     * a reader never finds an entry beyond the data, nor misses one for long.
+     */
+    fflush(stream);
+    long offset = ftell(stream);
+    if(offset >= 0) {
+      struct LogIndexEntry entry = { .time = now, .offset = offset };
+      fwrite(&entry, sizeof(entry), 1, index->file);
+      fflush(index->file);
+      index->records = 0;
+      index->last_time = now;
+    }
+  }
+  /* Data may hold a batch of records. */
+  for(const char * end = data + len;
+      (data = memchr(data, '\n', end - data)) != NULL; ++data)
+    ++index->records;
+}
+
+size_t log_header_layout(const char * line, size_t len, long * nsec,
+			 size_t * severity) {
+  /* "[Sun 18 Oct 2026 07:15:33] " is 27 characters. */
+  if(len < 29 || line[0] != '[') return 0;
+  /* A fraction of the second may follow, as in "[%D.%us] %L: %M". */
+  size_t bracket = 25;
+  long fraction = 0, scale = 1000000000;
+  if(line[25] == '.') {
+    for(bracket = 26; bracket < len && bracket < 35
+	  && line[bracket] >= '0' && line[bracket] <= '9'; ++bracket) {
+      scale /= 10;
+      fraction = fraction * 10 + (line[bracket] - '0');
+    }
+    if(bracket == 26) return 0;
+  }
+  if(bracket + 3 >= len || line[bracket] != ']' || line[bracket + 1] != ' ')
+    return 0;
+  /* Find the end of the severity and the separator after it. */
+  const char * colon = memchr(line + bracket + 2, ':', len - bracket - 2);
+  if(colon == NULL || (size_t) (colon - line) + 1 >= len
+     || colon[1] != ' ')
+    return 0;
+  if(nsec != NULL) *nsec = fraction * scale;
+  if(severity != NULL) *severity = bracket + 2;
+  return colon - line + 2;
+}
+
+size_t log_parse_header(const char * line, size_t len, struct timespec * time,
+			log_t * level) {
+  long nsec;
+  size_t severity;
+  size_t header = log_header_layout(line, len, &nsec, &severity);
+  if(header == 0) return 0;
+  char stamp[25];
+  memcpy(stamp, line + 1, 24);
+  stamp[24] = '\0';
+  struct tm fields;
+  memset(&fields, 0, sizeof(fields));
+  const char * end = strptime(stamp, "%a %d %b %Y %H:%M:%S", &fields);
+  if(end == NULL || *end != '\0') return 0;
+  if(level != NULL) {
+    static const char * names[] = {
+      "FATAL", "ERROR", "WARNING", "INFO", "DEBUG", "TRACE"
+    };
+    size_t name_len = header - 2 - severity;
+    *level = LOG_TRACE + 1;
+    for(int i = LOG_FATAL; i <= LOG_TRACE; ++i)
+      if(strlen(names[i]) == name_len
+	 && memcmp(names[i], line + severity, name_len) == 0)
+	*level = i;
+  }
+  if(time != NULL) {
+    fields.tm_isdst = -1;
+    time->tv_sec = mktime(&fields);
+    time->tv_nsec = nsec;
+  }
+  return header;
+}
+
+/**
+ * Returns the header time of the line, reusing the last conversion when the
+ * timestamp text is unchanged (mktime() is comparatively slow).
+ */
+static bool log_index_line_time(const char * line, size_t len, time_t * time,
+				char * last_stamp, time_t * last_time) {
+  if(len >= 27 && line[0] == '[' && memcmp(line, last_stamp, 26) == 0) {
+    *time = *last_time;
+    return true;
+  }
+  struct timespec stamp;
+  if(log_parse_header(line, len, &stamp, NULL) == 0) return false;
+  memcpy(last_stamp, line, 26);
+  *last_time = *time = stamp.tv_sec;
+  return true;
+}
+
+size_t log_index_query(const char * filename, time_t from, time_t to,
+		       FILE * out) {
+  /* Read the index to find the byte range that may hold the records. */
+  size_t len = strlen(filename);
+  char * index_filename = malloc(len + sizeof(".idx"));
+  if(index_filename == NULL) return 0;
+  memcpy(index_filename, filename, len);
+  memcpy(index_filename + len, ".idx", sizeof(".idx"));
+  int index_fd = open(index_filename, O_RDONLY);
+  free(index_filename);
+  int fd = open(filename, O_RDONLY);
+  struct stat index_stats, stats;
+  if(fd < 0 || fstat(fd, &stats) != 0) {
+    log_error("I could not open %s with error %d.", filename, errno);
+    if(fd >= 0) close(fd);
+    if(index_fd >= 0) close(index_fd);
+    return 0;
+  }
+  uint64_t start = 0, end = stats.st_size;
+  if(index_fd >= 0 && fstat(index_fd, &index_stats) == 0
+     && index_stats.st_size > 8) {
+    void * map = mmap(NULL, index_stats.st_size, PROT_READ, MAP_PRIVATE,
+		      index_fd, 0);
+    if(map != MAP_FAILED) {
+      if(memcmp(map, LOG_INDEX_MAGIC, 8) == 0) {
+	const struct LogIndexEntry * entries =
+	  (const struct LogIndexEntry *) ((const char *) map + 8);
+	size_t count = (index_stats.st_size - 8) / sizeof(*entries);
+	/* The last entry written before from bounds the start... */
+	size_t lo = 0, hi = count;
+	while(lo < hi) {
+	  size_t mid = lo + (hi - lo) / 2;
+	  if(entries[mid].time < (int64_t) from) lo = mid + 1; else hi = mid;
+	}
+	if(lo > 0) start = entries[lo - 1].offset;
+	/* ...and the first entry written well after to bounds the end. */
+	hi = count;
+	while(lo < hi) {
+	  size_t mid = lo + (hi - lo) / 2;
+	  if(entries[mid].time <= (int64_t) to + LOG_INDEX_SLACK) lo = mid + 1;
+	  else hi = mid;
+	}
+	if(lo < count && entries[lo].offset < end) end = entries[lo].offset;
+      }
+      munmap(map, index_stats.st_size);
+    }
+  }
+  if(index_fd >= 0) close(index_fd);
+  if(start >= end) {
+    close(fd);
+    return 0;
+  }
+  /* Map only the selected range and filter it on the header timestamps. */
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t map_start = start - start % page;
+  size_t map_len = end - map_start;
+  char * map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_start);
+  close(fd);
+  if(map == MAP_FAILED) {
+    log_error("I could not map %s with error %d.", filename, errno);
+    return 0;
+  }
+  madvise(map, map_len, MADV_SEQUENTIAL);
+  size_t records = 0;
+  bool selected = false;
+  char last_stamp[26] = "";
+  time_t last_time = 0;
+  const char * cursor = map + (start - map_start);
+  const char * limit = map + map_len;
+  while(cursor < limit) {
+    const char * newline = memchr(cursor, '\n', limit - cursor);
+    const char * next = newline != NULL ? newline + 1 : limit;
+    time_t time;
+    /* Lines without a header continue the previous record. */
+    if(log_index_line_time(cursor, next - cursor, &time, last_stamp,
+			   &last_time)) {
+      selected = time >= from && time <= to;
+      if(selected) ++records;
+    }
+    if(selected) fwrite(cursor, sizeof(char), next - cursor, out);
+    cursor = next;
+  }
+  munmap(map, map_len);
+  return records;
+}
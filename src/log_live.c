@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * Identifies a live ring ("LOGLIVE1").
+ */
+#define LOG_LIVE_MAGIC "LOGLIVE1"
+
+/**
+ * The size of a slot, including its header. Longer records are cut short.
+ */
+#define LOG_LIVE_SLOT_SIZE 512
+
+/**
+ * The header of the segment of a live ring, followed by its slots.
+ */
+struct LogLiveHeader {
+  char magic[8];
+  uint32_t slot_count;               /**< A power of two. */
+  uint32_t slot_size;
+  int32_t pid;
+  int32_t level;
+  alignas(64) _Atomic uint64_t head; /**< The sequence number of the next
+					  record. */
+};
+
+/**
+ * A slot of a live ring. Its stamp is 2 * sequence + 1 while its record is
+ * written and 2 * sequence + 2 once it is complete, so a reader can tell a
+ * record it may read from one being written or already overwritten. Stamps
+ * only move forward, even when a writer falls a whole ring behind.
+ */
+struct LogLiveSlot {
+  _Atomic uint64_t stamp;
+  uint32_t len;
+  int32_t level;
+  char data[];
+};
+
+_Atomic int log_live_level = -1;
+
+/**
+ * The ring of this process. Replaced rings stay mapped, since other threads
+ * may still be writing to them.
+ */
+static _Atomic(struct LogLiveHeader *) log_live_ring = NULL;
+static pthread_mutex_t log_live_lock = PTHREAD_MUTEX_INITIALIZER;
+static char log_live_name[256] = "";
+static pid_t log_live_owner = 0; /**< The process that created the ring. */
+static bool log_live_registered = false;
+
+/**
+ * A reader of a live ring (see log_live_attach()).
+ */
+struct LogLive {
+  const struct LogLiveHeader * ring;
+  size_t size;
+  uint64_t cursor; /**< The sequence number of the next record to read. */
+};
+
+static struct LogLiveSlot * log_live_slot(const struct LogLiveHeader * ring,
+					  uint64_t sequence) {
+  size_t index = sequence & (ring->slot_count - 1);
+  return (struct LogLiveSlot *) ((char *) (ring + 1)
+				 + index * ring->slot_size);
+}
+
+/**
+ * Removes the name of the ring, unless it was inherited across fork() and so
+ * belongs to the parent. log_live_lock must be held.
+ */
+static void log_live_unlink(void) {
+  if(log_live_name[0] != '\0' && log_live_owner == getpid())
+    shm_unlink(log_live_name);
+  log_live_name[0] = '\0';
+}
+
+/**
+ * Removes the name of the ring of this process when it exits.
+ */
+static void log_live_exit(void) {
+  pthread_mutex_lock(&log_live_lock);
+  log_live_unlink();
+  pthread_mutex_unlock(&log_live_lock);
+}
+
+void log_set_live(const char * name, size_t slots, log_t level) {
+  pthread_mutex_lock(&log_live_lock);
+  atomic_store(&log_live_level, -1);
+  atomic_store_explicit(&log_live_ring, NULL, memory_order_release);
+  log_live_unlink();
+  if(name == NULL || slots == 0) {
+    pthread_mutex_unlock(&log_live_lock);
+    return;
+  }
+  size_t slot_count = 1;
+  while(slot_count < slots && slot_count < ((size_t) 1 << 24))
+    slot_count <<= 1;
+  size_t size = sizeof(struct LogLiveHeader)
+    + slot_count * LOG_LIVE_SLOT_SIZE;
+  snprintf(log_live_name, sizeof(log_live_name), "%s%s",
+	   name[0] == '/' ? "" : "/", name);
+  int fd = shm_open(log_live_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  struct LogLiveHeader * ring = MAP_FAILED;
+  if(fd >= 0 && ftruncate(fd, size) == 0)
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int error = errno;
+  if(fd >= 0) close(fd);
+  if(ring == MAP_FAILED) {
+    if(fd >= 0) shm_unlink(log_live_name);
+    log_live_name[0] = '\0';
+    pthread_mutex_unlock(&log_live_lock);
+    log_error("I could not create the live ring %s with error %d.", name,
+	      error);
+    return;
+  }
+  ring->slot_count = slot_count;
+  ring->slot_size = LOG_LIVE_SLOT_SIZE;
+  ring->pid = log_live_owner = getpid();
+  ring->level = level;
+  atomic_store(&ring->head, 0);
+  memcpy(ring->magic, LOG_LIVE_MAGIC, sizeof(ring->magic));
+  if(!log_live_registered) {
+    atexit(log_live_exit);
+    log_live_registered = true;
+  }
+  atomic_store_explicit(&log_live_ring, ring, memory_order_release);
+  atomic_store(&log_live_level, level);
+  pthread_mutex_unlock(&log_live_lock);
+}
+
+void log_live_append(const log_t level, const char * record, size_t len) {
+  struct LogLiveHeader * ring =
+    atomic_load_explicit(&log_live_ring, memory_order_acquire);
+  if(ring == NULL) return;
+  uint64_t sequence = atomic_fetch_add_explicit(&ring->head, 1,
+						memory_order_relaxed);
+  struct LogLiveSlot * slot = log_live_slot(ring, sequence);
+  uint64_t stamp = atomic_load_explicit(&slot->stamp, memory_order_relaxed);
+  do {
+    /* A writer a ring ahead already has the slot, so this record is lost. */
+    if(stamp >= 2 * sequence + 1) return;
+  } while(!atomic_compare_exchange_weak_explicit(&slot->stamp, &stamp,
+						 2 * sequence + 1,
+						 memory_order_relaxed,
+						 memory_order_relaxed));
+  atomic_thread_fence(memory_order_release);
+  size_t room = ring->slot_size - sizeof(struct LogLiveSlot);
+  if(len > room) {
+    memcpy(slot->data, record, room - 1);
+    slot->data[room - 1] = '\n';
+    len = room;
+  } else {
+    memcpy(slot->data, record, len);
+  }
+  slot->len = len;
+  slot->level = level;
+  stamp = 2 * sequence + 1;
+  if(atomic_compare_exchange_strong_explicit(&slot->stamp, &stamp,
+					     2 * sequence + 2,
+					     memory_order_release,
+					     memory_order_relaxed))
+    return;
+  /*
+   * A writer a ring ahead started on the slot while this one wrote to it, so
+   * its record may be mixed with this one: mark it overwritten by moving the
+   * stamp on to a later record being written.
+   */
+  while(!atomic_compare_exchange_weak_explicit(&slot->stamp, &stamp,
+					       stamp + 1 + (stamp & 1),
+					       memory_order_release,
+					       memory_order_relaxed));
+}
+
+void log_live_submit(const struct LogRecord * fields, va_list args) {
+  char record[LOG_LIVE_SLOT_SIZE];
+  size_t len = log_render_record(record, sizeof(record), fields, args);
+  log_live_append(fields->level, record,
+		  len < sizeof(record) ? len : sizeof(record));
+}
+
+void log_live_submit_message(const struct LogRecord * fields, ...) {
+  va_list args;
+  va_start(args, fields);
+  log_live_submit(fields, args);
+  va_end(args);
+}
+
+struct LogLive * log_live_attach(const char * name, size_t backlog) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+  int fd = shm_open(path, O_RDONLY, 0);
+  struct stat stats;
+  if(fd < 0 || fstat(fd, &stats) != 0) {
+    log_error("I could not open the live ring %s with error %d.", name,
+	      errno);
+    if(fd >= 0) close(fd);
+    return NULL;
+  }
+  size_t size = stats.st_size;
+  const struct LogLiveHeader * ring = MAP_FAILED;
+  if(size >= sizeof(struct LogLiveHeader))
+    ring = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(ring == MAP_FAILED || memcmp(ring->magic, LOG_LIVE_MAGIC, 8) != 0
+     || size < sizeof(struct LogLiveHeader)
+     + (size_t) ring->slot_count * ring->slot_size) {
+    if(ring != MAP_FAILED) munmap((void *) ring, size);
+    log_error("%s is not a live log ring.", name);
+    return NULL;
+  }
+  struct LogLive * live = malloc(sizeof(struct LogLive));
+  if(live == NULL) {
+    munmap((void *) ring, size);
+    return NULL;
+  }
+  live->ring = ring;
+  live->size = size;
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if(backlog > ring->slot_count) backlog = ring->slot_count;
+  live->cursor = head > backlog ? head - backlog : 0;
+  return live;
+}
+
+size_t log_live_read(struct LogLive * live, log_t level, FILE * out,
+		     size_t * lost) {
+  const struct LogLiveHeader * ring = live->ring;
+  size_t room = ring->slot_size - sizeof(struct LogLiveSlot);
+  char record[LOG_LIVE_SLOT_SIZE];
+  size_t read = 0, skipped = 0;
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  /* Records more than a ring behind have been overwritten. */
+  if(head - live->cursor > ring->slot_count) {
+    skipped += head - ring->slot_count - live->cursor;
+    live->cursor = head - ring->slot_count;
+  }
+  for(; live->cursor < head; ++live->cursor) {
+    const struct LogLiveSlot * slot = log_live_slot(ring, live->cursor);
+    uint64_t expected = 2 * live->cursor + 2;
+    uint64_t stamp = atomic_load_explicit(&slot->stamp, memory_order_acquire);
+    if(stamp < expected) break; /* Still being written; read it next time. */
+    if(stamp == expected) {
+      size_t len = slot->len < room ? slot->len : room;
+      int record_level = slot->level;
+      memcpy(record, slot->data, len);
+      atomic_thread_fence(memory_order_acquire);
+      /* The record was not overwritten while it was copied. */
+      if(atomic_load_explicit(&slot->stamp, memory_order_relaxed) == stamp) {
+	if(record_level <= (int) level) {
+	  fwrite(record, 1, len, out);
+	  ++read;
+	}
+	continue;
+      }
+    }
+    ++skipped;
+  }
+  if(lost != NULL) *lost = skipped;
+  return read;
+}
+
+void log_live_detach(struct LogLive * live) {
+  if(live == NULL) return;
+  munmap((void *) live->ring, live->size);
+  free(live);
+}
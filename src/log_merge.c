@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The number of records gathered for each call to writev().
+ */
+#define LOG_MERGE_IOV 1024
+
+/**
+ * A mapped file being merged, and its next record.
+ */
+struct LogMergeSource {
+  size_t index;             /**< The position of the file in the arguments. */
+  char * map;
+  size_t size;
+  bool blocks;              /**< The file was written in blocks. */
+  struct LogBlockCursor cursor;
+  const char * next;        /**< The rest of the current segment. */
+  const char * limit;
+  const char * record;      /**< The next record, NULL at the end. */
+  size_t record_len;
+  struct timespec time;     /**< The timestamp of the next record. */
+  char last_stamp[25];      /**< The last timestamp converted, to the second. */
+  time_t last_sec;
+};
+
+/**
+ * The records gathered for writev().
+ */
+struct LogMergeOutput {
+  int fd;
+  int count;
+  struct iovec iov[LOG_MERGE_IOV];
+};
+
+/**
+ * Reads the timestamp of a line if it starts with a header, converting only
+ * timestamps that differ from the last one to the second (mktime() is
+ * comparatively slow).
+ */
+static bool log_merge_line_time(struct LogMergeSource * source,
+				const char * line, size_t len,
+				struct timespec * time) {
+  long nsec;
+  if(log_header_layout(line, len, &nsec, NULL) == 0) return false;
+  if(memcmp(line, source->last_stamp, sizeof(source->last_stamp)) == 0) {
+    time->tv_sec = source->last_sec;
+    time->tv_nsec = nsec;
+    return true;
+  }
+  if(log_parse_header(line, len, time, NULL) == 0) return false;
+  memcpy(source->last_stamp, line, sizeof(source->last_stamp));
+  source->last_sec = time->tv_sec;
+  return true;
+}
+
+/**
+ * Moves a source to its next record, which is a header line and the lines
+ * without a header that follow it. Text before the first header of a
+ * segment makes a record of its own, with the time of the record before it.
+ * \return false at the end of the file.
+ */
+static bool log_merge_advance(struct LogMergeSource * source) {
+  while(source->next >= source->limit) {
+    const char * payload;
+    size_t len;
+    if(!source->blocks || !log_block_next(&source->cursor, &payload, &len)) {
+      source->record = NULL;
+      return false;
+    }
+    source->next = payload;
+    source->limit = payload + len;
+  }
+  const char * start = source->next;
+  const char * limit = source->limit;
+  log_merge_line_time(source, start, limit - start, &source->time);
+  const char * cursor = start;
+  struct timespec time;
+  do {
+    const char * newline = memchr(cursor, '\n', limit - cursor);
+    cursor = newline != NULL ? newline + 1 : limit;
+  } while(cursor < limit
+	  && (*cursor != '['
+	      || !log_merge_line_time(source, cursor, limit - cursor, &time)));
+  source->record = start;
+  source->record_len = cursor - start;
+  source->next = cursor;
+  return true;
+}
+
+/**
+ * Returns whether the next record of a comes before that of b.
+ */
+static inline bool log_merge_before(const struct LogMergeSource * a,
+				    const struct LogMergeSource * b) {
+  if(a->time.tv_sec != b->time.tv_sec) return a->time.tv_sec < b->time.tv_sec;
+  if(a->time.tv_nsec != b->time.tv_nsec)
+    return a->time.tv_nsec < b->time.tv_nsec;
+  return a->index < b->index;
+}
+
+/**
+ * Moves the source at position i of the heap down to its place.
+ */
+static void log_merge_sift_down(struct LogMergeSource ** heap, size_t count,
+				size_t i) {
+  struct LogMergeSource * source = heap[i];
+  for(size_t child; (child = 2 * i + 1) < count; i = child) {
+    if(child + 1 < count && log_merge_before(heap[child + 1], heap[child]))
+      ++child;
+    if(!log_merge_before(heap[child], source)) break;
+    heap[i] = heap[child];
+  }
+  heap[i] = source;
+}
+
+/**
+ * Writes the gathered records.
+ * \return false if they could not be written.
+ */
+static bool log_merge_flush(struct LogMergeOutput * output) {
+  struct iovec * iov = output->iov;
+  int count = output->count;
+  output->count = 0;
+  while(count > 0) {
+    ssize_t written = writev(output->fd, iov, count);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      log_error("I could not write the merged records with error %d.",
+		errno);
+      return false;
+    }
+    /* Skip what was written and retry the rest. */
+    for(; count > 0 && (size_t) written >= iov->iov_len; ++iov, --count)
+      written -= iov->iov_len;
+    if(count > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+/**
+ * Gathers a record, extending the last one gathered if it ends where the
+ * record starts.
+ */
+static bool log_merge_gather(struct LogMergeOutput * output,
+			     const char * record, size_t len) {
+  if(output->count > 0) {
+    struct iovec * last = &output->iov[output->count - 1];
+    if((const char *) last->iov_base + last->iov_len == record) {
+      last->iov_len += len;
+      return true;
+    }
+  }
+  if(output->count == LOG_MERGE_IOV && !log_merge_flush(output)) return false;
+  output->iov[output->count].iov_base = (void *) record;
+  output->iov[output->count].iov_len = len;
+  ++output->count;
+  return true;
+}
+
+long long log_merge(const char * const * filenames, size_t count, FILE * out,
+		    size_t * corrupt) {
+  if(corrupt != NULL) *corrupt = 0;
+  if(count == 0) return 0;
+  struct LogMergeSource * sources = calloc(count,
+					   sizeof(struct LogMergeSource));
+  struct LogMergeSource ** heap = calloc(count,
+					 sizeof(struct LogMergeSource *));
+  struct LogMergeOutput * output = malloc(sizeof(struct LogMergeOutput));
+  long long records = -1;
+  size_t opened = 0, heap_count = 0;
+  if(sources == NULL || heap == NULL || output == NULL) goto done;
+  for(; opened < count; ++opened) {
+    struct LogMergeSource * source = &sources[opened];
+    source->index = opened;
+    int fd = open(filenames[opened], O_RDONLY);
+    struct stat stats;
+    if(fd < 0 || fstat(fd, &stats) != 0) {
+      log_error("I could not open %s with error %d.", filenames[opened],
+		errno);
+      if(fd >= 0) close(fd);
+      goto done;
+    }
+    source->size = stats.st_size;
+    if(source->size > 0) {
+      source->map = mmap(NULL, source->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(source->map == MAP_FAILED) {
+	log_error("I could not map %s with error %d.", filenames[opened],
+		  errno);
+	source->map = NULL;
+	close(fd);
+	goto done;
+      }
+      madvise(source->map, source->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    source->blocks = log_block_is_file(source->map, source->size);
+    if(source->blocks) {
+      log_block_cursor_init(&source->cursor, source->map, source->size);
+    } else {
+      source->next = source->map;
+      source->limit = source->map + source->size;
+    }
+    if(log_merge_advance(source)) heap[heap_count++] = source;
+  }
+  for(size_t i = heap_count; i-- > 0;)
+    log_merge_sift_down(heap, heap_count, i);
+  fflush(out);
+  output->fd = fileno(out);
+  output->count = 0;
+  records = 0;
+  while(heap_count > 0) {
+    struct LogMergeSource * source = heap[0];
+    if(!log_merge_gather(output, source->record, source->record_len)) {
+      records = -1;
+      goto done;
+    }
+    ++records;
+    if(!log_merge_advance(source)) heap[0] = heap[--heap_count];
+    log_merge_sift_down(heap, heap_count, 0);
+  }
+  if(!log_merge_flush(output)) records = -1;
+ done:
+  for(size_t i = 0; i < opened && sources != NULL; ++i) {
+    if(sources[i].blocks && corrupt != NULL)
+      *corrupt += sources[i].cursor.skipped;
+    if(sources[i].map != NULL) munmap(sources[i].map, sources[i].size);
+  }
+  free(sources);
+  free(heap);
+  free(output);
+  return records;
+}
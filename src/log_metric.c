@@ -0,0 +1,406 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The number of metrics that can be registered.
+ */
+#define LOG_METRICS 64
+
+/**
+ * The longest metric name kept, including its terminator. Longer names are
+ * cut short.
+ */
+#define LOG_METRIC_NAME_SIZE 48
+
+/**
+ * Histograms have LOG_METRIC_SUB buckets per power of two, from
+ * 2^LOG_METRIC_MIN_EXPONENT up, so a quantile is within about 6% of the true
+ * value. Bucket 0 holds values that are not positive.
+ */
+#define LOG_METRIC_BUCKETS 512
+#define LOG_METRIC_SUB 8
+#define LOG_METRIC_MIN_EXPONENT -8
+
+/**
+ * The interval between summaries unless log_set_metric_interval() is
+ * called (in nanoseconds).
+ */
+#define LOG_METRIC_INTERVAL_NS 10000000000ULL
+
+enum {
+  LOG_METRIC_COUNTER,
+  LOG_METRIC_HISTOGRAM
+};
+
+/**
+ * The totals of a metric kept by one thread, which is their only writer.
+ * They only grow, so summaries report the difference from the last one.
+ */
+struct LogMetricCells {
+  _Atomic int64_t count; /**< The sum of the deltas, or the values observed. */
+  _Atomic double sum;
+  _Atomic uint64_t buckets[]; /**< Histograms only. */
+};
+
+/**
+ * The cells of a thread. A block is handed to another thread when its
+ * thread exits, and its totals carry on.
+ */
+struct LogMetricThread {
+  struct LogMetricThread * next;
+  _Atomic bool in_use;
+  _Atomic(struct LogMetricCells *) cells[LOG_METRICS];
+};
+
+struct LogMetric {
+  char name[LOG_METRIC_NAME_SIZE];
+  int kind;
+  /* The totals at the last summary. */
+  int64_t last_count;
+  double last_sum;
+  uint64_t last_buckets[LOG_METRIC_BUCKETS];
+};
+
+static struct {
+  pthread_mutex_t lock; /**< Taken to register a metric and to summarize. */
+  struct LogMetric metrics[LOG_METRICS];
+  _Atomic int count;
+  _Atomic(struct LogMetricThread *) threads;
+  _Atomic uint64_t interval_ns;
+  _Atomic uint64_t deadline_ns; /**< When the next summary is due, or 0. */
+  uint64_t summary_ns;          /**< When the last summary was made. */
+  bool full;                    /**< A metric could not be registered. */
+} log_metric = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .interval_ns = LOG_METRIC_INTERVAL_NS
+};
+
+static __thread struct LogMetricThread * log_metric_thread = NULL;
+
+/**
+ * The metric indices of the names this thread used last, by address.
+ */
+static __thread struct {
+  const char * name;
+  int index;
+} log_metric_names[64];
+
+static pthread_once_t log_metric_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_metric_key;
+
+/**
+ * Returns the current value of the coarse monotonic clock in nanoseconds,
+ * which is cheap enough to read on every update.
+ */
+static uint64_t log_metric_now_ns(void) {
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Returns the histogram bucket of a value from the bits of its exponent and
+ * the top bits of its mantissa.
+ */
+static int log_metric_bucket(double value) {
+  if(!(value > 0)) return 0;
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int exponent = (int) ((bits >> 52) & 0x7ff) - 1023;
+  int sub = (bits >> 49) & (LOG_METRIC_SUB - 1);
+  int index = 1 + (exponent - LOG_METRIC_MIN_EXPONENT) * LOG_METRIC_SUB + sub;
+  if(index < 1) return 1;
+  return index < LOG_METRIC_BUCKETS ? index : LOG_METRIC_BUCKETS - 1;
+}
+
+/**
+ * Returns the middle of the values of a bucket.
+ */
+static double log_metric_bucket_value(int index) {
+  if(index == 0) return 0;
+  int exponent = (index - 1) / LOG_METRIC_SUB + LOG_METRIC_MIN_EXPONENT;
+  int sub = (index - 1) % LOG_METRIC_SUB;
+  uint64_t bits = (uint64_t) (exponent + 1023) << 52;
+  double power;
+  memcpy(&power, &bits, sizeof(power));
+  return power * (1 + (sub + 0.5) / LOG_METRIC_SUB);
+}
+
+/**
+ * Hands the block of an exiting thread to the next thread that needs one.
+ */
+static void log_metric_release(void * argument) {
+  struct LogMetricThread * block = argument;
+  atomic_store_explicit(&block->in_use, false, memory_order_release);
+}
+
+static void log_metric_setup(void) {
+  pthread_key_create(&log_metric_key, log_metric_release);
+}
+
+/**
+ * Returns the block of the calling thread, taking a released one or
+ * allocating a new one the first time.
+ */
+static struct LogMetricThread * log_metric_block(void) {
+  if(log_metric_thread != NULL) return log_metric_thread;
+  struct LogMetricThread * block =
+    atomic_load_explicit(&log_metric.threads, memory_order_acquire);
+  for(; block != NULL; block = block->next) {
+    bool in_use = false;
+    if(atomic_compare_exchange_strong(&block->in_use, &in_use, true)) break;
+  }
+  if(block == NULL) {
+#ifdef LOG_STATIC_MEMORY
+    block = log_arena_alloc(sizeof(struct LogMetricThread));
+#else
+    block = calloc(1, sizeof(struct LogMetricThread));
+#endif
+    if(block == NULL) return NULL;
+    atomic_store(&block->in_use, true);
+    block->next = atomic_load(&log_metric.threads);
+    while(!atomic_compare_exchange_weak(&log_metric.threads, &block->next,
+					block))
+      ;
+  }
+  pthread_once(&log_metric_once, log_metric_setup);
+  pthread_setspecific(log_metric_key, block);
+  log_metric_thread = block;
+  return block;
+}
+
+static void log_metric_exit(void) {
+  log_metric_flush();
+}
+
+/**
+ * Finds a registered metric by name.
+ * \return Its index, or -1.
+ */
+static int log_metric_find(const char * name, int count) {
+  for(int i = 0; i < count; ++i)
+    if(strncmp(log_metric.metrics[i].name, name,
+	       LOG_METRIC_NAME_SIZE - 1) == 0)
+      return i;
+  return -1;
+}
+
+/**
+ * Returns the index of a metric, registering it the first time.
+ * \return The index, or -1 if the metric has another kind or there are too
+ * many metrics.
+ */
+static int log_metric_index(const char * name, int kind) {
+  size_t slot = ((uintptr_t) name >> 3) & 63;
+  int index;
+  if(log_metric_names[slot].name == name) {
+    index = log_metric_names[slot].index;
+  } else {
+    index = log_metric_find(name, atomic_load_explicit(&log_metric.count,
+						       memory_order_acquire));
+    if(index < 0) {
+      pthread_mutex_lock(&log_metric.lock);
+      int count = atomic_load(&log_metric.count);
+      index = log_metric_find(name, count);
+      if(index < 0 && count < LOG_METRICS) {
+	struct LogMetric * metric = &log_metric.metrics[count];
+	strncpy(metric->name, name, LOG_METRIC_NAME_SIZE - 1);
+	metric->kind = kind;
+	index = count;
+	atomic_store_explicit(&log_metric.count, count + 1,
+			      memory_order_release);
+	if(log_metric.summary_ns == 0) {
+	  /* The first interval starts with the first metric. */
+	  atexit(log_metric_exit);
+	  uint64_t now = log_metric_now_ns();
+	  uint64_t interval = atomic_load(&log_metric.interval_ns);
+	  log_metric.summary_ns = now;
+	  if(interval > 0) atomic_store(&log_metric.deadline_ns, now + interval);
+	}
+      }
+      bool warn = index < 0 && !log_metric.full;
+      log_metric.full |= index < 0;
+      pthread_mutex_unlock(&log_metric.lock);
+      if(warn)
+	log_warning("I could not register the metric %s, since there are "
+		    "already %d metrics.", name, LOG_METRICS);
+      if(index < 0) return -1;
+    }
+    log_metric_names[slot].name = name;
+    log_metric_names[slot].index = index;
+  }
+  return log_metric.metrics[index].kind == kind ? index : -1;
+}
+
+/**
+ * Returns the cells of a metric for the calling thread, allocating them the
+ * first time.
+ */
+static struct LogMetricCells * log_metric_cells(int index, int kind) {
+  struct LogMetricThread * block = log_metric_block();
+  if(block == NULL) return NULL;
+  struct LogMetricCells * cells =
+    atomic_load_explicit(&block->cells[index], memory_order_relaxed);
+  if(cells != NULL) return cells;
+  size_t size = sizeof(struct LogMetricCells);
+  if(kind == LOG_METRIC_HISTOGRAM)
+    size += LOG_METRIC_BUCKETS * sizeof(_Atomic uint64_t);
+#ifdef LOG_STATIC_MEMORY
+  cells = log_arena_alloc(size);
+#else
+  cells = calloc(1, size);
+#endif
+  if(cells != NULL)
+    atomic_store_explicit(&block->cells[index], cells, memory_order_release);
+  return cells;
+}
+
+/**
+ * Writes a summary if one is due, from the first thread to notice.
+ */
+static void log_metric_tick(void) {
+  uint64_t deadline = atomic_load_explicit(&log_metric.deadline_ns,
+					   memory_order_relaxed);
+  if(deadline == 0) return;
+  uint64_t now = log_metric_now_ns();
+  if(now < deadline) return;
+  uint64_t interval = atomic_load(&log_metric.interval_ns);
+  if(interval > 0
+     && atomic_compare_exchange_strong(&log_metric.deadline_ns, &deadline,
+				       now + interval))
+    log_metric_flush();
+}
+
+void log_metric_count(const char * name, long long delta) {
+  int index = log_metric_index(name, LOG_METRIC_COUNTER);
+  if(index < 0) return;
+  struct LogMetricCells * cells = log_metric_cells(index, LOG_METRIC_COUNTER);
+  if(cells == NULL) return;
+  /* This thread is the only writer, so a load and a store will do. */
+  atomic_store_explicit(&cells->count,
+			atomic_load_explicit(&cells->count,
+					     memory_order_relaxed) + delta,
+			memory_order_relaxed);
+  log_metric_tick();
+}
+
+void log_metric_observe(const char * name, double value) {
+  int index = log_metric_index(name, LOG_METRIC_HISTOGRAM);
+  if(index < 0) return;
+  struct LogMetricCells * cells =
+    log_metric_cells(index, LOG_METRIC_HISTOGRAM);
+  if(cells == NULL) return;
+  _Atomic uint64_t * bucket = &cells->buckets[log_metric_bucket(value)];
+  atomic_store_explicit(bucket,
+			atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+  atomic_store_explicit(&cells->sum,
+			atomic_load_explicit(&cells->sum,
+					     memory_order_relaxed) + value,
+			memory_order_relaxed);
+  atomic_store_explicit(&cells->count,
+			atomic_load_explicit(&cells->count,
+					     memory_order_relaxed) + 1,
+			memory_order_relaxed);
+  log_metric_tick();
+}
+
+/**
+ * Returns the value below which a fraction of the values of a histogram
+ * fall.
+ */
+static double log_metric_quantile(const uint64_t * buckets, uint64_t count,
+				  double fraction) {
+  uint64_t rank = (uint64_t) (fraction * count);
+  if(rank < 1) rank = 1;
+  uint64_t seen = 0;
+  for(int i = 0; i < LOG_METRIC_BUCKETS; ++i)
+    if((seen += buckets[i]) >= rank) return log_metric_bucket_value(i);
+  return log_metric_bucket_value(LOG_METRIC_BUCKETS - 1);
+}
+
+/**
+ * Writes the summary of a metric for the values added since the last one.
+ * The metrics must be locked.
+ */
+static void log_metric_summarize(struct LogMetric * metric, int index,
+				 double seconds) {
+  int64_t count = 0;
+  double sum = 0;
+  uint64_t buckets[LOG_METRIC_BUCKETS];
+  bool histogram = metric->kind == LOG_METRIC_HISTOGRAM;
+  if(histogram) memset(buckets, 0, sizeof(buckets));
+  for(struct LogMetricThread * block = atomic_load(&log_metric.threads);
+      block != NULL; block = block->next) {
+    struct LogMetricCells * cells =
+      atomic_load_explicit(&block->cells[index], memory_order_acquire);
+    if(cells == NULL) continue;
+    count += atomic_load_explicit(&cells->count, memory_order_relaxed);
+    sum += atomic_load_explicit(&cells->sum, memory_order_relaxed);
+    for(int i = 0; histogram && i < LOG_METRIC_BUCKETS; ++i)
+      buckets[i] += atomic_load_explicit(&cells->buckets[i],
+					 memory_order_relaxed);
+  }
+  int64_t new_count = count - metric->last_count;
+  metric->last_count = count;
+  if(!histogram) {
+    if(new_count != 0)
+      log_info("Metric %s: %lld in %.1f s (%.1f/s).", metric->name,
+	       (long long) new_count, seconds, new_count / seconds);
+    return;
+  }
+  double new_sum = sum - metric->last_sum;
+  metric->last_sum = sum;
+  uint64_t total = 0;
+  int last = 0;
+  for(int i = 0; i < LOG_METRIC_BUCKETS; ++i) {
+    uint64_t added = buckets[i] - metric->last_buckets[i];
+    metric->last_buckets[i] = buckets[i];
+    buckets[i] = added;
+    total += added;
+    if(added > 0) last = i;
+  }
+  if(total == 0) return;
+  log_info("Metric %s: %llu values in %.1f s, mean %.4g, p50 %.3g, p90 %.3g, "
+	   "p99 %.3g, max %.3g.", metric->name, (unsigned long long) total,
+	   seconds, new_sum / total, log_metric_quantile(buckets, total, 0.5),
+	   log_metric_quantile(buckets, total, 0.9),
+	   log_metric_quantile(buckets, total, 0.99),
+	   log_metric_bucket_value(last));
+}
+
+void log_metric_flush(void) {
+  pthread_mutex_lock(&log_metric.lock);
+  uint64_t now = log_metric_now_ns();
+  double seconds = (now - log_metric.summary_ns) / 1e9;
+  if(seconds <= 0) seconds = 1e-9;
+  log_metric.summary_ns = now;
+  int count = atomic_load(&log_metric.count);
+  for(int i = 0; i < count; ++i)
+    log_metric_summarize(&log_metric.metrics[i], i, seconds);
+  pthread_mutex_unlock(&log_metric.lock);
+}
+
+void log_set_metric_interval(unsigned seconds) {
+  uint64_t interval = seconds * 1000000000ULL;
+  atomic_store(&log_metric.interval_ns, interval);
+  pthread_mutex_lock(&log_metric.lock);
+  /* Before the first metric, the interval starts when it is registered. */
+  if(log_metric.summary_ns != 0)
+    atomic_store(&log_metric.deadline_ns, interval > 0 ?
+		 log_metric_now_ns() + interval : 0);
+  pthread_mutex_unlock(&log_metric.lock);
+}
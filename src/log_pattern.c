@@ -0,0 +1,438 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The operations of a compiled pattern.
+ */
+enum LogPatternOp {
+  LOG_OP_TEXT,       /**< Literal text from the pattern. */
+  LOG_OP_MESSAGE,    /**< %M */
+  LOG_OP_LEVEL,      /**< %L */
+  LOG_OP_DATETIME,   /**< %D */
+  LOG_OP_DATE,       /**< %d */
+  LOG_OP_TIME,       /**< %T */
+  LOG_OP_MILLIS,     /**< %ms */
+  LOG_OP_MICROS,     /**< %us */
+  LOG_OP_NANOS,      /**< %ns */
+  LOG_OP_EPOCH,      /**< %s */
+  LOG_OP_TID,        /**< %tid */
+  LOG_OP_THREAD,     /**< %tname */
+  LOG_OP_PID,        /**< %pid */
+  LOG_OP_FILE,       /**< %F */
+  LOG_OP_LINE,       /**< %N */
+  LOG_OP_FUNCTION,   /**< %fn */
+  LOG_OP_SITE,       /**< %site */
+  LOG_OP_CONTEXT     /**< %X */
+};
+
+/**
+ * One operation of a compiled pattern. Literal text is a slice of the
+ * pattern's text pool.
+ */
+struct LogPatternStep {
+  uint32_t op;
+  uint32_t offset;
+  uint32_t len;
+};
+
+struct LogPattern {
+  size_t count;
+  const struct LogPatternStep * steps;
+  const char * text;
+  bool needs_time; /**< Whether any operation shows the time. */
+  bool needs_site; /**< Whether any operation shows the call site. */
+  struct LogPattern * retired; /**< See log_pattern_retire(). */
+};
+
+/**
+ * The directives of the pattern language. Longer names must come before
+ * their prefixes.
+ */
+static const struct {
+  const char * name;
+  size_t len;
+  enum LogPatternOp op;
+} log_pattern_directives[] = {
+  { "tname", 5, LOG_OP_THREAD },
+  { "site", 4, LOG_OP_SITE },
+  { "tid", 3, LOG_OP_TID },
+  { "pid", 3, LOG_OP_PID },
+  { "ms", 2, LOG_OP_MILLIS },
+  { "us", 2, LOG_OP_MICROS },
+  { "ns", 2, LOG_OP_NANOS },
+  { "fn", 2, LOG_OP_FUNCTION },
+  { "M", 1, LOG_OP_MESSAGE },
+  { "L", 1, LOG_OP_LEVEL },
+  { "D", 1, LOG_OP_DATETIME },
+  { "d", 1, LOG_OP_DATE },
+  { "T", 1, LOG_OP_TIME },
+  { "s", 1, LOG_OP_EPOCH },
+  { "F", 1, LOG_OP_FILE },
+  { "N", 1, LOG_OP_LINE },
+  { "X", 1, LOG_OP_CONTEXT }
+};
+
+/**
+ * "[%D] %L: %X%M", the header that log_parse_header() reads followed by the
+ * context fields, if any, and the message.
+ */
+static const struct LogPatternStep log_default_steps[] = {
+  { LOG_OP_TEXT, 0, 1 },
+  { LOG_OP_DATETIME, 0, 0 },
+  { LOG_OP_TEXT, 1, 2 },
+  { LOG_OP_LEVEL, 0, 0 },
+  { LOG_OP_TEXT, 3, 2 },
+  { LOG_OP_CONTEXT, 0, 0 },
+  { LOG_OP_MESSAGE, 0, 0 }
+};
+
+const struct LogPattern log_default_pattern = {
+  .count = sizeof(log_default_steps) / sizeof(log_default_steps[0]),
+  .steps = log_default_steps,
+  .text = "[] : ",
+  .needs_time = true,
+  .needs_site = false,
+  .retired = NULL
+};
+
+struct LogPattern * log_pattern_compile(const char * pattern,
+					size_t * error_offset) {
+  /* One step per character is more than enough. */
+  size_t pattern_len = strlen(pattern);
+  struct LogPattern * compiled =
+    malloc(sizeof(struct LogPattern)
+	   + pattern_len * sizeof(struct LogPatternStep) + pattern_len + 1);
+  if(compiled == NULL) {
+    *error_offset = 0;
+    return NULL;
+  }
+  struct LogPatternStep * steps = (struct LogPatternStep *) (compiled + 1);
+  char * text = (char *) (steps + pattern_len);
+  size_t count = 0, text_len = 0;
+  bool has_message = false, needs_time = false, needs_site = false;
+  for(const char * p = pattern; *p != '\0';) {
+    if(p[0] != '%' || p[1] == '%') {
+      /* Literal text, merged with the text before it. */
+      if(count == 0 || steps[count - 1].op != LOG_OP_TEXT)
+	steps[count++] = (struct LogPatternStep) { LOG_OP_TEXT, text_len, 0 };
+      text[text_len++] = *p;
+      ++steps[count - 1].len;
+      p += p[0] == '%' ? 2 : 1;
+      continue;
+    }
+    size_t d = 0, num_directives =
+      sizeof(log_pattern_directives) / sizeof(log_pattern_directives[0]);
+    while(d < num_directives
+	  && strncmp(p + 1, log_pattern_directives[d].name,
+		     log_pattern_directives[d].len) != 0)
+      ++d;
+    /* The message can only be rendered once. */
+    if(d == num_directives
+       || (log_pattern_directives[d].op == LOG_OP_MESSAGE && has_message)) {
+      *error_offset = p - pattern;
+      free(compiled);
+      return NULL;
+    }
+    enum LogPatternOp op = log_pattern_directives[d].op;
+    has_message |= op == LOG_OP_MESSAGE;
+    needs_time |= op >= LOG_OP_DATETIME && op <= LOG_OP_EPOCH;
+    needs_site |= op >= LOG_OP_FILE && op <= LOG_OP_SITE;
+    steps[count++] = (struct LogPatternStep) { op, 0, 0 };
+    p += 1 + log_pattern_directives[d].len;
+  }
+  compiled->count = count;
+  compiled->steps = steps;
+  compiled->text = text;
+  compiled->needs_time = needs_time;
+  compiled->needs_site = needs_site;
+  compiled->retired = NULL;
+  return compiled;
+}
+
+/**
+ * Patterns that have been replaced. They are kept because another thread may
+ * still be rendering a record with them.
+ */
+static struct LogPattern * log_retired_patterns = NULL;
+
+void log_pattern_retire(const struct LogPattern * pattern) {
+  if(pattern == NULL || pattern == &log_default_pattern) return;
+  struct LogPattern * retired = (struct LogPattern *) pattern;
+  retired->retired = log_retired_patterns;
+  log_retired_patterns = retired;
+}
+
+/**
+ * The wall-clock fields of the last second rendered by this thread. The
+ * strings are rendered when first needed in each second.
+ */
+struct LogTimeCache {
+  time_t second;
+  bool have_fields;
+  bool have_datetime;
+  bool have_date;
+  bool have_time;
+  struct tm fields;
+  char datetime[24];
+  char date[10];
+  char time[8];
+};
+
+static __thread struct LogTimeCache log_time_cache = { .second = -1 };
+
+static struct LogTimeCache * log_time_fields(time_t second) {
+  struct LogTimeCache * cache = &log_time_cache;
+  if(cache->second != second || !cache->have_fields) {
+    localtime_r(&second, &cache->fields);
+    cache->second = second;
+    cache->have_fields = true;
+    cache->have_datetime = cache->have_date = cache->have_time = false;
+  }
+  return cache;
+}
+
+/**
+ * The rendered record, with the semantics of snprintf() except that it is
+ * not null terminated.
+ */
+struct LogPatternOut {
+  char * buffer;
+  size_t size;
+  size_t len;
+};
+
+static inline void log_pattern_put(struct LogPatternOut * out,
+				   const char * chars, size_t n) {
+  if(out->len < out->size) {
+    size_t room = out->size - out->len;
+    memcpy(out->buffer + out->len, chars, n < room ? n : room);
+  }
+  out->len += n;
+}
+
+/**
+ * Writes value in decimal, zero padded to at least digits digits.
+ */
+static void log_pattern_put_uint(struct LogPatternOut * out, uint64_t value,
+				 int digits) {
+  char number[24];
+  char * p = number + sizeof(number);
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+    --digits;
+  } while(value > 0 || digits > 0);
+  log_pattern_put(out, p, number + sizeof(number) - p);
+}
+
+/**
+ * Returns whether a step renders the same text for every record of a call
+ * site.
+ */
+static inline bool log_pattern_site_step(const struct LogPatternStep * step) {
+  return step->op == LOG_OP_TEXT || step->op == LOG_OP_LEVEL
+    || (step->op >= LOG_OP_FILE && step->op <= LOG_OP_SITE);
+}
+
+/**
+ * Renders a step for which log_pattern_site_step() is true.
+ */
+static void log_pattern_put_site_step(struct LogPatternOut * out,
+				      const struct LogPattern * pattern,
+				      const struct LogPatternStep * step,
+				      log_t level, const struct LogSite * site) {
+  const char * name;
+  switch(step->op) {
+  case LOG_OP_TEXT:
+    log_pattern_put(out, pattern->text + step->offset, step->len);
+    break;
+  case LOG_OP_LEVEL:
+    name = log_level_str(level);
+    log_pattern_put(out, name, strlen(name));
+    break;
+  case LOG_OP_FILE:
+    if(site != NULL) log_pattern_put(out, site->file, strlen(site->file));
+    break;
+  case LOG_OP_LINE:
+    if(site != NULL) log_pattern_put_uint(out, site->line, 1);
+    break;
+  case LOG_OP_FUNCTION:
+    if(site != NULL)
+      log_pattern_put(out, site->function, strlen(site->function));
+    break;
+  case LOG_OP_SITE:
+    if(site != NULL) {
+      char id[17];
+      snprintf(id, sizeof(id), "%016llx", log_site_id(site));
+      log_pattern_put(out, id, 16);
+    }
+    break;
+  }
+}
+
+struct LogSitePrefix * log_pattern_site_prefix(
+  const struct LogPattern * pattern, const struct LogSite * site) {
+  if(!pattern->needs_site) return NULL;
+  /* Measure the runs, then render them after their lengths. */
+  size_t count = 0;
+  struct LogPatternOut out = { .buffer = NULL, .size = 0, .len = 0 };
+  for(size_t i = 0; i < pattern->count; ++i) {
+    if(!log_pattern_site_step(&pattern->steps[i])) continue;
+    if(i == 0 || !log_pattern_site_step(&pattern->steps[i - 1])) ++count;
+    log_pattern_put_site_step(&out, pattern, &pattern->steps[i], site->level,
+			      site);
+  }
+  size_t size = sizeof(struct LogSitePrefix) + count * sizeof(uint32_t)
+    + out.len;
+#ifdef LOG_STATIC_MEMORY
+  struct LogSitePrefix * prefix = log_arena_alloc(size);
+#else
+  struct LogSitePrefix * prefix = malloc(size);
+#endif
+  if(prefix == NULL) return NULL;
+  char * text = (char *) (prefix->lens + count);
+  out = (struct LogPatternOut) { .buffer = text, .size = out.len, .len = 0 };
+  size_t run = 0, start = 0;
+  for(size_t i = 0; i < pattern->count; ++i) {
+    if(!log_pattern_site_step(&pattern->steps[i])) continue;
+    log_pattern_put_site_step(&out, pattern, &pattern->steps[i], site->level,
+			      site);
+    if(i + 1 == pattern->count
+       || !log_pattern_site_step(&pattern->steps[i + 1])) {
+      prefix->lens[run++] = out.len - start;
+      start = out.len;
+    }
+  }
+  prefix->pattern = pattern;
+  prefix->older = NULL;
+  prefix->text = text;
+  prefix->count = count;
+  return prefix;
+}
+
+int log_pattern_render(const struct LogPattern * pattern, char * buffer,
+		       size_t size, const struct LogRecord * record,
+		       va_list args) {
+  struct LogPatternOut out = { .buffer = buffer, .size = size, .len = 0 };
+  struct LogTimeCache * cache;
+  const char * name;
+  /* Tick stamps are only converted if the pattern shows the time. */
+  struct timespec time = record->time;
+  if(record->ticks != 0 && pattern->needs_time)
+    log_clock_to_realtime(record->ticks, &time);
+  /* The text that depends only on the call site is rendered once per site. */
+  const struct LogSitePrefix * prefix = NULL;
+  if(pattern->needs_site && record->site != NULL)
+    prefix = log_site_prefix(record->site, pattern);
+  const char * prefix_text = prefix != NULL ? prefix->text : NULL;
+  size_t run = 0;
+  for(size_t i = 0; i < pattern->count; ++i) {
+    const struct LogPatternStep * step = &pattern->steps[i];
+    if(log_pattern_site_step(step)) {
+      if(prefix == NULL) {
+	log_pattern_put_site_step(&out, pattern, step, record->level,
+				  record->site);
+	continue;
+      }
+      log_pattern_put(&out, prefix_text, prefix->lens[run]);
+      prefix_text += prefix->lens[run++];
+      while(i + 1 < pattern->count
+	    && log_pattern_site_step(&pattern->steps[i + 1]))
+	++i;
+      continue;
+    }
+    switch(step->op) {
+    case LOG_OP_MESSAGE: {
+      if(record->format == NULL) {
+	log_pattern_put(&out, record->message, record->message_len);
+	break;
+      }
+      size_t room = out.len < size ? size - out.len : 0;
+      int len = record->packed != NULL ?
+	log_snprintf_packed(buffer + (size - room), room, record->format,
+			    record->packed) :
+	log_vsnprintf(buffer + (size - room), room, record->format, args);
+      if(len > 0) out.len += len;
+      break;
+    }
+    case LOG_OP_DATETIME:
+      cache = log_time_fields(time.tv_sec);
+      if(!cache->have_datetime) {
+	char datetime[25];
+	strftime(datetime, sizeof(datetime), "%a %d %b %Y %H:%M:%S",
+		 &cache->fields);
+	memcpy(cache->datetime, datetime, sizeof(cache->datetime));
+	cache->have_datetime = true;
+      }
+      log_pattern_put(&out, cache->datetime, sizeof(cache->datetime));
+      break;
+    case LOG_OP_DATE:
+      cache = log_time_fields(time.tv_sec);
+      if(!cache->have_date) {
+	char date[24];
+	/* The fields are bounded so that the date cannot be cut short. */
+	snprintf(date, sizeof(date), "%04u-%02u-%02u",
+		 (unsigned) (cache->fields.tm_year + 1900) % 10000,
+		 (unsigned) (cache->fields.tm_mon + 1) % 100,
+		 (unsigned) cache->fields.tm_mday % 100);
+	memcpy(cache->date, date, sizeof(cache->date));
+	cache->have_date = true;
+      }
+      log_pattern_put(&out, cache->date, sizeof(cache->date));
+      break;
+    case LOG_OP_TIME:
+      cache = log_time_fields(time.tv_sec);
+      if(!cache->have_time) {
+	char time_str[24];
+	snprintf(time_str, sizeof(time_str), "%02u:%02u:%02u",
+		 (unsigned) cache->fields.tm_hour % 100,
+		 (unsigned) cache->fields.tm_min % 100,
+		 (unsigned) cache->fields.tm_sec % 100);
+	memcpy(cache->time, time_str, sizeof(cache->time));
+	cache->have_time = true;
+      }
+      log_pattern_put(&out, cache->time, sizeof(cache->time));
+      break;
+    case LOG_OP_MILLIS:
+      log_pattern_put_uint(&out, time.tv_nsec / 1000000, 3);
+      break;
+    case LOG_OP_MICROS:
+      log_pattern_put_uint(&out, time.tv_nsec / 1000, 6);
+      break;
+    case LOG_OP_NANOS:
+      log_pattern_put_uint(&out, time.tv_nsec, 9);
+      break;
+    case LOG_OP_EPOCH:
+      log_pattern_put_uint(&out, time.tv_sec, 1);
+      break;
+    case LOG_OP_TID:
+      log_pattern_put_uint(&out, record->tid != 0 ? record->tid
+			   : log_thread_id(), 1);
+      break;
+    case LOG_OP_THREAD:
+      name = record->thread_name != NULL ? record->thread_name
+	: log_thread_name();
+      log_pattern_put(&out, name, strlen(name));
+      break;
+    case LOG_OP_PID:
+      log_pattern_put_uint(&out, log_process_id(), 1);
+      break;
+    case LOG_OP_CONTEXT:
+      /* The fields were rendered when they were pushed. */
+      if(record->context != NULL)
+	log_pattern_put(&out, record->context->text, record->context->len);
+      break;
+    }
+  }
+  /* Keep the newline even if the record had to be cut short. */
+  ++out.len;
+  if(size > 0) buffer[(out.len < size ? out.len : size) - 1] = '\n';
+  return out.len;
+}
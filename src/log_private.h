@@ -0,0 +1,618 @@
+#ifndef __LOGLIB_SRC_LOG_PRIVATE_H__
+#define __LOGLIB_SRC_LOG_PRIVATE_H__
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "log.h"
+
+/**
+ * Internal interfaces shared between the translation units of the log
+ * library. Nothing declared here is part of the public API.
+ */
+
+/**
+ * Returns true if messages of the given level belong on the standard error
+ * stream (warnings and anything more severe).
+ */
+static inline bool log_level_is_error(const log_t level) {
+  return level <= LOG_WARNING;
+}
+
+/**
+ * Returned by log_pack_args() for formats whose arguments cannot be packed.
+ */
+#define LOG_PACK_UNSUPPORTED ((size_t) -1)
+
+/**
+ * Copies the arguments of a format into buffer, so that the message can be
+ * formatted later by log_snprintf_packed(). Strings are copied, since they
+ * may not outlive the call.
+ * \param buffer The destination of the packed arguments.
+ * \param size The size of buffer; if it is too small, nothing is packed but
+ * the size needed is still returned.
+ * \param format The format, which must outlive the packed arguments.
+ * \param args The arguments of format.
+ * \return The size of the packed arguments, or LOG_PACK_UNSUPPORTED if the
+ * format uses a conversion that log_vsnprintf() passes to the C library.
+ */
+size_t log_pack_args(void * buffer, size_t size, const char * format,
+		     va_list args);
+
+/**
+ * Formats a message like log_snprintf() from arguments packed by
+ * log_pack_args().
+ */
+int log_snprintf_packed(char * buffer, size_t size, const char * format,
+			const void * packed);
+
+/**
+ * Returns the name of the severity level as printed in the record header.
+ */
+const char * log_level_str(const log_t level);
+
+/**
+ * The capacity of the context of each thread: the number of fields and the
+ * bytes of their rendered text.
+ */
+#define LOG_CONTEXT_FIELDS 16
+#define LOG_CONTEXT_SIZE 512
+
+/**
+ * The context fields pushed by a thread (see log_context_push()), rendered
+ * as "key=value " text.
+ */
+struct LogContext {
+  size_t depth;
+  size_t len;
+  unsigned short offsets[LOG_CONTEXT_FIELDS]; /**< Where each field starts
+						 in text. */
+  char text[LOG_CONTEXT_SIZE];
+};
+
+/**
+ * Returns the context of the calling thread.
+ */
+const struct LogContext * log_context_current(void);
+
+/**
+ * The size of a thread name, including the null character.
+ */
+#define LOG_THREAD_NAME_SIZE 16
+
+/**
+ * The fields of a record before it is rendered.
+ */
+struct LogRecord {
+  log_t level;
+  struct timespec time; /**< The wall-clock time of the call... */
+  uint64_t ticks; /**< ...or, if not 0, the clock ticks of the call. */
+  const struct LogSite * site; /**< The call site, or NULL. */
+  const char * format; /**< The format of the message, or NULL... */
+  const char * message; /**< ...if the message is already formatted. */
+  size_t message_len;
+  const void * packed; /**< The arguments of format packed by
+			  log_pack_args(), or NULL to take them from a
+			  va_list. */
+  const struct LogContext * context; /**< The context fields, or NULL. */
+  pid_t tid; /**< The thread that logged the record, or 0 for the calling
+		thread... */
+  const char * thread_name; /**< ...and its name, or NULL. */
+};
+
+/**
+ * The sources of record timestamps (see log_set_clock()).
+ */
+enum {
+  LOG_CLOCK_SOURCE_REALTIME, /**< clock_gettime(CLOCK_REALTIME). */
+  LOG_CLOCK_SOURCE_COUNTER,  /**< The invariant CPU cycle counter. */
+  LOG_CLOCK_SOURCE_MONOTONIC /**< Ticks of CLOCK_MONOTONIC (nanoseconds). */
+};
+
+/**
+ * The current source of record timestamps.
+ */
+extern _Atomic int log_clock_source;
+
+/**
+ * Reads the ticks of a tick-based clock source.
+ */
+static inline uint64_t log_clock_read(const int source) {
+  if(source == LOG_CLOCK_SOURCE_COUNTER) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (ticks));
+    return ticks;
+#endif
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Converts ticks read by log_clock_read() to wall-clock time, refreshing the
+ * calibration if it is due.
+ */
+void log_clock_to_realtime(uint64_t ticks, struct timespec * time);
+
+/**
+ * Stamps a record with the current time from the configured source. Tick
+ * sources only store the ticks; they are converted when the record is
+ * rendered.
+ */
+static inline void log_record_stamp(struct LogRecord * record) {
+  int source = atomic_load_explicit(&log_clock_source, memory_order_relaxed);
+  if(source == LOG_CLOCK_SOURCE_REALTIME) {
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->ticks = 0;
+  } else {
+    record->ticks = log_clock_read(source);
+  }
+}
+
+/**
+ * A record pattern compiled by log_pattern_compile() (see log_set_pattern()).
+ */
+struct LogPattern;
+
+/**
+ * The pattern "[%D] %L: %X%M" that records have unless log_set_pattern() is
+ * called.
+ */
+extern const struct LogPattern log_default_pattern;
+
+/**
+ * Compiles a pattern into a sequence of operations.
+ * \param pattern The pattern, as passed to log_set_pattern().
+ * \param error_offset Receives the offset of the offending directive if the
+ * pattern is not valid.
+ * \return The compiled pattern, or NULL if the pattern is not valid or memory
+ * could not be allocated.
+ */
+struct LogPattern * log_pattern_compile(const char * pattern,
+					size_t * error_offset);
+
+/**
+ * Keeps a pattern that has been replaced until the process exits, since other
+ * threads may still be rendering with it. The module must be locked.
+ */
+void log_pattern_retire(const struct LogPattern * pattern);
+
+/**
+ * Renders a record with a compiled pattern, followed by a newline, into
+ * buffer. See log_vformat_record() for the handling of short buffers.
+ * \param args The arguments of record->format.
+ * \return The length of the complete record, which may exceed size.
+ */
+int log_pattern_render(const struct LogPattern * pattern, char * buffer,
+		       size_t size, const struct LogRecord * record,
+		       va_list args);
+
+/**
+ * What a pattern renders from a call site alone: the text of each run of
+ * literal text, %L, %F, %N and %fn steps, in order.
+ */
+struct LogSitePrefix {
+  const struct LogPattern * pattern;
+  struct LogSitePrefix * older; /**< Replaced prefixes, which are kept. */
+  const char * text;            /**< The runs, one after the other. */
+  size_t count;
+  uint32_t lens[];              /**< The length of each run. */
+};
+
+/**
+ * Renders the prefix of a call site for a pattern.
+ * \return The prefix, or NULL if the pattern shows no field of the site or
+ * memory could not be allocated.
+ */
+struct LogSitePrefix * log_pattern_site_prefix(
+  const struct LogPattern * pattern, const struct LogSite * site);
+
+/**
+ * Returns the prefix of a call site for a pattern, rendering it the first
+ * time the site is logged with the pattern.
+ * \return The prefix, or NULL if there is none (see
+ * log_pattern_site_prefix()) or too many sites have been logged to cache it.
+ */
+const struct LogSitePrefix * log_site_prefix(const struct LogSite * site,
+					     const struct LogPattern * pattern);
+
+/**
+ * Adds a call site to the site dictionary, if one is set and the site is
+ * not in it yet (see log_set_site_dictionary()).
+ * \param site The call site.
+ * \param format The format of the record logged from it, which the entry
+ * shows.
+ */
+void log_site_note(const struct LogSite * site, const char * format);
+
+/**
+ * The counts of a call site or format (see log_set_fingerprints()).
+ */
+struct LogFingerprint;
+
+/**
+ * Counts a record under its fingerprint, and decides whether it is collapsed
+ * (see log_set_collapse_repeats()). Reports that are due are written.
+ * \param fields The fields of the record.
+ * \param collapsed Set to whether the record must not be written.
+ * \return The fingerprint of the record, or NULL if fingerprints are
+ * disabled or it has none.
+ */
+struct LogFingerprint * log_fingerprint_note(const struct LogRecord * fields,
+					     bool * collapsed);
+
+/**
+ * Adds the length of a written record to its fingerprint.
+ */
+void log_fingerprint_count(struct LogFingerprint * print, size_t len);
+
+/**
+ * Renders a record like log_pattern_render() with the pattern set by
+ * log_set_pattern().
+ */
+int log_render_record(char * buffer, size_t size,
+		      const struct LogRecord * record, va_list args);
+
+/**
+ * Returns the kernel ID of the calling thread, which is cached.
+ */
+pid_t log_thread_id(void);
+
+/**
+ * Returns the ID of the process, which is cached.
+ */
+pid_t log_process_id(void);
+
+/**
+ * Returns the name of the calling thread, which is cached.
+ */
+const char * log_thread_name(void);
+
+/**
+ * Renders a complete record (by default "[TIMESTAMP] SEVERITY: MESSAGE\n")
+ * stamped with the current time into buffer.
+ * Like snprintf(), the record is cut short if it does not fit, but it always
+ * ends with a newline when size is not zero.
+ * \param buffer The destination buffer.
+ * \param size The size of buffer in bytes.
+ * \param level The severity level of the message.
+ * \param format The format argument to be passed to log_vsnprintf().
+ * \param args The arguments to be passed to log_vsnprintf().
+ * \return The length of the complete record, which may exceed size.
+ */
+int log_vformat_record(char * buffer, size_t size, const log_t level,
+		       const char * format, va_list args);
+
+/**
+ * Renders a complete record like log_vformat_record().
+ * \return The number of bytes written to buffer.
+ */
+int log_format_record(char * buffer, size_t size, const log_t level,
+		      const char * format, ...);
+
+/**
+ * Writes len bytes of already formatted records to the stream that receives
+ * messages of the given level. The module lock and the advisory file lock are
+ * held for the duration of the write, so data may hold several records that
+ * must appear contiguously.
+ * \param level The severity level used to select the stream.
+ * \param data The formatted records, each terminated by a newline.
+ * \param len The number of bytes in data.
+ */
+void log_emit(const log_t level, const char * data, size_t len);
+
+/**
+ * Writes already formatted records to both streams with a single
+ * acquisition of the module lock, like log_emit().
+ * \param data The records for the standard output and error streams.
+ * \param len The number of bytes in each of data[0] and data[1] (0 to skip
+ * a stream).
+ */
+void log_emit_streams(const char * const * data, const size_t * len);
+
+/**
+ * Flushes what the streams have buffered to their files, so that records
+ * written with log_emit() can be read at once. Sinks keep their own policy.
+ */
+void log_flush_streams(void);
+
+/**
+ * Returns whether a message of the given level is logged, taking the levels
+ * shed by the governor into account. Messages that are shed are counted.
+ */
+bool log_level_logged(const log_t level);
+
+/**
+ * Allocates memory from the arena reserved by log_static_init(). The memory
+ * is never freed.
+ * \param size The number of bytes to allocate.
+ * \return The memory, or NULL if the arena was not reserved or is exhausted.
+ */
+void * log_arena_alloc(size_t size);
+
+/**
+ * Returns the level set by log_set_level() without locking or setting up the
+ * module, so that it can be called from a signal handler.
+ */
+log_t log_level_threshold(void);
+
+/**
+ * Renders a record (not critical / no lock needed) so that it can be written
+ * with a single call, or handed off to the shared-memory ring, and writes it.
+ * Most records fit on the stack.
+ * \param fields The fields of the record.
+ * \param args The arguments of fields->format.
+ */
+void log_submit(const struct LogRecord * fields, va_list args);
+
+/**
+ * Submits a record like log_submit() once its fingerprint has been noted
+ * with log_fingerprint_note() (and the record was not collapsed).
+ * \param fields The fields of the record.
+ * \param print The fingerprint of the record, or NULL.
+ * \param args The arguments of fields->format.
+ */
+void log_submit_noted(const struct LogRecord * fields,
+		      struct LogFingerprint * print, va_list args);
+
+/**
+ * Logs a message as log_msg() and log_msg_site() do: at the levels logged,
+ * in the transaction of the thread or only in the live ring.
+ * \param level The severity level of the message.
+ * \param format The format of the message.
+ * \param site The call site of the message, or NULL.
+ * \param args The arguments of format.
+ */
+void log_vmsg(const log_t level, const char * format,
+	      const struct LogSite * site, va_list args);
+
+/**
+ * Submits a record like log_submit(), taking the arguments of fields->format
+ * (if any) from the call.
+ */
+void log_submit_message(const struct LogRecord * fields, ...);
+
+/**
+ * The open transaction of the calling thread, or NULL (see log_txn_begin()).
+ */
+struct LogTxn;
+extern __thread struct LogTxn * log_txn_thread;
+
+/**
+ * What becomes of a record of an open transaction.
+ */
+enum {
+  LOG_TXN_NONE,    /**< It is treated as if there were no transaction. */
+  LOG_TXN_CAPTURE, /**< It is captured by log_txn_capture(). */
+  LOG_TXN_EMIT     /**< It is written although its level is not logged. */
+};
+
+/**
+ * Decides what becomes of a record while the calling thread has an open
+ * transaction. A logged record of level LOG_ERROR or more severe fails the
+ * transaction, which writes the records captured so far.
+ * \param level The severity level of the record.
+ * \param logged Whether the level is logged regardless of the transaction.
+ * \return LOG_TXN_NONE, LOG_TXN_CAPTURE or LOG_TXN_EMIT.
+ */
+int log_txn_route(log_t level, bool logged);
+
+/**
+ * Captures a record in the buffer of the open transaction. The arguments are
+ * packed with log_pack_args() and only formatted if the transaction fails.
+ * \param fields The fields of the record, stamped.
+ * \param args The arguments of fields->format, or NULL if the record has a
+ * message.
+ */
+void log_txn_capture(const struct LogRecord * fields, va_list * args);
+
+/**
+ * The sidecar time index of a log file (see log_set_index()).
+ */
+struct LogIndex;
+
+/**
+ * Creates the sidecar index for the log file filename, named filename.idx.
+ * \param filename The name of the log file.
+ * \param every_records Add an entry after this many records (0 for never).
+ * \param every_seconds Add an entry after this many seconds (0 for never).
+ * \return The index, or NULL if it could not be created.
+ */
+struct LogIndex * log_index_open(const char * filename, unsigned every_records,
+				 unsigned every_seconds);
+
+/**
+ * Closes the index and releases its resources. index may be NULL.
+ */
+void log_index_close(struct LogIndex * index);
+
+/**
+ * Updates the index before data is written to stream, adding an entry for
+ * the current offset of stream if one is due. Stream is flushed before the
+ * entry, and the entry is flushed at once.
+ * \param index The index of the log file.
+ * \param stream The stream of the log file.
+ * \param data The records about to be written.
+ * \param len The number of bytes in data.
+ */
+void log_index_note(struct LogIndex * index, FILE * stream, const char * data,
+		    size_t len);
+
+/**
+ * Checks the layout of a record header without converting its timestamp
+ * (see log_parse_header()).
+ * \param line The start of the line.
+ * \param len The number of bytes available at line.
+ * \param nsec If not NULL, receives the fraction of the second of the
+ * timestamp in nanoseconds (0 if it has none).
+ * \param severity If not NULL, receives the offset of the severity name.
+ * \return The length of the header, or 0 if the line does not start with
+ * one.
+ */
+size_t log_header_layout(const char * line, size_t len, long * nsec,
+			 size_t * severity);
+
+/**
+ * A destination of a stream other than a FILE, such as a compressed file.
+ * Its functions are called with the module locked.
+ */
+struct LogSink {
+  /** Writes len bytes of formatted records. */
+  void (*write)(struct LogSink * sink, const char * data, size_t len);
+  /** Completes what the sink has buffered, leaving it open. */
+  void (*sync)(struct LogSink * sink);
+  /** Writes anything still buffered and frees the sink. */
+  void (*close)(struct LogSink * sink);
+};
+
+/**
+ * Opens a file that records are written to as zstd frames (see
+ * log_set_stdout_compressed()).
+ * \param filename The name of the file, which is truncated.
+ * \param dictionary The name of a dictionary file, or NULL.
+ * \return The sink, or NULL with errno set (to ENOTSUP if the library was
+ * built without zstd).
+ */
+struct LogSink * log_zstd_open(const char * filename, const char * dictionary);
+
+/**
+ * Opens a file that records are written to in checksummed blocks (see
+ * log_set_stdout_blocks()). Anything after the last intact block of an
+ * existing file is truncated, and new blocks are appended.
+ * \param filename The name of the file.
+ * \return The sink, or NULL with errno set (to EINVAL if the file exists but
+ * was not written in blocks).
+ */
+struct LogSink * log_block_open(const char * filename);
+
+/**
+ * Opens a file that records are written to around the page cache (see
+ * log_set_stdout_direct()).
+ * \param filename The name of the file, which is truncated.
+ * \return The sink, or NULL with errno set.
+ */
+struct LogSink * log_direct_open(const char * filename);
+
+/**
+ * A position in a mapped block file (see log_block_next()).
+ */
+struct LogBlockCursor {
+  const char * map;
+  size_t size;
+  size_t offset;     /**< Where the next block is looked for. */
+  uint64_t expected; /**< The sequence number of the next intact block. */
+  bool damaged;      /**< Damage was found since the last intact block. */
+  size_t skipped;    /**< The blocks lost so far. */
+};
+
+/**
+ * Returns whether a mapped file starts like a block file.
+ */
+bool log_block_is_file(const char * map, size_t size);
+
+/**
+ * Starts a cursor at the beginning of a mapped block file.
+ */
+void log_block_cursor_init(struct LogBlockCursor * cursor, const char * map,
+			   size_t size);
+
+/**
+ * Finds the next intact block of a mapped block file, skipping and counting
+ * corrupt ones as log_block_read() does.
+ * \param cursor The cursor, which is moved past the block.
+ * \param payload Receives the start of the payload of the block.
+ * \param len Receives the length of the payload.
+ * \return true if a block was found, or false at the end of the file.
+ */
+bool log_block_next(struct LogBlockCursor * cursor, const char ** payload,
+		    size_t * len);
+
+/**
+ * Opens a sink that sends records to a collector over a Unix-domain socket
+ * (see log_set_stdout_socket()).
+ * \param path The path of the socket of the collector.
+ * \param fallback The name of the file that receives the records the
+ * collector cannot take, or NULL to drop them.
+ * \param flags LOG_SOCKET_RFC5424 or 0.
+ * \param level The severity of records whose header cannot be parsed.
+ * \return The sink, or NULL with errno set.
+ */
+struct LogSink * log_socket_open(const char * path, const char * fallback,
+				 int flags, log_t level);
+
+/**
+ * The least severe level copied to the live ring, or -1 if there is none
+ * (see log_set_live()).
+ */
+extern _Atomic int log_live_level;
+
+/**
+ * Returns whether records of the given level are copied to the live ring.
+ */
+static inline bool log_live_wants(const log_t level) {
+  return (int) level
+    <= atomic_load_explicit(&log_live_level, memory_order_relaxed);
+}
+
+/**
+ * Copies a formatted record to the live ring, cutting it short if it does
+ * not fit in a slot. Only memory is written.
+ * \param level The severity level of the record.
+ * \param record The formatted record, terminated by a newline.
+ * \param len The number of bytes in record.
+ */
+void log_live_append(const log_t level, const char * record, size_t len);
+
+/**
+ * Renders a record that is not otherwise logged and copies it to the live
+ * ring.
+ * \param fields The fields of the record.
+ * \param args The arguments of fields->format.
+ */
+void log_live_submit(const struct LogRecord * fields, va_list args);
+
+/**
+ * Copies a record to the live ring like log_live_submit(), taking the
+ * arguments of fields->format (if any) from the call.
+ */
+void log_live_submit_message(const struct LogRecord * fields, ...);
+
+/**
+ * Hands a formatted record to the shared-memory ring if this process is
+ * attached to one.
+ * \param level The severity level of the record.
+ * \param record The formatted record, terminated by a newline.
+ * \param len The number of bytes in record.
+ * \return true if the ring took responsibility for the record (it was either
+ * queued or counted as dropped), false if no ring is attached.
+ */
+bool log_shm_enqueue(const log_t level, const char * record, size_t len);
+
+/**
+ * Returns whether this process is attached to a shared-memory ring.
+ */
+bool log_shm_is_attached(void);
+
+/**
+ * Hands a formatted record to the staging buffer of the NUMA node of the
+ * calling CPU if staging is enabled (see log_set_staging()).
+ * \param level The severity level of the record.
+ * \param record The formatted record, terminated by a newline.
+ * \param len The number of bytes in record.
+ * \return true if the record was staged, false if the caller must write it.
+ */
+bool log_staging_enqueue(const log_t level, const char * record, size_t len);
+
+#endif
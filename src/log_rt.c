@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The size of the packed arguments a real-time record can hold. Records with
+ * longer arguments are counted as lost.
+ */
+#define LOG_RT_PACKED_SIZE 224
+
+/**
+ * A record queued by log_rt_msg(). Only the consumer formats it, so it keeps
+ * the thread that logged it and the context fields of that thread, which
+ * follow the packed arguments.
+ */
+struct LogRtRecord {
+  const char * format;
+  struct timespec time;
+  uint64_t ticks;
+  int32_t level;
+  uint32_t len;
+  uint32_t context_len;
+  pid_t tid;
+  char thread_name[LOG_THREAD_NAME_SIZE];
+  alignas(8) unsigned char packed[LOG_RT_PACKED_SIZE];
+};
+
+/**
+ * The ring of one producer thread. The thread (or a signal handler that
+ * interrupts it) is the only producer, and log_rt_drain() the only consumer.
+ * The cursors live on separate cache lines.
+ */
+struct LogRtRing {
+  _Atomic int state;                   /**< A LOG_RT_RING_* value. */
+  _Atomic bool busy;                   /**< The producer is writing. */
+  alignas(64) _Atomic uint64_t head;   /**< Next position to be written. */
+  alignas(64) _Atomic uint64_t tail;   /**< Next position to be drained. */
+  alignas(64) _Atomic uint64_t lost;   /**< Records that were not queued. */
+  uint64_t reported_lost;              /**< Guarded by drain_lock. */
+  struct LogRtRecord * records;
+};
+
+/**
+ * The states of a ring of the pool.
+ */
+enum {
+  LOG_RT_RING_FREE,     /**< It can be claimed by a thread. */
+  LOG_RT_RING_OWNED,    /**< It belongs to a thread. */
+  LOG_RT_RING_RELEASED  /**< It is freed once drained. */
+};
+
+/**
+ * The pool of rings allocated by log_rt_setup().
+ */
+static struct {
+  _Atomic(struct LogRtRing *) rings;
+  size_t ring_count;
+  size_t record_count; /**< A power of two. */
+  pthread_mutex_t drain_lock;
+} log_rt_pool = { .rings = NULL, .drain_lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * The ring of the calling thread. The initial-exec model keeps the access
+ * from allocating, which a signal handler could not afford.
+ */
+static __thread struct LogRtRing * log_rt_ring
+  __attribute__((tls_model("initial-exec"))) = NULL;
+
+void log_rt_setup(size_t threads, size_t records) {
+  if(atomic_load(&log_rt_pool.rings) != NULL) {
+    log_error("I could not set up the real-time rings with error %d.",
+	      EALREADY);
+    return;
+  }
+  size_t record_count = 1;
+  while(record_count < records && record_count < ((size_t) 1 << 24))
+    record_count <<= 1;
+  struct LogRtRing * rings = calloc(threads, sizeof(struct LogRtRing));
+  struct LogRtRecord * pool =
+    calloc(threads * record_count, sizeof(struct LogRtRecord));
+  if(threads == 0 || rings == NULL || pool == NULL) {
+    free(rings);
+    free(pool);
+    log_error("I could not set up the real-time rings with error %d.",
+	      threads == 0 ? EINVAL : ENOMEM);
+    return;
+  }
+  for(size_t i = 0; i < threads; ++i)
+    rings[i].records = pool + i * record_count;
+  /* Producers then only read their cached IDs, or ask the kernel. */
+  log_thread_id();
+  log_rt_pool.ring_count = threads;
+  log_rt_pool.record_count = record_count;
+  atomic_store_explicit(&log_rt_pool.rings, rings, memory_order_release);
+}
+
+/**
+ * Claims a free ring of the pool for the calling thread. This takes at most
+ * one attempt per ring.
+ */
+static struct LogRtRing * log_rt_claim(void) {
+  struct LogRtRing * rings =
+    atomic_load_explicit(&log_rt_pool.rings, memory_order_acquire);
+  if(rings == NULL) return NULL;
+  for(size_t i = 0; i < log_rt_pool.ring_count; ++i) {
+    int expected = LOG_RT_RING_FREE;
+    if(atomic_compare_exchange_strong(&rings[i].state, &expected,
+				      LOG_RT_RING_OWNED))
+      return log_rt_ring = &rings[i];
+  }
+  return NULL;
+}
+
+void log_rt_msg(const log_t level, const char * format, ...) {
+  if(level > log_level_threshold()) return;
+  struct LogRtRing * ring = log_rt_ring;
+  if(ring == NULL && (ring = log_rt_claim()) == NULL) return;
+  /*
+   * A signal handler that interrupts its thread in the middle of a record
+   * must not touch the ring, so the record is counted as lost.
+   */
+  if(atomic_exchange_explicit(&ring->busy, true, memory_order_acquire)) {
+    atomic_fetch_add_explicit(&ring->lost, 1, memory_order_relaxed);
+    return;
+  }
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  bool queued = false;
+  if(head - tail < log_rt_pool.record_count) {
+    struct LogRtRecord * record =
+      &ring->records[head & (log_rt_pool.record_count - 1)];
+    va_list args;
+    va_start(args, format);
+    size_t len = log_pack_args(record->packed, LOG_RT_PACKED_SIZE, format,
+			       args);
+    va_end(args);
+    /*
+     * Formats that need the C library cannot be deferred, and the context
+     * fields must fit after the arguments.
+     */
+    const struct LogContext * context = log_context_current();
+    if(len <= LOG_RT_PACKED_SIZE
+       && context->len <= LOG_RT_PACKED_SIZE - len) {
+      struct LogRecord stamp = { .level = level };
+      log_record_stamp(&stamp);
+      memcpy(record->packed + len, context->text, context->len);
+      record->format = format;
+      record->time = stamp.time;
+      record->ticks = stamp.ticks;
+      record->level = level;
+      record->len = len;
+      record->context_len = context->len;
+      record->tid = log_thread_id();
+      memcpy(record->thread_name, log_thread_name(), LOG_THREAD_NAME_SIZE);
+      atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+      queued = true;
+    }
+  }
+  if(!queued) atomic_fetch_add_explicit(&ring->lost, 1, memory_order_relaxed);
+  atomic_store_explicit(&ring->busy, false, memory_order_release);
+}
+
+void log_rt_release(void) {
+  struct LogRtRing * ring = log_rt_ring;
+  if(ring == NULL) return;
+  log_rt_ring = NULL;
+  atomic_store_explicit(&ring->state, LOG_RT_RING_RELEASED,
+			memory_order_release);
+}
+
+size_t log_rt_drain(void) {
+  struct LogRtRing * rings =
+    atomic_load_explicit(&log_rt_pool.rings, memory_order_acquire);
+  if(rings == NULL) return 0;
+  pthread_mutex_lock(&log_rt_pool.drain_lock);
+  size_t drained = 0;
+  struct LogContext context;
+  context.depth = 0;
+  for(size_t i = 0; i < log_rt_pool.ring_count; ++i) {
+    struct LogRtRing * ring = &rings[i];
+    int state = atomic_load_explicit(&ring->state, memory_order_acquire);
+    if(state == LOG_RT_RING_FREE) continue;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for(; tail != head; ++tail) {
+      const struct LogRtRecord * record =
+	&ring->records[tail & (log_rt_pool.record_count - 1)];
+      context.len = record->context_len;
+      memcpy(context.text, record->packed + record->len, context.len);
+      struct LogRecord fields = {
+	.level = record->level, .time = record->time, .ticks = record->ticks,
+	.format = record->format, .packed = record->packed,
+	.context = &context, .tid = record->tid,
+	.thread_name = record->thread_name
+      };
+      log_submit_message(&fields);
+      /* Hand the slot back only once the record has been rendered. */
+      atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+      ++drained;
+    }
+    uint64_t lost = atomic_load_explicit(&ring->lost, memory_order_relaxed);
+    if(lost != ring->reported_lost) {
+      struct LogRecord fields = {
+	.level = LOG_WARNING,
+	.format = "%llu real-time records were lost."
+      };
+      log_record_stamp(&fields);
+      log_submit_message(&fields,
+			 (unsigned long long) (lost - ring->reported_lost));
+      ring->reported_lost = lost;
+    }
+    /* A released ring is free again once it is empty. */
+    if(state == LOG_RT_RING_RELEASED) {
+      ring->reported_lost = 0;
+      atomic_store(&ring->lost, 0);
+      atomic_store_explicit(&ring->state, LOG_RT_RING_FREE,
+			    memory_order_release);
+    }
+  }
+  pthread_mutex_unlock(&log_rt_pool.drain_lock);
+  return drained;
+}
@@ -0,0 +1,554 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * Identifies a mapped segment as a log ring with lanes and slot owners
+ * ("LOGSHM04").
+ */
+#define LOG_SHM_MAGIC UINT64_C(0x34304d4853474f4c)
+
+/**
+ * Records are rendered on the producer's stack before they are copied into
+ * the ring, so slots are limited to this many bytes.
+ */
+#define LOG_SHM_MAX_SLOT_SIZE 4096
+
+/**
+ * The smallest slot that still leaves room for a useful record.
+ */
+#define LOG_SHM_MIN_SLOT_SIZE 64
+
+/**
+ * A slot that was claimed by a producer but not published within this many
+ * nanoseconds is reclaimed if the producer is no longer running, or has not
+ * even taken ownership of it.
+ */
+#define LOG_SHM_STALL_NS 1000000000LL
+
+/**
+ * A producer of a full lane with the LOG_SHM_WAIT policy waits at most this
+ * many nanoseconds for the collector before it drops the record.
+ */
+#define LOG_SHM_WAIT_NS 100000000LL
+
+/**
+ * Records are copied out of the ring into a batch buffer of this size so that
+ * the streams are locked once per batch rather than once per record.
+ */
+#define LOG_SHM_BATCH_SIZE 65536
+
+/**
+ * The express lane is checked again after this many bulk records.
+ */
+#define LOG_SHM_BULK_QUANTUM 256
+
+/**
+ * log_shm_create() gives the express lane a quarter of the slots of the bulk
+ * lane, but at least this many.
+ */
+#define LOG_SHM_MIN_EXPRESS_SLOTS 16
+
+/**
+ * The lanes of a ring. Warnings, errors and fatal errors (the records of the
+ * standard error stream) take the express lane and the rest the bulk lane.
+ */
+enum {
+  LOG_SHM_EXPRESS,
+  LOG_SHM_BULK,
+  LOG_SHM_LANES
+};
+
+/**
+ * One lane of the ring, a bounded queue of its own. The producer and consumer
+ * cursors live on separate cache lines.
+ */
+struct LogShmLane {
+  uint32_t slot_count;
+  uint32_t policy;  /**< What producers do when the lane is full. */
+  uint64_t offset;  /**< The offset of the slots in the segment. */
+  alignas(64) _Atomic uint64_t head; /**< Next position to be claimed. */
+  alignas(64) _Atomic uint64_t tail; /**< Next position to be drained. */
+  alignas(64) _Atomic uint64_t dropped; /**< Records lost to a full lane. */
+  _Atomic uint64_t abandoned; /**< Slots reclaimed from dead producers. */
+};
+
+/**
+ * The header at the start of the shared-memory segment. The slots of the
+ * lanes follow it.
+ */
+struct LogShmHeader {
+  _Atomic uint64_t magic;
+  uint32_t slot_size;
+  struct LogShmLane lanes[LOG_SHM_LANES];
+};
+
+/**
+ * A slot in the ring. The sequence number tells producers and consumers who
+ * owns the slot: seq == pos means it is free for the producer at pos, and
+ * seq == pos + 1 means the record written at pos is ready to be drained.
+ */
+struct LogShmSlot {
+  _Atomic uint64_t seq;
+  uint32_t level;
+  uint32_t length;
+  _Atomic uint64_t owner; /**< See log_shm_owner(). */
+  char data[];
+};
+
+/**
+ * The owner of a slot tells the collector which process writes the record
+ * claimed at a position: the low 32 bits of the position, then the process
+ * ID (0 for none), or LOG_SHM_RECLAIMED once the collector has given up on
+ * the record. Since the position is part of it, it need not be reset when
+ * the slot is released.
+ */
+#define LOG_SHM_RECLAIMED ((pid_t) -1)
+
+static inline uint64_t log_shm_owner(uint64_t pos, pid_t pid) {
+  return (uint64_t) (uint32_t) pos << 32 | (uint32_t) pid;
+}
+
+/**
+ * The consumer side bookkeeping of a lane.
+ */
+struct LogShmDrain {
+  char batch[LOG_SHM_BATCH_SIZE];
+  uint64_t stalled_pos;
+  long long stalled_since;
+  uint64_t reported_dropped;
+};
+
+/**
+ * The ring this process is attached to, if any.
+ */
+struct LogShm {
+  struct LogShmHeader * header;
+  size_t size;
+  /* Consumer side bookkeeping, guarded by drain_lock. */
+  pthread_mutex_t drain_lock;
+  struct LogShmDrain lanes[LOG_SHM_LANES];
+};
+
+static struct LogShm shm_ring = {
+  .drain_lock = PTHREAD_MUTEX_INITIALIZER
+};
+static _Atomic(struct LogShmHeader *) shm_attached = NULL;
+
+/**
+ * Returns the slot of lane used for position pos.
+ */
+static struct LogShmSlot * log_shm_slot(struct LogShmHeader * header,
+					 struct LogShmLane * lane,
+					 uint64_t pos) {
+  char * slots = (char *) header + lane->offset;
+  return (struct LogShmSlot *)
+    (slots + (size_t) (pos & (lane->slot_count - 1)) * header->slot_size);
+}
+
+/**
+ * Rounds a number of slots up to a power of two.
+ */
+static size_t log_shm_round_slots(size_t slots) {
+  size_t slot_count = 1;
+  while(slot_count < slots && slot_count < ((size_t) 1 << 30))
+    slot_count <<= 1;
+  return slot_count;
+}
+
+/**
+ * Returns the current value of the monotonic clock in nanoseconds.
+ */
+static long long log_shm_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Copies name into buffer, adding the leading slash required by shm_open().
+ */
+static const char * log_shm_path(const char * name, char * buffer,
+				 size_t size) {
+  snprintf(buffer, size, "%s%s", name[0] == '/' ? "" : "/", name);
+  return buffer;
+}
+
+/**
+ * Makes the mapped segment the ring of this process.
+ */
+static void log_shm_install(struct LogShmHeader * header, size_t size) {
+  log_shm_detach();
+  pthread_mutex_lock(&shm_ring.drain_lock);
+  shm_ring.header = header;
+  shm_ring.size = size;
+  for(int i = 0; i < LOG_SHM_LANES; ++i) {
+    struct LogShmDrain * drain = &shm_ring.lanes[i];
+    drain->stalled_pos = 0;
+    drain->stalled_since = 0;
+    drain->reported_dropped = atomic_load(&header->lanes[i].dropped)
+      + atomic_load(&header->lanes[i].abandoned);
+  }
+  pthread_mutex_unlock(&shm_ring.drain_lock);
+  atomic_store_explicit(&shm_attached, header, memory_order_release);
+}
+
+int log_shm_create(const char * name, size_t slots, size_t slot_size) {
+  size_t express_slots = slots / 4;
+  if(express_slots < LOG_SHM_MIN_EXPRESS_SLOTS)
+    express_slots = LOG_SHM_MIN_EXPRESS_SLOTS;
+  return log_shm_create_lanes(name, express_slots, LOG_SHM_WAIT, slots,
+			      LOG_SHM_DROP, slot_size);
+}
+
+int log_shm_create_lanes(const char * name, size_t express_slots,
+			 log_shm_policy_t express_policy, size_t bulk_slots,
+			 log_shm_policy_t bulk_policy, size_t slot_size) {
+  char path[256];
+  log_shm_path(name, path, sizeof(path));
+  /* Round the geometry to something the ring can index cheaply. */
+  size_t slot_counts[LOG_SHM_LANES] = {
+    log_shm_round_slots(express_slots), log_shm_round_slots(bulk_slots)
+  };
+  const log_shm_policy_t policies[LOG_SHM_LANES] = {
+    express_policy, bulk_policy
+  };
+  if(slot_size < LOG_SHM_MIN_SLOT_SIZE) slot_size = LOG_SHM_MIN_SLOT_SIZE;
+  if(slot_size > LOG_SHM_MAX_SLOT_SIZE) slot_size = LOG_SHM_MAX_SLOT_SIZE;
+  slot_size = (slot_size + 7) & ~(size_t) 7;
+  size_t size = sizeof(struct LogShmHeader)
+    + (slot_counts[LOG_SHM_EXPRESS] + slot_counts[LOG_SHM_BULK]) * slot_size;
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0660);
+  if(fd < 0 && errno == EEXIST) {
+    /* Reuse an existing ring so that queued records survive a restart. */
+    return log_shm_attach(name);
+  }
+  if(fd < 0 || ftruncate(fd, size) != 0) {
+    int error = errno;
+    if(fd >= 0) {
+      close(fd);
+      shm_unlink(path);
+    }
+    log_error("I could not create the shared-memory ring %s with error %d.",
+	      path, error);
+    return -1;
+  }
+  struct LogShmHeader * header = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				      MAP_SHARED, fd, 0);
+  if(header == MAP_FAILED) {
+    int error = errno;
+    close(fd);
+    shm_unlink(path);
+    log_error("I could not map the shared-memory ring %s with error %d.",
+	      path, error);
+    return -1;
+  }
+  header->slot_size = slot_size;
+  uint64_t offset = sizeof(struct LogShmHeader);
+  for(int i = 0; i < LOG_SHM_LANES; ++i) {
+    struct LogShmLane * lane = &header->lanes[i];
+    lane->slot_count = slot_counts[i];
+    lane->policy = policies[i];
+    lane->offset = offset;
+    offset += slot_counts[i] * slot_size;
+    atomic_init(&lane->head, 0);
+    atomic_init(&lane->tail, 0);
+    atomic_init(&lane->dropped, 0);
+    atomic_init(&lane->abandoned, 0);
+    for(size_t j = 0; j < slot_counts[i]; ++j) {
+      struct LogShmSlot * slot = log_shm_slot(header, lane, j);
+      atomic_init(&slot->seq, j);
+      atomic_init(&slot->owner, 0);
+    }
+  }
+  /* Publish the magic last so that attaching processes see a whole ring. */
+  atomic_store_explicit(&header->magic, LOG_SHM_MAGIC, memory_order_release);
+  close(fd);
+  log_shm_install(header, size);
+  return 0;
+}
+
+int log_shm_attach(const char * name) {
+  char path[256];
+  log_shm_path(name, path, sizeof(path));
+  int fd = shm_open(path, O_RDWR, 0);
+  struct stat stats;
+  if(fd < 0 || fstat(fd, &stats) != 0) {
+    int error = errno;
+    if(fd >= 0) close(fd);
+    log_error("I could not open the shared-memory ring %s with error %d.",
+	      path, error);
+    return -1;
+  }
+  size_t size = stats.st_size;
+  struct LogShmHeader * header = MAP_FAILED;
+  if(size >= sizeof(struct LogShmHeader))
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int error = errno;
+  close(fd);
+  if(header == MAP_FAILED) {
+    log_error("I could not map the shared-memory ring %s with error %d.",
+	      path, error);
+    return -1;
+  }
+  /* Check the geometry before trusting the segment. */
+  bool valid =
+    atomic_load_explicit(&header->magic, memory_order_acquire) == LOG_SHM_MAGIC;
+  size_t slot_size = header->slot_size;
+  valid = valid && slot_size >= LOG_SHM_MIN_SLOT_SIZE
+    && slot_size <= LOG_SHM_MAX_SLOT_SIZE;
+  uint64_t offset = sizeof(struct LogShmHeader);
+  for(int i = 0; valid && i < LOG_SHM_LANES; ++i) {
+    size_t slot_count = header->lanes[i].slot_count;
+    valid = slot_count != 0 && (slot_count & (slot_count - 1)) == 0
+      && header->lanes[i].offset == offset
+      && header->lanes[i].policy <= LOG_SHM_WAIT;
+    offset += slot_count * slot_size;
+  }
+  valid = valid && size == offset;
+  if(!valid) {
+    munmap(header, size);
+    log_error("%s is not a shared-memory log ring.", path);
+    return -1;
+  }
+  log_shm_install(header, size);
+  return 0;
+}
+
+void log_shm_detach(void) {
+  pthread_mutex_lock(&shm_ring.drain_lock);
+  struct LogShmHeader * header = atomic_exchange(&shm_attached, NULL);
+  if(header != NULL) munmap(header, shm_ring.size);
+  shm_ring.header = NULL;
+  pthread_mutex_unlock(&shm_ring.drain_lock);
+}
+
+void log_shm_unlink(const char * name) {
+  char path[256];
+  shm_unlink(log_shm_path(name, path, sizeof(path)));
+}
+
+bool log_shm_is_attached(void) {
+  return atomic_load_explicit(&shm_attached, memory_order_relaxed) != NULL;
+}
+
+bool log_shm_enqueue(const log_t level, const char * record, size_t len) {
+  struct LogShmHeader * header =
+    atomic_load_explicit(&shm_attached, memory_order_acquire);
+  if(header == NULL) return false;
+  struct LogShmLane * lane =
+    &header->lanes[log_level_is_error(level) ? LOG_SHM_EXPRESS : LOG_SHM_BULK];
+  size_t capacity = header->slot_size - sizeof(struct LogShmSlot);
+  if(len > capacity) len = capacity; /* The newline is restored below. */
+  /* Claim a position (Vyukov's bounded queue; lock-free, no syscalls). */
+  uint64_t pos = atomic_load_explicit(&lane->head, memory_order_relaxed);
+  struct LogShmSlot * slot;
+  long long waiting_since = 0;
+  for(;;) {
+    slot = log_shm_slot(header, lane, pos);
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    int64_t diff = (int64_t) (seq - pos);
+    if(diff == 0) {
+      if(atomic_compare_exchange_weak_explicit(&lane->head, &pos, pos + 1,
+					       memory_order_relaxed,
+					       memory_order_relaxed))
+	break;
+    } else if(diff < 0) {
+      /*
+       * The lane is full. Only a lane with the LOG_SHM_WAIT policy waits for
+       * the collector, and not for long.
+       */
+      long long now = lane->policy == LOG_SHM_WAIT ? log_shm_now() : 0;
+      if(waiting_since == 0) waiting_since = now;
+      if(lane->policy != LOG_SHM_WAIT
+	 || now - waiting_since > LOG_SHM_WAIT_NS) {
+	atomic_fetch_add_explicit(&lane->dropped, 1, memory_order_relaxed);
+	return true;
+      }
+      struct timespec pause = { .tv_sec = 0, .tv_nsec = 50000 };
+      nanosleep(&pause, NULL);
+      pos = atomic_load_explicit(&lane->head, memory_order_relaxed);
+    } else {
+      pos = atomic_load_explicit(&lane->head, memory_order_relaxed);
+    }
+  }
+  /*
+   * Take ownership of the slot before writing to it, unless the collector
+   * gave up on it first.
+   */
+  uint64_t owner = atomic_load_explicit(&slot->owner, memory_order_relaxed);
+  do {
+    if(owner == log_shm_owner(pos, LOG_SHM_RECLAIMED)) {
+      atomic_fetch_add_explicit(&lane->dropped, 1, memory_order_relaxed);
+      return true;
+    }
+  } while(!atomic_compare_exchange_weak(&slot->owner, &owner,
+					log_shm_owner(pos, log_process_id())));
+  slot->level = level;
+  slot->length = len;
+  memcpy(slot->data, record, len);
+  slot->data[len - 1] = '\n';
+  /*
+   * Publish the record. This fails only if the collector reclaimed the slot,
+   * which it does only for a producer that is not running, so the record is
+   * lost.
+   */
+  uint64_t expected = pos;
+  if(!atomic_compare_exchange_strong_explicit(&slot->seq, &expected, pos + 1,
+					      memory_order_release,
+					      memory_order_relaxed))
+    atomic_fetch_add_explicit(&lane->dropped, 1, memory_order_relaxed);
+  return true;
+}
+
+/**
+ * Whether the producer of the slot claimed at pos, stalled for longer than
+ * LOG_SHM_STALL_NS, will never publish it: it is no longer running, or it
+ * has still not taken ownership of the slot, which it is then denied.
+ */
+static bool log_shm_producer_gone(struct LogShmSlot * slot, uint64_t pos) {
+  uint64_t owner = atomic_load(&slot->owner);
+  while(owner >> 32 != (uint32_t) pos || (uint32_t) owner == 0) {
+    if(atomic_compare_exchange_weak(&slot->owner, &owner,
+				    log_shm_owner(pos, LOG_SHM_RECLAIMED)))
+      return true;
+  }
+  pid_t pid = (pid_t) (uint32_t) owner;
+  return pid == LOG_SHM_RECLAIMED || (kill(pid, 0) != 0 && errno == ESRCH);
+}
+
+/**
+ * Writes out the records accumulated for a lane.
+ */
+static void log_shm_flush(const log_t level, char * batch, size_t * len) {
+  if(*len > 0) log_emit(level, batch, *len);
+  *len = 0;
+}
+
+/**
+ * Writes out at most max records of a lane, in the order they were queued.
+ * Each lane feeds one stream.
+ * \return The number of records written.
+ */
+static size_t log_shm_drain_lane(struct LogShmHeader * header, int index,
+				 size_t max) {
+  struct LogShmLane * lane = &header->lanes[index];
+  struct LogShmDrain * drain = &shm_ring.lanes[index];
+  const log_t level = index == LOG_SHM_EXPRESS ? LOG_ERROR : LOG_INFO;
+  size_t len = 0;
+  size_t drained = 0;
+  uint64_t pos = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+  while(drained < max) {
+    struct LogShmSlot * slot = log_shm_slot(header, lane, pos);
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    int64_t diff = (int64_t) (seq - (pos + 1));
+    bool owned = false;
+    if(diff == 0) {
+      owned = atomic_compare_exchange_weak_explicit(&lane->tail, &pos,
+						    pos + 1,
+						    memory_order_relaxed,
+						    memory_order_relaxed);
+      if(!owned) continue; /* Another collector took it; pos was updated. */
+    } else if(diff < 0) {
+      /* Either the lane is empty or a producer is still writing. */
+      if(atomic_load_explicit(&lane->head, memory_order_relaxed) == pos)
+	break;
+      long long now = log_shm_now();
+      if(drain->stalled_pos != pos || drain->stalled_since == 0) {
+	drain->stalled_pos = pos;
+	drain->stalled_since = now;
+	break;
+      }
+      if(now - drain->stalled_since < LOG_SHM_STALL_NS) break;
+      /*
+       * A producer that is only slow (preempted or stopped) still writes to
+       * the slot, so the lane waits for it. Only the slot of a dead one, or
+       * of one that never took ownership of it, is reclaimed.
+       */
+      if(!log_shm_producer_gone(slot, pos)) break;
+      if(!atomic_compare_exchange_strong(&lane->tail, &pos, pos + 1))
+	continue;
+      uint64_t expected = pos;
+      drain->stalled_since = 0;
+      if(atomic_compare_exchange_strong(&slot->seq, &expected,
+					pos + lane->slot_count)) {
+	atomic_fetch_add(&lane->abandoned, 1);
+	++pos;
+	continue;
+      }
+      owned = true; /* It was published after all. */
+    } else {
+      pos = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+      continue;
+    }
+    /* Copy the record out and release the slot before any I/O happens. */
+    size_t length = slot->length;
+    if(len + length > LOG_SHM_BATCH_SIZE)
+      log_shm_flush(level, drain->batch, &len);
+    memcpy(drain->batch + len, slot->data, length);
+    len += length;
+    atomic_store_explicit(&slot->seq, pos + lane->slot_count,
+			  memory_order_release);
+    ++pos;
+    ++drained;
+  }
+  log_shm_flush(level, drain->batch, &len);
+  return drained;
+}
+
+/**
+ * Reports the records of a lane lost to a full lane or a dead producer since
+ * the last report.
+ */
+static void log_shm_report(struct LogShmHeader * header, int index) {
+  struct LogShmLane * lane = &header->lanes[index];
+  struct LogShmDrain * drain = &shm_ring.lanes[index];
+  uint64_t lost = atomic_load(&lane->dropped) + atomic_load(&lane->abandoned);
+  if(lost == drain->reported_dropped) return;
+  char record[128];
+  int len = log_format_record(record, sizeof(record), LOG_WARNING,
+			      "%llu records were lost by the %s lane of the "
+			      "shared-memory ring.",
+			      (unsigned long long)
+			      (lost - drain->reported_dropped),
+			      index == LOG_SHM_EXPRESS ? "express" : "bulk");
+  drain->reported_dropped = lost;
+  log_emit(LOG_WARNING, record, len);
+}
+
+size_t log_shm_drain(void) {
+  struct LogShmHeader * header =
+    atomic_load_explicit(&shm_attached, memory_order_acquire);
+  if(header == NULL) return 0;
+  pthread_mutex_lock(&shm_ring.drain_lock);
+  /*
+   * Empty the express lane before each quantum of the bulk lane, so that a
+   * flood of verbose records never delays an error by more than a quantum.
+   */
+  size_t drained = 0, bulk;
+  do {
+    drained += log_shm_drain_lane(header, LOG_SHM_EXPRESS, SIZE_MAX);
+    bulk = log_shm_drain_lane(header, LOG_SHM_BULK, LOG_SHM_BULK_QUANTUM);
+    drained += bulk;
+  } while(bulk == LOG_SHM_BULK_QUANTUM);
+  log_shm_report(header, LOG_SHM_EXPRESS);
+  log_shm_report(header, LOG_SHM_BULK);
+  pthread_mutex_unlock(&shm_ring.drain_lock);
+  /* A collector runs for long, so its files must not lag behind the ring. */
+  if(drained > 0) log_flush_streams();
+  return drained;
+}
@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The number of call sites whose prefixes are cached (a power of two).
+ * Records of further sites are rendered without a cached prefix.
+ */
+#define LOG_SITE_SLOTS 4096
+
+/**
+ * The number of slots a lookup probes before it gives up.
+ */
+#define LOG_SITE_PROBES 32
+
+/**
+ * The longest entry written to a site dictionary. Longer formats are cut
+ * short.
+ */
+#define LOG_SITE_ENTRY_SIZE 2048
+
+/**
+ * A call site, its ID (0 until it is first needed) and its prefix for the
+ * pattern it was last logged with.
+ */
+struct LogSiteSlot {
+  _Atomic(const struct LogSite *) site;
+  _Atomic uint64_t id;
+  _Atomic(struct LogSitePrefix *) prefix;
+  _Atomic bool recorded; /**< The site is in the dictionary. */
+};
+
+/**
+ * The sites seen so far, in an open-addressing table that is only ever added
+ * to, so lookups need no lock.
+ */
+static struct LogSiteSlot log_site_slots[LOG_SITE_SLOTS];
+
+/**
+ * Finds the slot of a site, claiming a free one the first time.
+ * \return The slot, or NULL if the table is too full.
+ */
+static struct LogSiteSlot * log_site_slot(const struct LogSite * site) {
+  /* Descriptors are at least 8-byte aligned, so skip the low bits. */
+  uint64_t hash = ((uintptr_t) site >> 3) * 0x9e3779b97f4a7c15ULL;
+  size_t index = hash >> 32;
+  for(int probe = 0; probe < LOG_SITE_PROBES; ++probe) {
+    struct LogSiteSlot * slot =
+      &log_site_slots[(index + probe) & (LOG_SITE_SLOTS - 1)];
+    const struct LogSite * found =
+      atomic_load_explicit(&slot->site, memory_order_acquire);
+    if(found == site) return slot;
+    if(found == NULL) {
+      if(atomic_compare_exchange_strong(&slot->site, &found, site)
+	 || found == site)
+	return slot;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * The set of IDs in a dictionary starts with room for this many (a power of
+ * two), twice the number of cached sites, so that it never grows while they
+ * suffice. Static-memory builds never grow it.
+ */
+#define LOG_SITE_KNOWN_SIZE (2 * LOG_SITE_SLOTS)
+
+/**
+ * The dictionary of site descriptors (see log_set_site_dictionary()). The IDs
+ * it holds are kept in an open-addressing set, at most half full: those it
+ * held when it was opened and those appended since.
+ */
+static struct {
+  pthread_mutex_t lock;
+  _Atomic bool enabled;
+  int fd;
+  uint64_t * known;
+  size_t known_size;  /**< A power of two, or 0. */
+  size_t known_count;
+} log_site_dictionary = { PTHREAD_MUTEX_INITIALIZER, false, -1, NULL, 0, 0 };
+
+/**
+ * Hashes a string into a running FNV-1a hash, including its terminator.
+ */
+static uint64_t log_site_hash(uint64_t hash, const char * text) {
+  do {
+    hash ^= (unsigned char) *text;
+    hash *= 0x100000001b3ULL;
+  } while(*text++ != '\0');
+  return hash;
+}
+
+/**
+ * Computes the ID of a site from its file, function, line and level. The
+ * format is left out, since a site may log a different one on each call.
+ */
+static uint64_t log_site_content_id(const struct LogSite * site) {
+  char numbers[32];
+  snprintf(numbers, sizeof(numbers), "%d %d", site->line, (int) site->level);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = log_site_hash(hash, site->file);
+  hash = log_site_hash(hash, site->function);
+  hash = log_site_hash(hash, numbers);
+  return hash != 0 ? hash : 1;
+}
+
+unsigned long long log_site_id(const struct LogSite * site) {
+  struct LogSiteSlot * slot = log_site_slot(site);
+  if(slot == NULL) return log_site_content_id(site);
+  uint64_t id = atomic_load_explicit(&slot->id, memory_order_relaxed);
+  if(id == 0) {
+    /* Threads that race here compute the same ID. */
+    id = log_site_content_id(site);
+    atomic_store_explicit(&slot->id, id, memory_order_relaxed);
+  }
+  return id;
+}
+
+/**
+ * Returns the slot of an ID in the set of known IDs: the slot holding it, or
+ * the empty slot where it belongs.
+ */
+static uint64_t * log_site_known_slot(uint64_t id) {
+  size_t mask = log_site_dictionary.known_size - 1;
+  for(size_t i = id & mask;; i = (i + 1) & mask)
+    if(log_site_dictionary.known[i] == id || log_site_dictionary.known[i] == 0)
+      return &log_site_dictionary.known[i];
+}
+
+/**
+ * Adds an ID to the set of known IDs, growing the set once it is half full.
+ * The dictionary must be locked.
+ */
+static void log_site_know(uint64_t id) {
+  if(log_site_dictionary.known_size == 0) return;
+  uint64_t * slot = log_site_known_slot(id);
+  if(*slot == id) return;
+  if(2 * (log_site_dictionary.known_count + 1)
+     > log_site_dictionary.known_size) {
+#ifdef LOG_STATIC_MEMORY
+    return; /* Its entry may be written again, but nothing is allocated. */
+#else
+    uint64_t * old = log_site_dictionary.known;
+    size_t old_size = log_site_dictionary.known_size;
+    uint64_t * known = calloc(2 * old_size, sizeof(uint64_t));
+    if(known == NULL) return;
+    log_site_dictionary.known = known;
+    log_site_dictionary.known_size = 2 * old_size;
+    for(size_t i = 0; i < old_size; ++i)
+      if(old[i] != 0) *log_site_known_slot(old[i]) = old[i];
+    free(old);
+    slot = log_site_known_slot(id);
+#endif
+  }
+  *slot = id;
+  ++log_site_dictionary.known_count;
+}
+
+/**
+ * Appends the entry of a site to the dictionary unless the dictionary
+ * already holds its ID, and then knows the ID. The dictionary must be locked.
+ * \return false if the entry could not be written.
+ */
+static bool log_site_append(const struct LogSite * site, const char * format,
+			    uint64_t id) {
+  if(log_site_dictionary.known_size > 0 && *log_site_known_slot(id) == id)
+    return true;
+  char entry[LOG_SITE_ENTRY_SIZE];
+  int len = snprintf(entry, sizeof(entry), "%016llx\t%s\t%s\t%d\t%s\t",
+		     (unsigned long long) id, log_level_str(site->level),
+		     site->file, site->line, site->function);
+  if(len < 0 || (size_t) len >= sizeof(entry) - 1) return false;
+  /* Escape the format so that the entry stays on one line. */
+  for(const char * p = format; *p != '\0'
+	&& (size_t) len < sizeof(entry) - 3; ++p) {
+    char c = *p;
+    if(c == '\\' || c == '\t' || c == '\n') {
+      entry[len++] = '\\';
+      c = c == '\t' ? 't' : c == '\n' ? 'n' : '\\';
+    }
+    entry[len++] = c;
+  }
+  entry[len++] = '\n';
+  /* One write, so that processes sharing the file do not mix entries. */
+  if(write(log_site_dictionary.fd, entry, len) != len) return false;
+  log_site_know(id);
+  return true;
+}
+
+void log_site_note(const struct LogSite * site, const char * format) {
+  if(!atomic_load_explicit(&log_site_dictionary.enabled,
+			   memory_order_relaxed))
+    return;
+  struct LogSiteSlot * slot = log_site_slot(site);
+  if(slot != NULL
+     && atomic_load_explicit(&slot->recorded, memory_order_relaxed))
+    return;
+  uint64_t id = log_site_id(site);
+  pthread_mutex_lock(&log_site_dictionary.lock);
+  if(log_site_dictionary.fd >= 0
+     && (slot == NULL || !atomic_load(&slot->recorded))) {
+    /* A site whose entry could not be written is not tried again. */
+    (void) log_site_append(site, format, id);
+    if(slot != NULL) atomic_store(&slot->recorded, true);
+  }
+  pthread_mutex_unlock(&log_site_dictionary.lock);
+}
+
+/**
+ * Creates the set of known IDs and reads the IDs of an existing dictionary
+ * into it.
+ */
+static void log_site_load(int fd) {
+  off_t size = lseek(fd, 0, SEEK_END);
+  lseek(fd, 0, SEEK_SET);
+  /* An entry is at least 26 bytes, and the set is kept at most half full. */
+  size_t known_size = LOG_SITE_KNOWN_SIZE;
+  while(size > 0 && known_size < (size_t) size / 26 * 2) known_size <<= 1;
+  uint64_t * known = calloc(known_size, sizeof(uint64_t));
+  if(known == NULL) return;
+  log_site_dictionary.known = known;
+  log_site_dictionary.known_size = known_size;
+  log_site_dictionary.known_count = 0;
+  if(size <= 0) return;
+  FILE * file = fdopen(dup(fd), "r");
+  if(file == NULL) return;
+  char line[LOG_SITE_ENTRY_SIZE];
+  while(fgets(line, sizeof(line), file) != NULL) {
+    char * end;
+    uint64_t id = strtoull(line, &end, 16);
+    if(end == line + 16 && *end == '\t' && id != 0)
+      log_site_know(id);
+    /* Skip the rest of a line longer than the buffer. */
+    while(strchr(line, '\n') == NULL && fgets(line, sizeof(line), file))
+      ;
+  }
+  fclose(file);
+}
+
+void log_set_site_dictionary(const char * filename) {
+  pthread_mutex_lock(&log_site_dictionary.lock);
+  atomic_store(&log_site_dictionary.enabled, false);
+  if(log_site_dictionary.fd >= 0) close(log_site_dictionary.fd);
+  log_site_dictionary.fd = -1;
+  free(log_site_dictionary.known);
+  log_site_dictionary.known = NULL;
+  log_site_dictionary.known_size = 0;
+  log_site_dictionary.known_count = 0;
+  /* The sites must be recorded again in the new dictionary. */
+  for(size_t i = 0; i < LOG_SITE_SLOTS; ++i)
+    atomic_store(&log_site_slots[i].recorded, false);
+  if(filename == NULL) {
+    pthread_mutex_unlock(&log_site_dictionary.lock);
+    return;
+  }
+  int fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if(fd < 0) {
+    int error = errno;
+    pthread_mutex_unlock(&log_site_dictionary.lock);
+    log_error("I could not open the site dictionary %s with error %d.",
+	      filename, error);
+    return;
+  }
+  log_site_load(fd);
+  log_site_dictionary.fd = fd;
+  atomic_store(&log_site_dictionary.enabled, true);
+  pthread_mutex_unlock(&log_site_dictionary.lock);
+}
+
+const struct LogSitePrefix * log_site_prefix(const struct LogSite * site,
+					     const struct LogPattern * pattern) {
+  struct LogSiteSlot * slot = log_site_slot(site);
+  if(slot == NULL) return NULL;
+  struct LogSitePrefix * prefix =
+    atomic_load_explicit(&slot->prefix, memory_order_acquire);
+  if(prefix != NULL && prefix->pattern == pattern) return prefix;
+  /* The site is new, or the pattern was changed since it was last logged. */
+  struct LogSitePrefix * rendered = log_pattern_site_prefix(pattern, site);
+  if(rendered == NULL) return NULL;
+  /* Prefixes are kept, since other threads may still be copying them. */
+  rendered->older = prefix;
+  if(!atomic_compare_exchange_strong(&slot->prefix, &prefix, rendered)) {
+    /* Another thread got there first; its prefix will do if it matches. */
+#ifndef LOG_STATIC_MEMORY
+    free(rendered);
+#endif
+    return prefix->pattern == pattern ? prefix : NULL;
+  }
+  return rendered;
+}
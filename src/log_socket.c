@@ -0,0 +1,357 @@
+#define _GNU_SOURCE /* For sendmmsg() and program_invocation_short_name. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The records a sink holds while the collector is slow or down. When it is
+ * full, the oldest records go to the fallback file, or are dropped.
+ */
+#define LOG_SOCKET_BUFFER_SIZE (256 * 1024)
+
+/**
+ * The largest packet in the compact framing.
+ */
+#define LOG_SOCKET_PACKET_SIZE 32768
+
+/**
+ * The most packets sent by one call to sendmmsg().
+ */
+#define LOG_SOCKET_BATCH 64
+
+/**
+ * Records are sent once the oldest one is this old (in nanoseconds), when
+ * the next record arrives, or once a packet is full.
+ */
+#define LOG_SOCKET_DELAY_NS 20000000ULL
+
+/**
+ * A sink that lost its collector tries to reconnect at most this often (in
+ * nanoseconds).
+ */
+#define LOG_SOCKET_RETRY_NS 1000000000ULL
+
+/**
+ * A sink that sends records to a collector over a Unix-domain socket.
+ */
+struct LogSocketSink {
+  struct LogSink sink;
+  struct sockaddr_un address;
+  int fd;                /**< The socket, or -1 while disconnected. */
+  int flags;
+  log_t level;           /**< The severity of lines without a header. */
+  int fallback_fd;       /**< The fallback file, or -1. */
+  uint64_t retry_ns;     /**< When to try to reconnect. */
+  uint64_t first_ns;     /**< When the oldest buffered record arrived. */
+  unsigned long long dropped; /**< Records dropped without a fallback. */
+  char hostname[64];
+  char last_stamp[25];   /**< The last header timestamp parsed, to the
+			    second... */
+  time_t last_sec;       /**< ...and its time. */
+  char headers[LOG_SOCKET_BATCH][128]; /**< RFC 5424 headers being sent. */
+  size_t len;
+  char buffer[LOG_SOCKET_BUFFER_SIZE];
+};
+
+/**
+ * Returns the current value of the monotonic clock in nanoseconds.
+ */
+static uint64_t log_socket_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Connects to the collector, as a SOCK_SEQPACKET or else a SOCK_DGRAM
+ * socket. Sends never block.
+ * \return true if the sink is connected.
+ */
+static bool log_socket_connect(struct LogSocketSink * sink) {
+  static const int types[] = { SOCK_SEQPACKET, SOCK_DGRAM };
+  for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+    int fd = socket(AF_UNIX, types[i] | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) continue;
+    if(connect(fd, (struct sockaddr *) &sink->address,
+	       sizeof(sink->address)) == 0) {
+      sink->fd = fd;
+      return true;
+    }
+    int error = errno;
+    close(fd);
+    /* Only a collector of the other type is worth a second attempt. */
+    if(error != EPROTOTYPE) break;
+  }
+  sink->retry_ns = log_socket_now_ns() + LOG_SOCKET_RETRY_NS;
+  return false;
+}
+
+/**
+ * Writes all of data to a file descriptor.
+ */
+static void log_socket_write_all(int fd, const char * data, size_t len) {
+  for(size_t written = 0; written < len;) {
+    ssize_t n = write(fd, data + written, len - written);
+    if(n < 0 && errno != EINTR) break;
+    if(n > 0) written += n;
+  }
+}
+
+/**
+ * Writes records that cannot be sent to the fallback file, or drops them.
+ */
+static void log_socket_spill(struct LogSocketSink * sink, const char * data,
+			     size_t len) {
+  if(sink->fallback_fd >= 0) {
+    log_socket_write_all(sink->fallback_fd, data, len);
+    return;
+  }
+  for(const char * end = data + len; data < end; ++data)
+    if(*data == '\n') ++sink->dropped;
+}
+
+/**
+ * Returns the length of the record at the start of data, up to and
+ * including its newline.
+ */
+static size_t log_socket_record_len(const char * data, size_t len) {
+  const char * newline = memchr(data, '\n', len);
+  return newline != NULL ? (size_t) (newline - data) + 1 : len;
+}
+
+/**
+ * Renders the RFC 5424 header of a record: the priority (facility user),
+ * the time and severity of the record header (or the current time and the
+ * severity of the stream), the host, the program and its ID.
+ * \return The length of the RFC 5424 header, and in skip the length of the
+ * record header it replaces.
+ */
+static size_t log_socket_rfc5424(struct LogSocketSink * sink,
+				 const char * record, size_t len, char * out,
+				 size_t size, size_t * skip) {
+  static const int severities[] = { 2, 3, 4, 6, 7, 7 };
+  struct timespec time;
+  log_t level = sink->level;
+  *skip = 0;
+  if(len > sizeof(sink->last_stamp)
+     && memcmp(record, sink->last_stamp, sizeof(sink->last_stamp)) == 0) {
+    /* The seconds of a header are converted once per second, but the
+       fraction of each record is its own. */
+    long nsec = 0;
+    *skip = log_parse_header(record, len, NULL, &level);
+    log_header_layout(record, len, &nsec, NULL);
+    time.tv_sec = sink->last_sec;
+    time.tv_nsec = nsec;
+  } else if((*skip = log_parse_header(record, len, &time, &level)) > 0) {
+    memcpy(sink->last_stamp, record, sizeof(sink->last_stamp));
+    sink->last_sec = time.tv_sec;
+  }
+  if(*skip == 0) clock_gettime(CLOCK_REALTIME, &time);
+  int severity = level >= LOG_FATAL && level <= LOG_TRACE
+    ? severities[level] : 7;
+  struct tm fields;
+  localtime_r(&time.tv_sec, &fields);
+  char stamp[48], zone[8];
+  size_t stamp_len = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S",
+			      &fields);
+  /* Record headers have whole seconds, and then so does the message. */
+  if(time.tv_nsec != 0)
+    snprintf(stamp + stamp_len, sizeof(stamp) - stamp_len, ".%06ld",
+	     time.tv_nsec / 1000);
+  strftime(zone, sizeof(zone), "%z", &fields);
+  int n = snprintf(out, size, "<%d>1 %s%.3s:%s %s %s %d - - ",
+		   8 + severity, stamp, zone, zone + 3, sink->hostname,
+		   program_invocation_short_name, (int) log_process_id());
+  return n > 0 && (size_t) n < size ? (size_t) n : 0;
+}
+
+/**
+ * Sends records, as many per packet as fit in the compact framing and one
+ * per packet in RFC 5424, with one system call per batch of packets. The
+ * sink must be connected.
+ * \return The number of bytes of data that were sent (or given up on).
+ */
+static size_t log_socket_send(struct LogSocketSink * sink, const char * data,
+			      size_t len) {
+  size_t sent = 0;
+  while(sent < len) {
+    struct mmsghdr messages[LOG_SOCKET_BATCH];
+    struct iovec parts[LOG_SOCKET_BATCH][2];
+    size_t lens[LOG_SOCKET_BATCH];
+    unsigned count = 0;
+    for(size_t offset = sent; offset < len && count < LOG_SOCKET_BATCH;
+	++count) {
+      const char * record = data + offset;
+      size_t left = len - offset;
+      size_t record_len = log_socket_record_len(record, left);
+      struct msghdr * header = &messages[count].msg_hdr;
+      memset(header, 0, sizeof(*header));
+      header->msg_iov = parts[count];
+      if(sink->flags & LOG_SOCKET_RFC5424) {
+	size_t skip;
+	char * prefix = sink->headers[count];
+	size_t prefix_len = log_socket_rfc5424(sink, record, record_len,
+					       prefix, sizeof(sink->headers[0]),
+					       &skip);
+	/* The trailing newline is not part of the message. */
+	size_t message_len = record_len - skip
+	  - (record[record_len - 1] == '\n');
+	parts[count][0] = (struct iovec) { prefix, prefix_len };
+	parts[count][1] = (struct iovec) { (char *) record + skip,
+					   message_len };
+	header->msg_iovlen = 2;
+      } else {
+	/* Add whole records while they fit in the packet. */
+	while(record_len < left) {
+	  size_t next = log_socket_record_len(record + record_len,
+					      left - record_len);
+	  if(record_len + next > LOG_SOCKET_PACKET_SIZE) break;
+	  record_len += next;
+	}
+	parts[count][0] = (struct iovec) { (char *) record, record_len };
+	header->msg_iovlen = 1;
+      }
+      lens[count] = record_len;
+      offset += record_len;
+    }
+    int n = sendmmsg(sink->fd, messages, count, MSG_NOSIGNAL);
+    for(int i = 0; i < n; ++i)
+      sent += lens[i];
+    if(n < 0 && errno == EMSGSIZE) {
+      /* A record too long for the socket goes to the fallback file. */
+      log_socket_spill(sink, data + sent, lens[0]);
+      sent += lens[0];
+    } else if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+	      && errno != EINTR && errno != ENOBUFS) {
+      /* The collector is gone; keep the records until it is back. */
+      close(sink->fd);
+      sink->fd = -1;
+      sink->retry_ns = log_socket_now_ns() + LOG_SOCKET_RETRY_NS;
+      break;
+    } else if(n < (int) count) {
+      break; /* The socket is full. */
+    }
+  }
+  return sent;
+}
+
+/**
+ * Sends the buffered records, reconnecting first if the sink lost its
+ * collector and the retry is due. While there is no collector, the records
+ * go to the fallback file if there is one; records that could not be sent
+ * to a collector stay buffered.
+ */
+static void log_socket_flush(struct LogSocketSink * sink) {
+  if(sink->len == 0) return;
+  if(sink->fd < 0) {
+    if(log_socket_now_ns() < sink->retry_ns || !log_socket_connect(sink)) {
+      if(sink->fallback_fd >= 0) {
+	log_socket_spill(sink, sink->buffer, sink->len);
+	sink->len = 0;
+      }
+      return;
+    }
+    if(sink->dropped > 0) {
+      /* Tell the collector what it missed. */
+      char note[LOG_SOCKET_PACKET_SIZE / 64];
+      size_t len = log_format_record(note, sizeof(note), LOG_WARNING,
+				     "%llu records were dropped while the "
+				     "collector was down.", sink->dropped);
+      if(log_socket_send(sink, note, len) == len) sink->dropped = 0;
+    }
+  }
+  size_t sent = log_socket_send(sink, sink->buffer, sink->len);
+  memmove(sink->buffer, sink->buffer + sent, sink->len - sent);
+  sink->len -= sent;
+}
+
+static void log_socket_sink_write(struct LogSink * base, const char * data,
+				  size_t len) {
+  struct LogSocketSink * sink = (struct LogSocketSink *) base;
+  uint64_t now = log_socket_now_ns();
+  if(sink->len + len > LOG_SOCKET_BUFFER_SIZE) {
+    log_socket_flush(sink);
+    if(sink->len + len > LOG_SOCKET_BUFFER_SIZE) {
+      /* The collector is not keeping up: give up on the oldest records. */
+      log_socket_spill(sink, sink->buffer, sink->len);
+      sink->len = 0;
+    }
+  }
+  if(len > LOG_SOCKET_BUFFER_SIZE) {
+    log_socket_spill(sink, data, len);
+    return;
+  }
+  if(sink->len == 0) sink->first_ns = now;
+  memcpy(sink->buffer + sink->len, data, len);
+  sink->len += len;
+  if(sink->len >= LOG_SOCKET_PACKET_SIZE
+     || now - sink->first_ns >= LOG_SOCKET_DELAY_NS)
+    log_socket_flush(sink);
+}
+
+static void log_socket_sink_sync(struct LogSink * base) {
+  struct LogSocketSink * sink = (struct LogSocketSink *) base;
+  /* Retry at once, since the records would be lost otherwise. */
+  sink->retry_ns = 0;
+  log_socket_flush(sink);
+  if(sink->len > 0) log_socket_spill(sink, sink->buffer, sink->len);
+  sink->len = 0;
+}
+
+static void log_socket_sink_close(struct LogSink * base) {
+  struct LogSocketSink * sink = (struct LogSocketSink *) base;
+  log_socket_sink_sync(base);
+  if(sink->fd >= 0) close(sink->fd);
+  if(sink->fallback_fd >= 0) close(sink->fallback_fd);
+  free(sink);
+}
+
+struct LogSink * log_socket_open(const char * path, const char * fallback,
+				 int flags, log_t level) {
+  if(strlen(path) >= sizeof(((struct sockaddr_un *) NULL)->sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  struct LogSocketSink * sink = malloc(sizeof(struct LogSocketSink));
+  if(sink == NULL) return NULL;
+  sink->sink.write = log_socket_sink_write;
+  sink->sink.sync = log_socket_sink_sync;
+  sink->sink.close = log_socket_sink_close;
+  memset(&sink->address, 0, sizeof(sink->address));
+  sink->address.sun_family = AF_UNIX;
+  strcpy(sink->address.sun_path, path);
+  sink->fd = -1;
+  sink->flags = flags;
+  sink->level = level;
+  sink->retry_ns = 0;
+  sink->dropped = 0;
+  sink->len = 0;
+  memset(sink->last_stamp, 0, sizeof(sink->last_stamp));
+  if(gethostname(sink->hostname, sizeof(sink->hostname)) != 0)
+    strcpy(sink->hostname, "-");
+  sink->hostname[sizeof(sink->hostname) - 1] = '\0';
+  sink->fallback_fd = -1;
+  if(fallback != NULL
+     && (sink->fallback_fd = open(fallback, O_WRONLY | O_CREAT | O_APPEND
+				  | O_CLOEXEC, 0666)) < 0) {
+    int error = errno;
+    free(sink);
+    errno = error;
+    return NULL;
+  }
+  /* The collector may not be up yet; the sink retries when records come. */
+  log_socket_connect(sink);
+  return &sink->sink;
+}
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE /* For sched_getcpu() and pthread_setaffinity_np(). */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The largest number of NUMA nodes that get a staging buffer of their own.
+ * CPUs of further nodes share the buffer of node 0.
+ */
+#define LOG_STAGING_MAX_NODES 64
+
+/**
+ * The size of a huge page, to which staging memory is rounded when huge
+ * pages are requested.
+ */
+#define LOG_STAGING_HUGE_PAGE_SIZE (2UL << 20)
+
+/**
+ * The smallest staging buffer of a node.
+ */
+#define LOG_STAGING_MIN_SIZE 16384
+
+/**
+ * The staging buffer and writer thread of a NUMA node. Producers append
+ * rendered records to the active half of the buffer of their stream; the
+ * writer swaps the halves and writes the full one.
+ */
+struct LogStagingNode {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;        /**< Signals the writer. */
+  pthread_cond_t ready;       /**< Signals that the writer has started. */
+  pthread_t writer;
+  cpu_set_t cpus;
+  bool running;               /**< Producers may append. */
+  bool stopping;              /**< The writer should drain and exit. */
+  bool started;
+  char * memory;
+  size_t mapped;
+  size_t size;                /**< The size of each half of each stream. */
+  char * active[2];           /**< The halves producers append to... */
+  char * spare[2];            /**< ...and the halves being written. */
+  size_t len[2];
+};
+
+/**
+ * The nodes are never freed, so a producer can always take their lock; it
+ * finds running false once the staging buffers are gone.
+ */
+static struct LogStagingNode staging_nodes[LOG_STAGING_MAX_NODES];
+static size_t staging_node_count = 0;
+static unsigned short staging_cpu_node[CPU_SETSIZE];
+static _Atomic bool staging_enabled = false;
+static pthread_mutex_t staging_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t staging_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Adds the CPUs of a list such as "0-3,8-11" to a set.
+ */
+static void log_staging_parse_cpus(const char * list, cpu_set_t * cpus) {
+  char * end;
+  while(*list != '\0' && *list != '\n') {
+    unsigned long first = strtoul(list, &end, 10), last = first;
+    if(end == list) break;
+    if(*end == '-') last = strtoul(end + 1, &end, 10);
+    for(unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+      CPU_SET(cpu, cpus);
+    list = *end == ',' ? end + 1 : end;
+  }
+}
+
+/**
+ * Reads the CPUs of each NUMA node from sysfs. Without NUMA support, all
+ * CPUs form a single node.
+ */
+static void log_staging_find_nodes(void) {
+  for(size_t i = 0; i < LOG_STAGING_MAX_NODES; ++i) {
+    pthread_mutex_init(&staging_nodes[i].lock, NULL);
+    pthread_cond_init(&staging_nodes[i].wake, NULL);
+    pthread_cond_init(&staging_nodes[i].ready, NULL);
+  }
+  DIR * dir = opendir("/sys/devices/system/node");
+  struct dirent * entry;
+  while(dir != NULL && (entry = readdir(dir)) != NULL) {
+    unsigned node;
+    char path[300], list[4096];
+    if(sscanf(entry->d_name, "node%u", &node) != 1
+       || node >= LOG_STAGING_MAX_NODES)
+      continue;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+	     entry->d_name);
+    FILE * file = fopen(path, "r");
+    if(file == NULL) continue;
+    if(fgets(list, sizeof(list), file) != NULL) {
+      log_staging_parse_cpus(list, &staging_nodes[node].cpus);
+      if(node + 1 > staging_node_count) staging_node_count = node + 1;
+    }
+    fclose(file);
+  }
+  if(dir != NULL) closedir(dir);
+  if(staging_node_count == 0) {
+    staging_node_count = 1;
+    sched_getaffinity(0, sizeof(cpu_set_t), &staging_nodes[0].cpus);
+  }
+  for(size_t node = 0; node < staging_node_count; ++node)
+    for(size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if(CPU_ISSET(cpu, &staging_nodes[node].cpus))
+	staging_cpu_node[cpu] = node;
+}
+
+/**
+ * Writes the records staged for each stream, one batch per stream.
+ */
+static void log_staging_write(struct LogStagingNode * node,
+			      const size_t * len) {
+  if(len[0] > 0) log_emit(LOG_INFO, node->spare[0], len[0]);
+  if(len[1] > 0) log_emit(LOG_ERROR, node->spare[1], len[1]);
+}
+
+/**
+ * The writer thread of a node. It runs on the CPUs of its node and touches
+ * the staging memory first, so that the kernel places it on that node.
+ */
+static void * log_staging_writer(void * argument) {
+  struct LogStagingNode * node = argument;
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node->cpus);
+  memset(node->memory, 0, node->mapped);
+  pthread_mutex_lock(&node->lock);
+  node->started = true;
+  pthread_cond_signal(&node->ready);
+  for(;;) {
+    while(node->len[0] == 0 && node->len[1] == 0 && !node->stopping)
+      pthread_cond_wait(&node->wake, &node->lock);
+    if(node->len[0] == 0 && node->len[1] == 0) break; /* Stopping. */
+    size_t len[2] = { node->len[0], node->len[1] };
+    for(int stream = 0; stream < 2; ++stream) {
+      char * full = node->active[stream];
+      node->active[stream] = node->spare[stream];
+      node->spare[stream] = full;
+      node->len[stream] = 0;
+    }
+    /* Producers fill the other halves while this thread writes. */
+    pthread_mutex_unlock(&node->lock);
+    log_staging_write(node, len);
+    pthread_mutex_lock(&node->lock);
+  }
+  pthread_mutex_unlock(&node->lock);
+  return NULL;
+}
+
+/**
+ * Maps the staging memory of a node, on huge pages if requested and
+ * available.
+ */
+static char * log_staging_map(size_t * size, bool huge_pages) {
+  char * memory = MAP_FAILED;
+  if(huge_pages) {
+    *size = (*size + LOG_STAGING_HUGE_PAGE_SIZE - 1)
+      & ~(LOG_STAGING_HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+    memory = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  }
+  if(memory == MAP_FAILED) {
+    memory = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+    /* Fall back on transparent huge pages. */
+    if(memory != MAP_FAILED && huge_pages)
+      madvise(memory, *size, MADV_HUGEPAGE);
+#endif
+  }
+  return memory == MAP_FAILED ? NULL : memory;
+}
+
+/**
+ * Stops the writers, which write what is staged first, and releases the
+ * staging memory. staging_lock must be held.
+ */
+static void log_staging_stop(void) {
+  atomic_store(&staging_enabled, false);
+  for(size_t i = 0; i < staging_node_count; ++i) {
+    struct LogStagingNode * node = &staging_nodes[i];
+    pthread_mutex_lock(&node->lock);
+    bool started = node->started;
+    node->running = false;
+    node->stopping = true;
+    pthread_cond_signal(&node->wake);
+    pthread_mutex_unlock(&node->lock);
+    if(started) pthread_join(node->writer, NULL);
+    if(node->memory != NULL) munmap(node->memory, node->mapped);
+    node->memory = NULL;
+    node->started = false;
+  }
+}
+
+/**
+ * Writes what is staged when the program exits.
+ */
+static void log_staging_exit(void) {
+  pthread_mutex_lock(&staging_lock);
+  log_staging_stop();
+  pthread_mutex_unlock(&staging_lock);
+}
+
+/**
+ * A child created by fork() has no writer threads, so it writes its records
+ * itself.
+ */
+static void log_staging_after_fork(void) {
+  atomic_store(&staging_enabled, false);
+  pthread_mutex_init(&staging_lock, NULL);
+  for(size_t i = 0; i < staging_node_count; ++i) {
+    struct LogStagingNode * node = &staging_nodes[i];
+    pthread_mutex_init(&node->lock, NULL);
+    node->running = false;
+    node->started = false;
+  }
+}
+
+static void log_staging_setup(void) {
+  log_staging_find_nodes();
+  pthread_atfork(NULL, NULL, log_staging_after_fork);
+  atexit(log_staging_exit);
+}
+
+void log_set_staging(size_t size, int flags) {
+  pthread_once(&staging_once, log_staging_setup);
+  pthread_mutex_lock(&staging_lock);
+  log_staging_stop();
+  if(size == 0) {
+    pthread_mutex_unlock(&staging_lock);
+    return;
+  }
+  if(size < LOG_STAGING_MIN_SIZE) size = LOG_STAGING_MIN_SIZE;
+  for(size_t i = 0; i < staging_node_count; ++i) {
+    struct LogStagingNode * node = &staging_nodes[i];
+    if(CPU_COUNT(&node->cpus) == 0) continue; /* A node without CPUs. */
+    size_t mapped = size;
+    if((node->memory = log_staging_map(&mapped,
+				       flags & LOG_STAGING_HUGE_PAGES)) == NULL) {
+      log_staging_stop();
+      pthread_mutex_unlock(&staging_lock);
+      log_error("I could not allocate the staging buffers with error %d.",
+		errno);
+      return;
+    }
+    node->mapped = mapped;
+    node->size = mapped / 4;
+    for(int stream = 0; stream < 2; ++stream) {
+      node->active[stream] = node->memory + 2 * stream * node->size;
+      node->spare[stream] = node->active[stream] + node->size;
+      node->len[stream] = 0;
+    }
+    node->stopping = false;
+    int error = pthread_create(&node->writer, NULL, log_staging_writer, node);
+    if(error != 0) {
+      log_staging_stop();
+      pthread_mutex_unlock(&staging_lock);
+      log_error("I could not start a staging writer with error %d.", error);
+      return;
+    }
+    pthread_mutex_lock(&node->lock);
+    while(!node->started)
+      pthread_cond_wait(&node->ready, &node->lock);
+    node->running = true;
+    pthread_mutex_unlock(&node->lock);
+  }
+  atomic_store(&staging_enabled, true);
+  pthread_mutex_unlock(&staging_lock);
+}
+
+bool log_staging_enqueue(const log_t level, const char * record, size_t len) {
+  if(!atomic_load_explicit(&staging_enabled, memory_order_relaxed))
+    return false;
+  int cpu = sched_getcpu();
+  struct LogStagingNode * node =
+    &staging_nodes[cpu >= 0 && cpu < CPU_SETSIZE ? staging_cpu_node[cpu] : 0];
+  int stream = log_level_is_error(level) ? 1 : 0;
+  pthread_mutex_lock(&node->lock);
+  /* The caller writes the record itself if it does not fit. */
+  bool staged = node->running && node->len[stream] + len <= node->size;
+  if(staged) {
+    memcpy(node->active[stream] + node->len[stream], record, len);
+    if(node->len[0] == 0 && node->len[1] == 0)
+      pthread_cond_signal(&node->wake);
+    node->len[stream] += len;
+  }
+  pthread_mutex_unlock(&node->lock);
+  return staged;
+}
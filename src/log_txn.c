@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "log_private.h"
+
+/**
+ * The capacity of the capture buffer of each thread.
+ */
+#define LOG_TXN_SIZE 65536
+
+/**
+ * A captured record. The context text, then a copy of the format and the
+ * packed arguments (or the formatted message) follow it, each padded to a
+ * multiple of 8 bytes.
+ */
+struct LogTxnEntry {
+  uint32_t size;        /**< The size of the whole entry. */
+  uint32_t data_len;    /**< The size of the packed arguments or message. */
+  uint16_t context_len;
+  int16_t level;
+  uint32_t format_size; /**< The size of the format, or 0 if data is the
+			   message. */
+  struct timespec time;
+  uint64_t ticks;
+  const struct LogSite * site;
+};
+
+/**
+ * The open transaction of a thread.
+ */
+struct LogTxn {
+  unsigned depth;       /**< The number of nested transactions. */
+  log_t level;          /**< The least severe level captured. */
+  bool failed;          /**< Captured records have been written. */
+  size_t len;
+  size_t skipped;       /**< Records that did not fit. */
+  unsigned char data[LOG_TXN_SIZE];
+};
+
+__thread struct LogTxn * log_txn_thread = NULL;
+
+/**
+ * The buffer of each thread is kept for its lifetime. It is taken from the
+ * arena if log_static_init() was called, and otherwise allocated and freed
+ * when the thread exits.
+ */
+static __thread struct LogTxn * log_txn_buffer = NULL;
+#ifndef LOG_STATIC_MEMORY
+static pthread_once_t log_txn_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_txn_key;
+
+static void log_txn_free(void * buffer) {
+  free(buffer);
+}
+
+static void log_txn_setup(void) {
+  pthread_key_create(&log_txn_key, log_txn_free);
+}
+#endif
+
+void log_txn_begin(log_t level) {
+  if(log_txn_thread != NULL) {
+    /* Nested transactions share the outermost one. */
+    ++log_txn_thread->depth;
+    return;
+  }
+  if(log_txn_buffer == NULL
+     && (log_txn_buffer = log_arena_alloc(sizeof(struct LogTxn))) == NULL) {
+#ifdef LOG_STATIC_MEMORY
+    log_error("I could not begin a transaction with error %d.", ENOMEM);
+    return;
+#else
+    pthread_once(&log_txn_once, log_txn_setup);
+    if((log_txn_buffer = malloc(sizeof(struct LogTxn))) == NULL) {
+      log_error("I could not begin a transaction with error %d.", errno);
+      return;
+    }
+    pthread_setspecific(log_txn_key, log_txn_buffer);
+#endif
+  }
+  struct LogTxn * txn = log_txn_buffer;
+  txn->depth = 1;
+  txn->level = level;
+  txn->failed = false;
+  txn->len = 0;
+  txn->skipped = 0;
+  log_txn_thread = txn;
+}
+
+/**
+ * Writes the captured records, oldest first.
+ */
+static void log_txn_flush(struct LogTxn * txn) {
+  struct LogContext context;
+  for(size_t offset = 0; offset < txn->len;) {
+    const struct LogTxnEntry * entry =
+      (const struct LogTxnEntry *) (txn->data + offset);
+    const unsigned char * data = (const unsigned char *) (entry + 1);
+    context.depth = 0;
+    context.len = entry->context_len;
+    memcpy(context.text, data, entry->context_len);
+    data += (entry->context_len + 7) / 8 * 8;
+    struct LogRecord fields = {
+      .level = entry->level, .time = entry->time, .ticks = entry->ticks,
+      .site = entry->site, .context = &context
+    };
+    if(entry->format_size > 0) {
+      fields.format = (const char *) data;
+      fields.packed = data + entry->format_size;
+    } else {
+      fields.message = (const char *) data;
+      fields.message_len = entry->data_len;
+    }
+    log_submit_message(&fields);
+    offset += entry->size;
+  }
+  if(txn->skipped > 0) {
+    struct LogRecord fields = {
+      .level = LOG_WARNING,
+      .format = "%zu records of the transaction did not fit in its buffer."
+    };
+    log_record_stamp(&fields);
+    log_submit_message(&fields, txn->skipped);
+  }
+  txn->len = 0;
+  txn->skipped = 0;
+}
+
+/**
+ * Ends the innermost transaction.
+ */
+static void log_txn_end(struct LogTxn * txn) {
+  if(--txn->depth == 0) log_txn_thread = NULL;
+}
+
+void log_txn_commit(void) {
+  struct LogTxn * txn = log_txn_thread;
+  if(txn == NULL) return;
+  if(txn->depth == 1) {
+    /* The records were not needed after all. */
+    txn->len = 0;
+    txn->skipped = 0;
+  }
+  log_txn_end(txn);
+}
+
+void log_txn_fail(void) {
+  struct LogTxn * txn = log_txn_thread;
+  if(txn == NULL) return;
+  log_txn_flush(txn);
+  txn->failed = true;
+  log_txn_end(txn);
+}
+
+int log_txn_route(log_t level, bool logged) {
+  struct LogTxn * txn = log_txn_thread;
+  if(logged) {
+    /* An error fails the transaction, after the records that led to it. */
+    if(level <= LOG_ERROR && !txn->failed) {
+      log_txn_flush(txn);
+      txn->failed = true;
+    }
+    return LOG_TXN_NONE;
+  }
+  if(level > txn->level) return LOG_TXN_NONE;
+  return txn->failed ? LOG_TXN_EMIT : LOG_TXN_CAPTURE;
+}
+
+void log_txn_capture(const struct LogRecord * fields, va_list * args) {
+  struct LogTxn * txn = log_txn_thread;
+  size_t room = LOG_TXN_SIZE - txn->len;
+  size_t context_len = fields->context != NULL ? fields->context->len : 0;
+  size_t header = sizeof(struct LogTxnEntry) + (context_len + 7) / 8 * 8;
+  if(header > room) {
+    ++txn->skipped;
+    return;
+  }
+  struct LogTxnEntry * entry = (struct LogTxnEntry *) (txn->data + txn->len);
+  unsigned char * data = txn->data + txn->len + header;
+  size_t data_len;
+  size_t format_size = 0;
+  const char * format = fields->format;
+  if(format != NULL) {
+    /* Keep the arguments rather than formatting them, and a copy of the
+       format, which may be in a buffer that is reused before the flush. */
+    size_t format_len = strlen(format) + 1;
+    format_size = (format_len + 7) / 8 * 8;
+    bool fits = format_size <= room - header;
+    if(fits) memcpy(data, format, format_len);
+    data_len = log_pack_args(fits ? data + format_size : data,
+			     fits ? room - header - format_size : 0, format,
+			     *args);
+    if(data_len == LOG_PACK_UNSUPPORTED) {
+      /* The C library will format it, so do so now. */
+      format_size = 0;
+      int len = log_vsnprintf((char *) data, room - header, fields->format,
+			      *args);
+      data_len = len > 0 ? len : 0;
+    }
+  } else {
+    data_len = fields->message_len;
+    if(data_len <= room - header) memcpy(data, fields->message, data_len);
+  }
+  size_t size = header + format_size + (data_len + 7) / 8 * 8;
+  if(size > room) {
+    ++txn->skipped;
+    return;
+  }
+  entry->size = size;
+  entry->data_len = data_len;
+  entry->context_len = context_len;
+  entry->level = fields->level;
+  entry->time = fields->time;
+  entry->ticks = fields->ticks;
+  entry->format_size = format_size;
+  entry->site = fields->site;
+  if(context_len > 0)
+    memcpy(entry + 1, fields->context->text, context_len);
+  txn->len += size;
+}
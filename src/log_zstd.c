@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef LOG_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "log.h"
+#include "log_private.h"
+
+#ifdef LOG_HAVE_ZSTD
+
+/**
+ * The number of uncompressed bytes after which a frame is ended, so that a
+ * reader can start decoding at any frame.
+ */
+#define LOG_ZSTD_FRAME_SIZE (1 << 20)
+
+/**
+ * The compression level, zstd's default, which keeps up with the writer.
+ */
+#define LOG_ZSTD_LEVEL 3
+
+/**
+ * A file written as a sequence of zstd frames.
+ */
+struct LogZstdSink {
+  struct LogSink sink;
+  int fd;
+  ZSTD_CCtx * cctx;
+  size_t frame_len;  /**< The uncompressed bytes of the current frame. */
+  size_t out_size;
+  char * out;
+};
+
+/**
+ * Writes all of data to a file descriptor.
+ */
+static void log_zstd_write_all(int fd, const char * data, size_t len) {
+  for(size_t written = 0; written < len;) {
+    ssize_t n = write(fd, data + written, len - written);
+    if(n < 0 && errno != EINTR) break;
+    if(n > 0) written += n;
+  }
+}
+
+/**
+ * Compresses data (possibly none) and writes what zstd produces, flushing
+ * the current block or ending the frame.
+ */
+static void log_zstd_compress(struct LogZstdSink * sink, const char * data,
+			      size_t len, ZSTD_EndDirective mode) {
+  ZSTD_inBuffer in = { data, len, 0 };
+  size_t remaining;
+  do {
+    ZSTD_outBuffer out = { sink->out, sink->out_size, 0 };
+    remaining = ZSTD_compressStream2(sink->cctx, &out, &in, mode);
+    if(ZSTD_isError(remaining)) return;
+    log_zstd_write_all(sink->fd, sink->out, out.pos);
+  } while(remaining != 0 || in.pos < in.size);
+}
+
+static void log_zstd_sink_write(struct LogSink * base, const char * data,
+				size_t len) {
+  struct LogZstdSink * sink = (struct LogZstdSink *) base;
+  /*
+   * Every write is flushed, so the file can be tailed and loses nothing
+   * that was logged if the process dies; frames are ended periodically.
+   */
+  sink->frame_len += len;
+  bool end = sink->frame_len >= LOG_ZSTD_FRAME_SIZE;
+  log_zstd_compress(sink, data, len, end ? ZSTD_e_end : ZSTD_e_flush);
+  if(end) sink->frame_len = 0;
+}
+
+static void log_zstd_sink_sync(struct LogSink * base) {
+  struct LogZstdSink * sink = (struct LogZstdSink *) base;
+  if(sink->frame_len > 0) log_zstd_compress(sink, NULL, 0, ZSTD_e_end);
+  sink->frame_len = 0;
+}
+
+static void log_zstd_sink_close(struct LogSink * base) {
+  struct LogZstdSink * sink = (struct LogZstdSink *) base;
+  log_zstd_sink_sync(base);
+  close(sink->fd);
+  ZSTD_freeCCtx(sink->cctx);
+  free(sink->out);
+  free(sink);
+}
+
+/**
+ * Reads a whole dictionary file.
+ * \return The dictionary, to be freed by the caller, or NULL with errno set.
+ */
+static char * log_zstd_read_dictionary(const char * filename, size_t * len) {
+  FILE * file = fopen(filename, "rb");
+  if(file == NULL) return NULL;
+  char * data = NULL;
+  if(fseek(file, 0, SEEK_END) == 0) {
+    long size = ftell(file);
+    rewind(file);
+    if(size > 0 && (data = malloc(size)) != NULL
+       && fread(data, 1, size, file) != (size_t) size) {
+      free(data);
+      data = NULL;
+      errno = EIO;
+    }
+    *len = size > 0 ? size : 0;
+    if(size <= 0) errno = EINVAL;
+  }
+  fclose(file);
+  return data;
+}
+
+struct LogSink * log_zstd_open(const char * filename,
+			       const char * dictionary) {
+  struct LogZstdSink * sink = calloc(1, sizeof(struct LogZstdSink));
+  if(sink == NULL) return NULL;
+  sink->sink.write = log_zstd_sink_write;
+  sink->sink.sync = log_zstd_sink_sync;
+  sink->sink.close = log_zstd_sink_close;
+  sink->out_size = ZSTD_CStreamOutSize();
+  sink->out = malloc(sink->out_size);
+  sink->cctx = ZSTD_createCCtx();
+  int error = sink->out == NULL || sink->cctx == NULL ? ENOMEM : 0;
+  if(error == 0) {
+    ZSTD_CCtx_setParameter(sink->cctx, ZSTD_c_compressionLevel,
+			   LOG_ZSTD_LEVEL);
+    ZSTD_CCtx_setParameter(sink->cctx, ZSTD_c_checksumFlag, 1);
+  }
+  if(error == 0 && dictionary != NULL) {
+    /* A trained dictionary is used as such, anything else as raw content. */
+    size_t len;
+    char * data = log_zstd_read_dictionary(dictionary, &len);
+    if(data == NULL)
+      error = errno;
+    else if(ZSTD_isError(ZSTD_CCtx_loadDictionary(sink->cctx, data, len)))
+      error = EINVAL;
+    free(data);
+  }
+  if(error == 0
+     && (sink->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			 0666)) < 0)
+    error = errno;
+  if(error != 0) {
+    ZSTD_freeCCtx(sink->cctx);
+    free(sink->out);
+    free(sink);
+    errno = error;
+    return NULL;
+  }
+  return &sink->sink;
+}
+
+#else
+
+struct LogSink * log_zstd_open(const char * filename,
+			       const char * dictionary) {
+  (void) filename;
+  (void) dictionary;
+  errno = ENOTSUP;
+  return NULL;
+}
+
+#endif
@@ -1,7 +1,23 @@
+#define _GNU_SOURCE /* For fopencookie(). */
+
+#include <pthread.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifdef LOG_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "log.h"
 #include "testing_utilities.h"
@@ -251,6 +267,1332 @@ void test_log_trace(CuTest * tc) {
   CuAssertTrue(tc, strstr(msg, "TRACE") != NULL);
 }
 
+/**
+ * Tests that records logged by a process attached to a shared-memory ring are
+ * queued rather than written, including records from a forked child, and
+ * that log_shm_drain() writes them to the stream in order.
+ */
+void test_shm_ring(CuTest * tc) {
+  char name[64];
+  snprintf(name, sizeof(name), "/loglib_test_%d", (int) getpid());
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  CuAssertIntEquals(tc, 0, log_shm_create(name, 8, 256));
+  log_info("Queued by the parent.");
+  pid_t child = fork();
+  if(child == 0) {
+    log_info("Queued by the child.");
+    _exit(EXIT_SUCCESS);
+  }
+  waitpid(child, NULL, 0);
+  /* Nothing reaches the stream until the ring is drained. */
+  check_num_lines(fid, 0, tc);
+  CuAssertIntEquals(tc, 2, (int) log_shm_drain());
+  check_num_lines(fid, 2, tc);
+  rewind(fid);
+  char msg[0xff];
+  fread(msg, sizeof(char), 0xff, fid);
+  CuAssertTrue(tc, strstr(msg, "parent") < strstr(msg, "child"));
+  log_shm_detach();
+  log_shm_unlink(name);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that a full bulk lane drops records instead of blocking, that the
+ * collector reports how many were lost, and that errors are unaffected.
+ */
+void test_shm_ring_full(CuTest * tc) {
+  char name[64];
+  snprintf(name, sizeof(name), "/loglib_test_full_%d", (int) getpid());
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_stderr(fid);
+  log_set_level(LOG_INFO);
+  log_shm_create(name, 4, 128);
+  for(int i = 0; i < 6; ++i)
+    log_info("Message %d.", i);
+  log_error("Error.");
+  CuAssertIntEquals(tc, 5, (int) log_shm_drain());
+  /* The 5 queued records and 1 warning about the 2 lost ones. */
+  check_num_lines(fid, 6, tc);
+  rewind(fid);
+  char msg[0x400];
+  msg[fread(msg, sizeof(char), sizeof(msg) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(msg, "2 records were lost by the bulk lane")
+	       != NULL);
+  /* The express lane is written first. */
+  CuAssertTrue(tc, strstr(msg, "Error.") < strstr(msg, "Message 0."));
+  log_shm_detach();
+  log_shm_unlink(name);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  fclose(fid);
+}
+
+/**
+ * Tests that producers of a full express lane wait for the collector rather
+ * than drop records.
+ */
+void test_shm_express_lane(CuTest * tc) {
+  char name[64];
+  snprintf(name, sizeof(name), "/loglib_test_express_%d", (int) getpid());
+  FILE * fid = tmpfile();
+  log_set_stderr(fid);
+  log_shm_create_lanes(name, 2, LOG_SHM_WAIT, 2, LOG_SHM_DROP, 128);
+  pid_t child = fork();
+  if(child == 0) {
+    for(int i = 0; i < 8; ++i)
+      log_warning("Warning %d.", i);
+    _exit(EXIT_SUCCESS);
+  }
+  size_t drained = 0;
+  while(waitpid(child, NULL, WNOHANG) == 0)
+    drained += log_shm_drain();
+  drained += log_shm_drain();
+  CuAssertIntEquals(tc, 8, (int) drained);
+  check_num_lines(fid, 8, tc);
+  log_shm_detach();
+  log_shm_unlink(name);
+  log_set_stderr(stderr);
+  fclose(fid);
+}
+
+/**
+ * Tests that log_parse_header() recovers the level and time of a record
+ * written by log_msg().
+ */
+void test_parse_header(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stderr(fid);
+  time_t before = time(NULL);
+  log_warning("Parse me.");
+  time_t after = time(NULL);
+  rewind(fid);
+  char msg[0xff];
+  size_t len = fread(msg, sizeof(char), 0xff, fid);
+  struct timespec stamp;
+  log_t level;
+  size_t header_len = log_parse_header(msg, len, &stamp, &level);
+  CuAssertTrue(tc, header_len > 0);
+  CuAssertIntEquals(tc, LOG_WARNING, level);
+  CuAssertTrue(tc, stamp.tv_sec >= before && stamp.tv_sec <= after);
+  CuAssertTrue(tc, strncmp(msg + header_len, "Parse me.", 9) == 0);
+  CuAssertIntEquals(tc, 0, (int) log_parse_header("Not a header.", 13, NULL,
+						   NULL));
+  log_set_stderr(stderr);
+  fclose(fid);
+}
+
+/**
+ * Tests that files opened while the index is enabled get a sidecar index with
+ * an entry every few records, and that log_index_query() returns the records
+ * in the window and no others.
+ */
+void test_index_query(CuTest * tc) {
+  char * filename = tmpnam(NULL);
+  char index_filename[L_tmpnam + 8];
+  snprintf(index_filename, sizeof(index_filename), "%s.idx", filename);
+  log_set_level(LOG_INFO);
+  log_set_index(4, 0);
+  log_set_stdout_file(filename);
+  time_t now = time(NULL);
+  for(int i = 0; i < 10; ++i)
+    log_info("Record %d.", i);
+  /*
+   * The entries are in the index file already, as are the records before the
+   * last one (43 bytes each).
+   */
+  struct stat stats;
+  CuAssertIntEquals(tc, 0, stat(index_filename, &stats));
+  CuAssertIntEquals(tc, 8 + 3 * 16, (int) stats.st_size);
+  CuAssertIntEquals(tc, 0, stat(filename, &stats));
+  CuAssertIntEquals(tc, 8 * 43, (int) stats.st_size);
+  log_set_stdout(stdout);
+  log_set_index(0, 0);
+  /* A magic number and entries for records 0, 4 and 8. */
+  CuAssertIntEquals(tc, 0, stat(index_filename, &stats));
+  CuAssertIntEquals(tc, 8 + 3 * 16, (int) stats.st_size);
+  FILE * out = tmpfile();
+  CuAssertIntEquals(tc, 10, (int) log_index_query(filename, now - 60,
+						  now + 60, out));
+  check_num_lines(out, 10, tc);
+  fclose(out);
+  out = tmpfile();
+  CuAssertIntEquals(tc, 0, (int) log_index_query(filename, now + 3600,
+						 now + 7200, out));
+  check_num_lines(out, 0, tc);
+  fclose(out);
+  remove(filename);
+  remove(index_filename);
+}
+
+/**
+ * Tests that log_index_query() selects records by their timestamp, keeps
+ * continuation lines with their record, and only reads the part of the file
+ * that the index points at.
+ */
+void test_index_query_window(CuTest * tc) {
+  char * filename = tmpnam(NULL);
+  char index_filename[L_tmpnam + 8];
+  snprintf(index_filename, sizeof(index_filename), "%s.idx", filename);
+  /* Write records an hour apart, by hand, with an entry for each. */
+  FILE * fid = fopen(filename, "w");
+  FILE * index = fopen(index_filename, "w");
+  fwrite("LOGIDX01", sizeof(char), 8, index);
+  time_t base = 1500000000;
+  for(int i = 0; i < 5; ++i) {
+    time_t stamp = base + 3600 * i;
+    struct tm fields;
+    localtime_r(&stamp, &fields);
+    char time_str[25];
+    strftime(time_str, 25, "%a %d %b %Y %H:%M:%S", &fields);
+    int64_t entry[2] = { stamp, ftell(fid) };
+    fwrite(entry, sizeof(entry), 1, index);
+    fprintf(fid, "[%s] INFO: Record %d.\nContinued.\n", time_str, i);
+  }
+  fclose(fid);
+  fclose(index);
+  FILE * out = tmpfile();
+  CuAssertIntEquals(tc, 2, (int) log_index_query(filename, base + 3600,
+						 base + 7200, out));
+  check_num_lines(out, 4, tc);
+  rewind(out);
+  char msg[0x200];
+  msg[fread(msg, sizeof(char), sizeof(msg) - 1, out)] = '\0';
+  CuAssertTrue(tc, strstr(msg, "Record 1.") != NULL);
+  CuAssertTrue(tc, strstr(msg, "Record 2.") != NULL);
+  CuAssertTrue(tc, strstr(msg, "Record 3.") == NULL);
+  fclose(out);
+  remove(filename);
+  remove(index_filename);
+}
+
+/**
+ * Tests that records follow the pattern set by log_set_pattern(), that an
+ * invalid pattern is reported and ignored, and that NULL restores the default
+ * pattern.
+ */
+void test_set_pattern(CuTest * tc) {
+  FILE * fid = tmpfile();
+  FILE * errors = tmpfile();
+  log_set_stdout(fid);
+  log_set_stderr(errors);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%d %T.%us <%L> [%tid/%pid] 100%% %M");
+  log_info("Patterned %d.", 1);
+  log_set_pattern("%M and %M");
+  check_num_lines(errors, 1, tc);
+  log_info("Patterned %d.", 2);
+  log_set_pattern(NULL);
+  log_info("Default.");
+  rewind(fid);
+  char line[0x100];
+  int year, month, day, hour, minute, second, micros, tid, pid, n;
+  char level[16];
+  CuAssertTrue(tc, fgets(line, sizeof(line), fid) != NULL);
+  CuAssertIntEquals(tc, 10, sscanf(line, "%4d-%2d-%2d %2d:%2d:%2d.%6d <%15[A-Z]> "
+				  "[%d/%d] 100%% Patterned 1.\n", &year, &month,
+				  &day, &hour, &minute, &second, &micros, level,
+				  &tid, &pid));
+  CuAssertStrEquals(tc, "INFO", level);
+  CuAssertIntEquals(tc, (int) getpid(), pid);
+  CuAssertTrue(tc, fgets(line, sizeof(line), fid) != NULL);
+  CuAssertIntEquals(tc, 1, sscanf(line, "%*s %*s <INFO> [%*d/%*d] 100%% "
+				  "Patterned %d.", &n));
+  CuAssertIntEquals(tc, 2, n);
+  CuAssertTrue(tc, fgets(line, sizeof(line), fid) != NULL);
+  CuAssertTrue(tc, log_parse_header(line, strlen(line), NULL, NULL) > 0);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  fclose(fid);
+  fclose(errors);
+}
+
+/**
+ * Tests that the log macros pass their call site, whose prefix is rendered
+ * once per site and pattern, and that log_msg() has none.
+ */
+void test_call_site(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%F:%N %fn() %L: %M");
+  int line = __LINE__ + 2;
+  for(int i = 0; i < 3; ++i) {
+    log_info("Site %d.", i);
+    if(i == 1) log_set_pattern("<%L %fn> %M");
+  }
+  log_msg(LOG_INFO, "No site.");
+  log_set_pattern(NULL);
+  rewind(fid);
+  char line_text[0x100], expected[0x100];
+  for(int i = 0; i < 2; ++i) {
+    snprintf(expected, sizeof(expected), "%s:%d test_call_site() INFO: "
+	     "Site %d.\n", __FILE__, line, i);
+    CuAssertTrue(tc, fgets(line_text, sizeof(line_text), fid) != NULL);
+    CuAssertStrEquals(tc, expected, line_text);
+  }
+  CuAssertTrue(tc, fgets(line_text, sizeof(line_text), fid) != NULL);
+  CuAssertStrEquals(tc, "<INFO test_call_site> Site 2.\n", line_text);
+  CuAssertTrue(tc, fgets(line_text, sizeof(line_text), fid) != NULL);
+  CuAssertStrEquals(tc, "<INFO > No site.\n", line_text);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that the log macros take a format that is not a literal, and use
+ * the format of each call rather than that of the first.
+ */
+void test_runtime_format(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%M");
+  const char * formats[] = { "first %d", "second %d" };
+  for(int i = 0; i < 2; ++i)
+    log_info(formats[i], i + 1);
+  log_set_pattern(NULL);
+  rewind(fid);
+  char text[0x100];
+  text[fread(text, 1, sizeof(text) - 1, fid)] = '\0';
+  CuAssertStrEquals(tc, "first 1\nsecond 2\n", text);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that the site dictionary records each call site once, across a
+ * reopening as after a restart, under the ID that %site renders.
+ */
+void test_site_dictionary(CuTest * tc) {
+  char filename[L_tmpnam];
+  tmpnam(filename);
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%site %M");
+  for(int run = 0; run < 2; ++run) {
+    log_set_site_dictionary(filename);
+    for(int i = 0; i < 3; ++i)
+      log_info("Tab\tand %d.", i);
+    log_debug("Not logged.");
+  }
+  log_set_site_dictionary(NULL);
+  log_set_pattern(NULL);
+  check_num_lines(fid, 6, tc);
+  rewind(fid);
+  char record[0x100], entry[0x400];
+  CuAssertTrue(tc, fgets(record, sizeof(record), fid) != NULL);
+  FILE * dictionary = fopen(filename, "r");
+  check_num_lines(dictionary, 1, tc);
+  rewind(dictionary);
+  CuAssertTrue(tc, fgets(entry, sizeof(entry), dictionary) != NULL);
+  fclose(dictionary);
+  /* The record starts with the ID of the entry. */
+  CuAssertTrue(tc, strncmp(record, entry, 16) == 0);
+  CuAssertTrue(tc, strstr(entry, "\tINFO\t" __FILE__ "\t") != NULL);
+  CuAssertTrue(tc, strstr(entry, "\ttest_site_dictionary\tTab\\tand %d.\n")
+	       != NULL);
+  log_set_stdout(stdout);
+  fclose(fid);
+  remove(filename);
+}
+
+/**
+ * More call sites than the registry has slots for.
+ */
+#define MANY_SITES 6000
+
+/**
+ * Tests that the dictionary records each site once even when the registry
+ * has no slot for it. The registry stays full, so this test runs last.
+ */
+void test_site_dictionary_overflow(CuTest * tc) {
+  static struct LogSite sites[MANY_SITES];
+  char filename[L_tmpnam];
+  tmpnam(filename);
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_site_dictionary(filename);
+  for(int run = 0; run < 2; ++run)
+    for(int i = 0; i < MANY_SITES; ++i) {
+      sites[i] = (struct LogSite) { __FILE__, __func__, i + 1, LOG_INFO };
+      log_msg_site(&sites[i], "Site %d.", i);
+    }
+  log_set_site_dictionary(NULL);
+  FILE * dictionary = fopen(filename, "r");
+  check_num_lines(dictionary, MANY_SITES, tc);
+  fclose(dictionary);
+  log_set_stdout(stdout);
+  fclose(fid);
+  remove(filename);
+}
+
+/**
+ * Tests that records stamped with the cycle counter carry the wall-clock
+ * time, in order.
+ */
+void test_set_clock(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%s.%ns %M");
+  log_set_clock(LOG_CLOCK_TSC);
+  time_t before = time(NULL);
+  for(int i = 0; i < 100; ++i)
+    log_info("Tick.");
+  time_t after = time(NULL);
+  log_set_clock(LOG_CLOCK_REALTIME);
+  log_set_pattern(NULL);
+  rewind(fid);
+  long long last = 0, seconds, nanoseconds;
+  for(int i = 0; i < 100; ++i) {
+    CuAssertIntEquals(tc, 2, fscanf(fid, "%lld.%lld Tick.\n", &seconds,
+				    &nanoseconds));
+    CuAssertTrue(tc, seconds >= before - 1 && seconds <= after + 1);
+    CuAssertTrue(tc, seconds * 1000000000LL + nanoseconds >= last);
+    last = seconds * 1000000000LL + nanoseconds;
+  }
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Logs a message from a thread without context fields.
+ */
+static void * log_from_other_thread(void * arg) {
+  (void) arg;
+  log_info("Other thread.");
+  return NULL;
+}
+
+/**
+ * Tests that context fields appear before the message until they are popped
+ * and only in records of the thread that pushed them, and that the thread
+ * name is available to patterns.
+ */
+void test_context(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_context_push("request", "%d", 42);
+  log_context_push("tenant", "%s", "acme");
+  log_info("Both.");
+  pthread_t thread;
+  pthread_create(&thread, NULL, log_from_other_thread, NULL);
+  pthread_join(thread, NULL);
+  log_context_pop();
+  log_info("One.");
+  log_context_clear();
+  log_context_pop();
+  log_info("None.");
+  log_set_thread_name("worker");
+  log_set_pattern("%tname: %X%M");
+  log_context_push("task", "%s", "index");
+  log_info("Named.");
+  log_context_clear();
+  log_set_pattern(NULL);
+  rewind(fid);
+  char msg[0x400];
+  msg[fread(msg, sizeof(char), sizeof(msg) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(msg, "INFO: request=42 tenant=acme Both.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "INFO: Other thread.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "INFO: request=42 One.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "INFO: None.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "\nworker: task=index Named.\n") != NULL);
+  log_set_thread_name("test_log");
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that a transaction keeps the records below the log level and writes
+ * them, formatted as when they were logged, only if it fails.
+ */
+void test_txn(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_stderr(fid);
+  log_set_level(LOG_INFO);
+  /* A committed transaction writes nothing below the level. */
+  log_txn_begin(LOG_DEBUG);
+  log_debug("Committed %d.", 1);
+  log_info("Kept.");
+  log_txn_commit();
+  /* A failed one writes its records, arguments copied when logged. */
+  char name[16] = "alpha";
+  log_txn_begin(LOG_DEBUG);
+  CuAssertTrue(tc, log_is_enabled(LOG_DEBUG));
+  CuAssertTrue(tc, !log_is_enabled(LOG_TRACE));
+  log_context_push("request", "%d", 7);
+  log_debug("Failed %s %5.2f %c.", name, 2.5, 'x');
+  strcpy(name, "overwritten");
+  log_trace("Too verbose.");
+  log_context_pop();
+  log_txn_fail();
+  log_debug("After the transaction.");
+  /* An error fails the transaction, after the records that led to it. */
+  log_txn_begin(LOG_DEBUG);
+  log_txn_begin(LOG_TRACE);
+  log_debug("Nested %u.", 3U);
+  log_txn_commit();
+  log_msg(LOG_ERROR, "Error.");
+  log_debug("Since the error.");
+  log_txn_commit();
+  CuAssertTrue(tc, !log_is_enabled(LOG_DEBUG));
+  rewind(fid);
+  char msg[0x400];
+  msg[fread(msg, sizeof(char), sizeof(msg) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(msg, "Committed") == NULL);
+  CuAssertTrue(tc, strstr(msg, "INFO: Kept.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "DEBUG: request=7 Failed alpha  2.50 x.\n")
+	       != NULL);
+  CuAssertTrue(tc, strstr(msg, "Too verbose") == NULL);
+  CuAssertTrue(tc, strstr(msg, "After the transaction") == NULL);
+  char * nested = strstr(msg, "DEBUG: Nested 3.\n");
+  char * error = strstr(msg, "ERROR: Error.\n");
+  CuAssertTrue(tc, nested != NULL && error != NULL && nested < error);
+  CuAssertTrue(tc, strstr(msg, "DEBUG: Since the error.\n") != NULL);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  fclose(fid);
+}
+
+/**
+ * Tests that a transaction copies no more of a string than its precision,
+ * so the string need not be terminated.
+ */
+void test_txn_bounded_string(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%M");
+  char * unterminated = malloc(4);
+  memcpy(unterminated, "abcd", 4);
+  log_txn_begin(LOG_DEBUG);
+  log_debug("%.*s|%.3s|%.*s", 4, unterminated, unterminated, -1, "all");
+  free(unterminated);
+  log_txn_fail();
+  log_set_pattern(NULL);
+  rewind(fid);
+  char text[0x100];
+  text[fread(text, 1, sizeof(text) - 1, fid)] = '\0';
+  CuAssertStrEquals(tc, "abcd|abc|all\n", text);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that a transaction copies the format, which may be in a buffer that
+ * is overwritten before the records are written.
+ */
+void test_txn_format_buffer(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%M");
+  char format[32] = "Step %d of the import.";
+  log_txn_begin(LOG_DEBUG);
+  log_debug(format, 1);
+  strcpy(format, "Unrelated %d text!!!!!");
+  log_txn_fail();
+  log_set_pattern(NULL);
+  rewind(fid);
+  char text[0x100];
+  text[fread(text, 1, sizeof(text) - 1, fid)] = '\0';
+  CuAssertStrEquals(tc, "Step 1 of the import.\n", text);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Whether slow_write() is slow.
+ */
+static volatile bool slow = true;
+
+static ssize_t slow_write(void * cookie, const char * data, size_t len) {
+  if(slow) usleep(2000);
+  return fwrite(data, sizeof(char), len, (FILE *) cookie);
+}
+
+/**
+ * Tests that the governor sheds TRACE records while the stream is slow and
+ * restores them, with a summary, when it is fast again.
+ */
+void test_governor(CuTest * tc) {
+  FILE * sink = tmpfile();
+  FILE * stream = fopencookie(sink, "w", (cookie_io_functions_t) {
+      .write = slow_write });
+  setvbuf(stream, NULL, _IONBF, 0);
+  FILE * fid = tmpfile();
+  log_set_stdout(stream);
+  log_set_stderr(fid);
+  log_set_level(LOG_TRACE);
+  log_set_governor(500, 100);
+  for(int i = 0; i < 100; ++i)
+    log_trace("Slow %d.", i);
+  CuAssertTrue(tc, !log_is_enabled(LOG_TRACE));
+  CuAssertTrue(tc, log_is_enabled(LOG_DEBUG));
+  slow = false;
+  sleep(1);
+  for(int i = 0; i < 100; ++i)
+    log_debug("Fast %d.", i);
+  CuAssertTrue(tc, log_is_enabled(LOG_TRACE));
+  log_set_governor(0, 0);
+  rewind(fid);
+  char msg[0x400];
+  msg[fread(msg, sizeof(char), sizeof(msg) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(msg, "WARNING: The log is slow") != NULL);
+  unsigned long long info, debug, trace;
+  char * summary = strstr(msg, "The log is no longer slow; ");
+  CuAssertTrue(tc, summary != NULL);
+  CuAssertIntEquals(tc, 3, sscanf(summary, "The log is no longer slow; %llu "
+				  "INFO, %llu DEBUG and %llu TRACE", &info,
+				  &debug, &trace));
+  CuAssertTrue(tc, info == 0 && debug == 0 && trace > 0 && trace < 100);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  log_set_level(LOG_INFO);
+  fclose(stream);
+  fclose(sink);
+  fclose(fid);
+}
+
+/**
+ * Tests that the governor sheds from the configured level, so INFO records are
+ * shed at LOG_INFO, but never warnings.
+ */
+void test_governor_info(CuTest * tc) {
+  FILE * sink = tmpfile();
+  FILE * stream = fopencookie(sink, "w", (cookie_io_functions_t) {
+      .write = slow_write });
+  setvbuf(stream, NULL, _IONBF, 0);
+  FILE * fid = tmpfile();
+  log_set_stdout(stream);
+  log_set_stderr(fid);
+  log_set_level(LOG_INFO);
+  slow = true;
+  log_set_governor(500, 100);
+  for(int i = 0; i < 100; ++i)
+    log_info("Slow %d.", i);
+  CuAssertTrue(tc, !log_is_enabled(LOG_INFO));
+  CuAssertTrue(tc, log_is_enabled(LOG_WARNING));
+  slow = false;
+  sleep(1);
+  /* Nothing is written, so a shed record finds the stream idle. */
+  for(int i = 0; i < 100; ++i)
+    log_info("Idle %d.", i);
+  CuAssertTrue(tc, log_is_enabled(LOG_INFO));
+  log_set_governor(0, 0);
+  rewind(fid);
+  char msg[0x400];
+  msg[fread(msg, sizeof(char), sizeof(msg) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(msg, "WARNING: The log is slow") != NULL);
+  unsigned long long info, debug, trace;
+  char * summary = strstr(msg, "The log is no longer slow; ");
+  CuAssertTrue(tc, summary != NULL);
+  CuAssertIntEquals(tc, 3, sscanf(summary, "The log is no longer slow; %llu "
+				  "INFO, %llu DEBUG and %llu TRACE", &info,
+				  &debug, &trace));
+  CuAssertTrue(tc, info > 0 && info < 200 && debug == 0 && trace == 0);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  fclose(stream);
+  fclose(sink);
+  fclose(fid);
+}
+
+/**
+ * Logs records for test_staging().
+ */
+static void * log_staged(void * argument) {
+  for(int i = 0; i < 100; ++i)
+    log_info("Staged %d by %s.", i, (const char *) argument);
+  return NULL;
+}
+
+/**
+ * Tests that staged records all reach the stream once staging is disabled.
+ */
+void test_staging(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_staging(65536, 0);
+  pthread_t threads[4];
+  for(int i = 0; i < 4; ++i)
+    pthread_create(&threads[i], NULL, log_staged, "thread");
+  log_staged("main");
+  for(int i = 0; i < 4; ++i)
+    pthread_join(threads[i], NULL);
+  log_set_staging(0, 0);
+  check_num_lines(fid, 500, tc);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+static void log_from_signal(int signum) {
+  log_rt_msg(LOG_WARNING, "Signal %d.", signum);
+}
+
+/**
+ * Tests that records queued by log_rt_msg(), including from a signal
+ * handler, are written by log_rt_drain() and that overflow is counted.
+ */
+void test_rt(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_stderr(fid);
+  log_set_level(LOG_INFO);
+  log_rt_setup(2, 8);
+  char name[16] = "pump";
+  log_rt_msg(LOG_INFO, "Started %s at %.1f.", name, 48.5);
+  strcpy(name, "changed");
+  log_rt_msg(LOG_DEBUG, "Not logged.");
+  signal(SIGUSR1, log_from_signal);
+  raise(SIGUSR1);
+  signal(SIGUSR1, SIG_DFL);
+  /* A precision bounds a string that need not be terminated. */
+  char * unterminated = malloc(4);
+  memcpy(unterminated, "abcd", 4);
+  log_rt_msg(LOG_INFO, "Bounded %.*s|%.2s.", 4, unterminated, unterminated);
+  free(unterminated);
+  for(int i = 0; i < 8; ++i)
+    log_rt_msg(LOG_INFO, "Tick %d.", i);
+  /* Nothing is written until the records are drained. */
+  check_num_lines(fid, 0, tc);
+  CuAssertIntEquals(tc, 8, (int) log_rt_drain());
+  log_rt_release();
+  CuAssertIntEquals(tc, 0, (int) log_rt_drain());
+  rewind(fid);
+  char msg[0x800];
+  msg[fread(msg, sizeof(char), sizeof(msg) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(msg, "INFO: Started pump at 48.5.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "WARNING: Signal 10.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "INFO: Bounded abcd|ab.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "Tick 4.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "Tick 5.\n") == NULL);
+  CuAssertTrue(tc, strstr(msg, "Not logged") == NULL);
+  CuAssertTrue(tc, strstr(msg, "3 real-time records were lost.") != NULL);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  fclose(fid);
+}
+
+/**
+ * Logs a real-time record for test_rt_thread() from a named thread with a
+ * context field, and stores the ID of the thread.
+ */
+static void * log_rt_producer(void * tid) {
+  log_set_thread_name("rt-producer");
+  log_context_push("job", "%d", 7);
+  log_rt_msg(LOG_INFO, "From %s.", "the producer");
+  log_context_pop();
+  *(pid_t *) tid = gettid();
+  log_rt_release();
+  return NULL;
+}
+
+/**
+ * Tests that real-time records are rendered with the thread and context
+ * fields of the thread that logged them, not of the one that drains them.
+ * It uses the rings set up by test_rt().
+ */
+void test_rt_thread(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%tid %tname %X%M");
+  log_context_push("drainer", "%d", 1);
+  pid_t tid = 0;
+  pthread_t thread;
+  pthread_create(&thread, NULL, log_rt_producer, &tid);
+  pthread_join(thread, NULL);
+  CuAssertIntEquals(tc, 1, (int) log_rt_drain());
+  log_context_pop();
+  log_set_pattern(NULL);
+  rewind(fid);
+  char text[0x100], expected[0x100];
+  text[fread(text, 1, sizeof(text) - 1, fid)] = '\0';
+  snprintf(expected, sizeof(expected),
+	   "%d rt-producer job=7 From the producer.\n", (int) tid);
+  CuAssertStrEquals(tc, expected, text);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Appends records for test_batch() while another thread logs.
+ */
+static void * log_batch_item(void * argument) {
+  log_batch_begin();
+  for(int i = 0; i < 1000; ++i)
+    log_batch_append(LOG_INFO, "Item %d of %s.", i, (const char *) argument);
+  log_batch_commit();
+  return NULL;
+}
+
+/**
+ * Tests that the records of a batch are written together, in order, when
+ * it is committed.
+ */
+void test_batch(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_stderr(fid);
+  log_set_level(LOG_INFO);
+  log_batch_begin();
+  log_batch_append(LOG_INFO, "First.");
+  log_batch_begin();
+  log_batch_append(LOG_WARNING, "Warning %d.", 1);
+  log_batch_append(LOG_DEBUG, "Not logged.");
+  log_batch_commit();
+  /* Nothing is written until the outermost batch is committed. */
+  check_num_lines(fid, 0, tc);
+  log_batch_append(LOG_INFO, "Second.");
+  log_batch_commit();
+  check_num_lines(fid, 3, tc);
+  pthread_t thread;
+  pthread_create(&thread, NULL, log_batch_item, "the batch");
+  for(int i = 0; i < 100; ++i)
+    log_info("Interleaved %d.", i);
+  pthread_join(thread, NULL);
+  rewind(fid);
+  /* The 1000 items are contiguous and in order. */
+  char line[256];
+  int next = -1;
+  while(fgets(line, sizeof(line), fid) != NULL) {
+    char * item = strstr(line, "INFO: Item ");
+    if(next >= 0 && next < 1000) {
+      CuAssertTrue(tc, item != NULL);
+      CuAssertIntEquals(tc, next, atoi(item + strlen("INFO: Item ")));
+      ++next;
+    } else if(item != NULL) {
+      CuAssertTrue(tc, next == -1);
+      CuAssertIntEquals(tc, 0, atoi(item + strlen("INFO: Item ")));
+      next = 1;
+    }
+  }
+  CuAssertIntEquals(tc, 1000, next);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  fclose(fid);
+}
+
+/**
+ * Leaves a batch open when the thread exits.
+ */
+static void * log_batch_abandoned(void * unused) {
+  (void) unused;
+  log_batch_begin();
+  for(int i = 0; i < 3; ++i)
+    log_batch_append(LOG_INFO, "Abandoned %d.", i);
+  return NULL;
+}
+
+/**
+ * Tests that the batch of a thread that exits is written, and that records
+ * appended in a transaction belong to it.
+ */
+void test_batch_exit_and_txn(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_stderr(fid);
+  log_set_level(LOG_INFO);
+  pthread_t thread;
+  pthread_create(&thread, NULL, log_batch_abandoned, NULL);
+  pthread_join(thread, NULL);
+  check_num_lines(fid, 3, tc);
+  log_batch_begin();
+  log_txn_begin(LOG_DEBUG);
+  log_batch_append(LOG_DEBUG, "Captured %d.", 1);
+  log_txn_fail();
+  log_batch_commit();
+  check_num_lines(fid, 4, tc);
+  rewind(fid);
+  char msg[0x400];
+  msg[fread(msg, sizeof(char), sizeof(msg) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(msg, "INFO: Abandoned 2.\n") != NULL);
+  CuAssertTrue(tc, strstr(msg, "DEBUG: Captured 1.\n") != NULL);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  fclose(fid);
+}
+
+/**
+ * Tests that log_set_stdout_compressed() writes records that decompress with
+ * its dictionary to what would have been written, or, in a build without
+ * zstd, that it logs an error.
+ */
+void test_compressed(CuTest * tc) {
+  char filename[L_tmpnam], dictionary[L_tmpnam];
+  tmpnam(filename);
+  tmpnam(dictionary);
+  FILE * dict = fopen(dictionary, "w");
+  fputs("INFO: Compressed record %d of %s.\n", dict);
+  fclose(dict);
+  FILE * err = tmpfile();
+  log_set_stderr(err);
+  log_set_level(LOG_INFO);
+  log_set_stdout_compressed(filename, dictionary);
+#ifdef LOG_HAVE_ZSTD
+  check_num_lines(err, 0, tc);
+  for(int i = 0; i < 1000; ++i)
+    log_info("Compressed record %d of %s.", i, "the test");
+  /* Replacing the stream ends the last frame. */
+  log_set_stdout(stdout);
+  FILE * file = fopen(filename, "rb");
+  static char compressed[1 << 16], text[1 << 17];
+  size_t len = fread(compressed, 1, sizeof(compressed), file);
+  fclose(file);
+  ZSTD_DCtx * dctx = ZSTD_createDCtx();
+  ZSTD_DCtx_loadDictionary(dctx, "INFO: Compressed record %d of %s.\n", 34);
+  ZSTD_inBuffer in = { compressed, len, 0 };
+  ZSTD_outBuffer out = { text, sizeof(text) - 1, 0 };
+  size_t pending = ZSTD_decompressStream(dctx, &out, &in);
+  ZSTD_freeDCtx(dctx);
+  CuAssertIntEquals(tc, 0, (int) pending);
+  text[out.pos] = '\0';
+  /* The records compress to a fraction of their size. */
+  CuAssertTrue(tc, len * 5 < out.pos);
+  int lines = 0;
+  for(char * line = text; (line = strchr(line, '\n')) != NULL; ++line)
+    ++lines;
+  CuAssertIntEquals(tc, 1000, lines);
+  CuAssertTrue(tc, strstr(text, "INFO: Compressed record 0 of the test.\n")
+	       != NULL);
+  CuAssertTrue(tc, strstr(text, "INFO: Compressed record 999 of the test.\n")
+	       != NULL);
+#else
+  check_num_lines(err, 1, tc);
+#endif
+  log_set_stderr(stderr);
+  fclose(err);
+  remove(filename);
+  remove(dictionary);
+}
+
+/**
+ * Tests that log_set_stdout_direct() writes exactly the records, rewriting
+ * the unaligned tail it wrote before.
+ */
+void test_direct(CuTest * tc) {
+  char filename[L_tmpnam];
+  tmpnam(filename);
+  log_set_level(LOG_INFO);
+  log_set_stdout_direct(filename);
+  for(int i = 0; i < 100; ++i)
+    log_info("Direct record %d of %s.", i, "the test");
+  /* The next record writes the buffer, which ends in a partial block. */
+  usleep(150000);
+  for(int i = 100; i < 30000; ++i)
+    log_info("Direct record %d of %s.", i, "the test");
+  log_set_stdout(stdout);
+  FILE * file = fopen(filename, "r");
+  CuAssertPtrNotNull(tc, file);
+  check_num_lines(file, 30000, tc);
+  rewind(file);
+  char line[0x100];
+  for(int i = 0; fgets(line, sizeof(line), file) != NULL; ++i) {
+    char expected[64];
+    snprintf(expected, sizeof(expected), "Direct record %d of the test.\n",
+	     i);
+    CuAssertStrEquals(tc, expected, strstr(line, "Direct"));
+  }
+  fclose(file);
+  remove(filename);
+}
+
+/**
+ * Tests that log_set_stdout_blocks() truncates a torn tail when it reopens a
+ * file, and that log_block_read() skips a corrupt block.
+ */
+void test_blocks(CuTest * tc) {
+  char filename[L_tmpnam];
+  tmpnam(filename);
+  log_set_level(LOG_INFO);
+  log_set_stdout_blocks(filename);
+  for(int i = 0; i < 3000; ++i)
+    log_info("Block record %d of %s.", i, "the test");
+  log_set_stdout(stdout);
+  /* A write torn by a power loss leaves garbage behind the last block. */
+  FILE * file = fopen(filename, "ab");
+  fputs("LOGB\x10\x00\x00\x00torn", file);
+  fclose(file);
+  log_set_stdout_blocks(filename);
+  for(int i = 3000; i < 3010; ++i)
+    log_info("Block record %d of %s.", i, "the test");
+  log_set_stdout(stdout);
+  FILE * out = tmpfile();
+  size_t corrupt;
+  long long blocks = log_block_read(filename, out, &corrupt);
+  CuAssertTrue(tc, blocks > 2);
+  CuAssertIntEquals(tc, 0, (int) corrupt);
+  check_num_lines(out, 3010, tc);
+  fclose(out);
+  /* Damage the payload of the first block. */
+  file = fopen(filename, "r+b");
+  fseek(file, 100, SEEK_SET);
+  fputc('#', file);
+  fclose(file);
+  out = tmpfile();
+  CuAssertTrue(tc, log_block_read(filename, out, &corrupt) == blocks - 1);
+  CuAssertIntEquals(tc, 1, (int) corrupt);
+  rewind(out);
+  char line[256];
+  CuAssertTrue(tc, fgets(line, sizeof(line), out) != NULL);
+  CuAssertTrue(tc, strstr(line, "INFO: Block record ") != NULL);
+  CuAssertTrue(tc, atoi(strstr(line, "record ") + 7) > 0);
+  fclose(out);
+  remove(filename);
+}
+
+/**
+ * Tests that log_merge() interleaves plain and block files by timestamp,
+ * including fractions of the second, keeping continuation lines with their
+ * record and the order of the files for equal timestamps.
+ */
+void test_merge(CuTest * tc) {
+  char first[L_tmpnam], second[L_tmpnam], blocks[L_tmpnam];
+  tmpnam(first);
+  tmpnam(second);
+  tmpnam(blocks);
+  FILE * file = fopen(first, "w");
+  fputs("[Sun 18 Oct 2026 07:15:33.200] INFO: a1\n  continued\n"
+	"[Sun 18 Oct 2026 07:15:34] INFO: a2\n"
+	"[Sun 18 Oct 2026 07:15:35] INFO: a3\n", file);
+  fclose(file);
+  file = fopen(second, "w");
+  fputs("[Sun 18 Oct 2026 07:15:33.1] WARNING: b1\n"
+	"[Sun 18 Oct 2026 07:15:34] ERROR: b2\n", file);
+  fclose(file);
+  /* Records logged now come after the fixed timestamps above. */
+  log_set_level(LOG_INFO);
+  log_set_pattern("[%D.%us] %L: %M");
+  log_set_stdout_blocks(blocks);
+  for(int i = 0; i < 3; ++i)
+    log_info("c%d", i);
+  log_set_stdout(stdout);
+  log_set_pattern(NULL);
+  const char * filenames[] = { blocks, first, second };
+  FILE * out = tmpfile();
+  size_t corrupt;
+  CuAssertTrue(tc, log_merge(filenames, 3, out, &corrupt) == 8);
+  CuAssertIntEquals(tc, 0, (int) corrupt);
+  check_num_lines(out, 9, tc);
+  rewind(out);
+  char merged[0x400];
+  merged[fread(merged, sizeof(char), sizeof(merged) - 1, out)] = '\0';
+  const char * order[] = { "b1", "a1\n  continued", "a2", "b2", "a3", "c0",
+			   "c1", "c2" };
+  const char * previous = merged;
+  for(int i = 0; i < 8; ++i) {
+    const char * found = strstr(merged, order[i]);
+    CuAssertPtrNotNull(tc, found);
+    CuAssertTrue(tc, found >= previous);
+    previous = found;
+  }
+  fclose(out);
+  remove(first);
+  remove(second);
+  remove(blocks);
+}
+
+/**
+ * Tests that log_set_stdout_socket() sends batches of records to a stand-in
+ * collector, frames them as RFC 5424 when asked, and writes them to the
+ * fallback file when there is no collector.
+ */
+void test_socket(CuTest * tc) {
+  char path[L_tmpnam], fallback[L_tmpnam];
+  tmpnam(path);
+  tmpnam(fallback);
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  strcpy(address.sun_path, path);
+  int server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  CuAssertIntEquals(tc, 0, bind(server, (struct sockaddr *) &address,
+				sizeof(address)));
+  listen(server, 1);
+  log_set_level(LOG_INFO);
+  log_set_stdout_socket(path, NULL, LOG_SOCKET_COMPACT);
+  for(int i = 0; i < 500; ++i)
+    log_info("Socket record %d.", i);
+  /* Replacing the stream sends what is buffered. */
+  log_set_stdout(stdout);
+  int peer = accept(server, NULL, NULL);
+  static char packet[65536];
+  int packets = 0, lines = 0;
+  ssize_t n;
+  while((n = recv(peer, packet, sizeof(packet), 0)) > 0) {
+    ++packets;
+    for(ssize_t i = 0; i < n; ++i)
+      if(packet[i] == '\n') ++lines;
+  }
+  CuAssertIntEquals(tc, 500, lines);
+  CuAssertTrue(tc, packets < 50);
+  close(peer);
+  close(server);
+  unlink(path);
+  /* A datagram collector that expects syslog messages. */
+  server = socket(AF_UNIX, SOCK_DGRAM, 0);
+  bind(server, (struct sockaddr *) &address, sizeof(address));
+  log_set_stdout_socket(path, NULL, LOG_SOCKET_RFC5424);
+  log_info("Syslog %s.", "record");
+  log_set_stdout(stdout);
+  n = recv(server, packet, sizeof(packet) - 1, MSG_DONTWAIT);
+  CuAssertTrue(tc, n > 0);
+  packet[n] = '\0';
+  CuAssertTrue(tc, strncmp(packet, "<14>1 ", 6) == 0);
+  CuAssertTrue(tc, strstr(packet, " - - Syslog record.") != NULL);
+  CuAssertTrue(tc, packet[n - 1] == '.');
+  /* Records of one second keep their own fractions. */
+  log_set_pattern("[%D.%us] %L: %M");
+  log_set_stdout_socket(path, NULL, LOG_SOCKET_RFC5424);
+  char stamps[3][64];
+  for(int i = 0; i < 3; ++i) {
+    log_info("Fraction %d.", i);
+    usleep(30000);
+  }
+  log_set_stdout(stdout);
+  log_set_pattern(NULL);
+  for(int i = 0; i < 3; ++i) {
+    n = recv(server, packet, sizeof(packet) - 1, MSG_DONTWAIT);
+    CuAssertTrue(tc, n > 6);
+    packet[n] = '\0';
+    sscanf(packet + 6, "%63s", stamps[i]);
+    CuAssertPtrNotNull(tc, strchr(stamps[i], '.'));
+  }
+  CuAssertTrue(tc, strcmp(stamps[0], stamps[1]) != 0);
+  CuAssertTrue(tc, strcmp(stamps[1], stamps[2]) != 0);
+  close(server);
+  unlink(path);
+  /* Without a collector, the records go to the fallback file. */
+  log_set_stdout_socket(path, fallback, LOG_SOCKET_COMPACT);
+  for(int i = 0; i < 10; ++i)
+    log_info("Fallback record %d.", i);
+  /* They are written when they would have been sent, not only at exit. */
+  usleep(30000);
+  log_info("Fallback record %d.", 10);
+  FILE * file = fopen(fallback, "r");
+  check_num_lines(file, 11, tc);
+  log_set_stdout(stdout);
+  check_num_lines(file, 11, tc);
+  fclose(file);
+  remove(fallback);
+}
+
+/**
+ * Tests that the live ring keeps records the streams filter out, and that a
+ * reader counts the records overwritten before it read them.
+ */
+void test_live(CuTest * tc) {
+  char name[64];
+  snprintf(name, sizeof(name), "loglib_test_live_%d", (int) getpid());
+  FILE * fid = tmpfile();
+  FILE * out = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_live(name, 8, LOG_DEBUG);
+  log_info("Logged.");
+  log_debug("Only in the ring %d.", 1);
+  check_num_lines(fid, 1, tc);
+  struct LogLive * live = log_live_attach(name, 8);
+  CuAssertPtrNotNull(tc, live);
+  size_t lost;
+  CuAssertIntEquals(tc, 2, (int) log_live_read(live, LOG_DEBUG, out, &lost));
+  CuAssertIntEquals(tc, 0, (int) lost);
+  check_num_lines(out, 2, tc);
+  /* 12 records in 8 slots overwrite the first 4 before they are read. */
+  for(int i = 0; i < 12; ++i)
+    log_debug("Message %d.", i);
+  CuAssertIntEquals(tc, 8, (int) log_live_read(live, LOG_DEBUG, out, &lost));
+  CuAssertIntEquals(tc, 4, (int) lost);
+  check_num_lines(out, 10, tc);
+  CuAssertIntEquals(tc, 0, (int) log_live_read(live, LOG_DEBUG, out, &lost));
+  log_live_detach(live);
+  /* A child that exits leaves the ring of its parent in place. */
+  fflush(NULL);
+  pid_t child = fork();
+  if(child == 0) exit(EXIT_SUCCESS);
+  waitpid(child, NULL, 0);
+  live = log_live_attach(name, 8);
+  CuAssertPtrNotNull(tc, live);
+  log_live_detach(live);
+  log_set_live(NULL, 0, LOG_DEBUG);
+  log_set_stdout(stdout);
+  fclose(fid);
+  fclose(out);
+}
+
+static void * count_requests(void * unused) {
+  (void) unused;
+  for(int i = 0; i < 500; ++i)
+    log_metric_count("test.requests", 1);
+  return NULL;
+}
+
+/**
+ * Tests that the counts of several threads are summed, and that histogram
+ * quantiles are close to the values observed.
+ */
+void test_metrics(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_metric_interval(0);
+  pthread_t threads[2];
+  for(int i = 0; i < 2; ++i)
+    pthread_create(&threads[i], NULL, count_requests, NULL);
+  for(int i = 1; i <= 1000; ++i)
+    log_metric_observe("test.latency", i);
+  for(int i = 0; i < 2; ++i)
+    pthread_join(threads[i], NULL);
+  log_metric_count("test.latency", 1); /* Ignored: it is a histogram. */
+  log_metric_flush();
+  check_num_lines(fid, 2, tc);
+  /* Nothing changed since the last summary. */
+  log_metric_flush();
+  check_num_lines(fid, 2, tc);
+  rewind(fid);
+  char line[0x200];
+  bool counted = false, observed = false;
+  while(fgets(line, sizeof(line), fid) != NULL) {
+    counted |= strstr(line, "Metric test.requests: 1000 in ") != NULL;
+    const char * summary = strstr(line, "Metric test.latency: 1000 values");
+    if(summary == NULL) continue;
+    observed = true;
+    double mean, p50, p90;
+    CuAssertIntEquals(tc, 3, sscanf(strstr(summary, "mean"),
+				    "mean %lf, p50 %lf, p90 %lf",
+				    &mean, &p50, &p90));
+    CuAssertDblEquals(tc, 500.5, mean, 1e-6);
+    CuAssertDblEquals(tc, 500, p50, 500 * 0.07);
+    CuAssertDblEquals(tc, 900, p90, 900 * 0.07);
+  }
+  CuAssertTrue(tc, counted);
+  CuAssertTrue(tc, observed);
+  log_set_metric_interval(10);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that repeated records are collapsed, and that the report ranks the
+ * most frequent messages first.
+ */
+void test_fingerprints(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_collapse_repeats(60);
+  for(int i = 0; i < 10; ++i)
+    log_info("Repeated %d.", i);
+  log_info("Once.");
+  for(int i = 2; i < 4; ++i)
+    log_msg(LOG_INFO, "Without a site %d.", i);
+  check_num_lines(fid, 3, tc);
+  /* The collapsed records are counted, then the 2 most frequent listed. */
+  log_set_fingerprints(2, 0);
+  log_fingerprint_report();
+  log_set_fingerprints(0, 0);
+  log_set_collapse_repeats(0);
+  check_num_lines(fid, 8, tc);
+  rewind(fid);
+  char text[0x1000];
+  text[fread(text, 1, sizeof(text) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(text, "Repeated 1.") == NULL);
+  CuAssertTrue(tc, strstr(text, "Without a site 3.") == NULL);
+  CuAssertTrue(tc, strstr(text, "\"Repeated %d.\" was repeated 9 more "
+			   "times.\n") != NULL);
+  CuAssertTrue(tc, strstr(text, "\"Without a site %d.\" was repeated 1 "
+			   "more times.\n") != NULL);
+  CuAssertTrue(tc, strstr(text, "13 records") != NULL);
+  CuAssertTrue(tc, strstr(text, " of 3 messages since") != NULL);
+  const char * first = strstr(text, "INFO: 1. ");
+  const char * second = strstr(text, "INFO: 2. ");
+  CuAssertPtrNotNull(tc, first);
+  CuAssertPtrNotNull(tc, second);
+  const char * count = strstr(first, ": 10 records");
+  CuAssertTrue(tc, count != NULL && count < second);
+  CuAssertTrue(tc, strstr(second, ": 2 records") != NULL);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that formats without a site are told apart by their contents, so
+ * formats built in one reused buffer get fingerprints of their own.
+ */
+void test_fingerprint_buffers(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%M");
+  log_set_fingerprints(3, 0);
+  char format[32];
+  for(int i = 0; i < 3; ++i) {
+    snprintf(format, sizeof(format), "Built format %d, %%d.", i);
+    for(int j = 0; j <= i; ++j)
+      log_msg(LOG_INFO, format, j);
+  }
+  /* The report must not read the buffer, which now holds something else. */
+  strcpy(format, "Overwritten.");
+  log_fingerprint_report();
+  log_set_fingerprints(0, 0);
+  log_set_pattern(NULL);
+  check_num_lines(fid, 10, tc);
+  rewind(fid);
+  char text[0x1000];
+  text[fread(text, 1, sizeof(text) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(text, "6 records (") != NULL);
+  CuAssertTrue(tc, strstr(text, " of 3 messages since") != NULL);
+  for(int i = 0; i < 3; ++i) {
+    char expected[64];
+    snprintf(expected, sizeof(expected), "%d. ", 3 - i);
+    const char * line = strstr(text, expected);
+    CuAssertPtrNotNull(tc, line);
+    snprintf(expected, sizeof(expected), "\"Built format %d, %%d.\"\n", i);
+    CuAssertTrue(tc, strncmp(strchr(line, '"'), expected, strlen(expected))
+		 == 0);
+  }
+  CuAssertTrue(tc, strstr(text, "Overwritten") == NULL);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that the formats logged by one call site get fingerprints of their
+ * own, so one is not collapsed as a repeat of the other.
+ */
+void test_fingerprint_site_formats(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_collapse_repeats(60);
+  const char * formats[] = { "Disk %s is full.", "User %s logged in." };
+  for(int i = 0; i < 4; ++i)
+    log_info(formats[i % 2], "x");
+  log_fingerprint_report();
+  log_set_collapse_repeats(0);
+  check_num_lines(fid, 4, tc);
+  rewind(fid);
+  char text[0x1000];
+  text[fread(text, 1, sizeof(text) - 1, fid)] = '\0';
+  CuAssertTrue(tc, strstr(text, "INFO: Disk x is full.\n") != NULL);
+  CuAssertTrue(tc, strstr(text, "INFO: User x logged in.\n") != NULL);
+  CuAssertTrue(tc, strstr(text, "\"Disk %s is full.\" was repeated 1 more "
+			   "times.\n") != NULL);
+  CuAssertTrue(tc, strstr(text, "\"User %s logged in.\" was repeated 1 "
+			   "more times.\n") != NULL);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
 CuSuite * setup_test_suite() {
   CuSuite * suite = CuSuiteNew();
   SUITE_ADD_TEST(suite, test_set_level_and_get_level);
@@ -266,6 +1608,39 @@ CuSuite * setup_test_suite() {
   SUITE_ADD_TEST(suite, test_log_info);
   SUITE_ADD_TEST(suite, test_log_debug);
   SUITE_ADD_TEST(suite, test_log_trace);
+  SUITE_ADD_TEST(suite, test_shm_ring);
+  SUITE_ADD_TEST(suite, test_shm_ring_full);
+  SUITE_ADD_TEST(suite, test_shm_express_lane);
+  SUITE_ADD_TEST(suite, test_parse_header);
+  SUITE_ADD_TEST(suite, test_index_query);
+  SUITE_ADD_TEST(suite, test_index_query_window);
+  SUITE_ADD_TEST(suite, test_set_pattern);
+  SUITE_ADD_TEST(suite, test_call_site);
+  SUITE_ADD_TEST(suite, test_runtime_format);
+  SUITE_ADD_TEST(suite, test_site_dictionary);
+  SUITE_ADD_TEST(suite, test_fingerprints);
+  SUITE_ADD_TEST(suite, test_fingerprint_buffers);
+  SUITE_ADD_TEST(suite, test_fingerprint_site_formats);
+  SUITE_ADD_TEST(suite, test_set_clock);
+  SUITE_ADD_TEST(suite, test_context);
+  SUITE_ADD_TEST(suite, test_txn);
+  SUITE_ADD_TEST(suite, test_txn_bounded_string);
+  SUITE_ADD_TEST(suite, test_txn_format_buffer);
+  SUITE_ADD_TEST(suite, test_governor);
+  SUITE_ADD_TEST(suite, test_governor_info);
+  SUITE_ADD_TEST(suite, test_staging);
+  SUITE_ADD_TEST(suite, test_rt);
+  SUITE_ADD_TEST(suite, test_rt_thread);
+  SUITE_ADD_TEST(suite, test_batch);
+  SUITE_ADD_TEST(suite, test_batch_exit_and_txn);
+  SUITE_ADD_TEST(suite, test_compressed);
+  SUITE_ADD_TEST(suite, test_blocks);
+  SUITE_ADD_TEST(suite, test_direct);
+  SUITE_ADD_TEST(suite, test_merge);
+  SUITE_ADD_TEST(suite, test_socket);
+  SUITE_ADD_TEST(suite, test_live);
+  SUITE_ADD_TEST(suite, test_metrics);
+  SUITE_ADD_TEST(suite, test_site_dictionary_overflow);
   return suite;
 }
 
@@ -280,4 +1655,5 @@ int main(void) {
   CuSuiteSummary(suite, output);
   CuSuiteDetails(suite, output);
   printf("%s\n", output->buffer);
+  return suite->failCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
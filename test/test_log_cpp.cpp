@@ -0,0 +1,136 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "log.hpp"
+extern "C" {
+#include "cutest-1.5/CuTest.h"
+}
+
+/**
+ * Unit tests for the C++ front end of the log module (log.hpp).
+ */
+
+/**
+ * Reads the messages logged to fid (with the pattern "%M") back into
+ * buffer.
+ */
+static void read_messages(FILE * fid, char * buffer, size_t size) {
+  rewind(fid);
+  buffer[fread(buffer, sizeof(char), size - 1, fid)] = '\0';
+}
+
+/**
+ * Tests that the checked formats produce the same messages as snprintf().
+ */
+void test_cpp_matches_snprintf(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%M");
+  int count = -42;
+  unsigned long bytes = 4294967296UL;
+  double ratio = 2.0 / 3.0;
+  const void * address = &count;
+  loglib_info("Plain text with 100%% literal percent.");
+  loglib_info("%d|%5i|%-5d|%05d|%+d|%x|%#X|%o", count, 7, 7, 7, 7, 255, 255,
+	      8);
+  loglib_info("%lu %zu %lld", bytes, (size_t) 12, (long long) INT64_MIN);
+  loglib_info("%f %.3e %g %10.4f|%-10.2G|", ratio, ratio, ratio, ratio, 1e-10);
+  loglib_info("%s [%10s] [%-6.2s] %c %p", "text", "right", "left", 'z',
+	      address);
+  char expected[1024];
+  int len = 0;
+  len += snprintf(expected + len, sizeof(expected) - len,
+		  "Plain text with 100%% literal percent.\n");
+  len += snprintf(expected + len, sizeof(expected) - len,
+		  "%d|%5i|%-5d|%05d|%+d|%x|%#X|%o\n", count, 7, 7, 7, 7, 255,
+		  255, 8);
+  len += snprintf(expected + len, sizeof(expected) - len, "%lu %zu %lld\n",
+		  bytes, (size_t) 12, (long long) INT64_MIN);
+  len += snprintf(expected + len, sizeof(expected) - len,
+		  "%f %.3e %g %10.4f|%-10.2G|\n", ratio, ratio, ratio, ratio,
+		  1e-10);
+  len += snprintf(expected + len, sizeof(expected) - len,
+		  "%s [%10s] [%-6.2s] %c %p\n", "text", "right", "left", 'z',
+		  address);
+  char actual[1024];
+  read_messages(fid, actual, sizeof(actual));
+  CuAssertStrEquals(tc, expected, actual);
+  log_set_pattern(NULL);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests the C++ argument types: strings, narrowed integers, enums, booleans
+ * and null pointers, and messages longer than the stack buffer.
+ */
+void test_cpp_types(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%M");
+  enum class Color : short { RED = 3 };
+  std::string owned = "owned";
+  std::string_view view = std::string_view("viewed-and-cut").substr(0, 6);
+  loglib_info("%s %s %.3s %8s|", owned, view, owned, view);
+  loglib_info("%hhd %hu %d %d %u %p", 300, -1, Color::RED, true, 7u,
+	      nullptr);
+  std::string long_message(3000, 'x');
+  loglib_info("%s", long_message);
+  loglib_debug("This should not be logged.");
+  char actual[4096];
+  read_messages(fid, actual, sizeof(actual));
+  std::string expected = "owned viewed own   viewed|\n"
+    "44 65535 3 1 7 (nil)\n" + long_message + "\n";
+  CuAssertStrEquals(tc, expected.c_str(), actual);
+  log_set_pattern(NULL);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+/**
+ * Tests that the C log macros use the format of each call, which need not
+ * be a literal.
+ */
+void test_c_macros_runtime_format(CuTest * tc) {
+  FILE * fid = tmpfile();
+  log_set_stdout(fid);
+  log_set_level(LOG_INFO);
+  log_set_pattern("%M");
+  const char * formats[] = { "first %d", "second %d" };
+  for(int i = 0; i < 2; ++i)
+    log_info(formats[i], i + 1);
+  char actual[256];
+  read_messages(fid, actual, sizeof(actual));
+  CuAssertStrEquals(tc, "first 1\nsecond 2\n", actual);
+  log_set_pattern(NULL);
+  log_set_stdout(stdout);
+  fclose(fid);
+}
+
+CuSuite * setup_test_suite() {
+  CuSuite * suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_cpp_matches_snprintf);
+  SUITE_ADD_TEST(suite, test_cpp_types);
+  SUITE_ADD_TEST(suite, test_c_macros_runtime_format);
+  return suite;
+}
+
+int main(void) {
+  /* Create the tests. */
+  CuString * output = CuStringNew();
+  CuSuite * suite = CuSuiteNew();
+  CuSuiteAddSuite(suite, setup_test_suite());
+  /* Run the tests. */
+  CuSuiteRun(suite);
+  /* Print the results. */
+  CuSuiteSummary(suite, output);
+  CuSuiteDetails(suite, output);
+  printf("%s\n", output->buffer);
+  return suite->failCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
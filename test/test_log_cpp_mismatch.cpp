@@ -0,0 +1,10 @@
+#include "log.hpp"
+
+/**
+ * A program that must not compile: the argument of %d is a string. The test
+ * passes if the build of this file fails with the log.hpp diagnostic.
+ */
+int main(void) {
+  loglib_info("%d records.", "many");
+  return 0;
+}
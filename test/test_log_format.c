@@ -0,0 +1,225 @@
+#include <float.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <wchar.h>
+
+#include "log.h"
+#include "cutest-1.5/CuTest.h"
+
+/**
+ * Differential tests of the log module's formatter (log_snprintf()) against
+ * the C library's snprintf(). Every case must match byte for byte, including
+ * the return value.
+ */
+
+/**
+ * Large enough for every case below.
+ */
+#define BUFFER_SIZE 4096
+
+/**
+ * Formats the arguments with both engines and fails on any difference.
+ */
+#define CHECK(tc, format, ...)						\
+  do {									\
+    char expected[BUFFER_SIZE], actual[BUFFER_SIZE];			\
+    int expected_len = snprintf(expected, BUFFER_SIZE, format, __VA_ARGS__); \
+    int actual_len = log_snprintf(actual, BUFFER_SIZE, format, __VA_ARGS__); \
+    CuAssertStrEquals_Msg(tc, format, expected, actual);		\
+    CuAssertIntEquals_Msg(tc, format, expected_len, actual_len);	\
+  } while(0)
+
+/**
+ * A small deterministic generator (xorshift64*) for the random cases.
+ */
+static uint64_t next_random() {
+  static uint64_t state = 0x9e3779b97f4a7c15ULL;
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Tests int conversions with every combination of flags, width and precision
+ * that log messages commonly use.
+ */
+void test_format_int(CuTest * tc) {
+  const char * formats[] = {
+    "%d", "%i", "%5d", "%-5d|", "%05d", "%+d", "% d", "%.3d", "%.0d",
+    "%8.3d", "%-8.3d|", "%+08d", "% 08d", "%u", "%x", "%X", "%#x", "%#X",
+    "%o", "%#o", "%#.0o", "%.0x", "%08.3x", "%#010x", "%-#10x|", "%hhd",
+    "%hd", "%hhu", "%hx", "[%d and %d]"
+  };
+  int values[] = {
+    0, 1, -1, 7, 9, 10, 42, -42, 99, 100, 255, 256, 1000, -1000, 65535,
+    123456789, -123456789, INT32_MAX, INT32_MIN
+  };
+  for(size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f)
+    for(size_t v = 0; v < sizeof(values) / sizeof(values[0]); ++v)
+      CHECK(tc, formats[f], values[v], values[v] / 3);
+  for(int i = 0; i < 10000; ++i) {
+    int value = (int) next_random();
+    CHECK(tc, "%d %u %x %o", value, value, value, value);
+  }
+}
+
+/**
+ * Tests the long, long long, size_t, intmax_t and ptrdiff_t conversions.
+ */
+void test_format_long(CuTest * tc) {
+  long long values[] = {
+    0, 1, -1, 4294967295LL, 4294967296LL, -4294967296LL, INT64_MAX,
+    INT64_MIN, 1000000000000000000LL
+  };
+  for(size_t v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+    long long value = values[v];
+    CHECK(tc, "%ld|%lu|%lx|%20ld|%-20lu|", (long) value,
+	  (unsigned long) value, (unsigned long) value, (long) value,
+	  (unsigned long) value);
+    CHECK(tc, "%lld|%llu|%llX|%+.25lld", value, (unsigned long long) value,
+	  (unsigned long long) value, value);
+    CHECK(tc, "%zu|%zd|%zx", (size_t) value, (ssize_t) value,
+	  (size_t) value);
+    CHECK(tc, "%jd|%ju|%td", (intmax_t) value, (uintmax_t) value,
+	  (ptrdiff_t) value);
+  }
+  for(int i = 0; i < 10000; ++i) {
+    uint64_t value = next_random() >> (next_random() % 64);
+    CHECK(tc, "%lu %ld %#lx %zu", (unsigned long) value, (long) value,
+	  (unsigned long) value, (size_t) value);
+  }
+}
+
+/**
+ * Tests %f, %e and %g on special values, halfway cases and random doubles
+ * of every magnitude.
+ */
+void test_format_double(CuTest * tc) {
+  const char * formats[] = {
+    "%f", "%.0f", "%.1f", "%.2f", "%.3f", "%.10f", "%.17f", "%.30f", "%e",
+    "%.0e", "%.1e", "%.3e", "%.16e", "%.20e", "%g", "%.0g", "%.1g", "%.2g",
+    "%.3g", "%.10g", "%.17g", "%.25g", "%#g", "%#.3g", "%#.0f", "%#.0e",
+    "%+f", "% e", "%12.4f", "%-12.4e|", "%012.3f", "%+015.6e", "%G", "%E",
+    "%F", "%-+10g|", "%010g", "%#-12.5G|", "%lf", "%le", "%lg"
+  };
+  double values[] = {
+    0.0, -0.0, 1.0, -1.0, 0.5, 1.5, 2.5, 3.5, -2.5, 0.125, 0.375, 0.05,
+    0.15, 0.25, 0.35, 9.5, 99.5, 999.5, 9.9999995, 0.1, 0.2, 0.3, 1e-5,
+    1e-4, 9.9999e-5, 0.000123456, 123456.0, 1234567.0, 999999.5, 1e15,
+    1e16, 1e17, 1e21, 1e22, 1e23, 1e100, 1e300, 1.7976931348623157e308,
+    2.2250738585072014e-308, 4.9406564584124654e-324, 1e-320,
+    3.141592653589793, 2.718281828459045, 123.456, -0.000001,
+    4503599627370496.5, 9007199254740993.0, 0.1 + 0.2,
+    INFINITY, -INFINITY, NAN
+  };
+  for(size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f)
+    for(size_t v = 0; v < sizeof(values) / sizeof(values[0]); ++v)
+      CHECK(tc, formats[f], values[v]);
+  /* Random bit patterns cover every exponent, including subnormals. */
+  for(int i = 0; i < 20000; ++i) {
+    uint64_t bits = next_random();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    CHECK(tc, "%e|%.3e|%.17e|%g|%.3g|%.17g", value, value, value, value,
+	  value, value);
+  }
+  /* Random values of ordinary magnitude, where %f prints few digits. */
+  for(int i = 0; i < 20000; ++i) {
+    double value = (double) (int64_t) next_random()
+      / (double) (1 << (next_random() % 30)) / 1e6;
+    CHECK(tc, "%f|%.0f|%.1f|%.2f|%.5f|%.12f|%g|%e", value, value, value,
+	  value, value, value, value, value);
+  }
+  /* Decimal values with few digits, which often sit near halfway. */
+  for(int i = 0; i < 20000; ++i) {
+    double value = (double) (next_random() % 2000001) / 1000.0;
+    CHECK(tc, "%.0f|%.1f|%.2f|%.3f|%.1e|%.2g", value, value, value, value,
+	  value, value);
+  }
+  /* The longest expansions. */
+  CHECK(tc, "%.1100f", 4.9406564584124654e-324);
+  CHECK(tc, "%.800e", 2.2250738585072014e-308);
+  CHECK(tc, "%.400f", 1.7976931348623157e308);
+}
+
+/**
+ * Tests %s, %c, %p, %% and the width and precision arguments given by '*'.
+ */
+void test_format_other(CuTest * tc) {
+  const char * strings[] = { "", "a", "hello", "a longer string value" };
+  for(size_t s = 0; s < sizeof(strings) / sizeof(strings[0]); ++s) {
+    CHECK(tc, "[%s] [%10s] [%-10s] [%.3s] [%10.2s]", strings[s], strings[s],
+	  strings[s], strings[s], strings[s]);
+    CHECK(tc, "[%*s] [%-*s] [%.*s]", 8, strings[s], -8, strings[s], 2,
+	  strings[s]);
+  }
+  /* A null string is undefined for snprintf(), so check the documented text. */
+  char nulls[64];
+  const char * null_string = NULL;
+  CuAssertIntEquals(tc, 33, log_snprintf(nulls, sizeof(nulls),
+					 "[%s] [%.3s] [%10s] [%.6s]",
+					 null_string, null_string,
+					 null_string, null_string));
+  CuAssertStrEquals(tc, "[(null)] [] [    (null)] [(null)]", nulls);
+  CHECK(tc, "[%c] [%3c] [%-3c] [%c]", 'x', 'y', 'z', 0x41);
+  int local;
+  CHECK(tc, "[%p] [%20p] [%-20p] [%p] [%10p]", (void *) &local,
+	(void *) &local, (void *) &local, (void *) NULL, (void *) NULL);
+  CHECK(tc, "100%% of %d%%", 50);
+  CHECK(tc, "[%*d] [%-*d] [%.*d] [%*.*f]", 6, 42, 6, 42, 4, 42, 10, 3, 3.14159);
+  CHECK(tc, "[%.*f] [%*d]", -1, 2.5, -4, 7);
+  CHECK(tc, "%s", "No conversions at all.");
+}
+
+/**
+ * Tests that output is cut short like snprintf() while the full length is
+ * still returned, and that unsupported conversions fall back to the C
+ * library.
+ */
+void test_format_truncation_and_fallback(CuTest * tc) {
+  for(size_t size = 0; size < 24; ++size) {
+    char expected[32], actual[32];
+    memset(expected, 'X', sizeof(expected));
+    memset(actual, 'X', sizeof(actual));
+    int expected_len = snprintf(expected, size, "%s=%d (%.2f)", "value", 12345,
+				6.789);
+    int actual_len = log_snprintf(actual, size, "%s=%d (%.2f)", "value", 12345,
+				  6.789);
+    CuAssertIntEquals(tc, expected_len, actual_len);
+    CuAssertTrue(tc, memcmp(expected, actual, sizeof(expected)) == 0);
+  }
+  CHECK(tc, "%a %ls", 1.0, L"wide");
+  CHECK(tc, "%2$s %1$s", "first", "second");
+  CHECK(tc, "%d then %Lf", 1, (long double) 2.5);
+}
+
+CuSuite * setup_test_suite() {
+  CuSuite * suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_format_int);
+  SUITE_ADD_TEST(suite, test_format_long);
+  SUITE_ADD_TEST(suite, test_format_double);
+  SUITE_ADD_TEST(suite, test_format_other);
+  SUITE_ADD_TEST(suite, test_format_truncation_and_fallback);
+  return suite;
+}
+
+int main(void) {
+  /* Create the tests. */
+  CuString * output = CuStringNew();
+  CuSuite * suite = CuSuiteNew();
+  CuSuiteAddSuite(suite, setup_test_suite());
+  /* Run the tests. */
+  CuSuiteRun(suite);
+  /* Print the results. */
+  CuSuiteSummary(suite, output);
+  CuSuiteDetails(suite, output);
+  printf("%s\n", output->buffer);
+  return suite->failCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "cutest-1.5/CuTest.h"
+
+/**
+ * malloc(), calloc() and realloc() are interposed to count the calls made
+ * while counting is true.
+ */
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * pointer, size_t size);
+
+static volatile bool counting = false;
+static volatile size_t allocations = 0;
+
+void * malloc(size_t size) {
+  if(counting) ++allocations;
+  return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) {
+  if(counting) ++allocations;
+  return __libc_calloc(count, size);
+}
+
+void * realloc(void * pointer, size_t size) {
+  if(counting) ++allocations;
+  return __libc_realloc(pointer, size);
+}
+
+/**
+ * Tests that a log-heavy run does not allocate once log_static_init() has
+ * been called, and reports how fast it logs.
+ */
+void test_static_memory(CuTest * tc) {
+  FILE * out = tmpfile();
+  FILE * err = tmpfile();
+  log_set_stdout(out);
+  log_set_stderr(err);
+  log_set_level(LOG_INFO);
+  log_set_pattern("[%d %T.%us] %tid %L: %X%M");
+  log_static_init(1 << 20);
+  char long_message[2048];
+  memset(long_message, 'x', sizeof(long_message) - 1);
+  long_message[sizeof(long_message) - 1] = '\0';
+  struct timespec start, end;
+  counting = true;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  const int records = 100000;
+  for(int i = 0; i < records; ++i) {
+    log_context_push("request", "%d", i);
+    log_info("Record %d of %s: %8.3f %#x %p.", i, "the benchmark", i * 0.5,
+	     (unsigned) i, (void *) &start);
+    if(i % 100 == 0) {
+      log_warning("Long: %s", long_message);
+      log_txn_begin(LOG_DEBUG);
+      log_debug("Captured %d %s.", i, "detail");
+      log_txn_fail();
+    }
+    log_context_pop();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  counting = false;
+  double seconds = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%d records in %.3f s (%.0f ns per record).\n", records, seconds,
+	 seconds * 1e9 / records);
+  CuAssertIntEquals(tc, 0, (int) allocations);
+  /* The records were written, and the long ones cut short. */
+  rewind(err);
+  char msg[1100];
+  CuAssertTrue(tc, fgets(msg, sizeof(msg), err) != NULL);
+  CuAssertTrue(tc, strstr(msg, "WARNING: request=0 Long: xxx") != NULL);
+  CuAssertTrue(tc, strlen(msg) == 1024 && msg[1023] == '\n');
+  rewind(out);
+  CuAssertTrue(tc, fgets(msg, sizeof(msg), out) != NULL);
+  CuAssertTrue(tc, strstr(msg, "INFO: request=0 Record 0 of the benchmark")
+	       != NULL);
+  log_set_pattern(NULL);
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  fclose(out);
+  fclose(err);
+}
+
+CuSuite * setup_test_suite() {
+  CuSuite * suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_static_memory);
+  return suite;
+}
+
+int main(void) {
+  /* Create the tests. */
+  CuString * output = CuStringNew();
+  CuSuite * suite = CuSuiteNew();
+  CuSuiteAddSuite(suite, setup_test_suite());
+  /* Run the tests. */
+  CuSuiteRun(suite);
+  /* Print the results. */
+  CuSuiteSummary(suite, output);
+  CuSuiteDetails(suite, output);
+  printf("%s\n", output->buffer);
+  return suite->failCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
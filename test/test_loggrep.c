@@ -0,0 +1,205 @@
+#define _GNU_SOURCE /* For memmem(). */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "cutest-1.5/CuTest.h"
+
+/**
+ * Differential tests of the loggrep tool against a plain record-by-record
+ * search of the same file, with one thread and with several. The path of
+ * loggrep is the first argument.
+ */
+
+/**
+ * The number of records in the generated file, enough for several chunks.
+ */
+#define NUM_RECORDS 40000
+
+static const char * loggrep = "./loggrep";
+
+/**
+ * The generated log file and its contents.
+ */
+static char filename[L_tmpnam];
+static char * contents = NULL;
+static size_t contents_len = 0;
+
+/**
+ * Reads a whole stream into a string that the caller frees.
+ */
+static char * read_all(FILE * stream, size_t * len) {
+  size_t capacity = 1 << 16;
+  char * text = malloc(capacity);
+  *len = 0;
+  size_t n;
+  while((n = fread(text + *len, 1, capacity - *len - 1, stream)) > 0) {
+    *len += n;
+    if(capacity - *len == 1) text = realloc(text, capacity *= 2);
+  }
+  text[*len] = '\0';
+  return text;
+}
+
+/**
+ * Writes records at every level from ERROR to TRACE, some of them with
+ * continuation lines, to a temporary file.
+ */
+static void generate_file(void) {
+  tmpnam(filename);
+  FILE * fid = fopen(filename, "w+");
+  log_set_stdout(fid);
+  log_set_stderr(fid);
+  log_set_level(LOG_TRACE);
+  for(int i = 0; i < NUM_RECORDS; ++i) {
+    log_t level = LOG_ERROR + i % 5;
+    if(i % 13 == 0)
+      log_msg(level, "Request %d failed for client-%d:\n  at frame %d\n"
+	      "  at frame %d", i, i % 7, i % 3, i % 11);
+    else
+      log_msg(level, "Request %d from client-%d.", i, i % 7);
+  }
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  log_set_level(LOG_INFO);
+  rewind(fid);
+  contents = read_all(fid, &contents_len);
+  fclose(fid);
+}
+
+/**
+ * Appends to out the records of the file at or above max_level that contain
+ * pattern, finding the records with log_parse_header().
+ */
+static size_t reference_grep(log_t max_level, const char * pattern,
+			     char * out) {
+  size_t out_len = 0;
+  const char * end = contents + contents_len;
+  const char * record = contents;
+  while(record < end) {
+    log_t level;
+    log_parse_header(record, end - record, NULL, &level);
+    /* The record goes on until the next line with a header. */
+    const char * stop = record;
+    do {
+      const char * newline = memchr(stop, '\n', end - stop);
+      stop = newline != NULL ? newline + 1 : end;
+    } while(stop < end
+	    && log_parse_header(stop, end - stop, NULL, NULL) == 0);
+    if(level <= max_level
+       && memmem(record, stop - record, pattern, strlen(pattern)) != NULL) {
+      memcpy(out + out_len, record, stop - record);
+      out_len += stop - record;
+    }
+    record = stop;
+  }
+  out[out_len] = '\0';
+  return out_len;
+}
+
+/**
+ * Runs loggrep on the file and returns its output, which the caller frees.
+ */
+static char * run_loggrep(const char * options, size_t * len) {
+  char command[1024];
+  snprintf(command, sizeof(command), "%s %s %s", loggrep, options, filename);
+  FILE * pipe = popen(command, "r");
+  if(pipe == NULL) return NULL;
+  char * text = read_all(pipe, len);
+  if(pclose(pipe) != 0) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/**
+ * Checks loggrep with one and with four threads against the reference.
+ */
+static void check_loggrep(CuTest * tc, const char * level_name, log_t level,
+			  const char * pattern) {
+  char * expected = malloc(contents_len + 1);
+  size_t expected_len = reference_grep(level, pattern, expected);
+  CuAssertTrue(tc, expected_len > 0);
+  for(int threads = 1; threads <= 4; threads += 3) {
+    char options[256];
+    snprintf(options, sizeof(options), "-j%d -l %s -e '%s'", threads,
+	     level_name, pattern);
+    size_t len;
+    char * actual = run_loggrep(options, &len);
+    CuAssertPtrNotNullMsg(tc, options, actual);
+    CuAssertIntEquals_Msg(tc, options, (int) expected_len, (int) len);
+    CuAssertTrue(tc, memcmp(expected, actual, len) == 0);
+    free(actual);
+  }
+  free(expected);
+}
+
+/**
+ * Tests the severity filter alone, by name and by number.
+ */
+void test_loggrep_levels(CuTest * tc) {
+  check_loggrep(tc, "ERROR", LOG_ERROR, "");
+  check_loggrep(tc, "WARNING", LOG_WARNING, "");
+  check_loggrep(tc, "3", LOG_INFO, "");
+  check_loggrep(tc, "TRACE", LOG_TRACE, "");
+}
+
+/**
+ * Tests substrings in headers, in messages and in continuation lines, with
+ * the severity filter.
+ */
+void test_loggrep_patterns(CuTest * tc) {
+  check_loggrep(tc, "TRACE", LOG_TRACE, "client-3");
+  check_loggrep(tc, "INFO", LOG_INFO, "client-3");
+  check_loggrep(tc, "DEBUG", LOG_DEBUG, "at frame 1");
+  check_loggrep(tc, "TRACE", LOG_TRACE, "WARNING: Request 3");
+  check_loggrep(tc, "TRACE", LOG_TRACE, "Request 39999 from");
+}
+
+/**
+ * Tests that -c counts the records that would be printed.
+ */
+void test_loggrep_count(CuTest * tc) {
+  char * expected = malloc(contents_len + 1);
+  reference_grep(LOG_WARNING, "client-5", expected);
+  int records = 0;
+  for(const char * line = expected; *line != '\0';
+      line = strchr(line, '\n') + 1)
+    if(log_parse_header(line, strlen(line), NULL, NULL) > 0) ++records;
+  free(expected);
+  size_t len;
+  char * actual = run_loggrep("-c -j4 -l WARNING -e client-5", &len);
+  CuAssertPtrNotNull(tc, actual);
+  CuAssertIntEquals(tc, records, atoi(actual));
+  free(actual);
+}
+
+CuSuite * setup_test_suite() {
+  CuSuite * suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_loggrep_levels);
+  SUITE_ADD_TEST(suite, test_loggrep_patterns);
+  SUITE_ADD_TEST(suite, test_loggrep_count);
+  return suite;
+}
+
+int main(int argc, char ** argv) {
+  if(argc > 1) loggrep = argv[1];
+  generate_file();
+  /* Create the tests. */
+  CuString * output = CuStringNew();
+  CuSuite * suite = CuSuiteNew();
+  CuSuiteAddSuite(suite, setup_test_suite());
+  /* Run the tests. */
+  CuSuiteRun(suite);
+  /* Print the results. */
+  CuSuiteSummary(suite, output);
+  CuSuiteDetails(suite, output);
+  printf("%s\n", output->buffer);
+  remove(filename);
+  free(contents);
+  return suite->failCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+/**
+ * logblockcat: prints the records of block files written by
+ * log_set_stdout_blocks() or log_set_stderr_blocks().
+ *
+ * Usage: logblockcat FILE...
+ *
+ * Corrupt blocks are skipped and counted on standard error. The exit status
+ * is 1 if any block was lost and 2 if a file could not be read.
+ */
+
+int main(int argc, char ** argv) {
+  if(argc < 2) {
+    fprintf(stderr, "Usage: %s FILE...\n", argv[0]);
+    return 2;
+  }
+  int status = EXIT_SUCCESS;
+  for(int i = 1; i < argc; ++i) {
+    size_t corrupt;
+    if(log_block_read(argv[i], stdout, &corrupt) < 0) {
+      status = 2;
+    } else if(corrupt > 0) {
+      fprintf(stderr, "%s: %zu blocks were lost.\n", argv[i], corrupt);
+      if(status == EXIT_SUCCESS) status = 1;
+    }
+  }
+  return status;
+}
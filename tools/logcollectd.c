@@ -0,0 +1,97 @@
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/**
+ * logcollectd: drains a shared-memory log ring into log files.
+ *
+ * Usage: logcollectd [-n slots] [-x express_slots] [-s slot_size]
+ *                    [-o stdout_file] [-e stderr_file] [-d] [-u] NAME
+ *
+ * The ring NAME is created if it does not exist, with slots slots in its bulk
+ * lane and express_slots slots in its express lane (default: a quarter of
+ * slots). Producers wait up to 100 ms for the collector when the express lane
+ * is full and then drop the record, or drop it at once if -d is given, as
+ * they do when the bulk lane is full. Records for info, debug and
+ * trace messages are written to stdout_file (default: standard output) and
+ * warnings and errors to stderr_file (default: standard error). The collector
+ * runs until it receives SIGINT or SIGTERM, drains the ring one last time and
+ * exits, removing the ring if -u was given. It exits with an error at once if
+ * the ring cannot be created or attached.
+ */
+
+/**
+ * The longest the collector sleeps when the ring is empty (in microseconds).
+ */
+#define MAX_IDLE_SLEEP_US 10000
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signum) {
+  (void) signum;
+  running = 0;
+}
+
+static void usage(const char * program) {
+  fprintf(stderr, "Usage: %s [-n slots] [-x express_slots] [-s slot_size] "
+	  "[-o stdout_file] [-e stderr_file] [-d] [-u] NAME\n", program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv) {
+  size_t slots = 4096;
+  size_t express_slots = 0;
+  size_t slot_size = 512;
+  log_shm_policy_t express_policy = LOG_SHM_WAIT;
+  char * stdout_file = NULL;
+  char * stderr_file = NULL;
+  bool unlink_on_exit = false;
+  int opt;
+  while((opt = getopt(argc, argv, "n:x:s:o:e:du")) != -1) {
+    switch(opt) {
+    case 'n': slots = strtoul(optarg, NULL, 10); break;
+    case 'x': express_slots = strtoul(optarg, NULL, 10); break;
+    case 's': slot_size = strtoul(optarg, NULL, 10); break;
+    case 'o': stdout_file = optarg; break;
+    case 'e': stderr_file = optarg; break;
+    case 'd': express_policy = LOG_SHM_DROP; break;
+    case 'u': unlink_on_exit = true; break;
+    default: usage(argv[0]);
+    }
+  }
+  if(optind != argc - 1) usage(argv[0]);
+  const char * name = argv[optind];
+  if(stdout_file != NULL) log_set_stdout_file(stdout_file);
+  if(stderr_file != NULL) log_set_stderr_file(stderr_file);
+  if(express_slots == 0) express_slots = slots / 4;
+  if(log_shm_create_lanes(name, express_slots, express_policy, slots,
+			  LOG_SHM_DROP, slot_size) != 0)
+    return EXIT_FAILURE; /* The error is logged. */
+  struct sigaction action = { .sa_handler = stop };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  /* Poll the ring, backing off while it stays empty. */
+  useconds_t idle = 0;
+  while(running) {
+    if(log_shm_drain() > 0) {
+      idle = 0;
+    } else {
+      idle = idle == 0 ? 100 : idle * 2;
+      if(idle > MAX_IDLE_SLEEP_US) idle = MAX_IDLE_SLEEP_US;
+      usleep(idle);
+    }
+  }
+  log_shm_drain();
+  log_shm_detach();
+  if(unlink_on_exit) log_shm_unlink(name);
+  /* Close any log files, flushing what was written. */
+  log_set_stdout(stdout);
+  log_set_stderr(stderr);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * logdict: collects the format strings of the log calls in source files
+ * into a dictionary for compressed log files.
+ *
+ * Usage: logdict [-s max_size] FILE... > DICTIONARY
+ *
+ * Finds the calls to the log macros (log_info() and the others), log_msg(),
+ * log_batch_append() and log_rt_msg() whose format is a string literal, and
+ * prints each distinct format once, preceded by its severity as it appears
+ * in records ("INFO: "). Literal parts of the formats then match the
+ * records, so log_set_stdout_compressed() and log_set_stderr_compressed()
+ * can use the output as a raw-content dictionary. The output stops short of
+ * max_size bytes (default 110 KiB).
+ */
+
+/**
+ * The calls whose format is collected, and the severity of the macros.
+ */
+static const struct {
+  const char * name;
+  const char * level; /**< NULL if the level is the first argument. */
+} calls[] = {
+  { "log_fatal", "FATAL" }, { "log_error", "ERROR" },
+  { "log_warning", "WARNING" }, { "log_info", "INFO" },
+  { "log_debug", "DEBUG" }, { "log_trace", "TRACE" },
+  { "log_msg", NULL }, { "log_batch_append", NULL }, { "log_rt_msg", NULL }
+};
+
+/**
+ * The distinct entries printed so far.
+ */
+static char ** entries = NULL;
+static size_t entry_count = 0;
+static size_t output_size = 0;
+
+static void usage(const char * program) {
+  fprintf(stderr, "Usage: %s [-s max_size] FILE...\n", program);
+  exit(EXIT_FAILURE);
+}
+
+static const char * skip_space(const char * p) {
+  while(isspace((unsigned char) *p)) ++p;
+  return p;
+}
+
+/**
+ * Reads adjacent string literals starting at p into text, unescaping the
+ * common escape sequences.
+ * \return The length of text, or 0 if there is no literal at p.
+ */
+static size_t read_literals(const char * p, char * text, size_t size) {
+  size_t len = 0;
+  while(*(p = skip_space(p)) == '"') {
+    for(++p; *p != '"' && *p != '\0' && *p != '\n'; ++p) {
+      char c = *p;
+      if(c == '\\' && p[1] != '\0') {
+	switch(*++p) {
+	case 'n': c = '\n'; break;
+	case 't': c = '\t'; break;
+	default: c = *p; break;
+	}
+      }
+      if(len + 1 < size) text[len++] = c;
+    }
+    if(*p != '"') break;
+    ++p;
+  }
+  text[len] = '\0';
+  return len;
+}
+
+/**
+ * Prints an entry unless it was printed before or would exceed max_size.
+ */
+static void add_entry(const char * level, const char * format,
+		      size_t max_size) {
+  char entry[4096];
+  int len = snprintf(entry, sizeof(entry), "%s: %s%s", level, format,
+		     format[0] != '\0' && format[strlen(format) - 1] == '\n'
+		     ? "" : "\n");
+  if(len < 0 || (size_t) len >= sizeof(entry)
+     || output_size + len > max_size)
+    return;
+  for(size_t i = 0; i < entry_count; ++i)
+    if(strcmp(entries[i], entry) == 0) return;
+  char ** grown = realloc(entries, (entry_count + 1) * sizeof(char *));
+  if(grown == NULL || (grown[entry_count] = strdup(entry)) == NULL) {
+    entries = grown != NULL ? grown : entries;
+    return;
+  }
+  entries = grown;
+  ++entry_count;
+  output_size += len;
+  fputs(entry, stdout);
+}
+
+/**
+ * Collects the formats of the calls in a source file.
+ */
+static bool scan_file(const char * filename, size_t max_size) {
+  FILE * file = fopen(filename, "r");
+  if(file == NULL) {
+    perror(filename);
+    return false;
+  }
+  char * source = NULL;
+  size_t size = 0, len = 0, n;
+  char chunk[65536];
+  while((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    if(len + n + 1 > size) {
+      size = (len + n + 1) * 2;
+      char * grown = realloc(source, size);
+      if(grown == NULL) break;
+      source = grown;
+    }
+    memcpy(source + len, chunk, n);
+    len += n;
+  }
+  fclose(file);
+  if(source == NULL) return true;
+  source[len] = '\0';
+  for(const char * p = source; (p = strstr(p, "log_")) != NULL; ++p) {
+    if(p > source && (isalnum((unsigned char) p[-1]) || p[-1] == '_'))
+      continue;
+    for(size_t i = 0; i < sizeof(calls) / sizeof(calls[0]); ++i) {
+      size_t name_len = strlen(calls[i].name);
+      if(strncmp(p, calls[i].name, name_len) != 0) continue;
+      const char * q = skip_space(p + name_len);
+      if(*q != '(') continue;
+      q = skip_space(q + 1);
+      const char * level = calls[i].level;
+      char name[16];
+      if(level == NULL) {
+	/* The level must be a constant such as LOG_INFO. */
+	size_t name_len = 0;
+	if(strncmp(q, "LOG_", 4) != 0) break;
+	for(q += 4; isupper((unsigned char) *q) && name_len + 1 < sizeof(name);
+	    ++q)
+	  name[name_len++] = *q;
+	name[name_len] = '\0';
+	q = skip_space(q);
+	if(*q != ',') break;
+	++q;
+	level = name;
+      }
+      char format[4000];
+      if(read_literals(q, format, sizeof(format)) > 0)
+	add_entry(level, format, max_size);
+      break;
+    }
+  }
+  free(source);
+  return true;
+}
+
+int main(int argc, char ** argv) {
+  size_t max_size = 110 * 1024;
+  int opt;
+  while((opt = getopt(argc, argv, "s:")) != -1) {
+    switch(opt) {
+    case 's': max_size = strtoul(optarg, NULL, 10); break;
+    default: usage(argv[0]);
+    }
+  }
+  if(optind == argc) usage(argv[0]);
+  bool failed = false;
+  for(int i = optind; i < argc; ++i)
+    if(!scan_file(argv[i], max_size)) failed = true;
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,453 @@
+#define _GNU_SOURCE /* For memmem() and memrchr(). */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOGGREP_X86 1
+#endif
+
+#include "log.h"
+
+/**
+ * loggrep: searches log files for records by severity and substring.
+ *
+ * Usage: loggrep [-c] [-j threads] [-l level] [-e pattern] FILE...
+ *
+ * Prints every record whose severity is at least as severe as level (a name
+ * such as WARNING or a number) and that contains pattern. A record is a line
+ * with a "[TIMESTAMP] SEVERITY: " header together with any following lines
+ * that have no header. With -c, only the number of matching records is
+ * printed.
+ *
+ * Each file is mapped into memory and split into chunks whose boundaries are
+ * moved forward to the next record, and the chunks are searched in parallel.
+ * Substrings are found with AVX2 or SSE2 when the processor supports them
+ * and with memmem() otherwise. Matching records are written straight from the
+ * mapping with writev(), in file order.
+ */
+
+/**
+ * Length of the "[Sun 18 Oct 2026 07:15:33] " prefix of a header.
+ */
+#define HEADER_PREFIX_LEN 27
+
+/**
+ * Each thread gets several chunks so that the work stays balanced.
+ */
+#define CHUNKS_PER_THREAD 4
+
+/**
+ * Signature of the substring search routines.
+ */
+typedef const char * (*find_t)(const char * haystack, size_t n,
+			       const char * needle, size_t k);
+
+/**
+ * The search shared by all threads.
+ */
+struct Search {
+  const char * pattern;
+  size_t pattern_len;
+  int max_level; /**< Records less severe than this are skipped. */
+  bool count_only;
+  find_t find;
+};
+
+/**
+ * A piece of a mapped file and the records found in it.
+ */
+struct Chunk {
+  const char * start;
+  const char * end;
+  size_t num_records; /**< The number of matching records. */
+  struct iovec * matches; /**< Ranges of adjacent matching records. */
+  size_t num_matches;
+  size_t capacity;
+};
+
+/**
+ * The work shared by the threads searching one file.
+ */
+struct Work {
+  const struct Search * search;
+  struct Chunk * chunks;
+  size_t num_chunks;
+  atomic_size_t next;
+};
+
+static const char * find_scalar(const char * haystack, size_t n,
+				const char * needle, size_t k) {
+  return memmem(haystack, n, needle, k);
+}
+
+#ifdef LOGGREP_X86
+/*
+ * The vector searches compare the first and last byte of the pattern against
+ * a whole register of candidate positions at once, and only check the middle
+ * of the pattern at positions where both match (W. Mula's method).
+ */
+__attribute__((target("avx2")))
+static const char * find_avx2(const char * haystack, size_t n,
+			      const char * needle, size_t k) {
+  if(k < 2) return k == 0 ? haystack : memchr(haystack, needle[0], n);
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+  size_t i = 0;
+  for(; i + k + 31 <= n; i += 32) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i *) (haystack + i));
+    __m256i block_last =
+      _mm256_loadu_si256((const __m256i *) (haystack + i + k - 1));
+    uint32_t mask = _mm256_movemask_epi8
+      (_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+			_mm256_cmpeq_epi8(last, block_last)));
+    while(mask != 0) {
+      unsigned bit = __builtin_ctz(mask);
+      if(memcmp(haystack + i + bit + 1, needle + 1, k - 2) == 0)
+	return haystack + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return i < n ? memmem(haystack + i, n - i, needle, k) : NULL;
+}
+
+__attribute__((target("sse2")))
+static const char * find_sse2(const char * haystack, size_t n,
+			      const char * needle, size_t k) {
+  if(k < 2) return k == 0 ? haystack : memchr(haystack, needle[0], n);
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[k - 1]);
+  size_t i = 0;
+  for(; i + k + 15 <= n; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i *) (haystack + i));
+    __m128i block_last =
+      _mm_loadu_si128((const __m128i *) (haystack + i + k - 1));
+    uint32_t mask = _mm_movemask_epi8
+      (_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+		     _mm_cmpeq_epi8(last, block_last)));
+    while(mask != 0) {
+      unsigned bit = __builtin_ctz(mask);
+      if(memcmp(haystack + i + bit + 1, needle + 1, k - 2) == 0)
+	return haystack + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return i < n ? memmem(haystack + i, n - i, needle, k) : NULL;
+}
+#endif
+
+/**
+ * Picks the fastest search the processor supports.
+ */
+static find_t select_find() {
+#ifdef LOGGREP_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) return find_avx2;
+  if(__builtin_cpu_supports("sse2")) return find_sse2;
+#endif
+  return find_scalar;
+}
+
+/**
+ * Returns true if the line starts with a record header.
+ */
+static inline bool is_header(const char * line, const char * end) {
+  return end - line > HEADER_PREFIX_LEN + 1 && line[0] == '['
+    && line[25] == ']' && line[26] == ' ';
+}
+
+/**
+ * Returns the severity of the record starting at line from the first letter
+ * of its severity name, which is enough to tell the levels apart.
+ */
+static inline int header_level(const char * line) {
+  switch(line[HEADER_PREFIX_LEN]) {
+  case 'F': return LOG_FATAL;
+  case 'E': return LOG_ERROR;
+  case 'W': return LOG_WARNING;
+  case 'I': return LOG_INFO;
+  case 'D': return LOG_DEBUG;
+  case 'T': return LOG_TRACE;
+  default:  return LOG_TRACE + 1;
+  }
+}
+
+/**
+ * Returns the start of the line after the one containing p.
+ */
+static inline const char * next_line(const char * p, const char * end) {
+  const char * newline = memchr(p, '\n', end - p);
+  return newline != NULL ? newline + 1 : end;
+}
+
+/**
+ * Returns the end of the record starting at record (the start of the next
+ * record or end).
+ */
+static const char * record_end(const char * record, const char * end) {
+  const char * line = next_line(record, end);
+  while(line < end && !is_header(line, end))
+    line = next_line(line, end);
+  return line;
+}
+
+/**
+ * Returns the start of the record containing p, not looking before start.
+ */
+static const char * record_start(const char * p, const char * start,
+				 const char * end) {
+  for(;;) {
+    const char * newline = p > start ? memrchr(start, '\n', p - start) : NULL;
+    const char * line = newline != NULL ? newline + 1 : start;
+    if(line == start || is_header(line, end)) return line;
+    p = newline;
+  }
+}
+
+/**
+ * Notes a matching record for output.
+ */
+static void add_match(struct Chunk * chunk, const struct Search * search,
+		      const char * record, const char * end) {
+  ++chunk->num_records;
+  if(!search->count_only) {
+    /* Extend the previous range if the records are adjacent. */
+    if(chunk->num_matches > 0) {
+      struct iovec * previous = &chunk->matches[chunk->num_matches - 1];
+      if((const char *) previous->iov_base + previous->iov_len == record) {
+	previous->iov_len += end - record;
+	return;
+      }
+    }
+    if(chunk->num_matches == chunk->capacity) {
+      chunk->capacity = chunk->capacity == 0 ? 64 : 2 * chunk->capacity;
+      chunk->matches = realloc(chunk->matches,
+			       chunk->capacity * sizeof(struct iovec));
+      if(chunk->matches == NULL) {
+	perror("loggrep");
+	exit(2);
+      }
+    }
+    chunk->matches[chunk->num_matches].iov_base = (void *) record;
+    chunk->matches[chunk->num_matches].iov_len = end - record;
+    ++chunk->num_matches;
+  }
+}
+
+/**
+ * Finds the matching records in a chunk.
+ */
+static void search_chunk(struct Chunk * chunk, const struct Search * search) {
+  const char * p = chunk->start;
+  const char * end = chunk->end;
+  if(search->pattern_len == 0) {
+    /* Severity only: walk the records and look at their headers. */
+    while(p < end) {
+      const char * stop = record_end(p, end);
+      if(!is_header(p, end) || header_level(p) <= search->max_level)
+	add_match(chunk, search, p, stop);
+      p = stop;
+    }
+    return;
+  }
+  /* Let the vector search skip to candidates, then check the severity. */
+  while(p < end) {
+    const char * hit = search->find(p, end - p, search->pattern,
+				    search->pattern_len);
+    if(hit == NULL) break;
+    const char * record = record_start(hit, p, end);
+    const char * stop = record_end(hit, end);
+    if(!is_header(record, end) || header_level(record) <= search->max_level)
+      add_match(chunk, search, record, stop);
+    p = stop;
+  }
+}
+
+static void * search_thread(void * arg) {
+  struct Work * work = arg;
+  size_t i;
+  while((i = atomic_fetch_add(&work->next, 1)) < work->num_chunks)
+    search_chunk(&work->chunks[i], work->search);
+  return NULL;
+}
+
+/**
+ * Writes the matching records in order, many ranges per system call.
+ */
+static void write_matches(const struct Chunk * chunk) {
+  size_t done = 0;
+  while(done < chunk->num_matches) {
+    size_t count = chunk->num_matches - done;
+    if(count > IOV_MAX) count = IOV_MAX;
+    struct iovec * iov = chunk->matches + done;
+    ssize_t written = writev(STDOUT_FILENO, iov, count);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      perror("loggrep");
+      exit(2);
+    }
+    /* Skip what was written, finishing any partially written range. */
+    while(count > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov, --count, ++done;
+    }
+    if(count > 0 && written > 0) {
+      struct iovec rest = {
+	.iov_base = (char *) iov->iov_base + written,
+	.iov_len = iov->iov_len - written
+      };
+      while(rest.iov_len > 0) {
+	ssize_t n = write(STDOUT_FILENO, rest.iov_base, rest.iov_len);
+	if(n < 0 && errno != EINTR) {
+	  perror("loggrep");
+	  exit(2);
+	}
+	if(n > 0) {
+	  rest.iov_base = (char *) rest.iov_base + n;
+	  rest.iov_len -= n;
+	}
+      }
+      ++done;
+    }
+  }
+}
+
+/**
+ * Searches one file, returning the number of matching records or -1.
+ */
+static long long search_file(const char * filename,
+			     const struct Search * search, int threads) {
+  int fd = open(filename, O_RDONLY);
+  struct stat stats;
+  if(fd < 0 || fstat(fd, &stats) != 0) {
+    fprintf(stderr, "loggrep: %s: %s\n", filename, strerror(errno));
+    if(fd >= 0) close(fd);
+    return -1;
+  }
+  if(stats.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  size_t size = stats.st_size;
+  const char * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    fprintf(stderr, "loggrep: %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  madvise((void *) map, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+  /* Split the file, moving each boundary forward to the next record. */
+  size_t num_chunks = (size_t) threads * CHUNKS_PER_THREAD;
+  if(size / num_chunks < 65536) num_chunks = size / 65536 + 1;
+  struct Chunk * chunks = calloc(num_chunks, sizeof(struct Chunk));
+  if(chunks == NULL) {
+    perror("loggrep");
+    exit(2);
+  }
+  const char * end = map + size;
+  const char * start = map;
+  for(size_t i = 0; i < num_chunks; ++i) {
+    const char * stop = i + 1 == num_chunks ? end
+      : map + size / num_chunks * (i + 1);
+    if(stop < start) stop = start;
+    if(stop < end) {
+      stop = next_line(stop - 1, end);
+      while(stop < end && !is_header(stop, end))
+	stop = next_line(stop, end);
+    }
+    chunks[i].start = start;
+    chunks[i].end = stop;
+    start = stop;
+  }
+  struct Work work = {
+    .search = search, .chunks = chunks, .num_chunks = num_chunks
+  };
+  atomic_init(&work.next, 0);
+  int num_threads = threads < (int) num_chunks ? threads : (int) num_chunks;
+  pthread_t * ids = calloc(num_threads, sizeof(pthread_t));
+  int started = 0;
+  for(int i = 1; i < num_threads; ++i)
+    if(pthread_create(&ids[started], NULL, search_thread, &work) == 0)
+      ++started;
+  search_thread(&work);
+  for(int i = 0; i < started; ++i)
+    pthread_join(ids[i], NULL);
+  free(ids);
+  long long total = 0;
+  for(size_t i = 0; i < num_chunks; ++i) {
+    total += chunks[i].num_records;
+    if(!search->count_only) write_matches(&chunks[i]);
+    free(chunks[i].matches);
+  }
+  free(chunks);
+  munmap((void *) map, size);
+  return total;
+}
+
+/**
+ * Parses a severity level given by name or number.
+ */
+static int parse_level(const char * text) {
+  static const char * names[] = {
+    "FATAL", "ERROR", "WARNING", "INFO", "DEBUG", "TRACE"
+  };
+  for(int i = LOG_FATAL; i <= LOG_TRACE; ++i)
+    if(strcasecmp(text, names[i]) == 0) return i;
+  char * end;
+  long level = strtol(text, &end, 10);
+  return *end == '\0' && end != text ? (int) level : -1;
+}
+
+static void usage(const char * program) {
+  fprintf(stderr, "Usage: %s [-c] [-j threads] [-l level] [-e pattern] "
+	  "FILE...\n", program);
+  exit(2);
+}
+
+int main(int argc, char ** argv) {
+  struct Search search = {
+    .pattern = "", .pattern_len = 0, .max_level = INT_MAX,
+    .count_only = false, .find = select_find()
+  };
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus > 0 ? (int) cpus : 1;
+  int opt;
+  while((opt = getopt(argc, argv, "cj:l:e:")) != -1) {
+    switch(opt) {
+    case 'c': search.count_only = true; break;
+    case 'j': threads = atoi(optarg); break;
+    case 'l':
+      if((search.max_level = parse_level(optarg)) < 0) usage(argv[0]);
+      break;
+    case 'e':
+      search.pattern = optarg;
+      search.pattern_len = strlen(optarg);
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if(optind == argc || threads < 1) usage(argv[0]);
+  long long total = 0;
+  bool failed = false;
+  for(int i = optind; i < argc; ++i) {
+    long long found = search_file(argv[i], &search, threads);
+    if(found < 0) failed = true;
+    else total += found;
+  }
+  if(search.count_only) printf("%lld\n", total);
+  return failed ? 2 : total > 0 ? 0 : 1;
+}
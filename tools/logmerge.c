@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+/**
+ * logmerge: prints the records of several log files as one timeline, in the
+ * order of their timestamps.
+ *
+ * Usage: logmerge FILE...
+ *
+ * The files may be plain log files or block files written by
+ * log_set_stdout_blocks() or log_set_stderr_blocks(), e.g. the standard
+ * output and error files of several processes. Records with the same
+ * timestamp are printed in the order the files are given. Corrupt blocks are
+ * skipped and counted on standard error. The exit status is 1 if any block
+ * was lost and 2 if a file could not be read.
+ */
+
+int main(int argc, char ** argv) {
+  if(argc < 2) {
+    fprintf(stderr, "Usage: %s FILE...\n", argv[0]);
+    return 2;
+  }
+  size_t corrupt;
+  if(log_merge((const char * const *) argv + 1, argc - 1, stdout,
+	       &corrupt) < 0)
+    return 2;
+  if(corrupt > 0) {
+    fprintf(stderr, "%s: %zu blocks were lost.\n", argv[0], corrupt);
+    return 1;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+#define _GNU_SOURCE /* For strptime(). */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+/**
+ * logrange: prints the records of a log file that fall in a time window.
+ *
+ * Usage: logrange FILE FROM TO
+ *
+ * FROM and TO are local times written as "YYYY-MM-DD HH:MM:SS" (or
+ * "YYYY-MM-DDTHH:MM:SS") or as seconds since the epoch. If FILE has a sidecar
+ * index written by log_set_index(), only the indexed range around the window
+ * is read.
+ */
+
+/**
+ * Parses a time argument, returning -1 if it is not valid.
+ */
+static time_t parse_time(const char * text) {
+  char * end;
+  if(isdigit((unsigned char) text[0])) {
+    long long seconds = strtoll(text, &end, 10);
+    if(*end == '\0') return (time_t) seconds;
+  }
+  const char * formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S" };
+  for(size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+    struct tm fields;
+    memset(&fields, 0, sizeof(fields));
+    end = strptime(text, formats[i], &fields);
+    if(end != NULL && *end == '\0') {
+      fields.tm_isdst = -1;
+      return mktime(&fields);
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char ** argv) {
+  if(argc != 4) {
+    fprintf(stderr, "Usage: %s FILE FROM TO\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  time_t from = parse_time(argv[2]);
+  time_t to = parse_time(argv[3]);
+  if(from == -1 || to == -1) {
+    fprintf(stderr, "%s: times must be \"YYYY-MM-DD HH:MM:SS\" or seconds "
+	    "since the epoch.\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  log_index_query(argv[1], from, to, stdout);
+  return EXIT_SUCCESS;
+}
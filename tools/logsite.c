@@ -0,0 +1,169 @@
+#define _GNU_SOURCE /* For getline(). */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * logsite: expands the call-site IDs in log records with the site
+ * dictionaries written by log_set_site_dictionary().
+ *
+ * Usage: logsite -d DICTIONARY [-d DICTIONARY]... [FILE]...
+ *
+ * Reads the records of the files (default: standard input) and replaces
+ * every word of 16 hexadecimal digits that is the ID of a site in one of
+ * the dictionaries with "FILE:LINE FUNCTION". The dictionaries of several
+ * builds can be given together; an ID found in more than one must describe
+ * the same site, since IDs are computed from the sites themselves.
+ */
+
+/**
+ * An entry of the merged dictionaries.
+ */
+struct Site {
+  uint64_t id; /**< 0 for an empty slot. */
+  char * location;
+};
+
+static struct Site * sites = NULL;
+static size_t site_size = 0; /**< A power of two. */
+static size_t site_count = 0;
+
+static void usage(const char * program) {
+  fprintf(stderr, "Usage: %s -d DICTIONARY [-d DICTIONARY]... [FILE]...\n",
+	  program);
+  exit(EXIT_FAILURE);
+}
+
+static struct Site * find_site(uint64_t id) {
+  size_t mask = site_size - 1;
+  for(size_t i = (id * 0x9e3779b97f4a7c15ULL) >> 32 & mask;;
+      i = (i + 1) & mask)
+    if(sites[i].id == id || sites[i].id == 0) return &sites[i];
+}
+
+static void add_site(uint64_t id, char * location) {
+  if(2 * (site_count + 1) > site_size) {
+    /* Keep the table at most half full. */
+    struct Site * old = sites;
+    size_t old_size = site_size;
+    site_size = site_size == 0 ? 1024 : 2 * site_size;
+    sites = calloc(site_size, sizeof(struct Site));
+    if(sites == NULL) {
+      perror("logsite");
+      exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < old_size; ++i)
+      if(old[i].id != 0) *find_site(old[i].id) = old[i];
+    free(old);
+  }
+  struct Site * site = find_site(id);
+  if(site->id == id) {
+    free(location);
+    return;
+  }
+  site->id = id;
+  site->location = location;
+  ++site_count;
+}
+
+/**
+ * Reads a dictionary: lines of ID, severity, file, line, function and
+ * format, separated by tabs.
+ */
+static bool load_dictionary(const char * filename) {
+  FILE * file = fopen(filename, "r");
+  if(file == NULL) {
+    perror(filename);
+    return false;
+  }
+  char * line = NULL;
+  size_t size = 0;
+  while(getline(&line, &size, file) > 0) {
+    char * fields[5];
+    char * p = line;
+    int count = 0;
+    for(; count < 5 && (fields[count] = strsep(&p, "\t")) != NULL; ++count)
+      ;
+    char * end;
+    uint64_t id = strtoull(fields[0], &end, 16);
+    if(count < 5 || end != fields[0] + 16 || id == 0) continue;
+    size_t len = strlen(fields[2]) + strlen(fields[3])
+      + strlen(fields[4]) + 3;
+    char * location = malloc(len);
+    if(location == NULL) break;
+    snprintf(location, len, "%s:%s %s", fields[2], fields[3], fields[4]);
+    add_site(id, location);
+  }
+  free(line);
+  fclose(file);
+  return true;
+}
+
+/**
+ * Writes a record with the site IDs in it expanded.
+ */
+static void expand(const char * line, size_t len, FILE * out) {
+  const char * start = line;
+  const char * end = line + len;
+  for(const char * p = line; p + 16 <= end;) {
+    if(!isxdigit((unsigned char) *p)
+       || (p > line && isalnum((unsigned char) p[-1]))) {
+      ++p;
+      continue;
+    }
+    size_t digits = 0;
+    while(p + digits < end && isxdigit((unsigned char) p[digits])) ++digits;
+    if(digits == 16
+       && (p + 16 == end || !isalnum((unsigned char) p[16]))) {
+      uint64_t id = strtoull(p, NULL, 16);
+      struct Site * site = id != 0 && site_size > 0 ? find_site(id) : NULL;
+      if(site != NULL && site->id == id) {
+	fwrite(start, 1, p - start, out);
+	fputs(site->location, out);
+	start = p + 16;
+      }
+    }
+    p += digits;
+  }
+  fwrite(start, 1, end - start, out);
+}
+
+static void expand_file(FILE * file) {
+  char * line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while((len = getline(&line, &size, file)) > 0)
+    expand(line, len, stdout);
+  free(line);
+}
+
+int main(int argc, char ** argv) {
+  int opt;
+  bool loaded = false;
+  while((opt = getopt(argc, argv, "d:")) != -1) {
+    switch(opt) {
+    case 'd':
+      if(!load_dictionary(optarg)) return EXIT_FAILURE;
+      loaded = true;
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if(!loaded) usage(argv[0]);
+  if(optind == argc) expand_file(stdin);
+  for(int i = optind; i < argc; ++i) {
+    FILE * file = fopen(argv[i], "r");
+    if(file == NULL) {
+      perror(argv[i]);
+      return EXIT_FAILURE;
+    }
+    expand_file(file);
+    fclose(file);
+  }
+  return EXIT_SUCCESS;
+}
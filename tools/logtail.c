@@ -0,0 +1,89 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/**
+ * logtail: follows the live ring of a running process (see log_set_live()).
+ *
+ * Usage: logtail [-n backlog] [-l level] NAME
+ *
+ * Prints the last backlog records already in the ring (default: 10), then
+ * the new ones as they are logged, until it receives SIGINT or SIGTERM.
+ * Only records whose severity is at least as severe as level (a name such
+ * as "warning" or a number) are printed. Records the process overwrote
+ * before they could be printed are counted on standard error.
+ */
+
+/**
+ * How long the tool sleeps when the ring has no new records (in
+ * microseconds).
+ */
+#define IDLE_SLEEP_US 20000
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signum) {
+  (void) signum;
+  running = 0;
+}
+
+/**
+ * Parses a severity level given by name or number.
+ */
+static int parse_level(const char * text) {
+  static const char * names[] = {
+    "FATAL", "ERROR", "WARNING", "INFO", "DEBUG", "TRACE"
+  };
+  for(int i = LOG_FATAL; i <= LOG_TRACE; ++i)
+    if(strcasecmp(text, names[i]) == 0) return i;
+  char * end;
+  long level = strtol(text, &end, 10);
+  return *end == '\0' && end != text ? (int) level : -1;
+}
+
+static void usage(const char * program) {
+  fprintf(stderr, "Usage: %s [-n backlog] [-l level] NAME\n", program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv) {
+  size_t backlog = 10;
+  int level = LOG_TRACE;
+  int opt;
+  while((opt = getopt(argc, argv, "n:l:")) != -1) {
+    switch(opt) {
+    case 'n': backlog = strtoull(optarg, NULL, 0); break;
+    case 'l':
+      if((level = parse_level(optarg)) < 0) usage(argv[0]);
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if(optind != argc - 1) usage(argv[0]);
+  struct LogLive * live = log_live_attach(argv[optind], backlog);
+  if(live == NULL) return EXIT_FAILURE;
+  struct sigaction action = { .sa_handler = stop };
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  while(running) {
+    size_t lost;
+    size_t read = log_live_read(live, level, stdout, &lost);
+    if(lost > 0) {
+      fflush(stdout);
+      fprintf(stderr, "logtail: %zu records were overwritten before they "
+	      "could be read.\n", lost);
+    }
+    if(read == 0 && lost == 0) {
+      fflush(stdout);
+      usleep(IDLE_SLEEP_US);
+    }
+  }
+  fflush(stdout);
+  log_live_detach(live);
+  return EXIT_SUCCESS;
+}
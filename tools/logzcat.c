@@ -0,0 +1,116 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zstd.h>
+
+/**
+ * logzcat: prints a log file written by log_set_stdout_compressed() or
+ * log_set_stderr_compressed(), optionally following it as it grows.
+ *
+ * Usage: logzcat [-D dictionary] [-f] FILE
+ *
+ * The dictionary must be the one the file was written with. With -f, the
+ * tool keeps reading new records until it is interrupted, like "tail -f".
+ */
+
+/**
+ * How long the tool waits for the file to grow when following it (in
+ * microseconds).
+ */
+#define FOLLOW_SLEEP_US 200000
+
+static void usage(const char * program) {
+  fprintf(stderr, "Usage: %s [-D dictionary] [-f] FILE\n", program);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Loads a dictionary into the decompression context.
+ */
+static bool load_dictionary(ZSTD_DCtx * dctx, const char * filename) {
+  FILE * file = fopen(filename, "rb");
+  if(file == NULL) {
+    perror(filename);
+    return false;
+  }
+  char * data = NULL;
+  size_t len = 0, size = 0, n;
+  char chunk[65536];
+  while((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    if(len + n > size) {
+      size = (len + n) * 2;
+      char * grown = realloc(data, size);
+      if(grown == NULL) break;
+      data = grown;
+    }
+    memcpy(data + len, chunk, n);
+    len += n;
+  }
+  fclose(file);
+  bool loaded = data != NULL
+    && !ZSTD_isError(ZSTD_DCtx_loadDictionary(dctx, data, len));
+  free(data);
+  if(!loaded) fprintf(stderr, "%s: not a usable dictionary.\n", filename);
+  return loaded;
+}
+
+int main(int argc, char ** argv) {
+  const char * dictionary = NULL;
+  bool follow = false;
+  int opt;
+  while((opt = getopt(argc, argv, "D:f")) != -1) {
+    switch(opt) {
+    case 'D': dictionary = optarg; break;
+    case 'f': follow = true; break;
+    default: usage(argv[0]);
+    }
+  }
+  if(optind != argc - 1) usage(argv[0]);
+  FILE * file = fopen(argv[optind], "rb");
+  if(file == NULL) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+  ZSTD_DCtx * dctx = ZSTD_createDCtx();
+  if(dctx == NULL
+     || (dictionary != NULL && !load_dictionary(dctx, dictionary)))
+    return EXIT_FAILURE;
+  size_t in_size = ZSTD_DStreamInSize(), out_size = ZSTD_DStreamOutSize();
+  char * in_data = malloc(in_size);
+  char * out_data = malloc(out_size);
+  if(in_data == NULL || out_data == NULL) return EXIT_FAILURE;
+  /* Decoding stops at the end of what has been written, mid-frame or not. */
+  size_t pending = 0;
+  for(;;) {
+    size_t n = fread(in_data, 1, in_size, file);
+    if(n == 0) {
+      if(!follow) break;
+      fflush(stdout);
+      clearerr(file);
+      usleep(FOLLOW_SLEEP_US);
+      continue;
+    }
+    ZSTD_inBuffer in = { in_data, n, 0 };
+    bool full = false; /* A full output buffer may leave data in zstd. */
+    while(in.pos < in.size || full) {
+      ZSTD_outBuffer out = { out_data, out_size, 0 };
+      pending = ZSTD_decompressStream(dctx, &out, &in);
+      if(ZSTD_isError(pending)) {
+	fprintf(stderr, "%s: %s\n", argv[optind], ZSTD_getErrorName(pending));
+	return EXIT_FAILURE;
+      }
+      fwrite(out_data, 1, out.pos, stdout);
+      full = out.pos == out.size;
+    }
+  }
+  fclose(file);
+  ZSTD_freeDCtx(dctx);
+  free(in_data);
+  free(out_data);
+  if(pending != 0)
+    fprintf(stderr, "%s: the last frame is not complete.\n", argv[optind]);
+  return EXIT_SUCCESS;
+}